@@ -7,35 +7,96 @@
  *
  */
 
+#include <unistd.h>
+#include <sched.h>
+#include <cstdlib>
 #include "audiorender.h"
 #include "config.h"
 
+// Semaphores for waking the workers.  Signalling one never blocks or takes a lock, so the callback can do
+// it every block.  Mac OS X doesn't implement unnamed POSIX semaphores, so use Mach's there.
+
+static int createSemaphore(renderSemaphore *semaphore)
+{
+#ifdef __APPLE__
+	return (semaphore_create(mach_task_self(), semaphore, SYNC_POLICY_FIFO, 0) == KERN_SUCCESS) ? 0 : 1;
+#else
+	return sem_init(semaphore, 0, 0);
+#endif
+}
+
+static inline void signalSemaphore(renderSemaphore *semaphore)
+{
+#ifdef __APPLE__
+	semaphore_signal(*semaphore);
+#else
+	sem_post(semaphore);
+#endif
+}
+
+static inline void waitSemaphore(renderSemaphore *semaphore)
+{
+#ifdef __APPLE__
+	while(semaphore_wait(*semaphore) == KERN_ABORTED);
+#else
+	while(sem_wait(semaphore) != 0);		// Interrupted by a signal
+#endif
+}
+
+static void destroySemaphore(renderSemaphore *semaphore)
+{
+#ifdef __APPLE__
+	semaphore_destroy(mach_task_self(), *semaphore);
+#else
+	sem_destroy(semaphore);
+#endif
+}
+
 // Initialize the render object
 AudioRender::AudioRender()
+: profiler_(RENDER_MAX_THREADS, SynthBase::kNumSynthTypes)
 {
-	// Initialize a mutex which prevents changing the render list while it's rendering
-	if(pthread_mutex_init(&renderMutex_, NULL) != 0)
+	// Initialize a mutex which keeps control threads from posting render commands at the same time.
+	// The render thread itself never takes this lock.
+	if(pthread_mutex_init(&queueMutex_, NULL) != 0)
 	{
-		cerr << "Error: Failed to initialize render mutex!\n";
+		cerr << "Error: Failed to initialize render queue mutex!\n";
 		Pa_Terminate();
 		exit(1);		// Can't work without the mutex, so quit
 	}
 	
-	// Similar mutex prevents problems with multi-threaded requests for channel allocation
-	if(pthread_mutex_init(&channelMutex_, NULL) != 0)
-	{
-		cerr << "Error: Failed to initialize channel mutex!\n";
-		Pa_Terminate();
-		exit(1);		// Can't work without the mutex, so quit
-	}	
-	
+	stream_ = NULL;
+	offlineTime_ = 0.0;
+	offlineRendering_ = false;
+	streamRendering_ = false;
+	eventLatency_ = -1.0;
 	numOutputChannels_ = 0;
 	globalAmplitude_ = 1.0;
+	outputBuses_ = NULL;
+	busStride_ = busFrameCount_ = 0;
+	
+	renderListLength_ = releasingListLength_ = 0;
+	commandWritePointer_ = commandReadPointer_ = releasingReadPointer_ = 0;
+	
+	numRenderThreads_ = 1;
+	workersFinished_ = 0;
+	workersShouldStop_ = false;
+	callbackSchedulingKnown_ = false;
+	for(int i = 0; i < RENDER_MAX_THREADS; i++)
+	{
+		renderThreads_[i].render = this;
+		renderThreads_[i].index = i;
+		renderThreads_[i].renderListLength = 0;
+		renderThreads_[i].busyTime = 0.0;
+	}
+	gettimeofday(&loadResetTime_, NULL);
 }
 
-// Set the basic stream information
+// Set the basic stream information.  The output buses and the input history are sized here for the longest
+// block the stream will deliver, so the callback never has to allocate them.
 
-void AudioRender::setStreamInfo(PaStream *stream, int numInputChannels, int numOutputChannels, float sampleRate, vector<int>& channelsToUse)
+void AudioRender::setStreamInfo(PaStream *stream, int numInputChannels, int numOutputChannels, float sampleRate,
+								vector<int>& channelsToUse, unsigned long maxFrameCount)
 {
 	int i;
 	
@@ -43,11 +104,13 @@ void AudioRender::setStreamInfo(PaStream *stream, int numInputChannels, int numO
 	numInputChannels_ = numInputChannels;
 	numOutputChannels_ = numOutputChannels;
 	sampleRate_ = sampleRate;
+	inputHistory_.setSize(numInputChannels, sampleRate);
 	
-	// Set up the output channel tracking vector, telling us whether each channel is in use
-	channelsUsed_.resize(numOutputChannels, false);
-	// Right now we don't change the state of any existing channels.  If we eventually want to run
-	// setStreamInfo multiple times, consider whether this is the desired behavior.
+	profiler_.setNumChannels(numOutputChannels);
+	if(maxFrameCount == 0)		// The stream didn't fix its block size
+		maxFrameCount = RENDER_BUS_BLOCK_SIZE;
+	allocateOutputBuses(maxFrameCount);
+	inputHistory_.reserve(maxFrameCount);
 	
 	// Set a list of channels to use
 	if(channelsToUse.size() == 0)
@@ -74,12 +137,23 @@ void AudioRender::setStreamInfo(PaStream *stream, int numInputChannels, int numO
 			}
 		}
 	}
+	
+	// Set up the free channel bitmap, with every channel free.  If we eventually want to run setStreamInfo
+	// multiple times, consider whether this is the desired behavior.
+	channelIndices_.assign(numOutputChannels_, -1);
+	for(i = 0; i < outputChannels_.size(); i++)
+		channelIndices_[outputChannels_[i]] = i;
+	freeChannels_.resize((outputChannels_.size() + RENDER_CHANNEL_WORD_BITS - 1) / RENDER_CHANNEL_WORD_BITS);
+	freeAllOutputChannels();
 }
 
 // Useful query methods for current stream
 
 double AudioRender::actualSampleRate()
 {
+	if(stream_ == NULL)		// Offline: the requested rate is the actual rate
+		return sampleRate_;
+	
 	const PaStreamInfo *streamInfo = Pa_GetStreamInfo(stream_);
 	
 	if(streamInfo == NULL)	// An error occurred, return 0
@@ -89,6 +163,9 @@ double AudioRender::actualSampleRate()
 
 PaTime AudioRender::inputLatency()
 {
+	if(stream_ == NULL)
+		return (PaTime)0.0;
+	
 	const PaStreamInfo *streamInfo = Pa_GetStreamInfo(stream_);
 	
 	if(streamInfo == NULL)	// An error occurred, return 0
@@ -98,6 +175,9 @@ PaTime AudioRender::inputLatency()
 
 PaTime AudioRender::outputLatency()
 {
+	if(stream_ == NULL)
+		return (PaTime)0.0;
+	
 	const PaStreamInfo *streamInfo = Pa_GetStreamInfo(stream_);
 	
 	if(streamInfo == NULL)	// An error occurred, return 0
@@ -111,155 +191,729 @@ PaTime AudioRender::outputLatency()
 // The second is the index of which MRP channel to use.  These are often the same, but in the 
 // case where we only want to use a subset of a device's channels, the MRP index might be different.
 // Returns <-1,-1> on error.
+//
+// Channels are claimed from a bitmap of free channels with compare-and-swap, so any thread can allocate or
+// free one without a lock.  The lowest free channel is always taken, as it was when they were searched in order.
 
 pair<int,int> AudioRender::allocateOutputChannel()
 {
-	int channelIndex;
-	bool foundChannel = false;
 	pair<int,int> out;
+	uint32_t bits;
+	int word, bit;
 	
 	out.first = out.second = -1;
 	
-	if(pthread_mutex_lock(&channelMutex_) != 0)	// One at a time for allocating channels
+	for(word = 0; word < freeChannels_.size(); word++)
 	{
-		cerr << "Error: Could not lock mutex in allocateOutputChannel()\n";
-		return out;
+		while((bits = freeChannels_[word]) != 0)
+		{
+			bit = __builtin_ctz(bits);			// Lowest free channel in this word
+			if(__sync_bool_compare_and_swap(&freeChannels_[word], bits, bits & ~(1U << bit)))
+			{
+				out.second = word*RENDER_CHANNEL_WORD_BITS + bit;
+				out.first = outputChannels_[out.second];
+				return out;
+			}
+			// Another thread changed the word first; look again
+		}
 	}
 	
-	for(channelIndex = 0; channelIndex < outputChannels_.size(); channelIndex++)
+	// No free channel, and out = <-1, -1>
+	return out;
+}
+
+void AudioRender::freeOutputChannel(int channel)		// Return the channel to the pool when finished
+{
+	int channelIndex;
+	
+	if(channel < 0 || channel >= numOutputChannels_)	// sanity check
+		return;
+	if((channelIndex = channelIndices_[channel]) < 0)	// Not one of ours
+		return;
+	
+	__sync_fetch_and_or(&freeChannels_[channelIndex / RENDER_CHANNEL_WORD_BITS], 1U << (channelIndex % RENDER_CHANNEL_WORD_BITS));
+}
+
+void AudioRender::freeAllOutputChannels()				// Clear the list
+{
+	int channelsLeft = outputChannels_.size();
+	
+	for(int word = 0; word < freeChannels_.size(); word++)
+	{
+		if(channelsLeft >= RENDER_CHANNEL_WORD_BITS)
+			freeChannels_[word] = 0xFFFFFFFF;
+		else
+			freeChannels_[word] = (1U << channelsLeft) - 1;
+		channelsLeft -= RENDER_CHANNEL_WORD_BITS;
+	}
+	__sync_synchronize();
+}
+
+
+// Set the number of threads sharing the render work, creating the workers.  Output channels available for
+// synths are dealt out to the threads in turn.  Returns the number of threads in use, which will be 1 if the
+// workers couldn't be created.
+
+int AudioRender::setRenderThreads(int numThreads)
+{
+	int i;
+	
+	stopRenderThreads();
+	
+	if(numThreads > RENDER_MAX_THREADS)
+		numThreads = RENDER_MAX_THREADS;
+	if(numThreads > (int)outputChannels_.size())	// No point having threads with nothing to do
+		numThreads = outputChannels_.size();
+	if(numThreads < 1)
+		numThreads = 1;
+	
+	channelThread_.assign(numOutputChannels_, 0);
+	for(i = 0; i < outputChannels_.size(); i++)
+		channelThread_[outputChannels_[i]] = i % numThreads;
+	
+	workersFinished_ = 0;
+	workersShouldStop_ = false;
+	
+	// Workers take on the audio callback's scheduling once it's known, on the first block
+	callbackSchedulingKnown_ = false;
+	
+	for(i = 1; i < numThreads; i++)
 	{
-		if(!channelsUsed_[outputChannels_[channelIndex]])
+		renderThreads_[i].schedulingCopied = false;
+		if(createSemaphore(&renderThreads_[i].wake) != 0)
 		{
-			channelsUsed_[outputChannels_[channelIndex]] = true; // Claim this one
-			foundChannel = true;
+			cerr << "Warning: Could not create render thread " << i << "; rendering on one thread\n";
+			numRenderThreads_ = i;
+			stopRenderThreads();
+			numThreads = 1;
 			break;
 		}
+		if(pthread_create(&renderThreads_[i].thread, NULL, staticWorkerLoop, &renderThreads_[i]) != 0)
+		{
+			cerr << "Warning: Could not create render thread " << i << "; rendering on one thread\n";
+			destroySemaphore(&renderThreads_[i].wake);
+			numRenderThreads_ = i;
+			stopRenderThreads();
+			numThreads = 1;
+			break;
+		}
+		
+		numRenderThreads_ = i + 1;
 	}
 	
-	if(pthread_mutex_unlock(&channelMutex_) != 0)
+	numRenderThreads_ = numThreads;
+	resetRenderThreadLoad();
+	
+	if(numRenderThreads_ > sysconf(_SC_NPROCESSORS_ONLN))
+		cerr << "Warning: " << numRenderThreads_ << " render threads but only " << sysconf(_SC_NPROCESSORS_ONLN) << " processors\n";
+	
+#ifdef DEBUG_MESSAGES
+	cout << "Rendering on " << numRenderThreads_ << " thread(s)\n";
+#endif
+	
+	return numRenderThreads_;
+}
+
+// Fraction of the time since the last reset that the given thread has spent rendering.  Thread 0
+// is the audio callback thread.
+
+double AudioRender::renderThreadLoad(int thread)
+{
+	struct timeval now;
+	double elapsed;
+	
+	if(thread < 0 || thread >= numRenderThreads_)
+		return 0.0;
+	
+	gettimeofday(&now, NULL);
+	elapsed = (double)(now.tv_sec - loadResetTime_.tv_sec) + 1.0e-6*(double)(now.tv_usec - loadResetTime_.tv_usec);
+	if(elapsed <= 0.0)
+		return 0.0;
+	return renderThreads_[thread].busyTime / elapsed;
+}
+
+void AudioRender::resetRenderThreadLoad()
+{
+	for(int i = 0; i < RENDER_MAX_THREADS; i++)
+		renderThreads_[i].busyTime = 0.0;
+	gettimeofday(&loadResetTime_, NULL);
+}
+
+// Print the render statistics gathered since the last reset
+
+void AudioRender::printRenderStats(ostream& output)
+{
+	RenderProfiler::cost c;
+	int i;
+	
+	output << "Render statistics (" << profiler_.blocks() << " blocks):\n";
+	output << "  Callback time: mean " << 100.0*profiler_.meanLoad() << "%, max " << 100.0*profiler_.maxLoad()
+		   << "% of block period\n";
+	for(i = 0; i < PROFILER_LOAD_BINS; i++)
 	{
-		cerr << "Error: Could not unlock mutex in allocateOutputChannel()\n";
-		return out;
-	}		
+		if(profiler_.loadHistogram(i) == 0)
+			continue;
+		if(i == PROFILER_LOAD_BINS - 1)
+			output << "    >= " << 10*i << "%: ";
+		else
+			output << "    " << 10*i << "-" << 10*(i + 1) << "%: ";
+		output << profiler_.loadHistogram(i) << endl;
+	}
 	
-	if(foundChannel)
+	output << "  Xruns: " << profiler_.xruns() << " (";
+	for(i = 0; i < RenderProfiler::kNumStatusFlags; i++)
+		output << (i > 0 ? ", " : "") << RenderProfiler::statusFlagName(i) << " " << profiler_.statusFlagCount(i);
+	output << ")\n";
+	
+	output << "  Voices per block: mean " << profiler_.meanVoices() << ", max " << profiler_.maxVoices() << endl;
+	for(i = 0; i < PROFILER_VOICE_BINS; i++)
 	{
-		out.first = outputChannels_[channelIndex];
-		out.second = channelIndex;
+		if(profiler_.voiceHistogram(i) == 0)
+			continue;
+		output << "    " << RenderProfiler::voiceBinLow(i);
+		if(i == PROFILER_VOICE_BINS - 1)
+			output << "+";
+		else if(RenderProfiler::voiceBinLow(i + 1) - 1 > RenderProfiler::voiceBinLow(i))
+			output << "-" << RenderProfiler::voiceBinLow(i + 1) - 1;
+		output << ": " << profiler_.voiceHistogram(i) << endl;
 	}
-	// else there was no free channel, and out = <-1, -1>
 	
-	return out;
+	output << "  Cost per synth render in us (mean / max, renders):\n";
+	c = profiler_.voiceCost();
+	if(c.renders > 0)
+		output << "    Per voice: " << 1.0e-3*(double)c.totalTime/(double)c.renders
+			   << " / " << 1.0e-3*(double)c.maxTime << " (" << c.renders << ")\n";
+	for(i = 0; i < profiler_.numTypes(); i++)
+	{
+		c = profiler_.typeCost(i);
+		if(c.renders == 0)
+			continue;
+		output << "    " << SynthBase::synthTypeName(i) << ": " << 1.0e-3*(double)c.totalTime/(double)c.renders
+			   << " / " << 1.0e-3*(double)c.maxTime << " (" << c.renders << ")\n";
+	}
+	for(i = 0; i < profiler_.numChannels(); i++)
+	{
+		c = profiler_.channelCost(i);
+		if(c.renders == 0)
+			continue;
+		output << "    Channel " << i << ": " << 1.0e-3*(double)c.totalTime/(double)c.renders
+			   << " / " << 1.0e-3*(double)c.maxTime << " (" << c.renders << ")\n";
+	}
 }
 
-void AudioRender::freeOutputChannel(int channel)		// Return the channel to the pool when finished
+// Send the render statistics by OSC.  Times are in microseconds; counts are truncated to 32 bits.
+
+void AudioRender::sendRenderStats()
 {
-	if(channel < 0 || channel >= numOutputChannels_)	// sanity check
+	RenderProfiler::cost c;
+	int i;
+	
+	if(oscController_ == NULL)
 		return;
 	
-	if(pthread_mutex_lock(&channelMutex_) != 0)	// One at a time for allocating channels
+	oscController_->sendMessage("/ui/stats/callback", "iffi", (int)profiler_.blocks(), (float)profiler_.meanLoad(),
+								(float)profiler_.maxLoad(), (int)profiler_.xruns(), LO_ARGS_END);
+	oscController_->sendMessage("/ui/stats/xruns", "iiiii", (int)profiler_.statusFlagCount(RenderProfiler::kInputUnderflow),
+								(int)profiler_.statusFlagCount(RenderProfiler::kInputOverflow),
+								(int)profiler_.statusFlagCount(RenderProfiler::kOutputUnderflow),
+								(int)profiler_.statusFlagCount(RenderProfiler::kOutputOverflow),
+								(int)profiler_.statusFlagCount(RenderProfiler::kPrimingOutput), LO_ARGS_END);
+	oscController_->sendMessage("/ui/stats/voices", "fi", (float)profiler_.meanVoices(), profiler_.maxVoices(), LO_ARGS_END);
+	c = profiler_.voiceCost();
+	if(c.renders > 0)
 	{
-		cerr << "Error: Could not lock mutex in allocateOutputChannel()\n";
-		return;
+		oscController_->sendMessage("/ui/stats/voice", "ffi", (float)(1.0e-3*(double)c.totalTime/(double)c.renders),
+									(float)(1.0e-3*(double)c.maxTime), (int)c.renders, LO_ARGS_END);
 	}
+	for(i = 0; i < profiler_.numTypes(); i++)
+	{
+		c = profiler_.typeCost(i);
+		if(c.renders == 0)
+			continue;
+		oscController_->sendMessage("/ui/stats/synth", "sffi", SynthBase::synthTypeName(i),
+									(float)(1.0e-3*(double)c.totalTime/(double)c.renders), (float)(1.0e-3*(double)c.maxTime),
+									(int)c.renders, LO_ARGS_END);
+	}
+	for(i = 0; i < profiler_.numChannels(); i++)
+	{
+		c = profiler_.channelCost(i);
+		if(c.renders == 0)
+			continue;
+		oscController_->sendMessage("/ui/stats/channel", "iffi", i,
+									(float)(1.0e-3*(double)c.totalTime/(double)c.renders), (float)(1.0e-3*(double)c.maxTime),
+									(int)c.renders, LO_ARGS_END);
+	}
+}
+
+// The statistics are cleared by the callback at the start of its next block
+
+void AudioRender::resetRenderStats()
+{
+	profiler_.reset();
+}
+
+// Stop and join all the worker threads, returning to single-threaded rendering.  The stream must not be
+// running, since the callback would be left waiting for workers that no longer exist.
+
+void AudioRender::stopRenderThreads()
+{
+	int i;
 	
-	channelsUsed_[channel] = false;
+	if(numRenderThreads_ <= 1)
+		return;
+	
+	workersShouldStop_ = true;
+	__sync_synchronize();
+	for(i = 1; i < numRenderThreads_; i++)
+		signalSemaphore(&renderThreads_[i].wake);
 	
-	if(pthread_mutex_unlock(&channelMutex_) != 0)
+	for(i = 1; i < numRenderThreads_; i++)
 	{
-		cerr << "Error: Could not unlock mutex in allocateOutputChannel()\n";
-		return;
-	}		
+		pthread_join(renderThreads_[i].thread, NULL);
+		destroySemaphore(&renderThreads_[i].wake);
+	}
+	
+	numRenderThreads_ = 1;
+	workersShouldStop_ = false;
 }
 
-void AudioRender::freeAllOutputChannels()				// Clear the list
+// Give up the CPU briefly while polling a shared counter
+
+static inline void spinPause()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Each worker sleeps on its semaphore until the callback posts a block, renders its group into their output
+// buses, and reports back.  The first time round, it takes on the scheduling policy and priority of the
+// callback thread, so it neither lags behind the callback nor starves it.
+
+void AudioRender::workerLoop(renderThread *thread)
 {
-	if(pthread_mutex_lock(&channelMutex_) != 0)	// One at a time for allocating channels
+	while(1)
 	{
-		cerr << "Error: Could not lock mutex in allocateOutputChannel()\n";
-		return;
+		waitSemaphore(&thread->wake);
+		__sync_synchronize();		// Don't read the block arguments ahead of the wakeup
+		
+		if(workersShouldStop_)
+			break;
+		
+		if(!thread->schedulingCopied && callbackSchedulingKnown_)
+		{
+			if(pthread_setschedparam(pthread_self(), callbackPolicy_, &callbackParam_) != 0)
+			{
+#ifdef DEBUG_MESSAGES
+				cout << "Render thread " << thread->index << " running at normal priority\n";
+#endif
+			}
+			thread->schedulingCopied = true;
+		}
+		
+		renderGroup(thread, thread->renderList, thread->renderListLength);
+		
+		__sync_fetch_and_add(&workersFinished_, 1);		// Also publishes the bus contents
 	}
+}
+
+// Render a list of synths into their output buses, adding the time taken to the thread's busy time and each
+// synth's time to the render statistics
+
+void AudioRender::renderGroup(renderThread *thread, SynthBase **list, int listLength)
+{
+	uint64_t start, synthStart, end;
 	
-	for(int i = 0; i < channelsUsed_.size(); i++)
-		channelsUsed_[i] = false;
+	start = end = RenderProfiler::now();
 	
-	if(pthread_mutex_unlock(&channelMutex_) != 0)
+	for(int i = 0; i < listLength; i++)
 	{
-		cerr << "Error: Could not unlock mutex in allocateOutputChannel()\n";
-		return;
-	}			
+		synthStart = end;
+		list[i]->render(blockInput_, outputBus(list[i]->outputChannel()), blockFrameCount_, blockTimeInfo_, blockStatusFlags_);
+		end = RenderProfiler::now();
+		profiler_.addSynthTime(thread->index, list[i]->synthType(), list[i]->outputChannel(), end - synthStart);
+	}
+	
+	thread->busyTime += 1.0e-9*(double)(end - start);
 }
 
-
-// Add a new synth object to the render list.  Returns 0 on success.
+// Add a new synth object to the render list.  Returns 0 on success.  The synth will start
+// rendering at the beginning of the next audio block.
 
 int AudioRender::addSynth(SynthBase *synth)
-{	
-	pair<set<SynthBase*>::iterator,bool> ret;
+{
+	int ret = 1;
 	
-	if(pthread_mutex_lock(&renderMutex_) != 0)	// Acquire lock ensuring we're not actively rendering
+	if(synth == NULL)
+		return 1;
+	
+	if(pthread_mutex_lock(&queueMutex_) != 0)	// One control thread at a time on the queue
 	{
 		cerr << "Error: Could not lock mutex in addSynth()\n";
 		return 1;
 	}
 	
-	ret = synths_.insert(synth);
+	if(synths_.count(synth) == 0)
+	{
+		if(synths_.size() >= RENDER_LIST_SIZE)
+			cerr << "Error: render list full in addSynth()\n";
+		else
+		{
+			// From here on, parameter changes go through the synth's queue to the render thread
+			synth->setRendering(true);
+			
+			if(postCommand(kRenderCommandAdd, synth) == 0)
+			{
+				synths_.insert(synth);
+				ret = 0;
+			}
+			else
+				synth->setRendering(false);
+		}
+	}
 	
-	if(pthread_mutex_unlock(&renderMutex_) != 0)
+	if(pthread_mutex_unlock(&queueMutex_) != 0)
 	{
 		cerr << "Error: Could not unlock mutex in addSynth()\n";
 		return 1;
 	}	
 	
-	if(ret.second != false)
-		return 0;
-	else
-		return 1;
+	return ret;
 }
 
-// Remove a synth object from the render list.  Returns 0 on success
+// Remove a synth object from the render list.  Returns 0 on success.  Doesn't return until
+// the render thread has stopped using the synth.
 
 int AudioRender::removeSynth(SynthBase *synth)
 {
-	int ret;
+	unsigned int sequence;
+	int ret = 1;
 	
-	if(pthread_mutex_lock(&renderMutex_) != 0)	// Acquire lock ensuring we're not actively rendering
+	if(pthread_mutex_lock(&queueMutex_) != 0)	// One control thread at a time on the queue
 	{
 		cerr << "Error: Could not lock mutex in removeSynth()\n";
 		return 1;
 	}	
 	
-	ret = synths_.erase(synth);
+	if(synths_.count(synth) > 0)
+	{
+		if(postCommand(kRenderCommandRemove, synth) == 0)
+		{
+			synths_.erase(synth);
+			ret = 0;
+		}
+	}
+	sequence = commandWritePointer_;
 	
-	if(pthread_mutex_unlock(&renderMutex_) != 0)
+	if(pthread_mutex_unlock(&queueMutex_) != 0)
 	{
 		cerr << "Error: Could not unlock mutex in removeSynth()\n";
 		return 1;
 	}	
 	
-	if(ret != 0)
-		return 0;
-	else
-		return 1;	
+	if(ret == 0)
+	{
+		waitForCommand(sequence);
+		synth->setRendering(false);	// Control threads own the synth's parameters again
+	}
+	return ret;
+}
+
+// Remove a synth object from the render list without waiting for the render thread.  Returns 0 once the
+// removal is queued (or if the synth isn't on the list), after which the synth remains in use until
+// removalIsComplete(*epoch) is true.  If the command couldn't be queued, returns 1 and leaves *epoch alone:
+// the synth is still being rendered, and the caller has to try again.
+
+int AudioRender::removeSynthDeferred(SynthBase *synth, unsigned int *epoch, PaTime when)
+{
+	int ret = 0;
+	
+	if(pthread_mutex_lock(&queueMutex_) != 0)	// One control thread at a time on the queue
+	{
+		cerr << "Error: Could not lock mutex in removeSynthDeferred()\n";
+		return 1;
+	}	
+	
+	if(synths_.count(synth) > 0)
+	{
+		if(postCommand(kRenderCommandRemove, synth, when) == 0)
+		{
+			synths_.erase(synth);
+			*epoch = commandWritePointer_;
+		}
+		else
+			ret = 1;
+	}
+	
+	if(pthread_mutex_unlock(&queueMutex_) != 0)
+	{
+		cerr << "Error: Could not unlock mutex in removeSynthDeferred()\n";
+		return 1;
+	}	
+	
+	return ret;
+}
+
+// Called once a deferred removal is complete: control threads own the synth's parameters again
+
+void AudioRender::synthRemoved(SynthBase *synth)
+{
+	if(synth != NULL)
+		synth->setRendering(false);
 }
 
 // Clear the render list, removing all synths
 
 void AudioRender::removeAllSynths()
 {
-	if(pthread_mutex_lock(&renderMutex_) != 0)	// Acquire lock ensuring we're not actively rendering
+	unsigned int sequence;
+	vector<SynthBase*> removed;
+	
+	if(pthread_mutex_lock(&queueMutex_) != 0)	// One control thread at a time on the queue
 	{
 		cerr << "Error: Could not lock mutex in removeAllSynths()\n";
 		return;
 	}		
 	
-	synths_.clear();
+	if(postCommand(kRenderCommandRemoveAll, NULL) == 0)
+	{
+		removed.assign(synths_.begin(), synths_.end());
+		synths_.clear();
+	}
+	sequence = commandWritePointer_;
 	
-	if(pthread_mutex_unlock(&renderMutex_) != 0)
+	if(pthread_mutex_unlock(&queueMutex_) != 0)
 	{
 		cerr << "Error: Could not unlock mutex in removeAllSynths()\n";
 		return;
 	}		
+	
+	waitForCommand(sequence);
+	for(int i = 0; i < removed.size(); i++)
+		removed[i]->setRendering(false);
+}
+
+// Start and stop the stream given to setStreamInfo().  While it runs, the callback is the only thread that
+// drains the command queue.  The flag saying so changes under queueMutex_, so a control thread that is
+// draining finishes before the first callback can, and none starts again until the last callback is over.
+
+PaError AudioRender::startStream()
+{
+	PaError err;
+	
+	pthread_mutex_lock(&queueMutex_);
+	streamRendering_ = true;
+	pthread_mutex_unlock(&queueMutex_);
+	
+	err = Pa_StartStream(stream_);
+	if(err != paNoError)
+	{
+		pthread_mutex_lock(&queueMutex_);
+		streamRendering_ = false;
+		pthread_mutex_unlock(&queueMutex_);
+	}
+	return err;
+}
+
+PaError AudioRender::stopStream()
+{
+	PaError err = Pa_StopStream(stream_);
+	
+	if(err == paNoError)
+	{
+		pthread_mutex_lock(&queueMutex_);
+		streamRendering_ = false;
+		pthread_mutex_unlock(&queueMutex_);
+	}
+	return err;
+}
+
+// Offline rendering: the calling thread drives renderCallback() itself, so it becomes the only thread that
+// may drain the command queue.  Any other thread waiting on a command waits for that thread's next block.
+
+void AudioRender::beginOfflineRender()
+{
+	offlineOwner_ = pthread_self();
+	__sync_synchronize();
+	offlineRendering_ = true;
+}
+
+void AudioRender::endOfflineRender()
+{
+	offlineRendering_ = false;
+	__sync_synchronize();
+}
+
+// Whether the calling thread may apply queued commands itself.  While the stream is running, only the
+// callback does.  Offline, only the thread driving the render does.  Otherwise nothing is rendering, so the
+// control threads have to, one at a time under queueMutex_.  Only settled with queueMutex_ held, since
+// that is what startStream() and stopStream() change the owner under.
+
+bool AudioRender::ownsRenderList()
+{
+	if(offlineRendering_)
+		return (pthread_equal(pthread_self(), offlineOwner_) != 0);
+	return !streamRendering_;
+}
+
+// Apply queued commands on a control thread that owns the render list, holding queueMutex_.  Offline, they
+// take effect at the current time, as they would at the start of the next block.  If that leaves a command
+// timed later at the head of the queue, the caller is waiting on something behind it and can't render its
+// way there, so everything is applied, as it is when there's no stream running at all.
+
+void AudioRender::drainCommands()
+{
+	unsigned int readPointer = commandReadPointer_;
+	
+	if(offlineRendering_)
+	{
+		applyCommands(offlineTime_, offlineTime_);
+		if(commandReadPointer_ != readPointer || commandReadPointer_ == commandWritePointer_)
+			return;
+	}
+	applyCommands();
+}
+
+// Place a command on the render queue.  Must be called with queueMutex_ held.  Returns 0 on success.
+
+int AudioRender::postCommand(int type, SynthBase *synth, PaTime when)
+{
+	unsigned int writePointer = commandWritePointer_;
+	int tries = 0;
+	
+	// If the queue is full, give the render thread a few blocks to catch up
+	while(writePointer - commandReadPointer_ >= RENDER_QUEUE_SIZE)
+	{
+		if(ownsRenderList())
+			drainCommands();
+		else if(++tries > RENDER_QUEUE_TIMEOUT)
+		{
+			cerr << "Error: render command queue full\n";
+			return 1;
+		}
+		else
+			usleep(1000);
+	}
+	
+	commandQueue_[writePointer & (RENDER_QUEUE_SIZE - 1)].type = type;
+	commandQueue_[writePointer & (RENDER_QUEUE_SIZE - 1)].synth = synth;
+	commandQueue_[writePointer & (RENDER_QUEUE_SIZE - 1)].time = when;
+	
+	__sync_synchronize();			// Command must be visible before the pointer moves
+	commandWritePointer_ = writePointer + 1;
+	
+	return 0;
+}
+
+// Wait until the render thread has applied every command up to (but not including) sequence.  If this
+// thread owns the render list, nobody else will drain the queue, so do it here.
+
+void AudioRender::waitForCommand(unsigned int sequence)
+{
+	while((int)(sequence - commandReadPointer_) > 0)
+	{
+		bool drained = false;
+		
+		if(ownsRenderList())
+		{
+			if(pthread_mutex_lock(&queueMutex_) != 0)
+			{
+				cerr << "Error: Could not lock mutex in waitForCommand()\n";
+				return;
+			}
+			if(ownsRenderList())		// Check again now that the owner can't change
+			{
+				drainCommands();
+				drained = true;
+			}
+			pthread_mutex_unlock(&queueMutex_);
+		}
+		if(!drained)
+			usleep(1000);
+	}
+}
+
+// Drain the command queue, updating the render list.  Called by the render thread at the beginning
+// of each block, with the times the block starts and ends, or through drainCommands() by a control thread
+// that owns the render list.
+//
+// Removals timed within the block are held in releasingList_ until the synths have rendered up to their
+// release, and finishCommands() completes them after the block.  A command timed after the block stops
+// the draining, since the commands behind it come from later events.
+
+void AudioRender::applyCommands(PaTime blockStartTime, PaTime blockEndTime)
+{
+	unsigned int readPointer = commandReadPointer_;
+	unsigned int writePointer = commandWritePointer_;
+	
+	__sync_synchronize();			// Don't read commands ahead of the write pointer
+	
+	while(readPointer != writePointer)
+	{
+		renderCommand *command = &commandQueue_[readPointer & (RENDER_QUEUE_SIZE - 1)];
+		
+		if(command->time >= blockEndTime)
+			break;
+		
+		switch(command->type)
+		{
+			case kRenderCommandAdd:
+				if(renderListLength_ < RENDER_LIST_SIZE)
+					renderList_[renderListLength_++] = command->synth;
+				break;
+			case kRenderCommandRemove:
+				if(command->time > blockStartTime && releasingListLength_ < RENDER_LIST_SIZE)
+					releasingList_[releasingListLength_++] = command->synth;
+				else
+					removeFromRenderList(command->synth);
+				break;
+			case kRenderCommandRemoveAll:
+				renderListLength_ = 0;
+				break;
+			default:
+				break;
+		}
+		
+		readPointer++;
+	}
+	
+	if(releasingListLength_ > 0)	// Not done until finishCommands()
+	{
+		releasingReadPointer_ = readPointer;
+		return;
+	}
+	
+	__sync_synchronize();			// Finish with the synths before telling anyone we're done
+	commandReadPointer_ = readPointer;
+}
+
+// Complete the removals applyCommands() held back for the block that has just been rendered
+
+void AudioRender::finishCommands()
+{
+	if(releasingListLength_ == 0)
+		return;
+	
+	for(int i = 0; i < releasingListLength_; i++)
+		removeFromRenderList(releasingList_[i]);
+	releasingListLength_ = 0;
+	
+	__sync_synchronize();			// Finish with the synths before telling anyone we're done
+	commandReadPointer_ = releasingReadPointer_;
+}
+
+void AudioRender::removeFromRenderList(SynthBase *synth)
+{
+	for(int i = 0; i < renderListLength_; i++)
+	{
+		if(renderList_[i] == synth)
+		{
+			renderList_[i] = renderList_[--renderListLength_];	// Order doesn't matter
+			break;
+		}
+	}
 }
 
 // This method registers for specific OSC paths when the OscController object is set.  We need a reference to the
@@ -271,17 +925,31 @@ void AudioRender::setOscController(OscController *c)
 		return;
 	
 	string volumePath("/ui/volume");
+	string statsPath("/ui/stats");
+	string statsResetPath("/ui/stats/reset");
 	
 	OscHandler::setOscController(c);
 	
 	addOscListener(volumePath);
+	addOscListener(statsPath);
+	addOscListener(statsResetPath);
 }
 
-// This method is called by the OscController when it receives a message we've registered for.  In this case
-// it's for changing the global volume.  Returns true on success.
+// This method is called by the OscController when it receives a message we've registered for:  changing the
+// global volume, or requesting or resetting the render statistics.  Returns true on success.
 
 bool AudioRender::oscHandlerMethod(const char *path, const char *types, int numValues, lo_arg **values, void *data)
 {
+	if(!strcmp(path, "/ui/stats"))
+	{
+		sendRenderStats();
+		return true;
+	}
+	if(!strcmp(path, "/ui/stats/reset"))
+	{
+		resetRenderStats();
+		return true;
+	}
 	if(strcmp(path, "/ui/volume") || numValues < 1)
 		return false;
 
@@ -305,42 +973,169 @@ int AudioRender::renderCallback(const void *input, void *output,
 								const PaStreamCallbackTimeInfo* timeInfo,
 								PaStreamCallbackFlags statusFlags)
 {
-	// First, initialize the output to all zeros
-	bzero(output, frameCount*numOutputChannels_*sizeof(float));
+	uint64_t blockStartTime = profiler_.beginBlock(frameCount, sampleRate_, statusFlags);
+	
+	if(frameCount <= busFrameCount_)
+		renderBlock(input, (float *)output, frameCount, timeInfo, statusFlags);
+	else if(busFrameCount_ > 0)
+	{
+		// Longer than the stream promised.  Render it in pieces the buses have room for rather than
+		// allocating here, with the times moved along to match each piece.
+		PaStreamCallbackTimeInfo pieceTimeInfo;
+		unsigned long offset, pieceFrameCount;
+		PaTime shift;
+		
+		for(offset = 0; offset < frameCount; offset += pieceFrameCount)
+		{
+			pieceFrameCount = min(busFrameCount_, frameCount - offset);
+			shift = (PaTime)offset/sampleRate_;
+			pieceTimeInfo.inputBufferAdcTime = timeInfo->inputBufferAdcTime + shift;
+			pieceTimeInfo.currentTime = timeInfo->currentTime + shift;
+			pieceTimeInfo.outputBufferDacTime = timeInfo->outputBufferDacTime + shift;
+			
+			renderBlock(input == NULL ? NULL : (const float *)input + offset*numInputChannels_,
+						(float *)output + offset*numOutputChannels_, pieceFrameCount, &pieceTimeInfo, statusFlags);
+		}
+	}
+	
+	profiler_.endBlock(blockStartTime, renderListLength_);
+	
+    return paContinue;
+}
+
+// Render one block of no more than busFrameCount_ frames
+
+void AudioRender::renderBlock(const void *input, float *outBuffer, unsigned long frameCount,
+							  const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags)
+{
+	unsigned long i;
+	int channel;
+	
+	// Pick up any synths added or removed since the last block.  The list won't change again
+	// until the next callback, so no lock is needed while we walk it.
+	applyCommands(timeInfo->outputBufferDacTime, timeInfo->outputBufferDacTime + (PaTime)frameCount/sampleRate_);
+	
+	// De-interleave the input and save its history.  Every synth reads its input from there, so it has
+	// to be in place before any rendering starts.
+	inputHistory_.write((const float *)input, frameCount);
+	
+	// Initialize the output buses that will be used to all zeros
+	memset(&busActive_[0], 0, busActive_.size());
+	for(i = 0; i < renderListLength_; i++)
+		busActive_[busIndex(renderList_[i]->outputChannel())] = true;
+	for(channel = 0; channel <= numOutputChannels_; channel++)
+	{
+		if(busActive_[channel])
+			bzero(outputBus(channel), frameCount*sizeof(float));
+	}
 	
 	// Walk through the list of synths, calling the render process for each, which will mix its output
-	// into the buffer (i.e. not overwrite what's already there).
+	// into the bus for its channel (i.e. not overwrite what's already there).
 	// Each synth already knows the sample rate and channel count.
 	
-	if(pthread_mutex_lock(&renderMutex_) != 0)	// Acquire lock ensuring the render list won't change
+	blockInput_ = input;
+	blockFrameCount_ = frameCount;
+	blockTimeInfo_ = timeInfo;
+	blockStatusFlags_ = statusFlags;
+	
+	if(numRenderThreads_ <= 1)
 	{
-		cerr << "Error: Could not lock mutex in renderCallback()\n";
-		return paInternalError;
+		renderGroup(&renderThreads_[0], renderList_, renderListLength_);
 	}
-	
-	set<SynthBase *>::iterator it;
-	for(it = synths_.begin(); it != synths_.end(); it++)
+	else
 	{
-		(*it)->render(input, output, frameCount, timeInfo, statusFlags);
+		int thread;
+		
+		// Deal the synths out to the thread that owns their channel, keeping their relative order
+		for(thread = 0; thread < numRenderThreads_; thread++)
+			renderThreads_[thread].renderListLength = 0;
+		for(i = 0; i < renderListLength_; i++)
+		{
+			channel = renderList_[i]->outputChannel();
+			thread = (channel >= 0 && channel < channelThread_.size()) ? channelThread_[channel] : 0;
+			renderThreads_[thread].renderList[renderThreads_[thread].renderListLength++] = renderList_[i];
+		}
+		
+		// The workers copy this thread's scheduling, whichever thread is driving the callback
+		if(!callbackSchedulingKnown_)
+		{
+			if(pthread_getschedparam(pthread_self(), &callbackPolicy_, &callbackParam_) == 0)
+				callbackSchedulingKnown_ = true;
+		}
+		
+		// Start the workers.  The barrier makes everything above visible to them before they wake.
+		workersFinished_ = 0;
+		__sync_synchronize();
+		for(thread = 1; thread < numRenderThreads_; thread++)
+			signalSemaphore(&renderThreads_[thread].wake);
+		
+		// Thread 0 renders its own channels, like any other
+		renderGroup(&renderThreads_[0], renderThreads_[0].renderList, renderThreads_[0].renderListLength);
+		
+		// Wait for the workers.  If they're taking a while, we may be sharing a core with one of them.
+		for(i = 0; workersFinished_ < numRenderThreads_ - 1; i++)
+		{
+			if(i < RENDER_WORKER_SPIN)
+				spinPause();
+			else
+				sched_yield();
+		}
+		__sync_synchronize();
 	}
 	
-	// Scale the output if necessary
-	if(globalAmplitude_ != 1.0)
+	// Scale the buses by the global amplitude and interleave them into the output, which is 32-bit float
+	// so needs no other conversion.  Silent channels are written as zeros without reading their bus.
+	const float amplitude = globalAmplitude_;
+	const int stride = numOutputChannels_;
+	
+	for(channel = 0; channel < numOutputChannels_; channel++)
 	{
-		for(int i = 0; i < frameCount*numOutputChannels_; i++)
-			((float *)output)[i] *= globalAmplitude_;
+		float *out = outBuffer + channel;
+		
+		if(busActive_[channel])
+		{
+			const float *bus = outputBus(channel);
+			for(i = 0; i < frameCount; i++)
+				out[i*stride] = bus[i]*amplitude;
+		}
+		else
+		{
+			for(i = 0; i < frameCount; i++)
+				out[i*stride] = 0.0f;
+		}
 	}
 	
-	if(pthread_mutex_unlock(&renderMutex_) != 0)	// Release our lock on the render list
+	// Synths that released during this block have rendered up to their release, and can go now
+	finishCommands();
+}
+
+// Make room in the output buses for blocks of frameCount samples.  Each bus starts on a cache line, so
+// render threads writing to neighboring buses don't contend for the same line.  Only called from
+// setStreamInfo(), never by the callback.
+
+void AudioRender::allocateOutputBuses(unsigned long frameCount)
+{
+	void *memory;
+	const unsigned long lineLength = RENDER_BUS_ALIGNMENT / sizeof(float);
+	unsigned long stride = (frameCount + lineLength - 1) / lineLength * lineLength;
+	
+	if(posix_memalign(&memory, RENDER_BUS_ALIGNMENT, (numOutputChannels_ + 1)*stride*sizeof(float)) != 0)
 	{
-		cerr << "Error: Could not unlock mutex in renderCallback()\n";
-		return paInternalError;
-	}	
+		cerr << "Error: Failed to allocate output buses!\n";
+		Pa_Terminate();
+		exit(1);		// Can't render anywhere without them, so quit
+	}
 	
-    return paContinue;
+	free(outputBuses_);
+	outputBuses_ = (float *)memory;
+	busStride_ = stride;
+	busFrameCount_ = frameCount;
+	busActive_.assign(numOutputChannels_ + 1, 0);
 }
 
 AudioRender::~AudioRender()
 {
-	pthread_mutex_destroy(&renderMutex_);
+	stopRenderThreads();
+	free(outputBuses_);
+	pthread_mutex_destroy(&queueMutex_);
 }
@@ -13,27 +13,72 @@
 #include <iostream>
 #include <set>
 #include <vector>
+#include <cmath>
 #include <pthread.h>
+#include <sys/time.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#else
+#include <semaphore.h>
+#endif
 #include "portaudio.h"
 #include "synth.h"
 #include "osccontroller.h"
+#include "renderprofiler.h"
+#include "inputhistory.h"
 
 using namespace std;
 
+#define RENDER_LIST_SIZE	256		// Maximum number of synths rendered at once
+#define RENDER_QUEUE_SIZE	256		// Size of the add/remove command queue (must be a power of 2)
+#define RENDER_QUEUE_TIMEOUT 100	// Milliseconds to wait for space on a full command queue
+#define RENDER_MAX_THREADS	16		// Maximum number of threads sharing the render work
+#define RENDER_WORKER_SPIN	2000	// Times the callback polls for the workers to finish before yielding
+#define RENDER_BUS_BLOCK_SIZE	1024	// Block size to make room for in the output buses if the stream doesn't fix one
+#define RENDER_BUS_ALIGNMENT	64		// Byte alignment of each output bus (one cache line)
+#define RENDER_CHANNEL_WORD_BITS	32	// Channels per word of the free channel bitmap
+
+#ifdef __APPLE__
+typedef semaphore_t renderSemaphore;
+#else
+typedef sem_t renderSemaphore;
+#endif
+
 class AudioRender : public OscHandler
 {
 public:
 	AudioRender();
 	
-	// This should always be called before starting the stream
+	// This should always be called before starting the stream.  maxFrameCount is the longest block the stream
+	// will deliver (0 if it isn't fixed), which the output buses and input history are allocated for.  A longer
+	// block is still rendered, in pieces of that size.
 	void setStreamInfo(PaStream *stream, int numInputChannels, int numOutputChannels, 
-					   float sampleRate, vector<int>& channelsToUse);
+					   float sampleRate, vector<int>& channelsToUse, unsigned long maxFrameCount);
+	
+	// Tools for querying the stream or timing status.  With no stream (offline rendering), time
+	// comes from whoever is driving renderCallback() via setOfflineTime().
+	PaTime currentTime() { return (stream_ == NULL ? offlineTime_ : Pa_GetStreamTime(stream_)); }
+	PaTime delayTime(PaTime delay) { return (currentTime() + delay); }
+	void setOfflineTime(PaTime time) { offlineTime_ = time; }
 	
-	// Tools for querying the stream or timing status
-	PaTime currentTime() { return Pa_GetStreamTime(stream_); }
-	PaTime delayTime(PaTime delay) { return (Pa_GetStreamTime(stream_) + delay); }
+	// Start and stop the stream, in place of Pa_StartStream() and Pa_StopStream()
+	PaError startStream();
+	PaError stopStream();
+	
+	// Bracket an offline render, on the thread that will call renderCallback().  In between, only that thread
+	// applies render commands; other threads wait for it rather than draining the queue themselves.
+	void beginOfflineRender();
+	void endOfflineRender();
+	
+	// How long after they arrive MIDI and OSC events take effect.  Scheduling every event the same time
+	// after its arrival lets synths begin, release and change parameters at the exact frame, instead of
+	// at the start of whichever buffer renders next, so timing doesn't depend on the buffer size.  The
+	// latency should cover at least one buffer plus the output latency, or events will arrive too late
+	// and start at the next buffer as before.  Negative (the default) turns scheduling off.
+	void setEventLatency(PaTime latency) { eventLatency_ = latency; }
+	PaTime eventLatency() { return eventLatency_; }
 
-	double cpuLoad() { return Pa_GetStreamCpuLoad(stream_); }
+	double cpuLoad() { return (stream_ == NULL ? 0.0 : Pa_GetStreamCpuLoad(stream_)); }
 	
 	int numInputChannels() { return numInputChannels_; }
 	int numOutputChannels() { return numOutputChannels_; }
@@ -42,22 +87,65 @@ public:
 	PaTime inputLatency();
 	PaTime outputLatency();
 	
+	// The input of the current block, de-interleaved, and its recent history on every channel.  Synths read
+	// their input from here.  With DC blocking on, DC is filtered out of the input once for all synths.
+	InputHistory *inputHistory() { return &inputHistory_; }
+	void setInputDcBlocking(bool dcBlocking) { inputHistory_.setDcBlocking(dcBlocking); }
+	
+	// Spread the rendering over several threads.  Each thread owns a fixed group of output channels and
+	// renders the synths on those channels into their output buses; the audio callback thread takes the first
+	// group itself and waits for the others to finish.  Synths on one channel always render in the same order
+	// on the same thread, so the output is identical to single-threaded rendering.  With one thread (the
+	// default) no workers are created.  Call after setStreamInfo() and before starting the stream.  Returns the
+	// number of threads actually in use.
+	int setRenderThreads(int numThreads);
+	int numRenderThreads() { return numRenderThreads_; }
+	
+	// Fraction of real time each render thread has spent rendering since the last reset
+	double renderThreadLoad(int thread);
+	void resetRenderThreadLoad();
+	
+	// Render statistics: callback duration histogram, xruns, voices per block and the cost of a voice, of
+	// each synth type and of each output channel.  sendRenderStats() transmits them under /ui/stats/..., which is also what
+	// happens when we receive /ui/stats; /ui/stats/reset clears them.
+	void printRenderStats(ostream& output);
+	void sendRenderStats();
+	void resetRenderStats();
+	uint64_t xruns() { return profiler_.xruns(); }
+	
 	// Set the global output amplitude
 	void setGlobalAmplitude(float amp) { globalAmplitude_ = amp; }
 	
 	// Tools for finding an open audio channel (allocated first-come, first-served)
 	// Returns the channel used, or -1 if none available.  Save this channel number
 	// for freeing later.  Only one object can use a channel at a time through this mechanism.
+	// None of these take a lock, so they're safe to call from any thread.
 	
 	pair<int,int> allocateOutputChannel();
 	void freeOutputChannel(int channel);		// Return the channel to the pool when finished
 	void freeAllOutputChannels();				// Clear the list
 	
-	// Tools for managing the synth list
+	// Tools for managing the synth list.  These are called from the MIDI/OSC threads and never
+	// touch the render list directly; instead they post a command that the render callback applies
+	// at the start of the next block.  removeSynth() and removeAllSynths() wait until the command
+	// has been applied, so the caller is free to delete the synth once they return.
 	int addSynth(SynthBase *synth);		// Add a new synth to the render list
 	int removeSynth(SynthBase *synth);	// Remove a synth from the render list
 	void removeAllSynths();				// Clear the render list
 	
+	// Deferred removal, for callers that shouldn't block on the render thread.  removeSynthDeferred() posts the
+	// command and returns at once, storing in *epoch the point in the command stream after which no render pass
+	// can see the synth.  If it fails, *epoch is untouched and the synth is still rendering until a later call
+	// succeeds.  Once removalIsComplete(epoch) returns true, call synthRemoved() and the synth may be
+	// deleted or reused.  removalIsComplete() never drains the queue itself, so it is safe to poll from any thread;
+	// waitForPendingRemovals() blocks until every removal posted so far is complete.  A removal given a time
+	// (that of the synth's release) waits for the buffer containing that time, and completes once the synth
+	// has rendered through it.
+	int removeSynthDeferred(SynthBase *synth, unsigned int *epoch, PaTime when = 0);
+	bool removalIsComplete(unsigned int epoch) { return ((int)(epoch - commandReadPointer_) <= 0); }
+	void waitForPendingRemovals() { waitForCommand(commandWritePointer_); }
+	void synthRemoved(SynthBase *synth);
+	
 	// OSC handler routine, for changing calibration settings
 	bool oscHandlerMethod(const char *path, const char *types, int numValues, lo_arg **values, void *data);
 	void setOscController(OscController *c);	// Override the OscHandler implementation to register our paths
@@ -83,25 +171,126 @@ public:
 	~AudioRender();
 	
 private:
+	enum {
+		kRenderCommandAdd = 0,
+		kRenderCommandRemove,
+		kRenderCommandRemoveAll
+	};
+	
+	typedef struct {
+		int type;
+		SynthBase *synth;
+		PaTime time;			// Stream time before which the command can't be applied, or 0
+	} renderCommand;
+	
+	typedef struct {
+		AudioRender *render;
+		int index;
+		pthread_t thread;
+		renderSemaphore wake;						// Signalled by the callback for each block (workers only)
+		bool schedulingCopied;						// Whether the worker has taken on the callback's priority
+		SynthBase *renderList[RENDER_LIST_SIZE];	// This thread's share of the render list, for the current block
+		int renderListLength;
+		double busyTime;							// Seconds spent rendering since the last reset
+	} renderThread;
+	
+	bool ownsRenderList();							// Whether this thread may drain the command queue itself
+	void drainCommands();							// Drain it on a control thread, holding queueMutex_
+	int postCommand(int type, SynthBase *synth, PaTime when = 0);	// Place a command on the queue (control threads only)
+	void waitForCommand(unsigned int sequence);		// Block until the render thread has applied a command
+	void applyCommands(PaTime blockStartTime = HUGE_VAL, PaTime blockEndTime = HUGE_VAL);	// Drain the queue into the render list
+	void finishCommands();							// Complete the removals held back by applyCommands()
+	void removeFromRenderList(SynthBase *synth);
+	
+	static void *staticWorkerLoop(void *data)
+	{
+		renderThread *thread = (renderThread *)data;
+		thread->render->workerLoop(thread);
+		return NULL;
+	}
+	void workerLoop(renderThread *thread);			// Body of each worker thread
+	void renderGroup(renderThread *thread, SynthBase **list, int listLength);
+	void stopRenderThreads();
+	
+	// Output buses.  Synths whose channel is out of range render into a scratch bus after the real ones,
+	// which is never heard.
+	void allocateOutputBuses(unsigned long frameCount);
+	void renderBlock(const void *input, float *outBuffer, unsigned long frameCount,
+					 const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags);
+	int busIndex(int channel) { return (channel >= 0 && channel < numOutputChannels_) ? channel : numOutputChannels_; }
+	float *outputBus(int channel) { return outputBuses_ + busIndex(channel)*busStride_; }
+	
 	/* Stream information */
 	PaStream *stream_;
 	int numInputChannels_;
 	int numOutputChannels_;
 	vector<int> outputChannels_;		// A list of channels we can use for output
 	float sampleRate_;
+	PaTime offlineTime_;				// Current time when there is no stream
+	volatile bool offlineRendering_;	// Between beginOfflineRender() and endOfflineRender()
+	pthread_t offlineOwner_;			// The thread driving the offline render
+	volatile bool streamRendering_;		// Between startStream() and stopStream(): only the callback drains
+	PaTime eventLatency_;				// Delay from the arrival of an event to its effect, or < 0 for none
+	InputHistory inputHistory_;			// Filled at the start of each block, before any synth renders
 
 	/* Global amplitude scaler for all outputs */
 	float globalAmplitude_;
 	
-	/* List of output channels, indicating whether each is in use */
-	vector<bool> channelsUsed_;
+	/* Planar output: synths mix into one contiguous bus per channel, and a single pass at the end of each
+	 block scales the buses by globalAmplitude_ and interleaves them into the stream's buffer.  Only the buses
+	 of channels with synths on them are cleared and read; the rest of the output is written as silence. */
+	float *outputBuses_;				// (numOutputChannels_ + 1) buses, busStride_ samples apart
+	unsigned long busStride_;			// busFrameCount_ rounded up to a whole number of cache lines
+	unsigned long busFrameCount_;		// Longest block the buses have room for
+	vector<char> busActive_;			// Whether each bus has synths on it this block
 	
-	/* List of synth processes to execute on each callback.  Use a map so we can remove specific
-	 synths later. */
+	/* Bitmap of free output channels: bit n is set while outputChannels_[n] is free.  Changed only by
+	 atomic operations, in allocateOutputChannel() and freeOutputChannel(). */
+	vector<uint32_t> freeChannels_;
+	vector<int> channelIndices_;		// Index of each output channel in outputChannels_, or -1 if unused
+	
+	/* List of synth processes to execute on each callback.  This array is owned by the render
+	 thread: only applyCommands() changes it, and order within it is not significant. */
+	SynthBase *renderList_[RENDER_LIST_SIZE];
+	int renderListLength_;
+	
+	/* Synths whose removal was timed during the current block, and where the command queue will have been
+	 read up to once they're gone.  Also owned by the render thread. */
+	SynthBase *releasingList_[RENDER_LIST_SIZE];
+	int releasingListLength_;
+	unsigned int releasingReadPointer_;
+	
+	/* Single-producer, single-consumer command queue.  The producer side is serialized by queueMutex_
+	 (taken only by control threads); the render thread reads without locking.  The counters are free-running
+	 and only ever written by one side. */
+	renderCommand commandQueue_[RENDER_QUEUE_SIZE];
+	volatile unsigned int commandWritePointer_;		// Written by control threads
+	volatile unsigned int commandReadPointer_;		// Written by the render thread
+	
+	/* Mirror of the render list contents as the control threads see it, used to give addSynth() and
+	 removeSynth() meaningful return values without consulting the render thread. */
 	set<SynthBase *> synths_;
 	
-	/* Render list mutex ensures that render list doesn't change while it's being iterated */
-	pthread_mutex_t renderMutex_, channelMutex_;
+	/* Render threads.  Thread 0 is whichever thread calls renderCallback(); the rest are workers.  Each block
+	 the callback publishes its arguments, signals each worker's semaphore and waits for workersFinished_ to
+	 count up to the number of workers.  Nothing on the callback's side takes a lock. */
+	renderThread renderThreads_[RENDER_MAX_THREADS];
+	int numRenderThreads_;
+	vector<int> channelThread_;						// Which thread renders each output channel
+	volatile unsigned int workersFinished_;
+	volatile bool workersShouldStop_;
+	volatile bool callbackSchedulingKnown_;			// Set once the callback has filled in the next two
+	int callbackPolicy_;
+	struct sched_param callbackParam_;
+	const void *blockInput_;						// Arguments of the block being rendered
+	unsigned long blockFrameCount_;
+	const PaStreamCallbackTimeInfo *blockTimeInfo_;
+	PaStreamCallbackFlags blockStatusFlags_;
+	struct timeval loadResetTime_;					// When busyTime was last zeroed
+	RenderProfiler profiler_;						// Statistics gathered by the callback and the workers
+	
+	/* queueMutex_ serializes the control threads posting commands */
+	pthread_mutex_t queueMutex_;
 };
 
 #endif // AUDIORENDER_H
@@ -0,0 +1,40 @@
+/*
+ *  benchmark.h
+ *  mrp
+ *
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <iostream>
+#include <stdint.h>
+#include "renderprofiler.h"
+using namespace std;
+
+// The scaffolding shared by the --benchmark-* options.  Each one times its loops with a BenchmarkTimer,
+// start() before and nsPer() after, which gives the wall-clock time divided by the samples (or lookups, or
+// calculations) the loop handled.
+
+class BenchmarkTimer
+{
+public:
+	void start() { startTime_ = RenderProfiler::now(); }
+	double nsPer(double count) { return (double)(RenderProfiler::now() - startTime_) / count; }
+
+private:
+	uint64_t startTime_;
+};
+
+// Print "<title> benchmark (ns/<unit>, <count> <unit>s each)", with any note after a semicolon
+
+inline void printBenchmarkHeading(ostream& output, const char *title, const char *unit, long count,
+								  const char *note = NULL)
+{
+	output << title << " benchmark (ns/" << unit << ", " << count << " " << unit << "s each";
+	if(note != NULL)
+		output << "; " << note;
+	output << ")\n";
+}
+
+#endif /* BENCHMARK_H */
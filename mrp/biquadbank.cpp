@@ -0,0 +1,527 @@
+/*
+ *  biquadbank.cpp
+ *  mrp
+ *
+ */
+
+#include <cmath>
+#include "biquadbank.h"
+#include "benchmark.h"
+#include "kerneldispatch.h"
+#include "filter.h"
+#include "config.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#if defined(__x86_64__) || defined(__SSE__)
+#define BIQUAD_BANK_SSE
+#endif
+#if defined(__GNUC__)						// Needs per-function target attributes (gcc or clang)
+#define BIQUAD_BANK_AVX
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BIQUAD_BANK_NEON
+#endif
+
+using namespace std;
+
+// Each kernel runs every filter over frameCount samples of input, writing the output of filter n for sample i
+// to output[i*size + n].  The arrays are padded with inert filters to a multiple of BIQUAD_BANK_LANES, so size
+// is always a multiple of every kernel's width.  Each group of lanes keeps its history in registers for the whole
+// block.  The arithmetic follows ButterBandpassFilter::filter() term by term:
+//
+//   t = x - a3*h0 - a4*h1
+//   y = t*a0 + a1*h0 + a2*h1
+//
+// after which the history shifts (h1 = h0, h0 = t) only in lanes whose active mask is set.
+
+typedef void (*biquadKernel)(const float *input, float *output, unsigned long frameCount,
+							 const float *a0, const float *a1, const float *a2, const float *a3, const float *a4,
+							 float *history0, float *history1, const uint32_t *activeMasks, int size);
+
+#pragma mark Kernels
+
+static inline bool groupIsActive(const uint32_t *activeMasks, int width)
+{
+	for(int n = 0; n < width; n++)
+	{
+		if(activeMasks[n] != 0)
+			return true;
+	}
+	return false;
+}
+
+// Plain C++ version
+
+static void filterScalar(const float *input, float *output, unsigned long frameCount,
+						 const float *a0, const float *a1, const float *a2, const float *a3, const float *a4,
+						 float *history0, float *history1, const uint32_t *activeMasks, int size)
+{
+	unsigned long i;
+	int n;
+
+	for(n = 0; n < size; n++)
+	{
+		float c0 = a0[n], c1 = a1[n], c2 = a2[n], c3 = a3[n], c4 = a4[n];	// Local, so the stores can't alias them
+		float h0 = history0[n], h1 = history1[n];
+		float *out = output + n;
+
+		if(activeMasks[n] == 0)
+			continue;
+
+		for(i = 0; i < frameCount; i++)
+		{
+			float t = input[i] - c3 * h0 - c4 * h1;
+
+			out[i*size] = t * c0 + c1 * h0 + c2 * h1;
+			h1 = h0;
+			h0 = t;
+		}
+
+		history0[n] = h0;
+		history1[n] = h1;
+	}
+}
+
+#ifdef BIQUAD_BANK_SSE
+
+static inline __m128 select(__m128 mask, __m128 a, __m128 b)	// mask ? a : b, lane by lane
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// One group of 4 filters, for when the other half of a group of 8 is inactive
+
+static void filterSseGroup(const float *input, float *output, unsigned long frameCount,
+						   const float *a0, const float *a1, const float *a2, const float *a3, const float *a4,
+						   float *history0, float *history1, const uint32_t *activeMasks, int size)
+{
+	__m128 c0 = _mm_loadu_ps(a0), c1 = _mm_loadu_ps(a1), c2 = _mm_loadu_ps(a2);
+	__m128 c3 = _mm_loadu_ps(a3), c4 = _mm_loadu_ps(a4);
+	__m128 h0 = _mm_loadu_ps(history0), h1 = _mm_loadu_ps(history1);
+	__m128 mask = _mm_loadu_ps((const float *)activeMasks);
+	unsigned long i;
+
+	for(i = 0; i < frameCount; i++)
+	{
+		__m128 x = _mm_set1_ps(input[i]);
+		__m128 t = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(c3, h0)), _mm_mul_ps(c4, h1));
+		__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(t, c0), _mm_mul_ps(c1, h0)), _mm_mul_ps(c2, h1));
+
+		_mm_storeu_ps(output + i*size, y);
+		h1 = select(mask, h0, h1);
+		h0 = select(mask, t, h0);
+	}
+
+	_mm_storeu_ps(history0, h0);
+	_mm_storeu_ps(history1, h1);
+}
+
+// SSE version.  Each filter's recursion is a chain of dependent operations, so two groups of 4 filters are
+// interleaved to keep the pipeline busy.  size is always a multiple of 8.  Groups with no active filters
+// are skipped.
+
+static void filterSse(const float *input, float *output, unsigned long frameCount,
+					  const float *a0, const float *a1, const float *a2, const float *a3, const float *a4,
+					  float *history0, float *history1, const uint32_t *activeMasks, int size)
+{
+	unsigned long i;
+	int n;
+
+	for(n = 0; n < size; n += 8)
+	{
+		bool lowActive = groupIsActive(&activeMasks[n], 4), highActive = groupIsActive(&activeMasks[n + 4], 4);
+
+		if(!lowActive || !highActive)
+		{
+			if(lowActive)
+				filterSseGroup(input, output + n, frameCount, &a0[n], &a1[n], &a2[n], &a3[n], &a4[n],
+							   &history0[n], &history1[n], &activeMasks[n], size);
+			else if(highActive)
+				filterSseGroup(input, output + n + 4, frameCount, &a0[n + 4], &a1[n + 4], &a2[n + 4], &a3[n + 4], &a4[n + 4],
+							   &history0[n + 4], &history1[n + 4], &activeMasks[n + 4], size);
+			continue;
+		}
+
+		__m128 c0a = _mm_loadu_ps(&a0[n]), c1a = _mm_loadu_ps(&a1[n]), c2a = _mm_loadu_ps(&a2[n]);
+		__m128 c3a = _mm_loadu_ps(&a3[n]), c4a = _mm_loadu_ps(&a4[n]);
+		__m128 h0a = _mm_loadu_ps(&history0[n]), h1a = _mm_loadu_ps(&history1[n]);
+		__m128 maska = _mm_loadu_ps((const float *)&activeMasks[n]);
+		__m128 c0b = _mm_loadu_ps(&a0[n + 4]), c1b = _mm_loadu_ps(&a1[n + 4]), c2b = _mm_loadu_ps(&a2[n + 4]);
+		__m128 c3b = _mm_loadu_ps(&a3[n + 4]), c4b = _mm_loadu_ps(&a4[n + 4]);
+		__m128 h0b = _mm_loadu_ps(&history0[n + 4]), h1b = _mm_loadu_ps(&history1[n + 4]);
+		__m128 maskb = _mm_loadu_ps((const float *)&activeMasks[n + 4]);
+		float *out = output + n;
+
+		for(i = 0; i < frameCount; i++)
+		{
+			__m128 x = _mm_set1_ps(input[i]);
+			__m128 ta = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(c3a, h0a)), _mm_mul_ps(c4a, h1a));
+			__m128 tb = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(c3b, h0b)), _mm_mul_ps(c4b, h1b));
+			__m128 ya = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ta, c0a), _mm_mul_ps(c1a, h0a)), _mm_mul_ps(c2a, h1a));
+			__m128 yb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tb, c0b), _mm_mul_ps(c1b, h0b)), _mm_mul_ps(c2b, h1b));
+
+			_mm_storeu_ps(out + i*size, ya);
+			_mm_storeu_ps(out + i*size + 4, yb);
+			h1a = select(maska, h0a, h1a);
+			h0a = select(maska, ta, h0a);
+			h1b = select(maskb, h0b, h1b);
+			h0b = select(maskb, tb, h0b);
+		}
+
+		_mm_storeu_ps(&history0[n], h0a);
+		_mm_storeu_ps(&history1[n], h1a);
+		_mm_storeu_ps(&history0[n + 4], h0b);
+		_mm_storeu_ps(&history1[n + 4], h1b);
+	}
+}
+
+#endif // BIQUAD_BANK_SSE
+
+#ifdef BIQUAD_BANK_AVX
+
+// AVX version, 8 filters at a time, or 16 with two groups interleaved as in the SSE version.  Once a group of
+// 16 is found with one half inactive, the rest are done 8 at a time, skipping inactive groups.  Only called
+// when the CPU reports AVX support.  FMA is deliberately not used, so the results match the scalar filter exactly.
+
+__attribute__((target("avx")))
+static void filterAvx(const float *input, float *output, unsigned long frameCount,
+					  const float *a0, const float *a1, const float *a2, const float *a3, const float *a4,
+					  float *history0, float *history1, const uint32_t *activeMasks, int size)
+{
+	unsigned long i;
+	int n;
+
+	for(n = 0; n + 16 <= size; n += 16)
+	{
+		if(!groupIsActive(&activeMasks[n], 16))
+			continue;
+		if(!groupIsActive(&activeMasks[n], 8) || !groupIsActive(&activeMasks[n + 8], 8))
+			break;			// Leave it to the single-group loop below
+
+		__m256 c0a = _mm256_loadu_ps(&a0[n]), c1a = _mm256_loadu_ps(&a1[n]), c2a = _mm256_loadu_ps(&a2[n]);
+		__m256 c3a = _mm256_loadu_ps(&a3[n]), c4a = _mm256_loadu_ps(&a4[n]);
+		__m256 h0a = _mm256_loadu_ps(&history0[n]), h1a = _mm256_loadu_ps(&history1[n]);
+		__m256 maska = _mm256_loadu_ps((const float *)&activeMasks[n]);
+		__m256 c0b = _mm256_loadu_ps(&a0[n + 8]), c1b = _mm256_loadu_ps(&a1[n + 8]), c2b = _mm256_loadu_ps(&a2[n + 8]);
+		__m256 c3b = _mm256_loadu_ps(&a3[n + 8]), c4b = _mm256_loadu_ps(&a4[n + 8]);
+		__m256 h0b = _mm256_loadu_ps(&history0[n + 8]), h1b = _mm256_loadu_ps(&history1[n + 8]);
+		__m256 maskb = _mm256_loadu_ps((const float *)&activeMasks[n + 8]);
+		float *out = output + n;
+
+		for(i = 0; i < frameCount; i++)
+		{
+			__m256 x = _mm256_set1_ps(input[i]);
+			__m256 ta = _mm256_sub_ps(_mm256_sub_ps(x, _mm256_mul_ps(c3a, h0a)), _mm256_mul_ps(c4a, h1a));
+			__m256 tb = _mm256_sub_ps(_mm256_sub_ps(x, _mm256_mul_ps(c3b, h0b)), _mm256_mul_ps(c4b, h1b));
+			__m256 ya = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ta, c0a), _mm256_mul_ps(c1a, h0a)), _mm256_mul_ps(c2a, h1a));
+			__m256 yb = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tb, c0b), _mm256_mul_ps(c1b, h0b)), _mm256_mul_ps(c2b, h1b));
+
+			_mm256_storeu_ps(out + i*size, ya);
+			_mm256_storeu_ps(out + i*size + 8, yb);
+			h1a = _mm256_blendv_ps(h1a, h0a, maska);
+			h0a = _mm256_blendv_ps(h0a, ta, maska);
+			h1b = _mm256_blendv_ps(h1b, h0b, maskb);
+			h0b = _mm256_blendv_ps(h0b, tb, maskb);
+		}
+
+		_mm256_storeu_ps(&history0[n], h0a);
+		_mm256_storeu_ps(&history1[n], h1a);
+		_mm256_storeu_ps(&history0[n + 8], h0b);
+		_mm256_storeu_ps(&history1[n + 8], h1b);
+	}
+
+	for(; n < size; n += 8)
+	{
+		if(!groupIsActive(&activeMasks[n], 8))
+			continue;
+
+		__m256 c0 = _mm256_loadu_ps(&a0[n]), c1 = _mm256_loadu_ps(&a1[n]), c2 = _mm256_loadu_ps(&a2[n]);
+		__m256 c3 = _mm256_loadu_ps(&a3[n]), c4 = _mm256_loadu_ps(&a4[n]);
+		__m256 h0 = _mm256_loadu_ps(&history0[n]), h1 = _mm256_loadu_ps(&history1[n]);
+		__m256 mask = _mm256_loadu_ps((const float *)&activeMasks[n]);
+		float *out = output + n;
+
+		for(i = 0; i < frameCount; i++)
+		{
+			__m256 x = _mm256_set1_ps(input[i]);
+			__m256 t = _mm256_sub_ps(_mm256_sub_ps(x, _mm256_mul_ps(c3, h0)), _mm256_mul_ps(c4, h1));
+			__m256 y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(t, c0), _mm256_mul_ps(c1, h0)), _mm256_mul_ps(c2, h1));
+
+			_mm256_storeu_ps(out + i*size, y);
+			h1 = _mm256_blendv_ps(h1, h0, mask);
+			h0 = _mm256_blendv_ps(h0, t, mask);
+		}
+
+		_mm256_storeu_ps(&history0[n], h0);
+		_mm256_storeu_ps(&history1[n], h1);
+	}
+}
+
+#endif // BIQUAD_BANK_AVX
+
+#ifdef BIQUAD_BANK_NEON
+
+// NEON version, 4 filters at a time, using separate multiplies and adds like the other kernels.  Groups with
+// no active filters are skipped.
+
+static void filterNeon(const float *input, float *output, unsigned long frameCount,
+					   const float *a0, const float *a1, const float *a2, const float *a3, const float *a4,
+					   float *history0, float *history1, const uint32_t *activeMasks, int size)
+{
+	unsigned long i;
+	int n;
+
+	for(n = 0; n < size; n += 4)
+	{
+		if(!groupIsActive(&activeMasks[n], 4))
+			continue;
+
+		float32x4_t c0 = vld1q_f32(&a0[n]), c1 = vld1q_f32(&a1[n]), c2 = vld1q_f32(&a2[n]);
+		float32x4_t c3 = vld1q_f32(&a3[n]), c4 = vld1q_f32(&a4[n]);
+		float32x4_t h0 = vld1q_f32(&history0[n]), h1 = vld1q_f32(&history1[n]);
+		uint32x4_t mask = vld1q_u32(&activeMasks[n]);
+		float *out = output + n;
+
+		for(i = 0; i < frameCount; i++)
+		{
+			float32x4_t x = vdupq_n_f32(input[i]);
+			float32x4_t t = vsubq_f32(vsubq_f32(x, vmulq_f32(c3, h0)), vmulq_f32(c4, h1));
+			float32x4_t y = vaddq_f32(vaddq_f32(vmulq_f32(t, c0), vmulq_f32(c1, h0)), vmulq_f32(c2, h1));
+
+			vst1q_f32(out + i*size, y);
+			h1 = vbslq_f32(mask, h0, h1);
+			h0 = vbslq_f32(mask, t, h0);
+		}
+
+		vst1q_f32(&history0[n], h0);
+		vst1q_f32(&history1[n], h1);
+	}
+}
+
+#endif // BIQUAD_BANK_NEON
+
+#pragma mark Kernel Selection
+
+static const KernelDispatch<biquadKernel>::kernelInfo kKernels[BiquadBank::kNumKernels] = {
+	{ "scalar", kInstructionsBase, filterScalar },
+#ifdef BIQUAD_BANK_AVX
+	{ "AVX", kInstructionsAvx, filterAvx },
+#else
+	{ "AVX", kInstructionsAvx, NULL },
+#endif
+#ifdef BIQUAD_BANK_SSE
+	{ "SSE", kInstructionsBase, filterSse },
+#else
+	{ "SSE", kInstructionsBase, NULL },
+#endif
+#ifdef BIQUAD_BANK_NEON
+	{ "NEON", kInstructionsBase, filterNeon },
+#else
+	{ "NEON", kInstructionsBase, NULL },
+#endif
+};
+
+static KernelDispatch<biquadKernel> gKernels("BiquadBank", kKernels, BiquadBank::kNumKernels);
+
+bool BiquadBank::kernelIsAvailable(int kernel)
+{
+	return gKernels.isAvailable(kernel);
+}
+
+int BiquadBank::currentKernel()
+{
+	return gKernels.current();
+}
+
+// Change the kernel used by every BiquadBank.  This should not be called while audio is running.
+
+void BiquadBank::setKernel(int kernel)
+{
+	gKernels.set(kernel);
+}
+
+const char *BiquadBank::kernelName(int kernel)
+{
+	return gKernels.name(kernel);
+}
+
+#pragma mark BiquadBank
+
+BiquadBank::BiquadBank(float sampleRate)
+{
+	piDivSampleRate_ = M_PI / sampleRate;
+	twoPiDivSampleRate_ = 2.0 * piDivSampleRate_;
+	size_ = paddedSize_ = 0;
+}
+
+void BiquadBank::resize(int size)
+{
+	int n, newPaddedSize = ((size + BIQUAD_BANK_LANES - 1) / BIQUAD_BANK_LANES) * BIQUAD_BANK_LANES;
+
+	if(newPaddedSize > a0_.size())
+	{
+		a0_.resize(newPaddedSize);
+		a1_.resize(newPaddedSize);
+		a2_.resize(newPaddedSize);
+		a3_.resize(newPaddedSize);
+		a4_.resize(newPaddedSize);
+		history0_.resize(newPaddedSize);
+		history1_.resize(newPaddedSize);
+		activeMasks_.resize(newPaddedSize);
+	}
+
+	// Filters past the old size, including padding, start out zeroed.  The padding lanes are inactive.
+	for(n = size_; n < newPaddedSize; n++)
+	{
+		a0_[n] = a1_[n] = a2_[n] = a3_[n] = a4_[n] = 0.0;
+		history0_[n] = history1_[n] = 0.0;
+		activeMasks_[n] = (n < size ? 0xFFFFFFFF : 0);
+	}
+
+	size_ = size;
+	paddedSize_ = newPaddedSize;
+}
+
+void BiquadBank::reserve(int size)
+{
+	int newPaddedSize = ((size + BIQUAD_BANK_LANES - 1) / BIQUAD_BANK_LANES) * BIQUAD_BANK_LANES;
+
+	if(newPaddedSize <= a0_.size())
+		return;
+
+	a0_.resize(newPaddedSize);
+	a1_.resize(newPaddedSize);
+	a2_.resize(newPaddedSize);
+	a3_.resize(newPaddedSize);
+	a4_.resize(newPaddedSize);
+	history0_.resize(newPaddedSize);
+	history1_.resize(newPaddedSize);
+	activeMasks_.resize(newPaddedSize);
+}
+
+void BiquadBank::updateCoefficients(int index, float frequency, float bandwidth)
+{
+	float a[5];
+
+	if(!ButterBandpassFilter::calculateCoefficients(a, frequency, bandwidth, piDivSampleRate_, twoPiDivSampleRate_))
+		return;
+
+	a0_[index] = a[0];
+	a1_[index] = a[1];
+	a2_[index] = a[2];
+	a3_[index] = a[3];
+	a4_[index] = a[4];
+}
+
+void BiquadBank::clearBuffer(int index)
+{
+	history0_[index] = history1_[index] = 0.0;
+}
+
+void BiquadBank::filter(const float *input, float *output, unsigned long frameCount)
+{
+	biquadKernel kernel = gKernels.function();
+	int n, active = 0;
+
+	for(n = 0; n < size_; n++)
+	{
+		if(activeMasks_[n] != 0)
+			active++;
+	}
+	if(active == 0)
+		return;
+
+	// A lone filter gains nothing from the SIMD lanes, and the plain version's history update is quicker
+	if(active == 1)
+		kernel = filterScalar;
+
+	(*kernel)(input, output, frameCount, &a0_[0], &a1_[0], &a2_[0], &a3_[0], &a4_[0],
+			    &history0_[0], &history1_[0], &activeMasks_[0], paddedSize_);
+}
+
+#pragma mark Benchmark
+
+#define BIQUAD_BENCHMARK_FRAMES		256			// Block size, as PllSynth uses
+#define BIQUAD_BENCHMARK_SAMPLES	2000000		// Total samples filtered for each measurement
+
+void BiquadBank::benchmark(ostream& output)
+{
+	const int filterCounts[] = { 1, 3, 4, 8, 16 };
+	const float sampleRate = 44100.0, fundamental = 261.6, q = 20.0;
+	int maxFilters = filterCounts[sizeof(filterCounts) / sizeof(int) - 1];
+	vector<float> input(BIQUAD_BENCHMARK_FRAMES), reference(BIQUAD_BENCHMARK_FRAMES * maxFilters);
+	vector<float> result(BIQUAD_BENCHMARK_FRAMES * ((maxFilters + BIQUAD_BANK_LANES - 1) / BIQUAD_BANK_LANES) * BIQUAD_BANK_LANES);
+	int savedKernel = gKernels.current();
+	int repetitions = BIQUAD_BENCHMARK_SAMPLES / BIQUAD_BENCHMARK_FRAMES;
+	double samples = (double)repetitions * BIQUAD_BENCHMARK_FRAMES;
+	BenchmarkTimer timer;
+	uint32_t noiseState = 1;
+	int h, j, kernel, r;
+	unsigned long i;
+
+	// A string partial plus some noise, as a PllSynth input might look
+	for(i = 0; i < BIQUAD_BENCHMARK_FRAMES; i++)
+	{
+		noiseState = noiseState * 1664525 + 1013904223;
+		input[i] = 0.5 * sinf(2.0 * M_PI * fundamental * (float)i / sampleRate) + (float)(int32_t)noiseState * (0.1 / 2147483648.0);
+	}
+
+	printBenchmarkHeading(output, "Biquad bank", "sample", BIQUAD_BENCHMARK_SAMPLES);
+	output << "Default kernel: " << kernelName(gKernels.current()) << endl;
+
+	for(h = 0; h < sizeof(filterCounts) / sizeof(int); h++)
+	{
+		int numFilters = filterCounts[h];
+		vector<ButterBandpassFilter> filters(numFilters, ButterBandpassFilter(sampleRate));
+		BiquadBank bank(sampleRate);
+
+		bank.resize(numFilters);
+		for(j = 0; j < numFilters; j++)
+		{
+			filters[j].updateCoefficients(fundamental*(float)(j+1), fundamental*(float)(j+1)/q);
+			bank.updateCoefficients(j, fundamental*(float)(j+1), fundamental*(float)(j+1)/q);
+		}
+
+		// Reference: one ButterBandpassFilter::filter() per filter per sample.  The output of the last
+		// repetition is kept, so the comparison includes any drift over the whole run.
+		timer.start();
+		for(r = 0; r < repetitions; r++)
+		{
+			for(j = 0; j < numFilters; j++)
+			{
+				for(i = 0; i < BIQUAD_BENCHMARK_FRAMES; i++)
+					reference[i*numFilters + j] = filters[j].filter(input[i]);
+			}
+		}
+		output << "  " << numFilters << " filters: ButterBandpassFilter " << timer.nsPer(samples);
+
+		for(kernel = 0; kernel < kNumKernels; kernel++)
+		{
+			float maxError = 0.0;
+
+			if(!kernelIsAvailable(kernel))
+				continue;
+			setKernel(kernel);
+			for(j = 0; j < numFilters; j++)
+				bank.clearBuffer(j);
+
+			timer.start();
+			for(r = 0; r < repetitions; r++)
+				bank.filter(&input[0], &result[0], BIQUAD_BENCHMARK_FRAMES);
+			double nsPerSample = timer.nsPer(samples);
+
+			for(i = 0; i < BIQUAD_BENCHMARK_FRAMES; i++)
+			{
+				for(j = 0; j < numFilters; j++)
+					maxError = max(maxError, fabsf(result[i*bank.stride() + j] - reference[i*numFilters + j]));
+			}
+
+			output << ", " << kernelName(kernel) << " " << nsPerSample << " (max diff " << maxError << ")";
+		}
+		output << endl;
+	}
+
+	setKernel(savedKernel);
+}
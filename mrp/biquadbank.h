@@ -0,0 +1,93 @@
+/*
+ *  biquadbank.h
+ *  mrp
+ *
+ */
+
+#ifndef BIQUAD_BANK_H
+#define BIQUAD_BANK_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+using namespace std;
+
+#define BIQUAD_BANK_LANES	8		// Filter storage is padded to a multiple of this (the widest kernel)
+
+// BiquadBank runs a set of second-order Butterworth bandpass filters, each equivalent to a ButterBandpassFilter,
+// over the same input signal.  The filter coefficients and history are held in structure-of-arrays form so
+// that 4 or 8 filters advance together in SIMD lanes.  The kernel is chosen at startup according to what the
+// CPU supports (SSE or NEON, with a plain C++ fallback).
+//
+// Each lane computes exactly the same sequence of float operations as ButterBandpassFilter::filter(), without
+// fused multiply-adds, so on x86 the output matches the scalar filter bit for bit.  On ARM, compilers fuse the
+// scalar filter's multiply-adds by default, so the two agree only to within rounding: a few ulps per sample,
+// which the filter's own decay keeps from accumulating.  --benchmark-filters reports the largest difference
+// seen for each kernel.
+//
+// A filter can be marked inactive, in which case filter() leaves its history untouched and its output is
+// meaningless.  This lets a synth skip filters for a stretch of samples exactly as it would by not calling
+// ButterBandpassFilter::filter().  Groups of filters that are all inactive cost nothing.
+
+class BiquadBank
+{
+public:
+	// Available kernels, in increasing order of preference.  Each filter is a chain of dependent operations,
+	// so with the handful of filters a synth has, latency rather than width limits the speed: two interleaved
+	// groups of 4 in SSE measure faster than 8 in AVX, and AVX is only used if chosen with setKernel().
+	enum {
+		kKernelScalar = 0,
+		kKernelAvx,
+		kKernelSse,
+		kKernelNeon,
+		kNumKernels
+	};
+
+	BiquadBank(float sampleRate);
+
+	// Change the number of filters.  New filters start with zero coefficients and history, and active.
+	// Doesn't allocate memory unless the bank grows beyond the largest size it has held before.
+	void resize(int size);
+	int size() { return size_; }
+	
+	// Allocate room for size filters now, so that resizing up to that many later won't allocate
+	void reserve(int size);
+	int capacity() { return a0_.size(); }
+
+	// Distance between successive samples of one filter in filter()'s output
+	int stride() { return paddedSize_; }
+
+	// Per-filter control, matching ButterBandpassFilter
+	void updateCoefficients(int index, float frequency, float bandwidth);
+	void clearBuffer(int index);
+	void setActive(int index, bool active) { activeMasks_[index] = (active ? 0xFFFFFFFF : 0); }
+
+	// Run every filter over frameCount samples of input.  The output of filter n for sample i is written to
+	// output[i*stride() + n], so output must hold frameCount*stride() floats.
+	void filter(const float *input, float *output, unsigned long frameCount);
+
+	// Kernel selection.  By default the best available kernel is used.
+	static bool kernelIsAvailable(int kernel);
+	static int currentKernel();
+	static void setKernel(int kernel);
+	static const char *kernelName(int kernel);
+
+	// Print the cost in ns/sample of each available kernel versus calling ButterBandpassFilter::filter() on
+	// each filter, with the largest difference in output, at several numbers of filters.  (A single active
+	// filter always uses the scalar kernel.)
+	static void benchmark(ostream& output);
+
+	~BiquadBank() {}
+
+private:
+	float piDivSampleRate_;				// Same derived parameters as ButterBandpassFilter
+	float twoPiDivSampleRate_;
+
+	vector<float> a0_, a1_, a2_, a3_, a4_;	// Coefficients, one array per term; see ButterBandpassFilter
+	vector<float> history0_, history1_;		// Two back-samples of memory for each filter
+	vector<uint32_t> activeMasks_;			// All ones if the filter's history should advance
+	int size_;
+	int paddedSize_;					// size_ rounded up to a multiple of BIQUAD_BANK_LANES
+};
+
+#endif // BIQUAD_BANK_H
@@ -23,6 +23,20 @@ public:
 	ButterBandpassFilter(float sampleRate);
 	
 	void updateCoefficients(float frequency, float bandwidth);	// Update the filter coefficients
+	
+	// The coefficient calculation itself, shared with BiquadBank.  Returns false (leaving a unchanged) if
+	// the frequency or bandwidth is out of range.  Ramping filters recalculate their coefficients every
+	// few samples, so this uses polynomial sine and cosine rather than tanf() and cosf();
+	// calculateCoefficientsTrig() is the original version, used as a fallback outside the polynomial
+	// range (bandwidth of half the sample rate or more).
+	static bool calculateCoefficients(float *a, float frequency, float bandwidth,
+									  float piDivSampleRate, float twoPiDivSampleRate);
+	static bool calculateCoefficientsTrig(float *a, float frequency, float bandwidth,
+										  float piDivSampleRate, float twoPiDivSampleRate);
+	
+	// Print the cost of each coefficient calculation, and the largest error in center frequency and
+	// frequency response of each against a double-precision calculation, over the audio range.
+	static void benchmarkCoefficients(ostream& output);
 	float filter(float sample) {								// Process a new sample
 		float t, y;												// Do this inline for time efficiency
 		t = sample - a_[3] * history_[0] - a_[4] * history_[1];
@@ -83,6 +97,51 @@ private:
 	unsigned int aLength_, bLength_;
 };
 
+// Filter of fixed order N, with its coefficients and state held inline and the loops unrolled at compile
+// time, for the PLL loop filter.  Uses the same coefficients as GenericFilter with N a-coefficients and
+// N+1 b-coefficients:
+//
+//   y[n] = b[0]*x[n] + ... + b[N]*x[n-N] - a[0]*y[n-1] - ... - a[N-1]*y[n-N]
+//
+// but is implemented in transposed direct form II, which needs only N state variables.
+
+template<int N> class FixedOrderFilter
+{
+public:
+	FixedOrderFilter() {
+		for(int i = 0; i < N; i++)
+			a_[i] = state_[i] = 0.0;
+		for(int i = 0; i <= N; i++)
+			b_[i] = 0.0;
+		b_[0] = 1.0;		// Passthrough until coefficients are set
+	}
+	
+	void updateCoefficients(const double *a, const double *b) {	// N a's, N+1 b's.  Clears the state.
+		for(int i = 0; i < N; i++)
+			a_[i] = a[i];
+		for(int i = 0; i <= N; i++)
+			b_[i] = b[i];
+		clearBuffer();
+	}
+	double filter(double sample) {								// Process a new sample
+		double y = b_[0]*sample + state_[0];
+		
+		for(int i = 0; i < N - 1; i++)
+			state_[i] = b_[i+1]*sample - a_[i]*y + state_[i+1];
+		state_[N-1] = b_[N]*sample - a_[N-1]*y;
+		
+		return y;
+	}
+	void clearBuffer() {										// Zero out the history
+		for(int i = 0; i < N; i++)
+			state_[i] = 0.0;
+	}
+	
+private:
+	double a_[N], b_[N+1];
+	double state_[N];
+};
+
 // An envelope follower acts as an ideal full-wave rectifier followed by a parallel resistor and capacitor:
 // Peaks in the signal are followed exactly, with a first-order decay between peaks.
 
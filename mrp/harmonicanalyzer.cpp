@@ -0,0 +1,343 @@
+/*
+ *  harmonicanalyzer.cpp
+ *  mrp
+ *
+ */
+
+#include <cmath>
+#include "harmonicanalyzer.h"
+#include "benchmark.h"
+#include "biquadbank.h"
+#include "filter.h"
+#include "phaseaccumulator.h"
+#include "wavetables.h"
+
+#define HARMONIC_QUARTER_CYCLE		0x40000000		// Phase offset from sine to cosine
+
+HarmonicAnalyzer::HarmonicAnalyzer(float timeConstant, float sampleRate)
+{
+	if(timeConstant == 0.0)
+		decayScaler_ = 0.0;
+	else
+		decayScaler_ = exp(-1.0/(fabsf(timeConstant)*sampleRate));
+
+	firstHarmonic_ = 1;
+	numHarmonics_ = 0;
+	SineTable<WAVETABLE_SINE_BITS>::build();
+	clear();
+}
+
+void HarmonicAnalyzer::resize(int numHarmonics)
+{
+	sumsCos_.resize(numHarmonics, 0.0);
+	sumsSin_.resize(numHarmonics, 0.0);
+	magnitudes_.resize(numHarmonics, 0.0);
+	levels_.resize(numHarmonics, 0.0);
+	lastCos_.resize(numHarmonics, 0.0);
+	lastSin_.resize(numHarmonics, 0.0);
+	wrapCos_.resize(numHarmonics, 0.0);
+	wrapSin_.resize(numHarmonics, 0.0);
+	numHarmonics_ = numHarmonics;
+}
+
+void HarmonicAnalyzer::reserve(int numHarmonics)
+{
+	sumsCos_.reserve(numHarmonics);
+	sumsSin_.reserve(numHarmonics);
+	magnitudes_.reserve(numHarmonics);
+	levels_.reserve(numHarmonics);
+	lastCos_.reserve(numHarmonics);
+	lastSin_.reserve(numHarmonics);
+	wrapCos_.reserve(numHarmonics);
+	wrapSin_.reserve(numHarmonics);
+}
+
+void HarmonicAnalyzer::clear()
+{
+	for(int n = 0; n < numHarmonics_; n++)
+		sumsCos_[n] = sumsSin_[n] = magnitudes_[n] = levels_[n] = 0.0;
+
+	lastPhase_ = 0;
+	lastSample_ = 0.0;
+	periodLength_ = 0.0;
+	periodIsWhole_ = false;
+}
+
+void HarmonicAnalyzer::analyze(const float *input, const uint32_t *phases, unsigned long frameCount, float *levels)
+{
+	unsigned long i;
+	int h, n;
+
+	if(numHarmonics_ == 0)
+	{
+		if(frameCount > 0)
+			lastPhase_ = phases[frameCount - 1];
+		return;
+	}
+
+	float *sumsCos = &sumsCos_[0], *sumsSin = &sumsSin_[0];
+	float *magnitudes = &magnitudes_[0], *currentLevels = &levels_[0];
+
+	for(i = 0; i < frameCount; i++)
+	{
+		uint32_t phase = phases[i];
+		float sample = input[i];
+
+		// A phase lower than the last one means the fundamental has completed a period
+		if(phase < lastPhase_)
+			finishPeriod(sample, phase);
+		lastPhase_ = phase;
+		lastSample_ = sample;
+
+		// cos((h+1)x) = 2cos(x)cos(hx) - cos((h-1)x), and likewise for sin
+		float cos1 = SineTable<WAVETABLE_SINE_BITS>::lookupPhase(phase + HARMONIC_QUARTER_CYCLE);
+		float twoCos1 = 2.0f*cos1;
+		float cosPrev = 1.0f, sinPrev = 0.0f;
+		float cosH = cos1, sinH = SineTable<WAVETABLE_SINE_BITS>::lookupPhase(phase);
+		float cosNext, sinNext;
+
+		for(h = 1; h < firstHarmonic_; h++)
+		{
+			cosNext = twoCos1*cosH - cosPrev;
+			sinNext = twoCos1*sinH - sinPrev;
+			cosPrev = cosH;
+			sinPrev = sinH;
+			cosH = cosNext;
+			sinH = sinNext;
+		}
+
+		for(n = 0; n < numHarmonics_; n++)
+		{
+			sumsCos[n] += sample*cosH;
+			sumsSin[n] += sample*sinH;
+
+			cosNext = twoCos1*cosH - cosPrev;
+			sinNext = twoCos1*sinH - sinPrev;
+			cosPrev = cosH;
+			sinPrev = sinH;
+			cosH = cosNext;
+			sinH = sinNext;
+		}
+		periodLength_ += 1.0f;
+
+		for(n = 0; n < numHarmonics_; n++)
+		{
+			float decayed = currentLevels[n]*decayScaler_;
+
+			currentLevels[n] = (magnitudes[n] > decayed ? magnitudes[n] : decayed);
+			levels[i*numHarmonics_ + n] = currentLevels[n];
+		}
+	}
+}
+
+// The input times the cosine and sine of each harmonic, at one sample
+
+void HarmonicAnalyzer::products(float sample, uint32_t phase, float *cosines, float *sines)
+{
+	float cos1 = SineTable<WAVETABLE_SINE_BITS>::lookupPhase(phase + HARMONIC_QUARTER_CYCLE);
+	float twoCos1 = 2.0f*cos1;
+	float cosPrev = 1.0f, sinPrev = 0.0f;
+	float cosH = cos1, sinH = SineTable<WAVETABLE_SINE_BITS>::lookupPhase(phase);
+	float cosNext, sinNext;
+	int h;
+
+	for(h = 1; h < firstHarmonic_ + numHarmonics_; h++)
+	{
+		if(h >= firstHarmonic_)
+		{
+			cosines[h - firstHarmonic_] = sample*cosH;
+			sines[h - firstHarmonic_] = sample*sinH;
+		}
+		cosNext = twoCos1*cosH - cosPrev;
+		sinNext = twoCos1*sinH - sinPrev;
+		cosPrev = cosH;
+		sinPrev = sinH;
+		cosH = cosNext;
+		sinH = sinNext;
+	}
+}
+
+// Called at the first sample of a new period, before it is added in.  The period really ended a fraction of
+// a sample earlier, where the phase wrapped, so the sums are corrected to the trapezoidal integral over
+// exactly that span: the products at the boundary are interpolated from the samples either side, and the
+// samples at each end weighted by the part of their interval inside the period.  The start of the new
+// period gets the same treatment.  A sine of amplitude A correlates to A*N/2 with itself over N samples.
+
+void HarmonicAnalyzer::finishPeriod(float sample, uint32_t phase)
+{
+	// Fraction of a sample between the boundary and this sample
+	float fraction = (float)phase/(float)(uint32_t)(phase - lastPhase_);
+	float *lastCos = &lastCos_[0], *lastSin = &lastSin_[0];
+	float *wrapCos = &wrapCos_[0], *wrapSin = &wrapSin_[0];
+	float length = periodLength_ - fraction;
+	float scale = (length > 0.0f ? 2.0f/length : 0.0f);
+	int n;
+
+	products(lastSample_, lastPhase_, lastCos, lastSin);
+	products(sample, phase, wrapCos, wrapSin);
+
+	for(n = 0; n < numHarmonics_; n++)
+	{
+		float boundaryCos = wrapCos[n] + fraction*(lastCos[n] - wrapCos[n]);
+		float boundarySin = wrapSin[n] + fraction*(lastSin[n] - wrapSin[n]);
+
+		// The last sample so far counted in full; it covers 1 - fraction, half of it at the boundary
+		sumsCos_[n] += 0.5f*((1.0f - fraction)*(lastCos[n] + boundaryCos) - lastCos[n]);
+		sumsSin_[n] += 0.5f*((1.0f - fraction)*(lastSin[n] + boundarySin) - lastSin[n]);
+
+		if(periodIsWhole_)
+			magnitudes_[n] = scale*sqrtf(sumsCos_[n]*sumsCos_[n] + sumsSin_[n]*sumsSin_[n]);
+
+		// Likewise for the first sample of the new period, which analyze() will count in full
+		sumsCos_[n] = 0.5f*(fraction*(boundaryCos + wrapCos[n]) - wrapCos[n]);
+		sumsSin_[n] = 0.5f*(fraction*(boundarySin + wrapSin[n]) - wrapSin[n]);
+	}
+
+	periodLength_ = fraction;
+	periodIsWhole_ = true;
+}
+
+#pragma mark Benchmark
+
+#define HARMONIC_BENCHMARK_FRAMES		44100		// One second of input, stepping up in level halfway
+#define HARMONIC_BENCHMARK_BLOCK		64			// Samples analyzed at once, as in PllSynth
+#define HARMONIC_BENCHMARK_REPETITIONS	10
+
+// Summarize the levels of numHarmonics harmonics against their true amplitudes: the mean relative error and
+// ripple over the last fifth of each half of the input, and the mean time to come within 10% of the new
+// amplitude after the step.
+
+static void printLevelStatistics(ostream& output, const float *levels, int numHarmonics, const float *amplitudes,
+								 float stepGain, float sampleRate)
+{
+	const int half = HARMONIC_BENCHMARK_FRAMES / 2;
+	double error = 0.0, ripple = 0.0, riseTime = 0.0;
+	int i, n, section;
+
+	for(n = 0; n < numHarmonics; n++)
+	{
+		for(section = 0; section < 2; section++)
+		{
+			float amplitude = amplitudes[n]*(section == 0 ? 1.0f : stepGain);
+			float minLevel = 1e9, maxLevel = 0.0;
+			double sum = 0.0;
+			int start = half*section + half*4/5, end = half*(section + 1);
+
+			for(i = start; i < end; i++)
+			{
+				float level = levels[i*numHarmonics + n];
+
+				sum += fabs(level - amplitude);
+				minLevel = min(minLevel, level);
+				maxLevel = max(maxLevel, level);
+			}
+			error += sum / (double)(end - start) / amplitude;
+			ripple += (maxLevel - minLevel) / amplitude;
+		}
+
+		for(i = half; i < HARMONIC_BENCHMARK_FRAMES - 1; i++)
+		{
+			if(fabsf(levels[i*numHarmonics + n] - amplitudes[n]*stepGain) < 0.1f*amplitudes[n]*stepGain)
+				break;
+		}
+		riseTime += (double)(i - half) / sampleRate;
+	}
+
+	output << "error " << 100.0*error/(2.0*numHarmonics) << "%, ripple " << 100.0*ripple/(2.0*numHarmonics)
+		   << "%, rise " << 1000.0*riseTime/numHarmonics << "ms";
+}
+
+void HarmonicAnalyzer::benchmark(ostream& output)
+{
+	const int harmonicCounts[] = { 3, 7, 15 };
+	const float sampleRate = 44100.0, fundamental = 261.6, q = 50.0, stepGain = 4.0;
+	const int maxHarmonics = harmonicCounts[sizeof(harmonicCounts) / sizeof(int) - 1];
+	vector<float> input(HARMONIC_BENCHMARK_FRAMES), filtered(HARMONIC_BENCHMARK_BLOCK * (maxHarmonics + BIQUAD_BANK_LANES));
+	vector<float> levels(HARMONIC_BENCHMARK_FRAMES * maxHarmonics), amplitudes(maxHarmonics);
+	vector<uint32_t> phases(HARMONIC_BENCHMARK_FRAMES);
+	PhaseAccumulator phase;
+	double samples = (double)HARMONIC_BENCHMARK_REPETITIONS * HARMONIC_BENCHMARK_FRAMES;
+	BenchmarkTimer timer;
+	uint32_t noiseState = 1;
+	int c, h, j, r;
+	unsigned long i, block;
+
+	// A string tone with harmonics falling off as 1/h, plus some noise.  The harmonics being measured (2 and
+	// up, as in PllSynth) step up in level halfway through.  The phase is exactly that of the fundamental,
+	// as if the PLL had locked.
+	for(i = 0; i < HARMONIC_BENCHMARK_FRAMES; i++)
+	{
+		float gain = (i < HARMONIC_BENCHMARK_FRAMES / 2 ? 1.0f : stepGain);
+		double t = (double)i / sampleRate;
+
+		phases[i] = phase.advance(fundamental, 1.0 / sampleRate);
+		noiseState = noiseState * 1664525 + 1013904223;
+		input[i] = 0.25 * sin(2.0 * M_PI * fundamental * t) + (float)(int32_t)noiseState * (0.02 / 2147483648.0);
+		for(h = 2; h <= maxHarmonics + 1; h++)
+			input[i] += gain * 0.025 / (float)h * sin(2.0 * M_PI * fundamental * (double)h * t + (double)h);
+	}
+	for(j = 0; j < maxHarmonics; j++)
+		amplitudes[j] = 0.025 / (float)(j + 2);
+
+	printBenchmarkHeading(output, "Harmonic analyzer", "sample", (long)samples,
+						  "level error and ripple relative to the true amplitude");
+
+	for(c = 0; c < sizeof(harmonicCounts) / sizeof(int); c++)
+	{
+		int numHarmonics = harmonicCounts[c];
+		BiquadBank bank(sampleRate);
+		vector<EnvelopeFollower> followers(numHarmonics, EnvelopeFollower(.05, sampleRate));
+		HarmonicAnalyzer analyzer(.05, sampleRate);
+
+		// Filters and followers, as PllSynth runs them without the analyzer
+		bank.resize(numHarmonics);
+		for(j = 0; j < numHarmonics; j++)
+		{
+			float freq = fundamental*(float)(j+2);
+			bank.updateCoefficients(j, freq, freq/q);
+		}
+
+		timer.start();
+		for(r = 0; r < HARMONIC_BENCHMARK_REPETITIONS; r++)
+		{
+			for(j = 0; j < numHarmonics; j++)
+			{
+				bank.clearBuffer(j);
+				followers[j].clearBuffer();
+			}
+			for(block = 0; block < HARMONIC_BENCHMARK_FRAMES; block += HARMONIC_BENCHMARK_BLOCK)
+			{
+				unsigned long frames = min((unsigned long)HARMONIC_BENCHMARK_BLOCK, HARMONIC_BENCHMARK_FRAMES - block);
+
+				bank.filter(&input[block], &filtered[0], frames);
+				for(j = 0; j < numHarmonics; j++)
+				{
+					for(i = 0; i < frames; i++)
+						levels[(block + i)*numHarmonics + j] = followers[j].filter(filtered[i*bank.stride() + j]);
+				}
+			}
+		}
+		output << "  " << numHarmonics << " harmonics:\n    filters:  " << timer.nsPer(samples) << " ns, ";
+		printLevelStatistics(output, &levels[0], numHarmonics, &amplitudes[0], stepGain, sampleRate);
+
+		// The analyzer
+		analyzer.setFirstHarmonic(2);
+		analyzer.resize(numHarmonics);
+
+		timer.start();
+		for(r = 0; r < HARMONIC_BENCHMARK_REPETITIONS; r++)
+		{
+			analyzer.clear();
+			for(block = 0; block < HARMONIC_BENCHMARK_FRAMES; block += HARMONIC_BENCHMARK_BLOCK)
+			{
+				unsigned long frames = min((unsigned long)HARMONIC_BENCHMARK_BLOCK, HARMONIC_BENCHMARK_FRAMES - block);
+
+				analyzer.analyze(&input[block], &phases[block], frames, &levels[block*numHarmonics]);
+			}
+		}
+		output << "\n    analyzer: " << timer.nsPer(samples) << " ns, ";
+		printLevelStatistics(output, &levels[0], numHarmonics, &amplitudes[0], stepGain, sampleRate);
+		output << endl;
+	}
+
+}
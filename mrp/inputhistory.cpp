@@ -0,0 +1,142 @@
+/*
+ *  inputhistory.cpp
+ *  mrp
+ *
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "inputhistory.h"
+
+InputHistory::InputHistory()
+{
+	numChannels_ = maxDelay_ = 0;
+	length_ = 1;
+	mask_ = 0;
+	blockStart_ = 0;
+	blockFrameCount_ = maxFrameCount_ = 0;
+	buffers_.resize(1, 0.0);		// Keeps read() safe before setSize() is called
+	block_ = NULL;
+	blockStride_ = 0;
+	dcBlocking_ = false;
+}
+
+void InputHistory::setSize(int numChannels, float sampleRate)
+{
+	allocate(numChannels, (int)ceilf(INPUT_HISTORY_MAX_DELAY * sampleRate),
+			 max(maxFrameCount_, (unsigned long)INPUT_HISTORY_BLOCK_SIZE));
+}
+
+void InputHistory::reserve(unsigned long frameCount)
+{
+	if(frameCount > maxFrameCount_)
+		allocate(numChannels_, maxDelay_, frameCount);
+}
+
+// A block longer than the buffers have room for goes into the history in pieces that fit, leaving the last
+// piece as the current block.  The buffers never change size here.
+
+void InputHistory::write(const float *input, unsigned long frameCount)
+{
+	unsigned long offset, pieceFrameCount;
+
+	if(numChannels_ == 0 || maxFrameCount_ == 0)
+		return;
+
+	for(offset = 0; offset < frameCount; offset += pieceFrameCount)
+	{
+		pieceFrameCount = min(maxFrameCount_, frameCount - offset);
+		writeBlock(input == NULL ? NULL : input + offset*numChannels_, pieceFrameCount);
+	}
+}
+
+void InputHistory::writeBlock(const float *input, unsigned long frameCount)
+{
+	unsigned long i;
+	int channel;
+
+	// The previous block ends where this one starts
+	blockStart_ += blockFrameCount_;
+	blockFrameCount_ = frameCount;
+
+	for(channel = 0; channel < numChannels_; channel++)
+	{
+		float *planar = block_ + channel*blockStride_;
+		float *buffer = &buffers_[channel*length_];
+
+		// De-interleave
+		if(input == NULL)
+		{
+			for(i = 0; i < frameCount; i++)
+				planar[i] = 0.0;
+		}
+		else
+		{
+			for(i = 0; i < frameCount; i++)
+				planar[i] = input[i*numChannels_ + channel];
+		}
+
+		// y[n] = x[n] - x[n-1] + pole*y[n-1]
+		if(dcBlocking_)
+		{
+			float lastInput = dcLastInput_[channel], lastOutput = dcLastOutput_[channel];
+
+			for(i = 0; i < frameCount; i++)
+			{
+				float in = planar[i];
+
+				lastOutput = in - lastInput + (float)INPUT_HISTORY_DC_POLE*lastOutput;
+				lastInput = in;
+				planar[i] = lastOutput;
+			}
+			dcLastInput_[channel] = lastInput;
+			dcLastOutput_[channel] = lastOutput;
+		}
+
+		// Then append to the history
+		for(i = 0; i < frameCount; i++)
+			buffer[(blockStart_ + i) & mask_] = planar[i];
+	}
+}
+
+// Make the ring buffers long enough for blocks of frameCount samples plus the longest delay, and one more
+// sample for interpolation.  Only called before the stream starts.  If the memory isn't there, the previous
+// size stays in effect.
+
+void InputHistory::allocate(int numChannels, int maxDelay, unsigned long frameCount)
+{
+	void *memory;
+	const unsigned long lineLength = INPUT_HISTORY_ALIGNMENT / sizeof(float);
+	unsigned long stride = (frameCount + lineLength - 1) / lineLength * lineLength;
+
+	// Each planar channel starts on a cache line
+	if(posix_memalign(&memory, INPUT_HISTORY_ALIGNMENT, (numChannels > 0 ? numChannels : 1)*stride*sizeof(float)) != 0)
+	{
+		cerr << "Warning: InputHistory failed to allocate " << frameCount << " frames\n";
+		return;
+	}
+	free(block_);
+	block_ = (float *)memory;
+	blockStride_ = stride;
+
+	numChannels_ = numChannels;
+	maxDelay_ = maxDelay;
+	length_ = 1;
+	while(length_ < frameCount + maxDelay_ + 1)
+		length_ <<= 1;
+	mask_ = length_ - 1;
+	maxFrameCount_ = frameCount;
+
+	buffers_.assign(numChannels_ > 0 ? numChannels_*length_ : 1, 0.0);
+	blockStart_ = 0;
+	blockFrameCount_ = 0;
+
+	dcLastInput_.assign(numChannels_, 0.0);
+	dcLastOutput_.assign(numChannels_, 0.0);
+}
+
+InputHistory::~InputHistory()
+{
+	free(block_);
+}
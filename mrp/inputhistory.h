@@ -0,0 +1,102 @@
+/*
+ *  inputhistory.h
+ *  mrp
+ *
+ */
+
+#ifndef INPUT_HISTORY_H
+#define INPUT_HISTORY_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+using namespace std;
+
+#define INPUT_HISTORY_MAX_DELAY		0.05	// Longest input delay available to the synths, in seconds
+#define INPUT_HISTORY_BLOCK_SIZE	1024	// Block size to make room for until reserve() asks for more
+#define INPUT_HISTORY_ALIGNMENT		64		// Byte alignment of each planar channel (one cache line)
+#define INPUT_HISTORY_DC_POLE		0.995	// Pole of the optional DC blocker (about 35Hz at 44.1kHz)
+
+// InputHistory prepares the audio input once per block for all the synths.  AudioRender owns one and
+// writes each block of interleaved input into it before any synth renders.  It holds:
+//
+//   - The current block, de-interleaved into one cache-aligned buffer per channel, so synths read their
+//     inputs contiguously rather than with a stride of the channel count.
+//   - The recent past of each channel in a ring buffer, so synths can read their inputs delayed by a
+//     fractional number of samples (e.g. for delay-and-sum across several pickups).
+//
+// Every synth reads the same buffers, so none keeps a copy of its own.  If DC blocking is on, both hold
+// the input after a one-pole DC blocking filter, which is then run once per channel rather than once per
+// synth.
+//
+// Positions are relative to the current block: frame i of the block, delayed by d samples, is the input
+// d samples before frame i arrived.  Delays between whole samples are linearly interpolated.
+
+class InputHistory
+{
+public:
+	InputHistory();
+
+	// Allocate the buffers, clearing any history.  Call before starting the stream.
+	void setSize(int numChannels, float sampleRate);
+	
+	// Make room for blocks of up to frameCount frames, if there isn't already.  Call before starting the
+	// stream, after setSize().
+	void reserve(unsigned long frameCount);
+
+	int numChannels() { return numChannels_; }
+	float maxDelay() { return (float)maxDelay_; }		// Longest delay that can be read, in samples
+
+	// Whether to filter DC out of the input.  Call before starting the stream.
+	void setDcBlocking(bool dcBlocking) { dcBlocking_ = dcBlocking; }
+	bool dcBlocking() { return dcBlocking_; }
+
+	// Take in a block of interleaved input (or silence if input is NULL).  Called by the render thread at
+	// the start of each block.  Never allocates: a block longer than reserve() made room for is taken in
+	// pieces, and only the last piece is left as the current block, so callers that need the whole block
+	// (like AudioRender) split long blocks themselves.
+	void write(const float *input, unsigned long frameCount);
+
+	// The current block of one channel, contiguous and aligned to INPUT_HISTORY_ALIGNMENT
+	const float *channel(int channel) { return block_ + channel*blockStride_; }
+
+	// Frame i of the current block on one channel, delayed by delay samples (0 <= delay <= maxDelay())
+	float read(int channel, unsigned long frame, float delay) {
+		const float *buffer = &buffers_[channel*length_];
+		int wholeDelay = (int)delay;
+		float fract = delay - (float)wholeDelay;
+		uint32_t index = blockStart_ + frame - wholeDelay;
+		float current = buffer[index & mask_];
+
+		return current + fract*(buffer[(index - 1) & mask_] - current);
+	}
+
+	// The same for a delay of a whole number of samples
+	float readWhole(int channel, unsigned long frame, int delay) {
+		return buffers_[channel*length_ + ((blockStart_ + frame - delay) & mask_)];
+	}
+
+	~InputHistory();
+
+private:
+	void allocate(int numChannels, int maxDelay, unsigned long frameCount);
+	void writeBlock(const float *input, unsigned long frameCount);	// At most maxFrameCount_ frames
+
+	float *block_;						// Planar current block, blockStride_ samples per channel
+	unsigned long blockStride_;			// maxFrameCount_ rounded up to a whole number of cache lines
+
+	vector<float> buffers_;				// One ring buffer per channel, each length_ samples long
+	int numChannels_;
+	int maxDelay_;
+	uint32_t length_;					// A power of two, at least the longest block plus maxDelay_ + 1
+	uint32_t mask_;
+	uint32_t blockStart_;				// Free-running position of the first frame of the current block
+	unsigned long blockFrameCount_;		// Length of the current block
+	unsigned long maxFrameCount_;		// Longest block the buffers have room for
+
+	bool dcBlocking_;
+	vector<float> dcLastInput_;			// One sample of memory per channel for the DC blocker
+	vector<float> dcLastOutput_;
+};
+
+#endif // INPUT_HISTORY_H
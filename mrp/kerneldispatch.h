@@ -0,0 +1,101 @@
+/*
+ *  kerneldispatch.h
+ *  mrp
+ *
+ */
+
+#ifndef KERNEL_DISPATCH_H
+#define KERNEL_DISPATCH_H
+
+#include <iostream>
+#include <stddef.h>
+using namespace std;
+
+// Instruction sets a SIMD kernel can need beyond what the build target guarantees.  SSE and SSE2 are part of
+// x86-64 and NEON of arm64, so kernels using those need nothing extra; AVX and AVX2 have to be checked for at
+// run time.
+
+enum {
+	kInstructionsBase = 0,				// Whatever the compiler was allowed to assume
+	kInstructionsAvx,
+	kInstructionsAvx2Fma,
+};
+
+inline bool cpuSupports(int instructions)
+{
+	switch(instructions)
+	{
+		case kInstructionsBase:
+			return true;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+		case kInstructionsAvx:
+			__builtin_cpu_init();		// May be called before the runtime's own initialization
+			return __builtin_cpu_supports("avx");
+		case kInstructionsAvx2Fma:
+			__builtin_cpu_init();
+			return (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+#endif
+		default:
+			return false;
+	}
+}
+
+// KernelDispatch chooses between the versions of a kernel that a bank class compiles for different instruction
+// sets, and is shared by every object of that class.  The kernels are given as a table in increasing order of
+// preference, each with the instructions it needs and its function (NULL where it isn't compiled for this
+// target), and the last one the CPU can run is used until set() picks another.  set() should not be called
+// while audio is running.
+
+template<typename Function>
+class KernelDispatch
+{
+public:
+	typedef struct {
+		const char *name;
+		int instructions;				// What the CPU needs, from the list above
+		Function function;
+	} kernelInfo;
+
+	KernelDispatch(const char *owner, const kernelInfo *kernels, int numKernels) {
+		owner_ = owner;
+		kernels_ = kernels;
+		numKernels_ = numKernels;
+		for(current_ = numKernels - 1; current_ > 0; current_--)
+		{
+			if(isAvailable(current_))
+				break;
+		}
+		function_ = kernels_[current_].function;
+#ifdef DEBUG_MESSAGES
+		cout << owner_ << ": using " << name(current_) << " kernel\n";
+#endif
+	}
+
+	bool isAvailable(int kernel) {
+		if(kernel < 0 || kernel >= numKernels_ || kernels_[kernel].function == NULL)
+			return false;
+		return cpuSupports(kernels_[kernel].instructions);
+	}
+	int current() { return current_; }
+	Function function() { return function_; }
+	const char *name(int kernel) { return (kernel >= 0 && kernel < numKernels_ ? kernels_[kernel].name : "unknown"); }
+
+	void set(int kernel) {
+		if(!isAvailable(kernel))
+		{
+			cerr << "Warning: " << owner_ << " kernel " << name(kernel) << " is not available on this machine\n";
+			return;
+		}
+		current_ = kernel;
+		function_ = kernels_[kernel].function;
+	}
+
+private:
+	const char *owner_;
+	const kernelInfo *kernels_;
+	int numKernels_;
+	int current_;
+	Function function_;					// kernels_[current_].function, for the render loops
+};
+
+#endif /* KERNEL_DISPATCH_H */
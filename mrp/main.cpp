@@ -17,6 +17,11 @@
 #include "osccontroller.h"
 #include "pitchtrack.h"
 #include "pnoscancontroller.h"
+#include "offlinerender.h"
+#include "oscillatorbank.h"
+#include "biquadbank.h"
+#include "noisegenerator.h"
+#include "harmonicanalyzer.h"
 
 using namespace std;
 
@@ -33,6 +38,7 @@ using namespace std;
 #define DEFAULT_OSC_THRU_PORT "7760"
 #define DEFAULT_OSC_PREFIX "/mrp"
 #define DEFAULT_TUNING 440.0
+#define DEFAULT_OFFLINE_OUTPUT "mrp-offline.wav"
 
 #define DEFAULT_PNOSCAN_MODE 2
 #define DEFAULT_PNOSCAN_HYSTERESIS 16
@@ -55,7 +61,20 @@ enum {
 	kOptionOscThruPort,
 	kOptionPrioritizeOldNotes,
 	kOptionPianoBarMidiChannel,
-	kOptionTuning
+	kOptionTuning,
+	kOptionOffline,
+	kOptionOfflineOutput,
+	kOptionOfflineInput,
+	kOptionOfflineLength,
+	kOptionBenchmarkOscillators,
+	kOptionBenchmarkFilters,
+	kOptionBenchmarkNoise,
+	kOptionBenchmarkWaveTables,
+	kOptionBenchmarkFeedback,
+	kOptionNoiseSeed,
+	kOptionRenderThreads,
+	kOptionInputDcBlock,
+	kOptionEventLatency
 };
 
 static struct option long_options[] = {
@@ -91,6 +110,19 @@ static struct option long_options[] = {
 	{"osc-thru-port", required_argument, NULL, kOptionOscThruPort},
 	{"prioritize-old-notes", no_argument, NULL, kOptionPrioritizeOldNotes},
 	{"tuning", required_argument, NULL, kOptionTuning},
+	{"render-threads", required_argument, NULL, kOptionRenderThreads},
+	{"input-dc-block", no_argument, NULL, kOptionInputDcBlock},
+	{"event-latency", required_argument, NULL, kOptionEventLatency},
+	{"offline", required_argument, NULL, kOptionOffline},
+	{"offline-output", required_argument, NULL, kOptionOfflineOutput},
+	{"offline-input", required_argument, NULL, kOptionOfflineInput},
+	{"offline-length", required_argument, NULL, kOptionOfflineLength},
+	{"benchmark-oscillators", no_argument, NULL, kOptionBenchmarkOscillators},
+	{"benchmark-filters", no_argument, NULL, kOptionBenchmarkFilters},
+	{"benchmark-noise", no_argument, NULL, kOptionBenchmarkNoise},
+	{"benchmark-wavetables", no_argument, NULL, kOptionBenchmarkWaveTables},
+	{"benchmark-feedback", no_argument, NULL, kOptionBenchmarkFeedback},
+	{"noise-seed", required_argument, NULL, kOptionNoiseSeed},
     {"poly-aftertouch", no_argument, NULL, 'A'},
     {"mode", required_argument, NULL, 'D'},
     {"hysteresis", required_argument, NULL, 'H'},
@@ -99,10 +131,6 @@ static struct option long_options[] = {
 	{0,0,0,0}
 };
 
-// Define this globally since lots of different processes use it.  Not programmatically clean, but
-// saves a lot of code.
-WaveTable waveTable;
-
 void usage(const char * processName)	// Print usage information and exit
 {
 	cout << "Usage: " << processName << " [-h] [-l] [-i #] [-o #] [-I #] [-O #] [-b #] [-s #] [-p file.xml] [-c file.txt] [-Z port]\n";
@@ -139,7 +167,21 @@ void usage(const char * processName)	// Print usage information and exit
 	cout << "  --osc-thru-port: port to transmit thru messages to (default: " << DEFAULT_OSC_THRU_PORT << ")\n";
 	cout << "  --pb-midi-channel <ch>: set the MIDI channel the PianoBar sends to (0-15, default: 15)\n";
 	cout << "  --prioritize-old-notes: continue sounding the earliest notes if out of channels (default: turn off earliest notes)\n";
+	cout << "  --render-threads #: split rendering by output channel across this many threads (default: 1)\n";
+	cout << "  --input-dc-block: filter DC out of the audio inputs before the synths use them\n";
+	cout << "  --event-latency <ms>: start, stop and change notes this long after their MIDI/OSC events arrive, at the exact frame (default: next buffer)\n";
+	cout << "  --noise-seed #: base seed for the noise synths' generators, which are seeded in order from it\n";
     cout << "  -A:  Use non-standard MIDI polyphonic aftertouch as key position\n";
+	cout << "Offline rendering options (no audio, MIDI or OSC devices are opened):" << endl;
+	cout << "  --offline <events.txt>: render the timestamped MIDI/OSC events in the file, faster than realtime\n";
+	cout << "  --offline-output <file.wav>: file for the rendered output (default: " << DEFAULT_OFFLINE_OUTPUT << ")\n";
+	cout << "  --offline-input <source>: input WAV file, or sine:<freq>[:<amp>], noise[:<amp>], silence (default: silence)\n";
+	cout << "  --offline-length <sec>: length to render (default: last event + " << OFFLINE_DEFAULT_TAIL << " seconds)\n";
+	cout << "  --benchmark-oscillators: time each oscillator bank kernel against the plain wavetable, then exit\n";
+	cout << "  --benchmark-filters: time and check each biquad bank kernel against the plain bandpass filter, and the bandpass coefficient calculation, then exit\n";
+	cout << "  --benchmark-noise: time the noise generator against rand() with many voices on several threads, then exit\n";
+	cout << "  --benchmark-wavetables: time and check each kind of sine lookup, including the polynomial, then exit\n";
+	cout << "  --benchmark-feedback: time and compare the harmonic analyzer against the filters and followers used for amplitude feedback, then exit\n";
     cout << "QRS PNOScan-specific options:" << endl;
     cout << "  -D #: Set the mode of the PNOScan" << endl;
     cout << "  -H #: Set the hysteresis value of the PNOScan" << endl;
@@ -386,6 +428,9 @@ int main (int argc, char * const argv[])
 	const PaDeviceInfo *deviceInfo;
 	int numInputChannels = DEFAULT_NUM_INPUTS, numOutputChannels = DEFAULT_NUM_OUTPUTS;
 	int bufferSize = DEFAULT_BUFFER_SIZE;
+	int renderThreads = 1;
+	bool inputDcBlock = false;
+	double eventLatency = -1.0;
 	float sampleRate = DEFAULT_SAMPLE_RATE;
 	float tuning = DEFAULT_TUNING;
 	vector<int> audioChannels;
@@ -435,6 +480,10 @@ int main (int argc, char * const argv[])
 	PianoBarController *pianoBarController = NULL;
 	int pianoBarMidiChannel = -1;
 	
+	// ---- Offline rendering ----
+	string *offlineEventFile = NULL, *offlineOutputFile = NULL, *offlineInputSource = NULL;
+	double offlineLength = -1.0;
+	
 	// ---- Other variables ----
 	int ch, i, option_index;
 	timedParameter tp;
@@ -560,6 +609,46 @@ int main (int argc, char * const argv[])
 			case kOptionPianoBarMidiChannel:
 				pianoBarMidiChannel = atoi(optarg);
 				break;
+			case kOptionOffline:
+				offlineEventFile = new string(optarg);
+				break;
+			case kOptionOfflineOutput:
+				offlineOutputFile = new string(optarg);
+				break;
+			case kOptionOfflineInput:
+				offlineInputSource = new string(optarg);
+				break;
+			case kOptionOfflineLength:
+				offlineLength = atof(optarg);
+				break;
+			case kOptionBenchmarkOscillators:
+				OscillatorBank::benchmark(cout);
+				exit(0);
+			case kOptionBenchmarkFilters:
+				BiquadBank::benchmark(cout);
+				ButterBandpassFilter::benchmarkCoefficients(cout);
+				exit(0);
+			case kOptionBenchmarkNoise:
+				NoiseGenerator::benchmark(cout);
+				exit(0);
+			case kOptionBenchmarkWaveTables:
+				benchmarkWaveTables(cout);
+				exit(0);
+			case kOptionBenchmarkFeedback:
+				HarmonicAnalyzer::benchmark(cout);
+				exit(0);
+			case kOptionNoiseSeed:
+				NoiseGenerator::setBaseSeed((uint32_t)strtoul(optarg, NULL, 0));
+				break;
+			case kOptionRenderThreads:
+				renderThreads = atoi(optarg);
+				break;
+			case kOptionInputDcBlock:
+				inputDcBlock = true;
+				break;
+			case kOptionEventLatency:
+				eventLatency = atof(optarg) / 1000.0;
+				break;
             case 'A':
                 use_PA = true;
                 break;
@@ -599,7 +688,97 @@ int main (int argc, char * const argv[])
 		oscThruHost = strdup(DEFAULT_OSC_THRU_HOST);
 	if(oscThruPort == NULL && useOscThru)
 		oscThruPort = strdup(DEFAULT_OSC_THRU_PORT);
-    
+	
+	// ************************** OFFLINE **********************************
+	
+	// Render a file of timestamped events without opening any audio, MIDI or OSC devices.  The MIDI and OSC
+	// controllers are set up as usual, except that nothing is transmitted and the OSC server is never started;
+	// events from the file are handed straight to their handlers.
+	
+	if(offlineEventFile != NULL)
+	{
+		int ret = 0;
+		
+		if(offlineOutputFile == NULL)
+			offlineOutputFile = new string(DEFAULT_OFFLINE_OUTPUT);
+		if(offlineInputSource == NULL)
+			offlineInputSource = new string("silence");
+		
+		cout << "Offline render: " << numOutputChannels << " output channels, " << numInputChannels << " input channels, ";
+		cout << sampleRate/1000. << "kHz sample rate, " << bufferSize << " frames per buffer\n";
+		
+		// No stream: the render object keeps its own clock
+		mainRender->setStreamInfo(NULL, numInputChannels, numOutputChannels, sampleRate, audioChannels, bufferSize);
+		mainRender->setRenderThreads(renderThreads);
+		mainRender->setInputDcBlocking(inputDcBlock);
+		mainRender->setEventLatency(eventLatency);
+		
+		mainMidiController->setA4Tuning(tuning);
+		mainMidiController->setDisplaceOldNotes(displaceOldNotes);
+		mainMidiController->setNoteDisabledChannels(midiDisabledChannels);
+		
+		// The OSC controller needs a server to attach to, but it never runs.  With no transmit address,
+		// outgoing messages are dropped.
+		oscServerThread = lo_server_thread_new(NULL, osc_error_handler);
+		if(oscServerThread == NULL)
+		{
+			cerr << "Error initializing OSC server.\n";
+			exit(1);
+		}
+		oscController = new OscController(oscServerThread, NULL, oscPathPrefix != NULL ? oscPathPrefix : DEFAULT_OSC_PREFIX);
+		oscController->setMidiController(mainMidiController);
+		oscController->setUseOscMidi(true);
+		mainMidiController->setOscController(oscController);
+		mainRender->setOscController(oscController);
+		
+		if(mainMidiController->loadPatchTable(*patchTableFile) != 0)
+		{
+			cerr << "Error reading patch table info from '" << *patchTableFile << "'\n";
+			ret = 1;
+		}
+		else
+		{
+			if(mainMidiController->loadCalibrationTable(*calibrationTableFile) != 0)
+			{
+				cerr << "Warning: error reading calibration info from '" << *calibrationTableFile << "'\n";
+				mainMidiController->clearCalibration();
+			}
+			
+			OfflineRender *offlineRender = new OfflineRender(mainRender, mainMidiController, oscController);
+			
+			if(offlineRender->loadEventFile(*offlineEventFile) != 0 || offlineRender->setInput(*offlineInputSource) != 0)
+				ret = 1;
+			else
+				ret = offlineRender->render(*offlineOutputFile, offlineLength, bufferSize);
+			
+			mainMidiController->consolePrintVoicePools(cout);
+			mainRender->printRenderStats(cout);
+			delete offlineRender;
+		}
+		
+		mainMidiController->consoleAllNotesOff(-1);
+		
+		delete offlineEventFile;
+		delete offlineOutputFile;
+		delete offlineInputSource;
+		delete patchTableFile;
+		delete calibrationTableFile;
+		delete pianoBarCalibrationTableFile;
+		delete mainMidiController;
+		delete mainRender;
+		delete oscController;
+		lo_server_thread_free(oscServerThread);
+		if(oscReceivePort != NULL)
+			free(oscReceivePort);
+		if(oscTransmitPort != NULL)
+			free(oscTransmitPort);
+		if(oscTransmitHost != NULL)
+			free(oscTransmitHost);
+		if(oscPathPrefix != NULL)
+			free(oscPathPrefix);
+		return ret;
+	}
+	
 	// ************************** AUDIO **********************************
 	
     // Initialize portaudio
@@ -771,7 +950,10 @@ int main (int argc, char * const argv[])
 	// to keep track of.  IMPORTANT: This has to be done before any XML parsing, since this
 	// will tell us the sampleRate and other important parameters that everything uses.
 	
-	mainRender->setStreamInfo(stream, numInputChannels, numOutputChannels, sampleRate, audioChannels);
+	mainRender->setStreamInfo(stream, numInputChannels, numOutputChannels, sampleRate, audioChannels, bufferSize);
+	mainRender->setRenderThreads(renderThreads);
+	mainRender->setInputDcBlocking(inputDcBlock);
+	mainRender->setEventLatency(eventLatency);
 	
 	// ******************************** MIDI **********************************
 	
@@ -1088,7 +1270,7 @@ int main (int argc, char * const argv[])
 		}
 	}
 	
-    err = Pa_StartStream(stream);	// Start the audio stream
+    err = mainRender->startStream();	// Start the audio stream
     if(err != paNoError)
 		exit_with_error(err);
 	
@@ -1136,7 +1318,22 @@ int main (int argc, char * const argv[])
 			shouldStop = true;
 		else if(tokenizedString[0] == "c" || tokenizedString[0] == "cpu")
 		{
-			cout << "CPU Load: " << mainRender->cpuLoad() << endl;
+			cout << "CPU Load: " << mainRender->cpuLoad() << " (" << mainRender->xruns() << " xruns)" << endl;
+			if(mainRender->numRenderThreads() > 1)
+			{
+				for(int i = 0; i < mainRender->numRenderThreads(); i++)
+					cout << "  Render thread " << i << ": " << mainRender->renderThreadLoad(i) << endl;
+				mainRender->resetRenderThreadLoad();
+			}
+		}
+		else if(tokenizedString[0] == "voices")
+			mainMidiController->consolePrintVoicePools(cout);
+		else if(tokenizedString[0] == "stats")
+		{
+			if(tokenizedString.size() >= 2 && tokenizedString[1] == "reset")
+				mainRender->resetRenderStats();
+			else
+				mainRender->printRenderStats(cout);
 		}
 		else if(tokenizedString[0] == "l" || tokenizedString[0] == "load")
 		{
@@ -1348,6 +1545,8 @@ int main (int argc, char * const argv[])
 			cout << "allnotesoff [a]: turn all notes off\n";
 			cout << "load <name> [l <name>]: load patch table from <name> (optional, default is given on command line\n";
 			cout << "cpu [c]: print current CPU load\n";
+			cout << "voices: print voice pool size, usage and high-water mark for each patch\n";
+			cout << "stats [reset]: print (or clear) callback time histogram, xruns, voices per block and synth costs\n";
 			cout << "loadcal <name> [lc <name>]: load actuator calibration from file <name> (optional)\n";
 			cout << "savecal <name> [sc <name>]: save actuator calibration to <name> (optional)\n";
 			cout << "clearcal [cc]: clear actuator calibration values\n";
@@ -1376,7 +1575,7 @@ int main (int argc, char * const argv[])
 		delete pianoBarController;
 	}
 	
-    err = Pa_StopStream(stream);
+    err = mainRender->stopStream();
     if(err != paNoError)
 		exit_with_error(err);
 	
@@ -40,6 +40,9 @@ MidiController::MidiController(AudioRender *render)
 		cerr << "Warning: MidiController failed to initialize event mutex\n";
 		// Throw exception?
 	}
+	if(pthread_mutex_init(&retiredMutex_, NULL) != 0)
+		cerr << "Warning: MidiController failed to initialize retired note mutex\n";
+	cleanupPass_ = 0;
 	
 	bzero(inputControllers_, 16*128*sizeof(unsigned char));	// Set default values
 	//bzero(inputPatches_, 16*sizeof(unsigned char));
@@ -55,6 +58,7 @@ MidiController::MidiController(AudioRender *render)
 	{
 		stringNoteMaps_[i] = i;					// By default, every note sounds on its own string
 		pianoDamperStates_[i] = DAMPER_DOWN;	// No damper lifting initially
+		programSlices_[i] = NULL;				// No programs until a patch table is loaded
 		
 		// Initialize the tuning table and set the offsets
 		noteFrequencies_[i] = a4Tuning_*(float)pow(2.0, ((float)i-69.0)/12.0);
@@ -68,9 +72,12 @@ MidiController::MidiController(AudioRender *render)
 	lastPitchTrackInputMute_ = false;
 	displaceOldNotes_ = false;
 	lastCalibrationFile_ = "";
+	eventTime_ = 0.0;
+	notesStolen_ = notesStolenSamePriority_ = notesDropped_ = 0;
 	
 	// Start the cleanup thread which checks for finished notes
 	cleanupShouldTerminate_ = false;
+	cleanupPaused_ = false;
 	
 	if(pthread_create(&cleanupThread_, NULL, cleanupLoop, this) != 0)
 	{
@@ -92,8 +99,9 @@ int MidiController::loadPatchTable(string& filename)
 {
 	TiXmlDocument doc(filename);
 	TiXmlElement *baseElement, *element;
-	map<string, Note*>::iterator oldPatchIterator;
+	map<string, Note*>::iterator oldPatchIterator, patchIterator;
 	int lastProgramId = -1;
+	long velocityTableSize = 0;
 	
 	// Clear out the old patches to make room for the new
 	for(oldPatchIterator = patches_.begin(); oldPatchIterator != patches_.end(); oldPatchIterator++)
@@ -102,6 +110,7 @@ int MidiController::loadPatchTable(string& filename)
 	}
 	patches_.clear();
 	programs_.clear();
+	compileProgramTable();
 	programTriggeredChanges_.clear();
 	if(pitchTrackController_ != NULL)
 	{
@@ -207,6 +216,17 @@ int MidiController::loadPatchTable(string& filename)
 		return 1;
 	}
 	
+	// The synth factories resolve their parameters for every velocity as the patches load
+	for(patchIterator = patches_.begin(); patchIterator != patches_.end(); patchIterator++)
+	{
+		MidiNote *note = dynamic_cast<MidiNote*>(patchIterator->second);
+		
+		if(note != NULL)
+			velocityTableSize += note->velocityTableSize();
+	}
+	if(velocityTableSize > 0)
+		cout << "Velocity tables: " << velocityTableSize/1024 << " kB\n";
+	
 	// Having loaded the patches themselves, now we need to load the patch table, which maps MIDI Program numbers to
 	// patches.  The contents of the <PatchTable> element tell us how to do this.
 	
@@ -582,6 +602,8 @@ int MidiController::loadPatchTable(string& filename)
 		element = element->NextSiblingElement("Program");
 	}
 	
+	compileProgramTable();
+	
 	// Parse the string map, which tells us which MIDI note should direct to which string.  It isn't always a 1-1 mapping because
 	// there may not be actuators on every string.  Presently, this is a global mapping that affects all programs from all keyboards.
 	
@@ -680,6 +702,43 @@ int MidiController::loadPatchTable(string& filename)
 	return 0;
 }
 
+// Lay programs_ out in programTable_, with a slice for each program that has any notes
+
+void MidiController::compileProgramTable()
+{
+	map<unsigned int, ProgramInfo>::iterator it;
+	int sliceIndices[128];
+	int program, numSlices = 0;
+	ProgramInfo undefined;
+	
+	for(program = 0; program < 128; program++)
+		sliceIndices[program] = -1;
+	for(it = programs_.begin(); it != programs_.end(); it++)
+	{
+		program = (it->first >> 12) & 0x7F;
+		if(sliceIndices[program] < 0)
+			sliceIndices[program] = numSlices++;
+	}
+	
+	bzero(&undefined, sizeof(ProgramInfo));
+	programTable_.assign(numSlices * 16 * 128, undefined);
+	
+	for(it = programs_.begin(); it != programs_.end(); it++)
+	{
+		unsigned int channel = (it->first >> 8) & 0x0F, note = it->first & 0xFF;
+		ProgramInfo& info = programTable_[sliceIndices[(it->first >> 12) & 0x7F]*16*128 + (channel << 7) + note];
+		
+		info = it->second;
+		info.isDefined = true;
+	}
+	
+	for(program = 0; program < 128; program++)
+		programSlices_[program] = (sliceIndices[program] < 0 ? NULL : &programTable_[sliceIndices[program]*16*128]);
+	
+	if(numSlices > 0)
+		cout << "Program table: " << numSlices << " programs, " << programTable_.size()*sizeof(ProgramInfo)/1024 << " kB\n";
+}
+
 int MidiController::loadCalibrationTable(string& filename)
 {
 	int errorNumber = 0;
@@ -775,8 +834,8 @@ void MidiController::allNotesOff(int midiChannel)			// midiChannel == -1 ---> re
 			if(currentNotes_.count(key) > 0)	// If the Note object has not removed itself during abort(), remove it from the map
 			{
 				removeEventListener(oldNote);	// Remove the note from any event listeners
-				currentNotes_.erase(key);
-				delete oldNote;
+				removeCurrentNote(key);
+				oldNote->reclaim();
 			}
 		}
 		else
@@ -874,6 +933,24 @@ void MidiController::consoleAllNotesOff(int midiChannel)
 	pthread_mutex_unlock(&eventMutex_);
 }
 
+void MidiController::consolePrintVoicePools(ostream& output)
+{
+	map<string, Note*>::iterator it;
+	
+	pthread_mutex_lock(&eventMutex_);
+	output << "Voice pools:\n";
+	for(it = patches_.begin(); it != patches_.end(); it++)
+	{
+		MidiNote *note = dynamic_cast<MidiNote*>(it->second);
+		
+		if(note != NULL)
+			note->printVoicePoolStatus(output);
+	}
+	output << "Voice stealing: " << notesStolen_ + notesStolenSamePriority_ << " notes turned off for new ones (";
+	output << notesStolenSamePriority_ << " of the same priority), " << notesDropped_ << " notes dropped for lack of a channel\n";
+	pthread_mutex_unlock(&eventMutex_);
+}
+
 
 unsigned char MidiController::getControllerValue(int channel, int controller)
 {
@@ -916,6 +993,35 @@ void MidiController::setNoteDisabledChannels(vector<int>& channels)	// Disable c
 	}
 }
 
+// Work out when an event should take effect, given the time since the last event on the same input as RtMidi
+// reports it.  Events are scheduled a fixed latency after they arrived, so their spacing survives the jitter of
+// the MIDI thread and the buffering of the audio.  The arrival time is the previous arrival plus the delta, as
+// long as that's no later than now and no further behind than the latency; otherwise (the first event on an
+// input, or a clock that has drifted) it's now.  OSC carries no delta times, so its events arrive now.  Returns
+// 0 when scheduling is off.  Call with eventMutex_ held.
+
+PaTime MidiController::eventArrivalTime(double deltaTime, int inputNumber)
+{
+	PaTime latency = render_->eventLatency();
+	PaTime now, arrival;
+	
+	if(latency < 0.0)
+		return 0.0;
+	
+	now = render_->currentTime();
+	if(inputNumber == OSC_MIDI_CONTROLLER_NUM || lastArrivalTimes_.count(inputNumber) == 0)
+		arrival = now;
+	else
+	{
+		arrival = lastArrivalTimes_[inputNumber] + deltaTime;
+		if(arrival > now || arrival < now - latency)
+			arrival = now;
+	}
+	lastArrivalTimes_[inputNumber] = arrival;
+	
+	return arrival + latency;
+}
+
 // This gets called every time MIDI data becomes available on any input controller.  deltaTime gives us
 // the time since the last event on the same controller, message holds a 3-byte MIDI message, and inputNumber
 // tells us the number of the device that triggered it (see main.cpp for how this number is calculated).
@@ -940,6 +1046,8 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 	
 	pthread_mutex_lock(&eventMutex_);	// Lock the event mutex: only one MIDI message at a time!
 	
+	eventTime_ = eventArrivalTime(deltaTime, inputNumber);		// When notes should act on this message
+	
 	unsigned char command = (*message)[0];
 	
 	if(command == MESSAGE_RESET)
@@ -960,10 +1068,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 		{
 			case MESSAGE_NOTEON:
 				if(message->size() < 3 || !canTriggerNoteOnChannel_[channel])
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 				// First, tell anyone else who might be listening to this note
 				// Send all note on events to anyone who's listening, since wanting to know this kind of info is rare anyway.
 				for(it = noteListeners_.begin(); it != noteListeners_.end(); it++)
@@ -981,10 +1086,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 				break;
 			case MESSAGE_NOTEOFF:
 				if(message->size() < 3 || !canTriggerNoteOnChannel_[channel])
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 				// First, tell anyone else who might be listening to this note
 				// Send all note on events to anyone who's listening, since wanting to know this kind of info is rare anyway.
 				for(it = noteListeners_.begin(); it != noteListeners_.end(); it++)
@@ -998,10 +1100,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
                 if (PNOcontroller_ != NULL && (*message)[2] > PNOSCAN_NOISE_THRESH && (*message)[1] >= 21) PNOcontroller_->handlePolyphonicAftertouch(message);
                 
 				if(message->size() < 3 || !canTriggerNoteOnChannel_[channel])
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 				// Notify any notes that want to receive aftertouch
 				for(it = aftertouchListeners_.begin(); it != aftertouchListeners_.end(); it++)
 				{
@@ -1011,10 +1110,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 				break;
 			case MESSAGE_CONTROL_CHANGE:
 				if(message->size() < 3)
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 #ifdef DEBUG_MESSAGES
 				cout << "Control change: channel " << channel << ", control " << (int)(*message)[1] << " = " << (int)(*message)[2] << endl;
 #endif
@@ -1066,14 +1162,12 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 				if((*message)[1] == CONTROL_ALL_NOTES_OFF || (*message)[1] == CONTROL_ALL_SOUND_OFF)
 				{
 					allNotesOff(channel);
-					pthread_mutex_unlock(&eventMutex_);
-					return;
+					break;			// Leave through the common exit, which clears eventTime_
 				}
 				if((*message)[1] == CONTROL_ALL_CONTROLLERS_OFF)
 				{
 					allControllersOff(channel);
-					pthread_mutex_unlock(&eventMutex_);
-					return;
+					break;
 				}
 				if((*message)[1] == CONTROL_DAMPER_PEDAL && channel == 0)	 // Special treatment for damper pedal change on main piano
 					damperPedalChange((*message)[2]);
@@ -1094,10 +1188,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 				break;
 			case MESSAGE_PROGRAM_CHANGE:
 				if(message->size() < 2)
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 #ifdef DEBUG_MESSAGES
 				cout << "Program change: channel " << channel << ", program " << (int)(*message)[1] << endl;
 #endif
@@ -1109,10 +1200,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 				break;
 			case MESSAGE_AFTERTOUCH_CHANNEL:
 				if(message->size() < 2 || !canTriggerNoteOnChannel_[channel])
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 				// Notify any notes that want to receive aftertouch
 				for(it = aftertouchListeners_.begin(); it != aftertouchListeners_.end(); it++)
 				{
@@ -1122,10 +1210,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 				break;
 			case MESSAGE_PITCHWHEEL:
 				if(message->size() < 3)
-				{
-					pthread_mutex_unlock(&eventMutex_);
-					return;
-				}
+					break;
 				pitchWheelValue = (*message)[2] << 7 + (*message)[1];	// 14-bit value sent LSB first
 				// Notify any notes that want to receive pitch wheel messages
 				for(it = pitchWheelListeners_.begin(); it != pitchWheelListeners_.end(); it++)
@@ -1142,6 +1227,7 @@ void MidiController::rtMidiCallback(double deltaTime, vector<unsigned char> *mes
 		}
 	}
 	
+	eventTime_ = 0.0;
 	pthread_mutex_unlock(&eventMutex_);
 }
 
@@ -1292,6 +1378,7 @@ bool MidiController::oscHandlerMethod(const char *path, const char *types, int n
 			pedalVal = 0;
 		}
 		pthread_mutex_lock(&eventMutex_);
+		eventTime_ = eventArrivalTime(0.0, OSC_MIDI_CONTROLLER_NUM);
 		damperPedalChange(pedalVal);
 		inputControllers_[0][CONTROL_DAMPER_PEDAL] = pedalVal;
 		
@@ -1299,6 +1386,7 @@ bool MidiController::oscHandlerMethod(const char *path, const char *types, int n
 		it = controlListeners_.begin();
 		while(it != controlListeners_.end())
 			(*it++)->midiControlChange(0, CONTROL_DAMPER_PEDAL, pedalVal);
+		eventTime_ = 0.0;
 		pthread_mutex_unlock(&eventMutex_);
 		return true;
 	}
@@ -1322,6 +1410,7 @@ bool MidiController::oscHandlerMethod(const char *path, const char *types, int n
 			pedalVal = 0;
 		}
 		pthread_mutex_lock(&eventMutex_);
+		eventTime_ = eventArrivalTime(0.0, OSC_MIDI_CONTROLLER_NUM);
 		sostenutoPedalChange(pedalVal);
 		inputControllers_[0][CONTROL_SOSTENUTO_PEDAL] = pedalVal;
 		
@@ -1329,6 +1418,7 @@ bool MidiController::oscHandlerMethod(const char *path, const char *types, int n
 		it = controlListeners_.begin();
 		while(it != controlListeners_.end())
 			(*it++)->midiControlChange(0, CONTROL_SOSTENUTO_PEDAL, pedalVal);
+		eventTime_ = 0.0;
 		pthread_mutex_unlock(&eventMutex_);
 		return true;
 	}
@@ -1479,9 +1569,10 @@ bool MidiController::oscHandleGlobalParameters(const char *path, const char *typ
     {
         for(int i = 0; i <= 3; ++i)
         {      
-            Note *protoNote = programs_[PROGRAM_ID(currentProgram_, 0, midiNote)].notes[i];
+            ProgramInfo *program = programInfo(currentProgram_, 0, midiNote);
+            Note *protoNote = (program != NULL ? program->notes[i] : NULL);
             
-            if (typeid(*protoNote) == typeid(RealTimeMidiNote))
+            if (protoNote != NULL && typeid(*protoNote) == typeid(RealTimeMidiNote))
             {
                 RealTimeMidiNote *protoRtNote = (RealTimeMidiNote *)protoNote;
                 
@@ -1539,7 +1630,9 @@ void MidiController::noteEnded(Note *note, unsigned int key)
 	
 	// Note objects call this when they finish releasing.  (Note that abort() might not call this.)
 	// We should remove the indicated note from the map of current notes and return its audio channel to the pool.
-	// Finally, delete the Note object.
+	// The channel can be reused right away: a new note's synths are added to the render list after this note's
+	// were removed.  The Note object itself may still be in use by the render thread, and our caller is usually
+	// one of its own methods, so hand it to the cleanup thread to delete later.
     
 #ifdef DEBUG_MESSAGES
 	cout << "Note with key " << key << " ended.\n";
@@ -1550,7 +1643,7 @@ void MidiController::noteEnded(Note *note, unsigned int key)
 	mrpSendRoutingMessage(note->mrpChannel(), 0);		// Disconnect the signal routing for this string
 	
 	if(currentNotes_.count(key) > 0)	// If the Note object has not removed itself during abort(), remove it from the map
-		currentNotes_.erase(key);
+		removeCurrentNote(key);
 	else
 		cerr << "Warning: attempt to remove nonexistent key " << key << endl;
 	
@@ -1558,7 +1651,10 @@ void MidiController::noteEnded(Note *note, unsigned int key)
 	snprintf(oscMessageString, 32, "/ui/channel/note%d", note->mrpChannel());
 	oscController_->sendMessage(oscMessageString, "s", "--", LO_ARGS_END);
 	
-	delete note;		// Will this crash??
+	pthread_mutex_lock(&retiredMutex_);
+	retiredNotes_.push_back(note);
+	retiredPasses_.push_back(cleanupPass_);
+	pthread_mutex_unlock(&retiredMutex_);
 }
 
 bool MidiController::pianoDamperLifted(int note)
@@ -1576,23 +1672,8 @@ void* MidiController::cleanupLoop(void *data)
 	
 	while(!controller->cleanupShouldTerminate_)
 	{
-		/*map<unsigned int, Note*>::iterator it = controller->currentNotes_.begin();
-         
-         // Check if each note is finished, and release it if it is.
-         
-         while(it != controller->currentNotes_.end())
-         {
-         if((*it).second->isFinished())
-         {
-         #ifdef DEBUG_MESSAGES
-         cout << "Found finished note " << (*it).second << ", aborting\n";
-         #endif
-         (*it++).second->abort();
-         }
-         else
-         it++;
-         }		*/
-		// FIXME: This crashes!
+		if(!controller->cleanupPaused_)
+			controller->cleanupPass();
 		
 		// Check every 10 ms.  Notes that are finished won't be actively rendering audio but they will be occupying a channel.
 		// This is a reasonable compromise between responsiveness and overhead
@@ -1602,13 +1683,92 @@ void* MidiController::cleanupLoop(void *data)
 	return NULL;
 }
 
+// Stop or restart the cleanup thread's passes.  Pausing waits for a pass in progress to finish, since
+// each pass holds eventMutex_ throughout.
+
+void MidiController::pauseCleanupThread(bool paused)
+{
+	cleanupPaused_ = paused;
+	__sync_synchronize();
+	
+	pthread_mutex_lock(&eventMutex_);
+	pthread_mutex_unlock(&eventMutex_);
+}
+
+void MidiController::cleanupPass()
+{
+	// Check if each note is finished, and abort it if it is.  Hold the event mutex so the map doesn't
+	// change underneath us.
+	
+	pthread_mutex_lock(&eventMutex_);
+	
+	map<unsigned int, Note*>::iterator it = currentNotes_.begin();
+	
+	while(it != currentNotes_.end())
+	{
+		if((*it).second->isFinished())
+		{
+#ifdef DEBUG_MESSAGES
+			cout << "Found finished note " << (*it).second << ", aborting\n";
+#endif
+			(*it++).second->abort();	// Erases the note from the map via noteEnded()
+		}
+		else
+			it++;
+	}
+	
+	reclaimRetiredNotes(false);
+	cleanupPass_++;
+	
+	pthread_mutex_unlock(&eventMutex_);
+}
+
+// Delete notes that have ended.  A note is deleted once the render thread has applied the removal of its synths,
+// and it has been retired for at least one full cleanup interval, so that whichever control thread ended it has
+// long since returned from its own methods.  If wait is true, delete every retired note, waiting for the render
+// thread if necessary; this is only safe once no other thread can be ending notes.
+
+void MidiController::reclaimRetiredNotes(bool wait)
+{
+	vector<Note*> reclaimable;
+	int i, kept = 0;
+	
+	if(wait)
+		render_->waitForPendingRemovals();
+	
+	pthread_mutex_lock(&retiredMutex_);
+	for(i = 0; i < retiredNotes_.size(); i++)
+	{
+		while(wait && !retiredNotes_[i]->isReclaimable())	// Its removals weren't all queued when it ended
+		{
+			usleep(1000);
+			render_->waitForPendingRemovals();
+		}
+		if(wait || (cleanupPass_ - retiredPasses_[i] >= 2 && retiredNotes_[i]->isReclaimable()))
+			reclaimable.push_back(retiredNotes_[i]);
+		else
+		{
+			retiredNotes_[kept] = retiredNotes_[i];
+			retiredPasses_[kept++] = retiredPasses_[i];
+		}
+	}
+	retiredNotes_.resize(kept);
+	retiredPasses_.resize(kept);
+	pthread_mutex_unlock(&retiredMutex_);
+	
+	for(i = 0; i < reclaimable.size(); i++)
+		reclaimable[i]->reclaim();
+}
+
 MidiController::~MidiController()
 {    
-	// Stop the cleanup thread
+	// Stop the cleanup thread, then delete whatever it didn't get to
 	cleanupShouldTerminate_ = true;
 	pthread_join(cleanupThread_, NULL);
+	reclaimRetiredNotes(true);
     
 	patches_.clear();
+	pthread_mutex_destroy(&retiredMutex_);
 	pthread_mutex_destroy(&eventMutex_);
 }
 
@@ -1641,7 +1801,9 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
     
 	// First things first: let's check that this event actually corresponds to a note!
 	
-	if(programs_.count(PROGRAM_ID(currentProgram_, midiChannel, midiNote)) == 0)
+	ProgramInfo *program = programInfo(currentProgram_, midiChannel, midiNote);
+	
+	if(program == NULL)
 	{
 #ifdef DEBUG_MESSAGES_EXTRA
 		cerr << "Warning: no Note found for program " << currentProgram_ << ", channel " << midiChannel << ", note " << midiNote << endl;
@@ -1649,16 +1811,16 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
 		return;
 	}
 	
-	// Consult the program map to decide what kind of note to make
+	// Consult the program table to decide what kind of note to make
 	
-	bool damper = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].useDamperPedal;
-	bool sostenuto = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].useSostenutoPedal;
-	bool useAux = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].useAuxPedal;
-    bool sustainAlways = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].sustainAlways;
+	bool damper = program->useDamperPedal;
+	bool sostenuto = program->useSostenutoPedal;
+	bool useAux = program->useAuxPedal;
+    bool sustainAlways = program->sustainAlways;
 	bool auxActive = (inputControllers_[0][CONTROL_AUX_PEDAL] >= 64);
-	int velocitySplit = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].velocitySplitPoint;
-	int priority = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].priority;
-    float thisNoteAmplitudeOffset = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].amplitudeOffset;
+	int velocitySplit = program->velocitySplitPoint;
+	int priority = program->priority;
+    float thisNoteAmplitudeOffset = program->amplitudeOffset;
 	int noteIndex = 0;
 	
 	key = ((unsigned int)midiChannel << 8) + (unsigned int)midiNote;
@@ -1677,7 +1839,7 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
     
     // If this note is assigned to a monophonic voice, check if there is any other note
     // present in the voice, and if so, turn it off.
-    int monoVoice = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].monoVoice;
+    int monoVoice = program->monoVoice;
 	if(monoVoice >= 0 && monoVoice < 16)
     {
         int previousKeyInVoice = monoVoiceNotes_[monoVoice];
@@ -1700,52 +1862,25 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
 	pair<int,int> channels = render_->allocateOutputChannel();
 	if(channels.first == -1)											// No channel available, or error occurred
 	{
-		// Tell the oldest note in the currently sounding collection to turn off
-		map<unsigned int, Note*>::iterator it;
-		double oldestTime = (double)render_->currentTime();	// Other notes should be older than this
-		int lowestPriority = INT_MAX;
-		Note *oldestNote = NULL;
-        
-		// First, look for the lowest priority among current notes
-		for(it = currentNotes_.begin(); it != currentNotes_.end(); it++)
-		{
-			Note *n = it->second;
-			if(n->priority() < lowestPriority)
-				lowestPriority = n->priority();
-		}
+		// Tell the oldest of the lowest-priority notes to turn off, if it's no more important than this one
+		Note *oldestNote = findNoteToSteal(priority);
 		
-		// Compare the lowest priority in the current collection to the priority of the note
-		// that we propose to turn on.
-		if(lowestPriority > priority || (lowestPriority == priority && !displaceOldNotes_))
+		if(oldestNote == NULL)
 		{
 			cerr << "No channel available for note " << midiNote << endl;
+			notesDropped_++;
 			return;
 		}
 		
-		// Now, break ties by finding the oldest note with the lowest priority
-		for(it = currentNotes_.begin(); it != currentNotes_.end(); it++)
-		{
-			Note *n = it->second;
-			if(n->priority() > lowestPriority)
-				continue;
-			if(n->startTime() < oldestTime)
-			{
-				oldestTime = n->startTime();
-				oldestNote = n;
-			}
-		}
-		if(oldestNote != NULL)
-		{
-			// Found the oldest note.  Turn it off.
-			cout << "Out of channels: turning off note with key " << oldestNote->midiNote() << endl;
-			oldestNote->abort();
-		}
+		cout << "Out of channels: turning off note with key " << oldestNote->midiNote() << endl;
+		oldestNote->abort();
 		
 		// Now try again...
 		channels = render_->allocateOutputChannel();
 		if(channels.first == -1)
 		{
 			cerr << "No channel available for note " << midiNote << endl;
+			notesDropped_++;
 			return;
 		}
 	}
@@ -1781,7 +1916,7 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
 			noteIndex = 0;	// Main, low velocity
 	}
 	
-	Note *oldNote = programs_[PROGRAM_ID(currentProgram_, midiChannel, midiNote)].notes[noteIndex];
+	Note *oldNote = program->notes[noteIndex];
 	
 	cout << "currentProgram_ " << currentProgram_ << " channel " << midiChannel << " noteIndex " << noteIndex << " Note " << oldNote << endl;
 	if(oldNote == NULL)
@@ -1838,7 +1973,7 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
 #endif
 	
 	newNote->begin(pianoDamperLifted(pianoString));			// Tell note to begin, and let it know whether damper is up
-	currentNotes_[key] = newNote;							// Store this note object in the map
+	addCurrentNote(key, newNote);							// Store this note object in the map
 	
 	if(midiNote >= 21 && midiNote <= 108)
 	{
@@ -1848,6 +1983,63 @@ void MidiController::noteOn(double deltaTime, vector<unsigned char> *message, in
 	}
 }
 
+// currentNotes_ maps keys to notes for note-off messages; voiceOrder_ holds the same notes sorted for voice
+// stealing, so that finding the note to turn off doesn't mean searching every note.  Keys and priorities
+// are fixed once a note is created, as are start times, so an entry never has to move.
+
+void MidiController::addCurrentNote(unsigned int key, Note *note)
+{
+	if(currentNotes_.count(key) > 0)		// Replacing a note which didn't remove itself
+		voiceOrder_.erase(voiceOrderEntryFor(key, currentNotes_[key]));
+	
+	currentNotes_[key] = note;
+	voiceOrder_.insert(voiceOrderEntryFor(key, note));
+}
+
+void MidiController::removeCurrentNote(unsigned int key)
+{
+	map<unsigned int, Note*>::iterator it = currentNotes_.find(key);
+	
+	if(it == currentNotes_.end())
+		return;
+	voiceOrder_.erase(voiceOrderEntryFor(key, it->second));
+	currentNotes_.erase(it);
+}
+
+MidiController::voiceOrderEntry MidiController::voiceOrderEntryFor(unsigned int key, Note *note)
+{
+	voiceOrderEntry entry;
+	
+	entry.priority = note->priority();
+	entry.startTime = note->startTime();
+	entry.key = key;
+	entry.note = note;
+	return entry;
+}
+
+// Find the note to turn off when we're out of channels and a note of the given priority wants to play: the
+// oldest note of the lowest priority, as long as that's below the new note's priority (or the same, if we're
+// displacing old notes).  Only notes which have already started are candidates.  Returns NULL if there's none.
+
+Note *MidiController::findNoteToSteal(int priority)
+{
+	if(voiceOrder_.empty())
+		return NULL;
+	
+	const voiceOrderEntry& oldest = *voiceOrder_.begin();
+	
+	if(oldest.priority > priority || (oldest.priority == priority && !displaceOldNotes_))
+		return NULL;
+	if(oldest.startTime >= (double)render_->currentTime())
+		return NULL;
+	
+	if(oldest.priority < priority)
+		notesStolen_++;
+	else
+		notesStolenSamePriority_++;
+	return oldest.note;
+}
+
 // For a given MIDI note, check if this triggers a program change.  This is called separately from noteOn()
 // so that the PianoBar controller can be more selective in when it triggers this event.
 
@@ -56,6 +56,7 @@ public:
 		int priority;
         int monoVoice;              // Monophonic voice this note is assigned to (0-15, or -1 for none)
 		float amplitudeOffset;      // Volume adjustment
+		bool isDefined;				// In the program table, whether this key has any of the above
 	} ProgramInfo;
 	
 	// FIXME: Really, we should replace all this program info business with some giant tree structure that splits
@@ -136,6 +137,7 @@ public:
 	int consoleProgramIncrement();
 	int consoleProgramDecrement();
 	void consoleAllNotesOff(int midiChannel);
+	void consolePrintVoicePools(ostream& output);		// Voice pool usage of each patch
 	
 	unsigned char getControllerValue(int channel, int controller);
 	unsigned char getPatchValue(int channel);
@@ -144,6 +146,10 @@ public:
 	void setNoteDisabledChannels(vector<int>& channels);	// Disable these channels from triggering notes
 	void setDisplaceOldNotes(bool d) { displaceOldNotes_ = d; }	// Whether to remove old notes when we run out of channels
 	
+	// Stream time at which the event being handled should take effect, or 0 for as soon as possible.  Notes read
+	// this (with eventMutex_ held, as they always are when handling events) to time their synths.
+	PaTime eventTime() { return eventTime_; }
+	
 	// The static callback below is needed to interface with RtMidi; it passes control off to the instance-specific function
 	void rtMidiCallback(double deltaTime, vector<unsigned char> *message, int inputNumber);	// Instance-specific callback
 	static void rtMidiStaticCallback(double deltaTime, vector<unsigned char> *message, void *userData)
@@ -184,6 +190,7 @@ public:
 	void removeEventListener(Note *note);
 	
 	void noteEnded(Note *note, unsigned int key);					// Called when a Note finishes to request removal from the map
+																	// The note is deleted later by the cleanup thread
 	
 	// ********** Utility Methods *****************
     
@@ -206,15 +213,37 @@ public:
 	// The cleanup thread regularly calls these functions to check whether any notes have finished.  The static function
 	// passes control to the instance-specific function, which polls the available notes to see whether they've finished.
 	// If so, it aborts the given note.  This allows notes to finish on timers rather than solely on events.
+	// The same thread deletes notes that have ended, once the render thread can no longer see their synths.
 	
 	static void *cleanupLoop(void *data);
+	void cleanupPass();							// One iteration of the loop; offline rendering calls this after each block
+	void pauseCleanupThread(bool paused);		// Offline rendering runs the passes itself, on the render thread
+	void reclaimRetiredNotes(bool wait);
     
 	// ************* Destructor *******************
 	
 	~MidiController();
 	
 private:
+	// Entry in the voice stealing order.  Notes sort by priority, then start time, then key, so the first entry
+	// is the one to turn off when we run out of channels: the oldest of the lowest priority.
+	struct voiceOrderEntry {
+		int priority;
+		double startTime;
+		unsigned int key;
+		Note *note;
+		
+		bool operator<(const voiceOrderEntry& other) const {
+			if(priority != other.priority)
+				return priority < other.priority;
+			if(startTime != other.startTime)
+				return startTime < other.startTime;
+			return key < other.key;
+		}
+	};
+	
 	// *********** Private Methods ****************
+	PaTime eventArrivalTime(double deltaTime, int inputNumber);	// Schedule an event (see eventTime())
 	void noteOn(double deltaTime, vector<unsigned char> *message, int inputNumber);
 	void noteOff(double deltaTime, vector<unsigned char> *message, int inputNumber);
 	void damperPedalChange(unsigned char value);		// Called when the damper pedal changes on any channel
@@ -222,8 +251,22 @@ private:
 	
 	void allNotesOff(int midiChannel);				// Turn off all sounding notes for channel (-1 = all channels)
 	
+	// Keep currentNotes_ and voiceOrder_ in step: always add and remove current notes through these
+	void addCurrentNote(unsigned int key, Note *note);
+	void removeCurrentNote(unsigned int key);
+	static voiceOrderEntry voiceOrderEntryFor(unsigned int key, Note *note);
+	Note *findNoteToSteal(int priority);			// Note to turn off to make room for one of this priority, or NULL
+	
 	void checkForProgramUpdate(int midiChannel, int midiNote);
 	
+	void compileProgramTable();
+	ProgramInfo *programInfo(unsigned int program, unsigned int channel, unsigned int note) {	// NULL if no such key
+		if(program > 127 || channel > 15 || note > 127 || programSlices_[program] == NULL)
+			return NULL;
+		ProgramInfo *info = &programSlices_[program][(channel << 7) + note];
+		return (info->isDefined ? info : NULL);
+	}
+	
 	// ************** Variables *******************
 	
     PNOscanController *PNOcontroller_;          // Pointer to the object that handles QRS PNOscan-specific methods
@@ -251,17 +294,30 @@ private:
     // We'll probably only use 88 of these but this keeps it synced to MIDI note number
 	
 	map<unsigned int, Note*> currentNotes_;		// Holds the currently sounding notes, for MIDI note-off purposes
+	set<voiceOrderEntry> voiceOrder_;			// The same notes, in the order they should be turned off
+	unsigned long notesStolen_;					// Notes turned off to make room for one of higher priority...
+	unsigned long notesStolenSamePriority_;		// ...or of the same priority, if displaceOldNotes_
+	unsigned long notesDropped_;				// Notes that didn't play because no channel could be found
     unsigned int monoVoiceNotes_[16];           // Which note is currently sounding in a defined monophonic voice
 	set<Note*> aftertouchListeners_;			// Notes that want to be updated on aftertouch data
 	set<Note*> pitchWheelListeners_;			// Notes that want to be updated on pitch wheel changes
 	set<Note*> controlListeners_;				// Notes that want to be updated on control changes
 	set<Note*> noteListeners_;					// Notes that want to be updated on other note on/off events
 	
+	vector<Note*> retiredNotes_;				// Notes that have ended but may still be visible to the render thread
+	vector<unsigned int> retiredPasses_;		// Cleanup pass during which each of retiredNotes_ ended
+	unsigned int cleanupPass_;					// Incremented by each run of the cleanup loop
+	pthread_mutex_t retiredMutex_;				// Protects retiredNotes_ and retiredPasses_
+	
 	pthread_t cleanupThread_;					// Thread identifier that runs the cleanup loop
 	pthread_mutex_t eventMutex_;				// This ensures that different MIDI streams and cleanup events happen atomically
     // It is a fairly course-grained control (the whole of a MIDI action takes place
     // within), but it ensures our data doesn't get corrupted by competing events.
 	bool cleanupShouldTerminate_;				// Set this to true on exit to let the cleanup thread end
+	volatile bool cleanupPaused_;				// While true, the cleanup thread skips its passes
+	
+	PaTime eventTime_;							// When the current event takes effect (see eventTime())
+	map<int, PaTime> lastArrivalTimes_;			// Arrival time of the last event on each MIDI input
 	
 	float a4Tuning_;							// Frequency of A4 (nominally 440Hz, but adjustable)
 	
@@ -278,6 +334,12 @@ private:
 	map<string, Note*> patches_;				// Holds a collection of prototype notes indexed by name
 	//ProgramInfo programs_[16][128];			// Information about each MIDI program on a per-key basis
 	map<unsigned int, ProgramInfo> programs_;
+	
+	// programs_ compiled into a dense table by compileProgramTable().  Each program with any notes gets a slice
+	// of 16 channels x 128 notes, so note-on finds everything about a key with one indexed load, and a program
+	// change only changes which slice currentProgram_ picks out.
+	vector<ProgramInfo> programTable_;
+	ProgramInfo *programSlices_[128];			// Each program's slice of programTable_, or NULL if it has no notes
 	map<unsigned int, unsigned int> programTriggeredChanges_;	// Holds info on MIDI events causing a program change
 	
 	// ****** Global Function Controllers *********
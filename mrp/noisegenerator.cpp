@@ -0,0 +1,252 @@
+/*
+ *  noisegenerator.cpp
+ *  mrp
+ *
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <pthread.h>
+#include "noisegenerator.h"
+#include "benchmark.h"
+#include "parameter.h"
+#include "config.h"
+
+#define NOISE_DEFAULT_BASE_SEED		0x4D525021		// Base seed until setBaseSeed() is called
+
+static uint32_t gBaseSeed = NOISE_DEFAULT_BASE_SEED;
+static uint32_t gSeedCounter = 0;
+
+static inline uint32_t rotateLeft(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+// splitmix32-style hash, used to spread a seed across the generator state
+static uint32_t mixSeed(uint32_t x)
+{
+	x += 0x9E3779B9;
+	x = (x ^ (x >> 16)) * 0x85EBCA6B;
+	x = (x ^ (x >> 13)) * 0xC2B2AE35;
+	return x ^ (x >> 16);
+}
+
+// Convert the top 24 bits of a random word to a float in [-1, 1).  Keeping only 24 bits means the
+// conversion is exact, so the result never rounds up to 1.0.
+static inline float toUniform(uint32_t x)
+{
+	return (float)(int32_t)(x & 0xFFFFFF00) * (1.0f / 2147483648.0f);
+}
+
+#pragma mark Seeds
+
+uint32_t NoiseGenerator::nextSeed()
+{
+	return mixSeed(gBaseSeed + __sync_fetch_and_add(&gSeedCounter, 1));
+}
+
+void NoiseGenerator::setBaseSeed(uint32_t seed)
+{
+	gBaseSeed = seed;
+	gSeedCounter = 0;
+}
+
+#pragma mark NoiseGenerator
+
+NoiseGenerator::NoiseGenerator()
+{
+	seed(nextSeed());
+}
+
+NoiseGenerator::NoiseGenerator(uint32_t seed)
+{
+	this->seed(seed);
+}
+
+void NoiseGenerator::seed(uint32_t seed)
+{
+	uint32_t x = seed;
+	int lane, word;
+
+	// Each word is the hash of the one before.  mixSeed(0) isn't zero, so no two words in a row are zero
+	// and no lane starts in the all-zero state, which xoshiro can't leave.
+	for(lane = 0; lane < NOISE_GENERATOR_LANES; lane++)
+	{
+		for(word = 0; word < 4; word++)
+			state_[word][lane] = x = mixSeed(x);
+	}
+
+	outputUsed_ = NOISE_GENERATOR_LANES;		// Nothing generated yet
+	haveGaussianSpare_ = false;
+	gaussianSpare_ = 0.0;
+}
+
+// One step of xoshiro128+ in every lane.  The lanes are independent, so this loop vectorizes.
+
+void NoiseGenerator::generate()
+{
+	for(int lane = 0; lane < NOISE_GENERATOR_LANES; lane++)
+	{
+		uint32_t s0 = state_[0][lane], s1 = state_[1][lane], s2 = state_[2][lane], s3 = state_[3][lane];
+		uint32_t t = s1 << 9;
+
+		output_[lane] = s0 + s3;
+
+		s2 ^= s0;
+		s3 ^= s1;
+		s1 ^= s2;
+		s0 ^= s3;
+		s2 ^= t;
+		s3 = rotateLeft(s3, 11);
+
+		state_[0][lane] = s0;
+		state_[1][lane] = s1;
+		state_[2][lane] = s2;
+		state_[3][lane] = s3;
+	}
+
+	outputUsed_ = 0;
+}
+
+// Samples are handed out in lane order, and any left over from one call are used at the start of the
+// next, so the sequence doesn't depend on how it's divided into buffers.
+
+void NoiseGenerator::uniform(float *buffer, unsigned long frameCount)
+{
+	unsigned long i = 0;
+	int lane;
+
+	while(i < frameCount && outputUsed_ < NOISE_GENERATOR_LANES)
+		buffer[i++] = toUniform(output_[outputUsed_++]);
+
+	for(; i + NOISE_GENERATOR_LANES <= frameCount; i += NOISE_GENERATOR_LANES)
+	{
+		generate();
+		for(lane = 0; lane < NOISE_GENERATOR_LANES; lane++)
+			buffer[i + lane] = toUniform(output_[lane]);
+	}
+	outputUsed_ = NOISE_GENERATOR_LANES;
+
+	if(i < frameCount)
+	{
+		generate();
+		while(i < frameCount)
+			buffer[i++] = toUniform(output_[outputUsed_++]);
+	}
+}
+
+// Box-Muller transform on pairs of uniform samples
+
+void NoiseGenerator::gaussian(float *buffer, unsigned long frameCount)
+{
+	const float scale = 1.0f / sqrtf(3.0f);
+	float pair[2];
+	unsigned long i = 0;
+
+	if(frameCount > 0 && haveGaussianSpare_)
+	{
+		buffer[i++] = gaussianSpare_;
+		haveGaussianSpare_ = false;
+	}
+
+	while(i < frameCount)
+	{
+		float u1, u2, radius;
+
+		uniform(pair, 2);
+		u1 = 0.5f - 0.5f * pair[0];					// (0, 1], so the log is finite
+		u2 = pair[1];								// [-1, 1), i.e. angle [-pi, pi)
+		radius = scale * sqrtf(-2.0f * logf(u1));
+
+		buffer[i++] = radius * cosf((float)M_PI * u2);
+		if(i < frameCount)
+			buffer[i++] = radius * sinf((float)M_PI * u2);
+		else
+		{
+			gaussianSpare_ = radius * sinf((float)M_PI * u2);
+			haveGaussianSpare_ = true;
+		}
+	}
+}
+
+#pragma mark Benchmark
+
+#define NOISE_BENCHMARK_VOICES		32			// Noise voices, divided among the threads
+#define NOISE_BENCHMARK_SAMPLES		4000000		// Total samples, divided among the voices
+#define NOISE_BENCHMARK_MAX_THREADS	8
+
+typedef struct {
+	int voices;									// Number of voices this thread renders
+	bool useRand;								// rand() or NoiseGenerator
+	float sink;									// Keeps the compiler from discarding the results
+} noiseBenchmarkThread;
+
+static void *noiseBenchmarkThreadFunction(void *arg)
+{
+	noiseBenchmarkThread *thread = (noiseBenchmarkThread *)arg;
+	vector<NoiseGenerator> generators(thread->voices);
+	float buffer[PARAMETER_UPDATE_INTERVAL];
+	int repetitions = NOISE_BENCHMARK_SAMPLES / (NOISE_BENCHMARK_VOICES * PARAMETER_UPDATE_INTERVAL);
+	int r, v, i;
+
+	for(v = 0; v < thread->voices; v++)
+		generators[v].reseed();			// The vector copies one generator, so give each its own seed
+
+	// Each voice fills one parameter update interval at a time, as NoiseSynth does
+	for(r = 0; r < repetitions; r++)
+	{
+		for(v = 0; v < thread->voices; v++)
+		{
+			if(thread->useRand)
+			{
+				for(i = 0; i < PARAMETER_UPDATE_INTERVAL; i++)
+					buffer[i] = (float)rand()/(float)(RAND_MAX>>1) - 1.0;
+			}
+			else
+				generators[v].uniform(buffer, PARAMETER_UPDATE_INTERVAL);
+			thread->sink += buffer[r % PARAMETER_UPDATE_INTERVAL];
+		}
+	}
+
+	return NULL;
+}
+
+void NoiseGenerator::benchmark(ostream& output)
+{
+	const int threadCounts[] = { 1, 2, 4, 8 };
+	noiseBenchmarkThread threads[NOISE_BENCHMARK_MAX_THREADS];
+	pthread_t threadIds[NOISE_BENCHMARK_MAX_THREADS];
+	BenchmarkTimer timer;
+	int repetitions = NOISE_BENCHMARK_SAMPLES / (NOISE_BENCHMARK_VOICES * PARAMETER_UPDATE_INTERVAL);
+	double totalSamples = (double)repetitions * NOISE_BENCHMARK_VOICES * PARAMETER_UPDATE_INTERVAL;
+	int h, m, t;
+
+	printBenchmarkHeading(output, "Noise generator", "sample", (long)totalSamples);
+	output << "  " << NOISE_BENCHMARK_VOICES << " voices, divided among the threads\n";
+
+	for(h = 0; h < sizeof(threadCounts) / sizeof(int); h++)
+	{
+		int numThreads = threadCounts[h];
+
+		output << "  " << numThreads << (numThreads == 1 ? " thread:" : " threads:");
+
+		for(m = 0; m < 2; m++)
+		{
+			timer.start();
+			for(t = 0; t < numThreads; t++)
+			{
+				threads[t].voices = NOISE_BENCHMARK_VOICES / numThreads;
+				threads[t].useRand = (m == 0);
+				threads[t].sink = 0.0;
+				pthread_create(&threadIds[t], NULL, noiseBenchmarkThreadFunction, &threads[t]);
+			}
+			for(t = 0; t < numThreads; t++)
+				pthread_join(threadIds[t], NULL);
+
+			// Wall-clock time per sample over all voices, so more threads should mean less time
+			output << (m == 0 ? " rand() " : ", NoiseGenerator ") << timer.nsPer(totalSamples);
+		}
+		output << endl;
+	}
+}
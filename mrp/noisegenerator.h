@@ -0,0 +1,60 @@
+/*
+ *  noisegenerator.h
+ *  mrp
+ *
+ */
+
+#ifndef NOISE_GENERATOR_H
+#define NOISE_GENERATOR_H
+
+#include <iostream>
+#include <stdint.h>
+using namespace std;
+
+#define NOISE_GENERATOR_LANES	8		// Independent generators run side by side, one per SIMD lane
+
+// NoiseGenerator produces white noise a buffer at a time, for NoiseSynth.  It runs NOISE_GENERATOR_LANES
+// xoshiro128+ generators side by side, whose state updates (adds, shifts and xors on 32-bit words) the
+// compiler can turn into SIMD instructions.  Unlike rand(), each generator has its own state, so synths on
+// different render threads never contend for a lock, and the output depends only on the seed.
+//
+// Generators created without an explicit seed take the next one from a global sequence, which starts
+// from the base seed.  Since synths are created in the same order each time a given set of events is
+// played, offline renders are reproducible.
+
+class NoiseGenerator
+{
+public:
+	NoiseGenerator();								// Seeded from the global sequence
+	NoiseGenerator(uint32_t seed);
+
+	void seed(uint32_t seed);
+	void reseed() { seed(nextSeed()); }				// Take a new seed from the global sequence
+
+	// Fill buffer with frameCount samples, uniformly distributed in [-1, 1)
+	void uniform(float *buffer, unsigned long frameCount);
+
+	// Fill buffer with frameCount samples of Gaussian noise with mean 0 and standard deviation 1/sqrt(3),
+	// the same power as uniform()
+	void gaussian(float *buffer, unsigned long frameCount);
+
+	// The global sequence of seeds
+	static uint32_t nextSeed();
+	static void setBaseSeed(uint32_t seed);			// Restart the sequence from a new base seed
+
+	// Print the cost in ns/sample of this generator versus rand(), for a number of voices each filling
+	// their own buffer as NoiseSynth does
+	static void benchmark(ostream& output);
+
+private:
+	void generate();								// Advance every lane, refilling output_
+
+	uint32_t state_[4][NOISE_GENERATOR_LANES];		// State words, one set per lane
+	uint32_t output_[NOISE_GENERATOR_LANES];		// Last values produced by each lane
+	int outputUsed_;								// How many of output_ have been handed out
+
+	float gaussianSpare_;							// Box-Muller produces samples in pairs
+	bool haveGaussianSpare_;
+};
+
+#endif // NOISE_GENERATOR_H
@@ -20,6 +20,8 @@ const char *kNoteNames[88] = { "A0", "A#0", "B0",
 	"C6", "C#6", "D6", "D#6", "E6", "F6", "F#6", "G6", "G#6", "A6", "A#6", "B6",
 	"C7", "C#7", "D7", "D#7", "E7", "F7", "F#7", "G7", "G#7", "A7", "A#7", "B7", "C8"};	
 
+timedParameter MidiNote::emptyRamp_;
+
 #pragma mark MidiNote
 
 /*MidiNote::MidiNote(const MidiNote& copy) : Note(copy), velocity_(copy.velocity_), name_(copy.name_)
@@ -182,6 +184,15 @@ int MidiNote::parseXml(TiXmlElement *baseElement)
 	if(numSynths == 0)
 		cerr << "MidiNote::parseXml() warning: no Synths found\n";
 	
+	// Every note takes an output channel, so no factory can have more voices in use than there are channels,
+	// plus those of notes that have ended but not yet been reclaimed by the cleanup thread.  The same goes for
+	// the notes themselves.
+	for(int i = 0; i < factories_.size(); i++)
+		factories_[i]->preallocateVoices(2*render_->numOutputChannels(), velocityCurve_);
+	if(notePool_ == NULL)
+		notePool_ = new NotePool;
+	notePool_->preallocateNotes(this, 2*render_->numOutputChannels());
+	
 	return 0;
 }
 
@@ -218,7 +229,7 @@ void MidiNote::begin(bool damperLifted)
 #endif
 		if(render_->addSynth(synths_[i]))
 			cerr << "MidiNote::begin() warning: error adding synth #" << i << endl;
-		synths_[i]->begin();
+		synths_[i]->begin(controller_->eventTime());
 	}
 	
 	isRunning_ = true;
@@ -261,21 +272,47 @@ void MidiNote::abort()
 		return;
 	
 	// Tell all synths to release, and remove them from the render queue	
-	// This setup doesn't allow synths any post-release activity since it removes them right away
+	// This setup doesn't allow synths any post-release activity since it removes them right away.
+	// Removal doesn't wait for the render thread; the controller holds on to this note until
+	// isReclaimable() says the last removal has taken effect.  If the event is scheduled, the synths
+	// render up to its time.  A removal that can't be queued now is retried by isReclaimable().
+	PaTime when = controller_->eventTime();
+	
 	for(int i = 0; i < synths_.size(); i++)
 	{
-		synths_[i]->release();
+		synths_[i]->release(when);
 #ifdef DEBUG_MESSAGES_EXTRA
 		cout << "removing Synth " << synths_[i] << endl;
 #endif
-		if(render_->removeSynth(synths_[i]))
-			cerr << "MidiNote::abort() warning: error removing synth #" << i << endl;
+		if(render_->removeSynthDeferred(synths_[i], &removalEpoch_, when))
+		{
+			cerr << "MidiNote::abort() warning: error removing synth #" << i << ", will retry\n";
+			pendingRemovals_.push_back(synths_[i]);
+		}
 	}
 	
 	isRunning_ = false;	
 	controller_->noteEnded(this, key_);			// Tell the controller we finished
 }
 
+// Not until every synth's removal has been queued, and the render thread has applied the last of them
+
+bool MidiNote::isReclaimable()
+{
+	int i, kept = 0;
+	
+	for(i = 0; i < pendingRemovals_.size(); i++)
+	{
+		if(render_->removeSynthDeferred(pendingRemovals_[i], &removalEpoch_))
+			pendingRemovals_[kept++] = pendingRemovals_[i];
+	}
+	pendingRemovals_.resize(kept);
+	
+	if(kept > 0)
+		return false;
+	return render_->removalIsComplete(removalEpoch_);
+}
+
 bool MidiNote::isFinished()
 {
 	bool finished = true;
@@ -332,7 +369,7 @@ void MidiNote::midiControlChange(unsigned char channel, unsigned char control, u
 MidiNote* MidiNote::createNote(int audioChannel, int mrpChannel, int midiNote, int midiChannel, int pianoString, unsigned int key, 
 							   int priority, int velocity, float phaseOffset, float amplitudeOffset)
 {
-	MidiNote *out = new MidiNote(controller_, render_);
+	MidiNote *out = allocateNote();
 	int i;
 	float baseFreq;
 	
@@ -349,29 +386,100 @@ MidiNote* MidiNote::createNote(int audioChannel, int mrpChannel, int midiNote, i
 	for(i = 0; i < factories_.size(); i++)
 	{
 		SynthBase *synth = factories_[i]->createSynth(midiNote, velocity, velocityCurve_, amplitudeOffset);
-		timedParameter emptyParam;
 
 		if(typeid(*synth) == typeid(PllSynth))
-			((PllSynth*)synth)->setPhaseOffset(phaseOffset, emptyParam);
-		synth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel);
+			((PllSynth*)synth)->setPhaseOffset(phaseOffset, emptyRamp_);
+		synth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel,
+										render_->inputHistory());
 		out->synths_.push_back(synth);
+		out->voiceFactories_.push_back(factories_[i]);
 	}	
 	
 	return out;
 }
 
-MidiNote::~MidiNote()
+// Take a note from the pool and return it to the state a new one would be in, with room for a synth from
+// each of our factories.
+
+MidiNote* MidiNote::allocateNote()
 {
-	int i;
+	MidiNote *out;
+	
+	if(notePool_ == NULL)			// parseXml() was never called
+		notePool_ = new NotePool;
+	out = notePool_->allocateNote(this);
+	
+	out->isRunning_ = false;
+	out->isReleasing_ = false;
+	out->startTime_ = (double)render_->currentTime();
+	out->removalEpoch_ = 0;
+	out->synths_.reserve(factories_.size());
+	out->voiceFactories_.reserve(factories_.size());
+	
+	return out;
+}
+
+void MidiNote::releaseSynths()
+{
+	for(int i = 0; i < synths_.size(); i++)
+	{
+		render_->synthRemoved(synths_[i]);
+		if(i < voiceFactories_.size())		// Synths from a factory go back to its voice pool
+			voiceFactories_[i]->releaseSynth(synths_[i]);
+		else
+			delete synths_[i];
+	}
+	synths_.clear();
+	voiceFactories_.clear();
+	pendingRemovals_.clear();
+}
+
+void MidiNote::reclaim()
+{
+	if(homePool_ == NULL)
+	{
+		delete this;
+		return;
+	}
 	
+	releaseSynths();
+	homePool_->releaseNote(this);		// Might delete us, if our patch has gone away
+}
+
+MidiNote::~MidiNote()
+{
 #ifdef DEBUG_ALLOCATION
 	cout << "**** ~MidiNote\n";
 #endif
 	
-	for(i = 0; i < synths_.size(); i++)
-		delete synths_[i];
-	for(i = 0; i < factories_.size(); i++)
-		delete factories_[i];
+	releaseSynths();
+	for(int i = 0; i < factories_.size(); i++)
+		factories_[i]->retire();
+	if(notePool_ != NULL)
+		notePool_->retire();
+}
+
+void MidiNote::printVoicePoolStatus(ostream& output)
+{
+	if(notePool_ != NULL)
+	{
+		output << "  " << name_ << " notes: ";
+		notePool_->printNotePoolStatus(output);
+	}
+	for(int i = 0; i < factories_.size(); i++)
+	{
+		output << "  " << name_ << " synth " << i << ": ";
+		factories_[i]->printVoicePoolStatus(output);
+	}
+}
+
+long MidiNote::velocityTableSize()
+{
+	long size = 0;
+	
+	for(int i = 0; i < factories_.size(); i++)
+		size += factories_[i]->velocityTableSize();
+	return size;
 }
 
 #pragma mark Private Methods
@@ -425,6 +533,14 @@ void MidiNote::assignPllSynthParameters(PllSynthFactory *factory, TiXmlElement *
 			valueStream >> boolalpha >> factory->useInterferenceRejection_;
 			factory->useInterferenceRejectionActive_ = true;	
 		}
+		else if(name->compare("SmoothGlobalAmplitude") == 0) {		// bool, time-invariant
+			valueStream >> boolalpha >> factory->smoothGlobalAmplitude_;
+			factory->smoothGlobalAmplitudeActive_ = true;
+		}
+		else if(name->compare("UseHarmonicAnalyzer") == 0) {		// bool, time-invariant
+			valueStream >> boolalpha >> factory->useHarmonicAnalyzer_;
+			factory->useHarmonicAnalyzerActive_ = true;
+		}
 		else if(name->compare("RelativeFrequency") == 0) {			// double, time-variant
 			parseVelocityPair(value->c_str(), &(factory->relativeFrequencyMin_.start), &(factory->relativeFrequencyMax_.start));
 			parseParameterRampWithVelocity(element, &(factory->relativeFrequencyMin_.ramp), &(factory->relativeFrequencyMax_.ramp));
@@ -550,6 +666,31 @@ void MidiNote::assignPllSynthParameters(PllSynthFactory *factory, TiXmlElement *
 			}
 			factory->inputDelaysConcavity_ = c;
 			factory->inputDelaysActive_ = true;
+			
+			// Delays are read from the input history AudioRender keeps.  Say so now if they can't be honored,
+			// rather than have the synths quietly ignore or shorten them.
+			double longestDelay = 0.0;
+			for(i = 0; i < vd1.size(); i++)
+				longestDelay = max(longestDelay, vd1[i]);
+			for(i = 0; i < vd2.size(); i++)
+				longestDelay = max(longestDelay, vd2[i]);
+			for(i = 0; i < vtp1.size(); i++)
+				for(int j = 0; j < vtp1[i].size(); j++)
+					longestDelay = max(longestDelay, vtp1[i][j].nextValue);
+			for(i = 0; i < vtp2.size(); i++)
+				for(int j = 0; j < vtp2[i].size(); j++)
+					longestDelay = max(longestDelay, vtp2[i][j].nextValue);
+			
+			if(longestDelay > 0.0)
+			{
+				InputHistory *history = render_->inputHistory();
+				
+				if(history == NULL || history->numChannels() < render_->numInputChannels())
+					cerr << "assignPllSynthParameters() warning: no input history, InputDelays will be ignored\n";
+				else if(longestDelay*render_->sampleRate() > history->maxDelay())
+					cerr << "assignPllSynthParameters() warning: InputDelays longer than "
+						 << history->maxDelay()/render_->sampleRate() << " seconds will be shortened\n";
+			}
 		}
 		else if(name->compare("LoopGain") == 0) {					// double, time-variant
 			parseVelocityPair(value->c_str(), &(factory->loopGainMin_.start), &(factory->loopGainMax_.start));
@@ -674,11 +815,25 @@ void MidiNote::assignNoiseSynthParameters(NoiseSynthFactory *factory, TiXmlEleme
 			factory->filterQsConcavity_ = c;
 			factory->filterQsActive_ = true;
 		}
+		else if(name->compare("UseGaussianNoise") == 0) {			// bool, time-invariant
+			valueStream >> boolalpha >> factory->useGaussianNoise_;
+			factory->useGaussianNoiseActive_ = true;
+		}
 		else
 			cerr << "assignNoiseSynthParameters() warning: unknown parameter '" << *name << "'\n";
 	}
 }
 
+// Synths keep at most PARAMETER_RAMP_SIZE segments of each parameter's ramp, so warn when a patch asks for more
+// rather than letting the ramp stop short without a word.
+
+static void checkRampLength(const char *function, int numSegments)
+{
+	if(numSegments > PARAMETER_RAMP_SIZE)
+		cerr << function << " warning: " << numSegments << " Ramp tags, only the first " << PARAMETER_RAMP_SIZE
+			 << " will be used\n";
+}
+
 timedParameter MidiNote::parseParameterRamp(TiXmlElement *element)
 {
 	TiXmlElement *ramp = element->FirstChildElement("Ramp");
@@ -732,6 +887,7 @@ timedParameter MidiNote::parseParameterRamp(TiXmlElement *element)
 		ramp = ramp->NextSiblingElement("Ramp");
 	}
 	
+	checkRampLength("parseParameterRamp()", out.size());
 	return out;
 }
 
@@ -741,6 +897,7 @@ timedParameter MidiNote::parseParameterRamp(TiXmlElement *element)
 void MidiNote::parseParameterRampWithVelocity(TiXmlElement *element, timedParameter *out1, timedParameter *out2)
 {
 	TiXmlElement *ramp = element->FirstChildElement("Ramp");
+	int numSegments = 0;
 	
 	while(ramp != NULL)		// These tags hold ramp values for time-variant parameters
 	{
@@ -788,12 +945,15 @@ void MidiNote::parseParameterRampWithVelocity(TiXmlElement *element, timedParame
 				out1->push_back(param1);
 			if(out2 != NULL)
 				out2->push_back(param2);
+			numSegments++;
 		}
 		else
 			cerr << "parseParameterRampWithVelocity() warning: null attributes in Ramp tag\n";
 		
 		ramp = ramp->NextSiblingElement("Ramp");
 	}
+	
+	checkRampLength("parseParameterRampWithVelocity()", numSegments);
 }
 
 
@@ -803,6 +963,7 @@ vector<timedParameter> MidiNote::parseMultiParameterRamp(TiXmlElement *element)
 	vector<timedParameter> out;		// The output is a vector of deque objects.  Each deque holds a list of values to ramp to
 	timedParameter emptyTp;			// timedParameter with no parameterValue elements
 	bool first = true;
+	int numSegments = 0;
 	
 	while(ramp != NULL)		// These tags hold ramp values for time-variant parameters
 	{
@@ -858,6 +1019,7 @@ vector<timedParameter> MidiNote::parseMultiParameterRamp(TiXmlElement *element)
 			
 			for(i = 0; i < size; i++)			// Go through each value in the list and add it to the appropriate timedParameter
 				out[i].push_back((parameterValue){p,values[i],shape});
+			numSegments++;
 		}
 		else
 			cerr << "assignPllSynthParameters() warning: null attributes in Ramp tag\n";
@@ -865,6 +1027,7 @@ vector<timedParameter> MidiNote::parseMultiParameterRamp(TiXmlElement *element)
 		ramp = ramp->NextSiblingElement("Ramp");
 	}
 	
+	checkRampLength("parseMultiParameterRamp()", numSegments);
 	return out;
 }
 
@@ -878,6 +1041,7 @@ void MidiNote::parseMultiParameterRampWithVelocity(TiXmlElement *element, vector
 	timedParameter emptyTp;			// timedParameter with no parameterValue elements
 	bool first = true;				
 	vector<double> val1, val2;
+	int numSegments = 0;
 	
 	while(ramp != NULL)		// These tags hold ramp values for time-variant parameters
 	{
@@ -952,12 +1116,15 @@ void MidiNote::parseMultiParameterRampWithVelocity(TiXmlElement *element, vector
 			
 			val1.clear();
 			val2.clear();
+			numSegments++;
 		}
 		else
 			cerr << "assignPllSynthParameters() warning: null attributes in Ramp tag\n";
 		
 		ramp = ramp->NextSiblingElement("Ramp");
 	}
+	
+	checkRampLength("parseMultiParameterRampWithVelocity()", numSegments);
 }
 
 vector<double> MidiNote::parseCommaSeparatedValues(const string& inString)
@@ -1065,8 +1232,229 @@ double MidiNote::strtod_with_suffix( const char * str )
 	return out;
 }
 
+#pragma mark Note Pool Methods
+
+MidiNote::NotePool::NotePool()
+{
+	notesAllocated_ = notesInUse_ = notesMissed_ = 0;
+	isRetired_ = false;
+	
+	if(pthread_mutex_init(&poolMutex_, NULL) != 0)
+		cerr << "Warning: Failed to initialize pool mutex in NotePool\n";
+}
+
+// Create enough notes for count to be playing (or waiting to be reclaimed) at once
+
+void MidiNote::NotePool::preallocateNotes(MidiNote *patch, int count)
+{
+	pthread_mutex_lock(&poolMutex_);
+	
+	freeNotes_.reserve(count);
+	while(notesAllocated_ < count)
+	{
+		MidiNote *note = patch->newNote();
+		
+		note->homePool_ = this;
+		note->synths_.reserve(patch->factories_.size());
+		note->voiceFactories_.reserve(patch->factories_.size());
+		freeNotes_.push_back(note);
+		notesAllocated_++;
+	}
+	
+	pthread_mutex_unlock(&poolMutex_);
+}
+
+MidiNote* MidiNote::NotePool::allocateNote(MidiNote *patch)
+{
+	MidiNote *note;
+	
+	pthread_mutex_lock(&poolMutex_);
+	if(freeNotes_.size() > 0)
+	{
+		note = freeNotes_.back();
+		freeNotes_.pop_back();
+	}
+	else
+	{
+		cerr << "Warning: note pool empty, allocating a new note\n";
+		note = patch->newNote();
+		note->homePool_ = this;
+		notesAllocated_++;
+		notesMissed_++;
+		freeNotes_.reserve(notesAllocated_);	// So the note can come back without allocating
+	}
+	notesInUse_++;
+	pthread_mutex_unlock(&poolMutex_);
+	
+	return note;
+}
+
+// Return a note to the pool.  Its synths must already have been released.
+
+void MidiNote::NotePool::releaseNote(MidiNote *note)
+{
+	bool shouldDelete;
+	
+	pthread_mutex_lock(&poolMutex_);
+	freeNotes_.push_back(note);
+	notesInUse_--;
+	shouldDelete = (isRetired_ && notesInUse_ == 0);
+	pthread_mutex_unlock(&poolMutex_);
+	
+	if(shouldDelete)		// Our patch went away while this note was playing
+		delete this;
+}
+
+void MidiNote::NotePool::retire()
+{
+	bool shouldDelete;
+	
+	pthread_mutex_lock(&poolMutex_);
+	isRetired_ = true;
+	shouldDelete = (notesInUse_ == 0);
+	pthread_mutex_unlock(&poolMutex_);
+	
+	if(shouldDelete)
+		delete this;
+}
+
+void MidiNote::NotePool::printNotePoolStatus(ostream& output)
+{
+	pthread_mutex_lock(&poolMutex_);
+	output << notesAllocated_ << " allocated, " << notesInUse_ << " in use, " << notesMissed_ << " allocated at note-on\n";
+	pthread_mutex_unlock(&poolMutex_);
+}
+
+MidiNote::NotePool::~NotePool()
+{
+	for(int i = 0; i < freeNotes_.size(); i++)
+		delete freeNotes_[i];
+	pthread_mutex_destroy(&poolMutex_);
+}
+
 #pragma mark Factory Methods
 
+MidiNote::SynthBaseFactory::SynthBaseFactory(MidiController *controller)
+{
+	controller_ = controller;
+	prototype_ = NULL;
+	voicesAllocated_ = voicesInUse_ = voicesHighWater_ = voicesMissed_ = 0;
+	isRetired_ = false;
+	velocityTablesBuilt_ = false;
+	velocityTableCurvature_ = 0.0;
+	velocityTableSize_ = 0;
+	
+	if(pthread_mutex_init(&poolMutex_, NULL) != 0)
+	{
+		cerr << "Warning: Failed to initialize pool mutex in SynthBaseFactory\n";
+		// Throw exception?
+	}
+#ifdef DEBUG_ALLOCATION
+	cout << "*** SynthBaseFactory\n"; 
+#endif
+}
+
+// Create the velocity tables, the prototype synth and enough voices to start count notes without allocating
+// anything.  More voices are allocated later if needed, and stay with the pool from then on.
+
+void MidiNote::SynthBaseFactory::preallocateVoices(int count, float velocityCurvature)
+{
+	pthread_mutex_lock(&poolMutex_);
+	
+	checkVelocityTables(velocityCurvature);
+	if(prototype_ == NULL)
+		prototype_ = newPrototype();
+	
+	freeVoices_.reserve(count);
+	while(voicesAllocated_ < count)
+	{
+		freeVoices_.push_back(newVoice());
+		voicesAllocated_++;
+	}
+	
+	pthread_mutex_unlock(&poolMutex_);
+}
+
+// Take a voice from the pool and reset it to match the prototype.  Only allocates memory if the pool is empty.
+
+SynthBase* MidiNote::SynthBaseFactory::allocateVoice()
+{
+	SynthBase *voice;
+	
+	if(prototype_ == NULL)			// preallocateVoices() was never called
+		prototype_ = newPrototype();
+	
+	if(freeVoices_.size() > 0)
+	{
+		voice = freeVoices_.back();
+		freeVoices_.pop_back();
+		resetVoice(voice);
+	}
+	else
+	{
+		cerr << "Warning: voice pool empty, allocating a new voice\n";
+		voice = newVoice();
+		voicesAllocated_++;
+		voicesMissed_++;
+		freeVoices_.reserve(voicesAllocated_);	// So the voice can come back without allocating
+	}
+	
+	if(++voicesInUse_ > voicesHighWater_)
+		voicesHighWater_ = voicesInUse_;
+	
+	return voice;
+}
+
+// Return a synth to the pool.  It must already be out of the render list.
+
+void MidiNote::SynthBaseFactory::releaseSynth(SynthBase *synth)
+{
+	bool shouldDelete;
+	
+	pthread_mutex_lock(&poolMutex_);
+	freeVoices_.push_back(synth);
+	voicesInUse_--;
+	shouldDelete = (isRetired_ && voicesInUse_ == 0);
+	pthread_mutex_unlock(&poolMutex_);
+	
+	if(shouldDelete)		// Our note went away while this synth was playing
+		delete this;
+}
+
+void MidiNote::SynthBaseFactory::retire()
+{
+	bool shouldDelete;
+	
+	pthread_mutex_lock(&poolMutex_);
+	isRetired_ = true;
+	shouldDelete = (voicesInUse_ == 0);
+	pthread_mutex_unlock(&poolMutex_);
+	
+	if(shouldDelete)
+		delete this;
+}
+
+void MidiNote::SynthBaseFactory::printVoicePoolStatus(ostream& output)
+{
+	pthread_mutex_lock(&poolMutex_);
+	output << voicesAllocated_ << " voices (" << voicesAllocated_*voiceSize()/1024 << " kB), " << voicesInUse_ << " in use, ";
+	output << "high-water mark " << voicesHighWater_ << ", " << voicesMissed_ << " allocated at note-on, ";
+	output << "velocity tables " << velocityTableSize_/1024 << " kB\n";
+	pthread_mutex_unlock(&poolMutex_);
+}
+
+MidiNote::SynthBaseFactory::~SynthBaseFactory()
+{
+#ifdef DEBUG_ALLOCATION
+	cout << "*** ~SynthBaseFactory\n";
+#endif
+	for(int i = 0; i < freeVoices_.size(); i++)
+		delete freeVoices_[i];
+	if(prototype_ != NULL)
+		delete prototype_;
+	pthread_mutex_destroy(&poolMutex_);
+}
+
 double MidiNote::SynthBaseFactory::transeg(double val1, double val2, double concavity, double velocity)
 {
 	// Given a low and high value, a concavity and a velocity, return a normalized value
@@ -1090,27 +1478,154 @@ double MidiNote::SynthBaseFactory::transeg(double val1, double val2, double conc
 	return out;
 }
 
-PllSynth* MidiNote::PllSynthFactory::createSynth(int note, int velocity, float velocityCurvature, float amplitudeOffset)
+double MidiNote::SynthBaseFactory::velocityRamp(timedParameter& ramp, paramHolder& low, paramHolder& high, double concavity,
+												double velocity)
+{
+	parameterValue pval;
+	int i;
+	
+	ramp.clear();
+	for(i = 0; i < min(low.ramp.size(), high.ramp.size()); i++)
+	{
+		pval.nextValue = transeg(low.ramp[i].nextValue, high.ramp[i].nextValue, concavity, velocity);
+		pval.duration = transeg(low.ramp[i].duration, high.ramp[i].duration, concavity, velocity);
+		pval.shape = low.ramp[i].shape;
+		ramp.push_back(pval);
+	}
+	
+	return transeg(low.start, high.start, concavity, velocity);
+}
+
+// Build the velocity tables for this curve, unless they were already built for it.  The patch's curve doesn't
+// change after loading, so this only does any work (and allocates memory) at note-on if preallocateVoices()
+// wasn't called.
+
+void MidiNote::SynthBaseFactory::checkVelocityTables(float velocityCurvature)
+{
+	if(velocityTablesBuilt_ && velocityCurvature == velocityTableCurvature_)
+		return;
+	
+	velocityTableSize_ = 0;
+	buildVelocityTables(velocityCurvature);
+	velocityTablesBuilt_ = true;
+	velocityTableCurvature_ = velocityCurvature;
+}
+
+void MidiNote::SynthBaseFactory::velocityTable(vector<paramHolder>& table, paramHolder& low, paramHolder& high, double concavity,
+											   float velocityCurvature)
+{
+	int velocity;
+	
+	table.resize(128);
+	for(velocity = 0; velocity < 128; velocity++)
+	{
+		double curvedVelocity = transeg(0.0, 127.0, velocityCurvature, (double)velocity);
+		paramHolder& entry = table[velocity];
+		
+		entry.start = velocityRamp(entry.ramp, low, high, concavity, curvedVelocity);
+		velocityTableSize_ += sizeof(paramHolder) + entry.ramp.size()*sizeof(parameterValue);
+	}
+}
+
+void MidiNote::SynthBaseFactory::velocityTable(vector<paramVectorHolder>& table, vector<paramHolder>& low, vector<paramHolder>& high,
+											   double concavity, float velocityCurvature)
+{
+	int velocity, j, size = min(low.size(), high.size());
+	
+	table.resize(128);
+	for(velocity = 0; velocity < 128; velocity++)
+	{
+		double curvedVelocity = transeg(0.0, 127.0, velocityCurvature, (double)velocity);
+		paramVectorHolder& entry = table[velocity];
+		
+		entry.values.resize(size);
+		entry.ramps.resize(size);
+		velocityTableSize_ += sizeof(paramVectorHolder) + size*(sizeof(double) + sizeof(timedParameter));
+		for(j = 0; j < size; j++)
+		{
+			entry.values[j] = velocityRamp(entry.ramps[j], low[j], high[j], concavity, curvedVelocity);
+			velocityTableSize_ += entry.ramps[j].size()*sizeof(parameterValue);
+		}
+	}
+}
+
+double MidiNote::SynthBaseFactory::scaledRamp(paramHolder& entry, double scale)
 {
-	PllSynth *out = new PllSynth(sampleRate_);		// Create a new synth object
-	float baseFreq = controller_->midiNoteToFrequency(note);
-	int i, j;
-	double start;
 	parameterValue pval;
-	timedParameter ramp;
-	vector<double> vd;
-	vector<timedParameter> vtp;
+	int i;
+	
+	scratchRamp_.clear();
+	for(i = 0; i < entry.ramp.size(); i++)
+	{
+		pval = entry.ramp[i];
+		pval.nextValue = scale*pval.nextValue;
+		scratchRamp_.push_back(pval);
+	}
+	
+	return scale*entry.start;
+}
+
+void MidiNote::SynthBaseFactory::scaledRamps(paramVectorHolder& entry, double scale)
+{
+	int j, size = entry.values.size();
+	
+	scratchValues_.resize(size);
+	if(scratchRamps_.size() < size)
+		scratchRamps_.resize(size);
+	
+	for(j = 0; j < size; j++)
+	{
+		timedParameter& ramp = scratchRamps_[j];
+		parameterValue pval;
+		int i;
+		
+		ramp.clear();
+		for(i = 0; i < entry.ramps[j].size(); i++)
+		{
+			pval = entry.ramps[j][i];
+			pval.nextValue = scale*pval.nextValue;
+			ramp.push_back(pval);
+		}
+		scratchValues_[j] = scale*entry.values[j];
+	}
+}
+
+// Take a voice from the pool and set it up for this note and velocity
+
+PllSynth* MidiNote::PllSynthFactory::createSynth(int note, int velocity, float velocityCurvature, float amplitudeOffset)
+{
+	PllSynth *out;
+	
+	velocity = max(0, min(velocity, 127));
+	
+	pthread_mutex_lock(&poolMutex_);
+	checkVelocityTables(velocityCurvature);
+	out = (PllSynth *)allocateVoice();
+	configureSynth(out, note, velocity, amplitudeOffset);
+	pthread_mutex_unlock(&poolMutex_);
 	
-	double curvedVelocity = transeg(0.0, 127.0, velocityCurvature, (double)velocity);
 #ifdef DEBUG_MESSAGES_EXTRA
-	cout << "Curved velocity: " << curvedVelocity << endl;
+	cout << *out;
 #endif
+	return out;
+}
+
+// The prototype holds the parameters that are the same for every note.  It is also configured for an
+// arbitrary note, so that it has as many harmonics, inputs, etc. as the voices will.
 
+SynthBase* MidiNote::PllSynthFactory::newPrototype()
+{
+	PllSynth *out = new PllSynth(sampleRate_);
+	
 	// Set non-ramping, non-velocity-sensitive parameters
 	if(useAmplitudeFeedbackActive_)
 		out->setUseAmplitudeFeedback(useAmplitudeFeedback_);
 	if(useInterferenceRejectionActive_)
 		out->setUseInterferenceRejection(useInterferenceRejection_);
+	if(smoothGlobalAmplitudeActive_)
+		out->setSmoothGlobalAmplitude(smoothGlobalAmplitude_);
+	if(useHarmonicAnalyzerActive_)
+		out->setUseHarmonicAnalyzer(useHarmonicAnalyzer_);
 	if(filterQActive_)
 		out->setFilterQ(filterQ_);
 	if(loopFilterPoleActive_)
@@ -1118,171 +1633,88 @@ PllSynth* MidiNote::PllSynthFactory::createSynth(int note, int velocity, float v
 	if(loopFilterZeroActive_)
 		out->setLoopFilterZero(loopFilterZero_);
 	
+	configureSynth(out, 60, 0, 1.0);
+	return out;
+}
+
+void MidiNote::PllSynthFactory::buildVelocityTables(float velocityCurvature)
+{
+	if(relativeFrequencyActive_)
+		velocityTable(relativeFrequencyTable_, relativeFrequencyMin_, relativeFrequencyMax_, relativeFrequencyConcavity_, velocityCurvature);
+	if(globalAmplitudeActive_)
+		velocityTable(globalAmplitudeTable_, globalAmplitudeMin_, globalAmplitudeMax_, globalAmplitudeConcavity_, velocityCurvature);
+	if(loopGainActive_)
+		velocityTable(loopGainTable_, loopGainMin_, loopGainMax_, loopGainConcavity_, velocityCurvature);
+	if(amplitudeFeedbackScalerActive_)
+		velocityTable(amplitudeFeedbackScalerTable_, amplitudeFeedbackScalerMin_, amplitudeFeedbackScalerMax_,
+					  amplitudeFeedbackScalerConcavity_, velocityCurvature);
+	
+	if(inputGainsActive_)
+		velocityTable(inputGainsTable_, inputGainsMin_, inputGainsMax_, inputGainsConcavity_, velocityCurvature);
+	if(inputDelaysActive_)
+		velocityTable(inputDelaysTable_, inputDelaysMin_, inputDelaysMax_, inputDelaysConcavity_, velocityCurvature);
+	if(harmonicAmplitudesActive_)
+		velocityTable(harmonicAmplitudesTable_, harmonicAmplitudesMin_, harmonicAmplitudesMax_, harmonicAmplitudesConcavity_,
+					  velocityCurvature);
+	if(harmonicPhasesActive_)
+		velocityTable(harmonicPhasesTable_, harmonicPhasesMin_, harmonicPhasesMax_, harmonicPhasesConcavity_, velocityCurvature);
+}
+
+// Set the parameters that depend on note and velocity.  Called with poolMutex_ held, since this uses the
+// scratch storage.  Parameters that depend only on velocity come straight from the tables.
+
+void MidiNote::PllSynthFactory::configureSynth(PllSynth *out, int note, int velocity, float amplitudeOffset)
+{
+	float baseFreq = controller_->midiNoteToFrequency(note);
+	double start;
+	
 	// Set single velocity-sensitive, ramping parameters
 	if(globalAmplitudeActive_)
 	{
-		start = amplitudeOffset*transeg(globalAmplitudeMin_.start, globalAmplitudeMax_.start, globalAmplitudeConcavity_, curvedVelocity);
-		for(i = 0; i < min(globalAmplitudeMin_.ramp.size(), globalAmplitudeMax_.ramp.size()); i++)
-		{
-			pval.nextValue = amplitudeOffset*transeg(globalAmplitudeMin_.ramp[i].nextValue, globalAmplitudeMax_.ramp[i].nextValue,
-									 globalAmplitudeConcavity_, curvedVelocity);
-			pval.duration = transeg(globalAmplitudeMin_.ramp[i].duration, globalAmplitudeMax_.ramp[i].duration,
-									globalAmplitudeConcavity_, curvedVelocity);
-			pval.shape = globalAmplitudeMin_.ramp[i].shape;
-			ramp.push_back(pval);
-		}
-		out->setGlobalAmplitude(start, ramp);
-		ramp.clear();
+		start = scaledRamp(globalAmplitudeTable_[velocity], amplitudeOffset);
+		out->setGlobalAmplitude(start, scratchRamp_);
 	}
 	else
 	{
 		start = amplitudeOffset*0.1;	// Default amplitude value includes calibration data
-		ramp.clear();
-		
-		out->setGlobalAmplitude(start, ramp);
+		out->setGlobalAmplitude(start, emptyRamp_);
 	}
 	if(loopGainActive_)
-	{
-		start = transeg(loopGainMin_.start, loopGainMax_.start, loopGainConcavity_, curvedVelocity);
-		for(i = 0; i < min(loopGainMin_.ramp.size(), loopGainMax_.ramp.size()); i++)
-		{
-			pval.nextValue = transeg(loopGainMin_.ramp[i].nextValue, loopGainMax_.ramp[i].nextValue,
-									 loopGainConcavity_, curvedVelocity);
-			pval.duration = transeg(loopGainMin_.ramp[i].duration, loopGainMax_.ramp[i].duration,
-									loopGainConcavity_, curvedVelocity);
-			pval.shape = loopGainMin_.ramp[i].shape;
-			ramp.push_back(pval);
-		}
-		out->setLoopGain(start, ramp);
-		ramp.clear();
-	}
+		out->setLoopGain(loopGainTable_[velocity].start, loopGainTable_[velocity].ramp);
 	if(amplitudeFeedbackScalerActive_)
-	{
-		start = transeg(amplitudeFeedbackScalerMin_.start, amplitudeFeedbackScalerMax_.start, amplitudeFeedbackScalerConcavity_, curvedVelocity);
-		for(i = 0; i < min(amplitudeFeedbackScalerMin_.ramp.size(), amplitudeFeedbackScalerMax_.ramp.size()); i++)
-		{
-			pval.nextValue = transeg(amplitudeFeedbackScalerMin_.ramp[i].nextValue, amplitudeFeedbackScalerMax_.ramp[i].nextValue,
-									 amplitudeFeedbackScalerConcavity_, curvedVelocity);
-			pval.duration = transeg(amplitudeFeedbackScalerMin_.ramp[i].duration, amplitudeFeedbackScalerMax_.ramp[i].duration,
-									amplitudeFeedbackScalerConcavity_, curvedVelocity);
-			pval.shape = amplitudeFeedbackScalerMin_.ramp[i].shape;
-			ramp.push_back(pval);
-		}
-		out->setAmplitudeFeedbackScaler(start, ramp);
-		ramp.clear();
-	}		
+		out->setAmplitudeFeedbackScaler(amplitudeFeedbackScalerTable_[velocity].start, amplitudeFeedbackScalerTable_[velocity].ramp);
 	
 	// Set vector ramping parameters (also velocity sensitive)
 	if(inputGainsActive_)
-	{
-		for(j = 0; j < min(inputGainsMin_.size(), inputGainsMax_.size()); j++)
-		{
-			start = transeg(inputGainsMin_[j].start, inputGainsMax_[j].start, inputGainsConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(inputGainsMin_[j].ramp.size(), inputGainsMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = transeg(inputGainsMin_[j].ramp[i].nextValue, inputGainsMax_[j].ramp[i].nextValue,
-										 inputGainsConcavity_, curvedVelocity);
-				pval.duration = transeg(inputGainsMin_[j].ramp[i].duration, inputGainsMax_[j].ramp[i].duration,
-										inputGainsConcavity_, curvedVelocity);
-				pval.shape = inputGainsMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setInputGains(vd, vtp);
-		vd.clear();
-		vtp.clear();
-	}
+		out->setInputGains(inputGainsTable_[velocity].values, inputGainsTable_[velocity].ramps);
 	if(inputDelaysActive_)
-	{
-		for(j = 0; j < min(inputDelaysMin_.size(), inputDelaysMax_.size()); j++)
-		{
-			start = transeg(inputDelaysMin_[j].start, inputDelaysMax_[j].start, inputDelaysConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(inputDelaysMin_[j].ramp.size(), inputDelaysMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = transeg(inputDelaysMin_[j].ramp[i].nextValue, inputDelaysMax_[j].ramp[i].nextValue,
-										 inputDelaysConcavity_, curvedVelocity);
-				pval.duration = transeg(inputDelaysMin_[j].ramp[i].duration, inputDelaysMax_[j].ramp[i].duration,
-										inputDelaysConcavity_, curvedVelocity);
-				pval.shape = inputDelaysMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setInputDelays(vd, vtp);
-		vd.clear();
-		vtp.clear();
-	}	
+		out->setInputDelays(inputDelaysTable_[velocity].values, inputDelaysTable_[velocity].ramps);
 	if(harmonicAmplitudesActive_)
-	{
-		for(j = 0; j < min(harmonicAmplitudesMin_.size(), harmonicAmplitudesMax_.size()); j++)
-		{
-			start = transeg(harmonicAmplitudesMin_[j].start, harmonicAmplitudesMax_[j].start, harmonicAmplitudesConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(harmonicAmplitudesMin_[j].ramp.size(), harmonicAmplitudesMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = transeg(harmonicAmplitudesMin_[j].ramp[i].nextValue, harmonicAmplitudesMax_[j].ramp[i].nextValue,
-										 harmonicAmplitudesConcavity_, curvedVelocity);
-				pval.duration = transeg(harmonicAmplitudesMin_[j].ramp[i].duration, harmonicAmplitudesMax_[j].ramp[i].duration,
-										harmonicAmplitudesConcavity_, curvedVelocity);
-				pval.shape = harmonicAmplitudesMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setHarmonicAmplitudes(vd, vtp);
-		vd.clear();
-		vtp.clear();
-	}	
+		out->setHarmonicAmplitudes(harmonicAmplitudesTable_[velocity].values, harmonicAmplitudesTable_[velocity].ramps);
 	if(harmonicPhasesActive_)
-	{
-		for(j = 0; j < min(harmonicPhasesMin_.size(), harmonicPhasesMax_.size()); j++)
-		{
-			start = transeg(harmonicPhasesMin_[j].start, harmonicPhasesMax_[j].start, harmonicPhasesConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(harmonicPhasesMin_[j].ramp.size(), harmonicPhasesMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = transeg(harmonicPhasesMin_[j].ramp[i].nextValue, harmonicPhasesMax_[j].ramp[i].nextValue,
-										 harmonicPhasesConcavity_, curvedVelocity);
-				pval.duration = transeg(harmonicPhasesMin_[j].ramp[i].duration, harmonicPhasesMax_[j].ramp[i].duration,
-										harmonicPhasesConcavity_, curvedVelocity);
-				pval.shape = harmonicPhasesMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setHarmonicPhases(vd, vtp);
-		vd.clear();
-		vtp.clear();
-	}
+		out->setHarmonicPhases(harmonicPhasesTable_[velocity].values, harmonicPhasesTable_[velocity].ramps);
 	
 	// Set center frequency, which depends on both note and velocity
 	if(relativeFrequencyActive_)
 	{
-		start = baseFreq*transeg(relativeFrequencyMin_.start, relativeFrequencyMax_.start, relativeFrequencyConcavity_, curvedVelocity);
-		for(i = 0; i < min(relativeFrequencyMin_.ramp.size(), relativeFrequencyMax_.ramp.size()); i++)
-		{
-			pval.nextValue = baseFreq*transeg(relativeFrequencyMin_.ramp[i].nextValue, relativeFrequencyMax_.ramp[i].nextValue,
-									 relativeFrequencyConcavity_, curvedVelocity);
-			pval.duration = transeg(relativeFrequencyMin_.ramp[i].duration, relativeFrequencyMax_.ramp[i].duration,
-									relativeFrequencyConcavity_, curvedVelocity);
-			pval.shape = relativeFrequencyMin_.ramp[i].shape;
-			ramp.push_back(pval);
-		}
-		out->setCenterFrequency(start, ramp);
-		ramp.clear();
+		start = scaledRamp(relativeFrequencyTable_[velocity], baseFreq);
+		out->setCenterFrequency(start, scratchRamp_);
 	}
 	else
-	{
-		ramp.clear();
-		out->setCenterFrequency(baseFreq, ramp);
-	}
+		out->setCenterFrequency(baseFreq, emptyRamp_);
+}
+
+NoiseSynth* MidiNote::NoiseSynthFactory::createSynth(int note, int velocity, float velocityCurvature, float amplitudeOffset)
+{
+	NoiseSynth *out;
+	
+	velocity = max(0, min(velocity, 127));
+	
+	pthread_mutex_lock(&poolMutex_);
+	checkVelocityTables(velocityCurvature);
+	out = (NoiseSynth *)allocateVoice();
+	configureSynth(out, note, velocity, amplitudeOffset);
+	pthread_mutex_unlock(&poolMutex_);
 	
 #ifdef DEBUG_MESSAGES_EXTRA
 	cout << *out;
@@ -1290,113 +1722,53 @@ PllSynth* MidiNote::PllSynthFactory::createSynth(int note, int velocity, float v
 	return out;
 }
 
-NoiseSynth* MidiNote::NoiseSynthFactory::createSynth(int note, int velocity, float velocityCurvature, float amplitudeOffset)
+SynthBase* MidiNote::NoiseSynthFactory::newPrototype()
 {
-	NoiseSynth *out = new NoiseSynth(sampleRate_);		// Create a new synth object	
+	NoiseSynth *out = new NoiseSynth(sampleRate_);
 	
+	configureSynth(out, 60, 0, 1.0);
+	return out;
+}
+
+void MidiNote::NoiseSynthFactory::buildVelocityTables(float velocityCurvature)
+{
+	if(globalAmplitudeActive_)
+		velocityTable(globalAmplitudeTable_, globalAmplitudeMin_, globalAmplitudeMax_, globalAmplitudeConcavity_, velocityCurvature);
+	if(filterFrequenciesActive_)
+		velocityTable(filterFrequenciesTable_, filterFrequenciesMin_, filterFrequenciesMax_, filterFrequenciesConcavity_, velocityCurvature);
+	if(filterQsActive_)
+		velocityTable(filterQsTable_, filterQsMin_, filterQsMax_, filterQsConcavity_, velocityCurvature);
+	if(filterAmplitudesActive_)
+		velocityTable(filterAmplitudesTable_, filterAmplitudesMin_, filterAmplitudesMax_, filterAmplitudesConcavity_, velocityCurvature);
+}
+
+void MidiNote::NoiseSynthFactory::configureSynth(NoiseSynth *out, int note, int velocity, float amplitudeOffset)
+{
 	float baseFreq = controller_->midiNoteToFrequency(note);
-	int i, j;
 	double start;
-	parameterValue pval;
-	timedParameter ramp;
-	vector<double> vd;
-	vector<timedParameter> vtp;
 	
-	double curvedVelocity = transeg(0.0, 127.0, velocityCurvature, (double)velocity);
-#ifdef DEBUG_MESSAGES
-	cout << "Curved velocity: " << curvedVelocity << endl;
-#endif
+	// Set non-ramping, non-velocity-sensitive parameters
+	if(useGaussianNoiseActive_)
+		out->setUseGaussianNoise(useGaussianNoise_);
 	
 	// Set single velocity-sensitive, ramping parameters
 	if(globalAmplitudeActive_)
 	{
-		start = amplitudeOffset*transeg(globalAmplitudeMin_.start, globalAmplitudeMax_.start, globalAmplitudeConcavity_, curvedVelocity);
-		for(i = 0; i < min(globalAmplitudeMin_.ramp.size(), globalAmplitudeMax_.ramp.size()); i++)
-		{
-			pval.nextValue = amplitudeOffset*transeg(globalAmplitudeMin_.ramp[i].nextValue, globalAmplitudeMax_.ramp[i].nextValue,
-									 globalAmplitudeConcavity_, curvedVelocity);
-			pval.duration = transeg(globalAmplitudeMin_.ramp[i].duration, globalAmplitudeMax_.ramp[i].duration,
-									globalAmplitudeConcavity_, curvedVelocity);
-			pval.shape = globalAmplitudeMin_.ramp[i].shape;
-			ramp.push_back(pval);
-		}
-		out->setGlobalAmplitude(start, ramp);
-		ramp.clear();
+		start = scaledRamp(globalAmplitudeTable_[velocity], amplitudeOffset);
+		out->setGlobalAmplitude(start, scratchRamp_);
 	}	
 
 	if(filterFrequenciesActive_)		// Normal filter frequencies to base frequency of the note
 	{
-		for(j = 0; j < min(filterFrequenciesMin_.size(), filterFrequenciesMax_.size()); j++)
-		{
-			start = baseFreq*transeg(filterFrequenciesMin_[j].start, filterFrequenciesMax_[j].start, filterFrequenciesConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(filterFrequenciesMin_[j].ramp.size(), filterFrequenciesMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = baseFreq*transeg(filterFrequenciesMin_[j].ramp[i].nextValue, filterFrequenciesMax_[j].ramp[i].nextValue,
-										 filterFrequenciesConcavity_, curvedVelocity);
-				pval.duration = transeg(filterFrequenciesMin_[j].ramp[i].duration, filterFrequenciesMax_[j].ramp[i].duration,
-										filterFrequenciesConcavity_, curvedVelocity);
-				pval.shape = filterFrequenciesMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setFilterFrequencies(vd, vtp);
-		vd.clear();
-		vtp.clear();
+		scaledRamps(filterFrequenciesTable_[velocity], baseFreq);
+		out->setFilterFrequencies(scratchValues_, scratchRamps_);
 	}	
 	// else do nothing-- no filters = plain white noise
 	
 	if(filterQsActive_)
-	{
-		for(j = 0; j < min(filterQsMin_.size(), filterQsMax_.size()); j++)
-		{
-			start = transeg(filterQsMin_[j].start, filterQsMax_[j].start, filterQsConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(filterQsMin_[j].ramp.size(), filterQsMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = transeg(filterQsMin_[j].ramp[i].nextValue, filterQsMax_[j].ramp[i].nextValue,
-										 filterQsConcavity_, curvedVelocity);
-				pval.duration = transeg(filterQsMin_[j].ramp[i].duration, filterQsMax_[j].ramp[i].duration,
-										filterQsConcavity_, curvedVelocity);
-				pval.shape = filterQsMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setFilterQs(vd, vtp);
-		vd.clear();
-		vtp.clear();
-	}	
+		out->setFilterQs(filterQsTable_[velocity].values, filterQsTable_[velocity].ramps);
 	if(filterAmplitudesActive_)
-	{
-		for(j = 0; j < min(filterAmplitudesMin_.size(), filterAmplitudesMax_.size()); j++)
-		{
-			start = transeg(filterAmplitudesMin_[j].start, filterAmplitudesMax_[j].start, filterAmplitudesConcavity_, curvedVelocity);
-			vd.push_back(start);
-			for(i = 0; i < min(filterAmplitudesMin_[j].ramp.size(), filterAmplitudesMax_[j].ramp.size()); i++)
-			{
-				pval.nextValue = transeg(filterAmplitudesMin_[j].ramp[i].nextValue, filterAmplitudesMax_[j].ramp[i].nextValue,
-										 filterAmplitudesConcavity_, curvedVelocity);
-				pval.duration = transeg(filterAmplitudesMin_[j].ramp[i].duration, filterAmplitudesMax_[j].ramp[i].duration,
-										filterAmplitudesConcavity_, curvedVelocity);
-				pval.shape = filterAmplitudesMin_[j].ramp[i].shape;
-				ramp.push_back(pval);
-			}			
-			vtp.push_back(ramp);
-			ramp.clear();
-		}
-		out->setFilterAmplitudes(vd, vtp);
-		vd.clear();
-		vtp.clear();
-	}		
-	
-#ifdef DEBUG_MESSAGES_EXTRA
-	cout << *out;
-#endif
-	return out;
+		out->setFilterAmplitudes(filterAmplitudesTable_[velocity].values, filterAmplitudesTable_[velocity].ramps);
 }
 
 #pragma mark CalibratorNote
@@ -1604,7 +1976,8 @@ CalibratorNote* CalibratorNote::createNote(int audioChannel, int mrpChannel, int
 			continue;
 		PllSynth *newSynth = new PllSynth(*(PllSynth *)synths_[i]);
 		
-		newSynth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel);
+		newSynth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel,
+										render_->inputHistory());
 		newSynth->setCenterFrequency(baseFreq, emptyParam);
 		newSynth->setGlobalAmplitude(calibratorGlobalAmplitude_*amplitudeOffset, emptyParam);
 		newSynth->setPhaseOffset(phaseOffset, emptyParam);
@@ -1803,7 +2176,8 @@ ResonanceNote* ResonanceNote::createNote(int audioChannel, int mrpChannel, int m
 			continue;
 		
 		ResonanceSynth *newSynth = new ResonanceSynth(*(ResonanceSynth *)synths_[i]);
-		newSynth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel);
+		newSynth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel,
+										render_->inputHistory());
 		
 		out->synths_.push_back(newSynth);
 	}
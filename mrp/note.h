@@ -79,9 +79,10 @@ public:
 	virtual void release() { abort(); }						
 	virtual void releaseDamperDown() { abort(); }					
 	virtual void abort() { 
-		if(isRunning_)
-			controller_->noteEnded(this, key_);
+		if(!isRunning_)
+			return;
 		isRunning_ = false;
+		controller_->noteEnded(this, key_);
 	}								
 	
 	// This method is called from an external thread to check whether the note is finished.  Should return true if all
@@ -90,6 +91,16 @@ public:
 	
 	virtual bool isFinished() { return true; }	
 	
+	// Once a note has ended, the controller keeps it until this returns true, meaning the render thread can no longer
+	// be using any part of it.  Notes whose synths are removed without waiting should override this.
+	
+	virtual bool isReclaimable() { return true; }
+	
+	// The controller calls this instead of delete once it's done with a note.  Notes that came from a pool go
+	// back to it rather than being deleted.
+	
+	virtual void reclaim() { delete this; }
+	
 	// MIDI data methods: these are called whenever relevant MIDI data comes in.  The Note object can call a filter method
 	// in MidiController to set which messages it wants to receive.  By default, these methods do nothing
 	
@@ -130,11 +141,14 @@ protected:
 	class SynthBaseFactory;
 	class PllSynthFactory;
 	class NoiseSynthFactory;
+	class NotePool;
 	
 public:
 	MidiNote(MidiController *controller, AudioRender *render) : Note(controller, render) { 
 		isReleasing_ = false;
 		velocityCurve_ = 0.0;
+		removalEpoch_ = 0;
+		notePool_ = homePool_ = NULL;
 #ifdef DEBUG_ALLOCATION
 		cout << "*** MidiNote\n"; 
 #endif
@@ -153,6 +167,8 @@ public:
 	void abort();									// releaseDamperDown() also calls abort()
 	
 	bool isFinished();								// Whether all our synths are finished...
+	bool isReclaimable();							// Whether the render thread has let go of our synths
+	void reclaim();									// Return a created note to its patch's pool
 	
 	// begin: inserts the synths into the audiorender queue
 	// release, releaseDamperDown, abort: tells all synths to release now, and removes them from the queue
@@ -167,6 +183,10 @@ public:
 	MidiNote* createNote(int audioChannel, int mrpChannel, int midiNote, int midiChannel, int pianoString, unsigned int key,
 						 int priority, int velocity, float phaseOffset, float amplitudeOffset);
 	
+	// Print the size, usage and high-water mark of each synth factory's voice pool
+	void printVoicePoolStatus(ostream& output);
+	long velocityTableSize();						// Bytes taken by the factories' velocity tables
+	
 	~MidiNote();
 
 	// Text parsers -- eventually move this to a separate class?
@@ -185,6 +205,12 @@ protected:
 	void assignPllSynthParameters(PllSynthFactory *factory, TiXmlElement *element);
 	void assignNoiseSynthParameters(NoiseSynthFactory *factory, TiXmlElement *element);
 	
+	// createNote() takes an unused note of the right type from notePool_ and resets it, rather than allocating.
+	// Subclasses with their own createNote() override newNote() so the pool holds notes of their type.
+	virtual MidiNote* newNote() { return new MidiNote(controller_, render_); }
+	MidiNote* allocateNote();
+	void releaseSynths();							// Hand our synths back to their factories' voice pools
+	
 	
 	// ***** Private Variables ******
 	vector<SynthBase*> synths_;						// These are the Synth objects that will do the audio rendering.
@@ -192,6 +218,13 @@ protected:
 	vector<SynthBaseFactory*> factories_;			// These are special containers that hold a range of possible
 													// parameter values for each synth.  When createNote() is called a new
 													// MidiNote is created which holds synths instead of factories.
+	vector<SynthBaseFactory*> voiceFactories_;		// In a created note, the factory each synth came from, so it can
+													// go back to that factory's voice pool when the note is deleted.
+	static timedParameter emptyRamp_;				// For setting values with no ramp; never modified
+	unsigned int removalEpoch_;						// Render command sequence after which abort()'s removals are complete
+	vector<SynthBase*> pendingRemovals_;			// Synths whose removal abort() couldn't queue, still rendering
+	NotePool *notePool_;							// In a patch, where createNote() gets its notes
+	NotePool *homePool_;							// In a created note, the pool reclaim() returns it to
 
 	int velocity_;									// MIDI velocity number
 	string name_;									// The name of this patch
@@ -209,44 +242,104 @@ protected:
 		timedParameter ramp;			// objects, but we don't want all that baggage here.
 	} paramHolder;
 	
+	typedef struct {		// A vector parameter, in the form the synths take it
+		vector<double> values;
+		vector<timedParameter> ramps;
+	} paramVectorHolder;
+	
 	class SynthBaseFactory	// Make all members public, but only MidiNote can see them since the class is private
 	{
 	public:
-		SynthBaseFactory(MidiController *controller) { 
-			controller_ = controller; 
-#ifdef DEBUG_ALLOCATION
-			cout << "*** SynthBaseFactory\n"; 
-#endif
-		}
+		SynthBaseFactory(MidiController *controller);
 		float sampleRate_;	
 		
-		// This creates a new object and returns it.  The object will eventually need to be deleted elsewhere.
+		// Synths come from a pool of preallocated voices, so that starting a note doesn't allocate memory.
+		// Each voice is reset from a prototype synth holding everything that doesn't depend on the note
+		// or velocity; createSynth() then fills in the rest.  The synth goes back to the pool with
+		// releaseSynth() once it has been removed from the render list.
 		virtual SynthBase* createSynth(int note, int velocity, float velocityCurvature, 
-									   float amplitudeOffset) { return new SynthBase(sampleRate_); }
-		virtual ~SynthBaseFactory() { 
-#ifdef DEBUG_ALLOCATION
-			cout << "*** ~SynthBaseFactory\n";
-#endif
-		}
+									   float amplitudeOffset) { return NULL; }
+		void releaseSynth(SynthBase *synth);
+		
+		// Build the velocity tables and the prototype, and fill the pool.  Call once all the parameters have
+		// been assigned.
+		void preallocateVoices(int count, float velocityCurvature);
+		
+		// Use this instead of delete.  Synths still in use are returned here later, so the factory only goes
+		// away once the last of them comes back.
+		void retire();
+		
+		void printVoicePoolStatus(ostream& output);
+		long velocityTableSize() { return velocityTableSize_; }		// In bytes
+		
 	protected:
+		virtual ~SynthBaseFactory();	// See retire()
+		
+		// Each subclass resolves its velocity-sensitive parameters for all 128 velocities ahead of time, so
+		// that createSynth() only has to look them up.  Call with poolMutex_ held.
+		virtual void buildVelocityTables(float velocityCurvature) {}
+		void checkVelocityTables(float velocityCurvature);
+		
+		// Each subclass creates and resets voices of its own synth type
+		virtual SynthBase* newPrototype() { return new SynthBase(sampleRate_); }
+		virtual SynthBase* newVoice() { return new SynthBase(*prototype_); }
+		virtual void resetVoice(SynthBase *voice) { *voice = *prototype_; }
+		virtual int voiceSize() { return sizeof(SynthBase); }
+		
+		SynthBase* allocateVoice();		// Call with poolMutex_ held
+		
 		// This function calculates a user-defined curve similar to csound's transeg opcode
 		double transeg(double val1, double val2, double concavity, double velocity);
 		
+		// Fill in ramp with the values of a parameter for this velocity and return its starting value.  The
+		// storage already in ramp is reused.
+		double velocityRamp(timedParameter& ramp, paramHolder& low, paramHolder& high, double concavity,
+							double velocity);
+		
+		// Fill in table with a parameter for each velocity, curved by velocityCurvature
+		void velocityTable(vector<paramHolder>& table, paramHolder& low, paramHolder& high, double concavity,
+						   float velocityCurvature);
+		void velocityTable(vector<paramVectorHolder>& table, vector<paramHolder>& low, vector<paramHolder>& high,
+						   double concavity, float velocityCurvature);
+		
+		// Copy a table entry into scratchRamp_ (or scratchValues_ and scratchRamps_) with its values multiplied
+		// by scale, for parameters which also depend on the note.  Returns the starting value.
+		double scaledRamp(paramHolder& entry, double scale);
+		void scaledRamps(paramVectorHolder& entry, double scale);
+		
 		MidiController *controller_;
+		
+		SynthBase *prototype_;
+		vector<SynthBase*> freeVoices_;
+		int voicesAllocated_;			// Total voices belonging to this factory
+		int voicesInUse_;
+		int voicesHighWater_;			// Most voices ever in use at once
+		int voicesMissed_;				// Times the pool was empty and a voice had to be allocated at note-on
+		bool isRetired_;
+		pthread_mutex_t poolMutex_;		// Protects the pool and the scratch storage below
+		
+		// Scratch storage for createSynth(), kept between calls so that its memory is reused
+		timedParameter scratchRamp_;
+		vector<double> scratchValues_;
+		vector<timedParameter> scratchRamps_;	// Only ever grows; the synths use scratchValues_.size()
+		
+		bool velocityTablesBuilt_;
+		float velocityTableCurvature_;	// Velocity curve the tables were built for
+		long velocityTableSize_;
 	};
 	
 	class PllSynthFactory : public SynthBaseFactory
 	{
 	public:								
 		PllSynthFactory(MidiController *controller) : SynthBaseFactory(controller), useAmplitudeFeedbackActive_(false),
-		  useInterferenceRejectionActive_(false), filterQActive_(false), loopFilterPoleActive_(false), loopFilterZeroActive_(false),
+		  useInterferenceRejectionActive_(false), smoothGlobalAmplitudeActive_(false), useHarmonicAnalyzerActive_(false), filterQActive_(false), loopFilterPoleActive_(false), loopFilterZeroActive_(false),
 		  relativeFrequencyActive_(false), globalAmplitudeActive_(false), loopGainActive_(false), amplitudeFeedbackScalerActive_(false),
 		  inputGainsActive_(false), inputDelaysActive_(false), harmonicAmplitudesActive_(false), harmonicPhasesActive_(false) {}
 		
 		// Non-ramping (non-velocity-sensitive) parameters
-		bool useAmplitudeFeedback_, useInterferenceRejection_;
+		bool useAmplitudeFeedback_, useInterferenceRejection_, smoothGlobalAmplitude_, useHarmonicAnalyzer_;
 		float filterQ_, loopFilterPole_, loopFilterZero_;
-		bool useAmplitudeFeedbackActive_, useInterferenceRejectionActive_, filterQActive_, loopFilterPoleActive_, loopFilterZeroActive_;
+		bool useAmplitudeFeedbackActive_, useInterferenceRejectionActive_, smoothGlobalAmplitudeActive_, useHarmonicAnalyzerActive_, filterQActive_, loopFilterPoleActive_, loopFilterZeroActive_;
 		
 		// Single ramping parameters
 		paramHolder relativeFrequencyMin_, relativeFrequencyMax_;	// Substitutes for centerFrequency until we know MIDI note
@@ -265,13 +358,31 @@ protected:
 		float inputGainsConcavity_, inputDelaysConcavity_, harmonicAmplitudesConcavity_, harmonicPhasesConcavity_;
 		
 		PllSynth* createSynth(int note, int velocity, float velocityCurvature, float amplitudeOffset);
+		
+	protected:
+		SynthBase* newPrototype();
+		SynthBase* newVoice() { return new PllSynth(*(PllSynth *)prototype_); }
+		void resetVoice(SynthBase *voice) { *(PllSynth *)voice = *(PllSynth *)prototype_; }
+		int voiceSize() { return sizeof(PllSynth); }
+		
+		void buildVelocityTables(float velocityCurvature);
+		void configureSynth(PllSynth *out, int note, int velocity, float amplitudeOffset);
+		
+		// Parameters for each velocity, before scaling by calibration (globalAmplitude) or note frequency
+		// (relativeFrequency)
+		vector<paramHolder> relativeFrequencyTable_, globalAmplitudeTable_, loopGainTable_, amplitudeFeedbackScalerTable_;
+		vector<paramVectorHolder> inputGainsTable_, inputDelaysTable_, harmonicAmplitudesTable_, harmonicPhasesTable_;
 	};
 	
 	class NoiseSynthFactory : public SynthBaseFactory
 	{
 	public:
-		NoiseSynthFactory(MidiController *controller) : SynthBaseFactory(controller), globalAmplitudeActive_(false),
-		  filterFrequenciesActive_(false), filterQsActive_(false), filterAmplitudesActive_(false) {}
+		NoiseSynthFactory(MidiController *controller) : SynthBaseFactory(controller), useGaussianNoiseActive_(false),
+		  globalAmplitudeActive_(false), filterFrequenciesActive_(false), filterQsActive_(false), filterAmplitudesActive_(false) {}
+		
+		// Non-ramping, non-velocity-sensitive parameters
+		bool useGaussianNoise_;
+		bool useGaussianNoiseActive_;
 		
 		// Single ramping parameters
 		paramHolder globalAmplitudeMin_, globalAmplitudeMax_;
@@ -286,6 +397,45 @@ protected:
 		float filterFrequenciesConcavity_, filterQsConcavity_, filterAmplitudesConcavity_;
 	
 		NoiseSynth* createSynth(int note, int velocity, float velocityCurvature, float amplitudeOffset);
+		
+	protected:
+		SynthBase* newPrototype();
+		SynthBase* newVoice() { return new NoiseSynth(*(NoiseSynth *)prototype_); }
+		void resetVoice(SynthBase *voice) { *(NoiseSynth *)voice = *(NoiseSynth *)prototype_; }
+		int voiceSize() { return sizeof(NoiseSynth); }
+		
+		void buildVelocityTables(float velocityCurvature);
+		void configureSynth(NoiseSynth *out, int note, int velocity, float amplitudeOffset);
+		
+		// Parameters for each velocity, before scaling by calibration (globalAmplitude) or note frequency
+		// (filterFrequencies)
+		vector<paramHolder> globalAmplitudeTable_;
+		vector<paramVectorHolder> filterFrequenciesTable_, filterQsTable_, filterAmplitudesTable_;
+	};
+	
+	// Created notes are pooled like the synth voices, so that note-on only resets and configures existing
+	// objects.  Like a factory, the pool outlives its patch until the last of its notes has been reclaimed.
+	class NotePool
+	{
+	public:
+		NotePool();
+		
+		void preallocateNotes(MidiNote *patch, int count);
+		MidiNote* allocateNote(MidiNote *patch);	// Only allocates memory if the pool is empty
+		void releaseNote(MidiNote *note);
+		void retire();							// Use this instead of delete
+		
+		void printNotePoolStatus(ostream& output);
+		
+	protected:
+		~NotePool();							// See retire()
+		
+		vector<MidiNote*> freeNotes_;
+		int notesAllocated_;					// Total notes belonging to this pool
+		int notesInUse_;
+		int notesMissed_;						// Times the pool was empty and a note had to be allocated at note-on
+		bool isRetired_;
+		pthread_mutex_t poolMutex_;				// Protects everything above
 	};
 };
 
@@ -0,0 +1,538 @@
+/*
+ *  offlinerender.cpp
+ *  mrp
+ *
+ */
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/time.h>
+#include "offlinerender.h"
+#include "config.h"
+
+#define OFFLINE_NOISE_SEED	0x4E4F4953		// Seed for the noise input
+
+OfflineRender::OfflineRender(AudioRender *render, MidiController *midiController, OscController *oscController)
+: render_(render), midiController_(midiController), oscController_(oscController), inputNoise_(OFFLINE_NOISE_SEED)
+{
+	inputType_ = kInputSilence;
+	inputFrequency_ = 0.0;
+	inputAmplitude_ = 0.0;
+	inputPhase_ = 0.0;
+	inputFileChannels_ = 0;
+	inputFilePosition_ = 0;
+}
+
+// Read a list of timestamped events from a text file.  See offlinerender.h for the format.
+
+int OfflineRender::loadEventFile(const string& filename)
+{
+	ifstream inFile(filename.c_str());
+	string line;
+	int lineNumber = 0;
+
+	if(!inFile.is_open())
+	{
+		cerr << "Error: unable to open event file '" << filename << "'\n";
+		return 1;
+	}
+
+	events_.clear();
+
+	while(getline(inFile, line))
+	{
+		stringstream s(line);
+		string typeString, token;
+		offlineEvent event;
+
+		lineNumber++;
+		if(!(s >> event.time))			// Blank line or comment
+			continue;
+		if(!(s >> typeString))
+		{
+			cerr << "Warning: missing event type on line " << lineNumber << endl;
+			continue;
+		}
+
+		if(typeString == "midi")
+		{
+			event.type = kEventMidi;
+			if(!(s >> event.inputNumber))
+			{
+				cerr << "Warning: missing MIDI input number on line " << lineNumber << endl;
+				continue;
+			}
+			while(s >> token)
+				event.midi.push_back((unsigned char)strtol(token.c_str(), NULL, 0));
+			if(event.midi.size() == 0)
+			{
+				cerr << "Warning: empty MIDI message on line " << lineNumber << endl;
+				continue;
+			}
+		}
+		else if(typeString == "osc")
+		{
+			event.type = kEventOsc;
+			if(!(s >> event.path))
+			{
+				cerr << "Warning: missing OSC path on line " << lineNumber << endl;
+				continue;
+			}
+			if(!(s >> event.types))			// OSC messages with no arguments are allowed
+				event.types = "";
+
+			bool valid = true;
+
+			for(int i = 0; i < event.types.length(); i++)
+			{
+				lo_arg value;
+
+				if(!(s >> token))
+				{
+					valid = false;
+					break;
+				}
+				memset(&value, 0, sizeof(value));
+				switch(event.types[i])
+				{
+					case 'i':
+						value.i = (int32_t)strtol(token.c_str(), NULL, 0);
+						break;
+					case 'f':
+						value.f = (float)atof(token.c_str());
+						break;
+					case 's':
+						event.strings.push_back(token);
+						break;
+					default:
+						valid = false;
+						break;
+				}
+				if(!valid)
+					break;
+				event.values.push_back(value);
+			}
+			if(!valid)
+			{
+				cerr << "Warning: invalid OSC arguments on line " << lineNumber << " (supported types: i f s)\n";
+				continue;
+			}
+		}
+		else
+		{
+			cerr << "Warning: unknown event type '" << typeString << "' on line " << lineNumber << endl;
+			continue;
+		}
+
+		events_.push_back(event);
+	}
+
+	// Keep events with identical times in file order
+	stable_sort(events_.begin(), events_.end(), OfflineRender::eventComesBefore);
+
+#ifdef DEBUG_MESSAGES
+	cout << "Loaded " << events_.size() << " events from '" << filename << "'\n";
+#endif
+
+	return 0;
+}
+
+// Choose the source for the input channels.  Returns 0 on success.
+
+int OfflineRender::setInput(const string& source)
+{
+	size_t colon = source.find(':');
+	string kind = source.substr(0, colon);
+
+	inputPhase_ = 0.0;
+	inputFilePosition_ = 0;
+	inputNoise_.seed(OFFLINE_NOISE_SEED);
+
+	if(kind == "silence" || source.length() == 0)
+	{
+		inputType_ = kInputSilence;
+		return 0;
+	}
+	if(kind == "sine")
+	{
+		inputType_ = kInputSine;
+		inputFrequency_ = 440.0;
+		inputAmplitude_ = 0.5;
+		if(colon != string::npos)
+		{
+			string args = source.substr(colon + 1);
+			size_t colon2 = args.find(':');
+
+			inputFrequency_ = atof(args.substr(0, colon2).c_str());
+			if(colon2 != string::npos)
+				inputAmplitude_ = atof(args.substr(colon2 + 1).c_str());
+		}
+		return 0;
+	}
+	if(kind == "noise")
+	{
+		inputType_ = kInputNoise;
+		inputAmplitude_ = 0.1;
+		if(colon != string::npos)
+			inputAmplitude_ = atof(source.substr(colon + 1).c_str());
+		return 0;
+	}
+
+	// Otherwise it had better be a WAV file
+	if(readWavFile(source) != 0)
+		return 1;
+	inputType_ = kInputWav;
+	return 0;
+}
+
+// Run the render loop.  Events are dispatched at the start of the block in which they fall, which is the same
+// resolution the live system gets from the MIDI and OSC threads.  With an event latency, every event arriving
+// during a block is dispatched before the block renders, with the clock set to its own time as if it had just
+// arrived, and takes effect at its frame of this block or a later one.
+
+int OfflineRender::render(const string& outputFilename, double length, int bufferSize)
+{
+	int numInputChannels = render_->numInputChannels();
+	int numOutputChannels = render_->numOutputChannels();
+	double sampleRate = render_->sampleRate();
+	unsigned long totalFrames, framesRendered = 0;
+	unsigned int dataBytes = 0;
+	PaStreamCallbackTimeInfo timeInfo;
+	struct timeval startTime, endTime;
+	int nextEvent = 0;
+	FILE *outFile;
+
+	if(bufferSize <= 0 || numOutputChannels <= 0 || sampleRate <= 0)
+	{
+		cerr << "Error: invalid stream settings for offline render\n";
+		return 1;
+	}
+
+	if(length < 0)
+		length = (events_.size() > 0 ? events_.back().time : 0.0) + OFFLINE_DEFAULT_TAIL;
+	totalFrames = (unsigned long)ceil(length * sampleRate);
+
+	outFile = fopen(outputFilename.c_str(), "wb");
+	if(outFile == NULL)
+	{
+		cerr << "Error: unable to open '" << outputFilename << "' for writing\n";
+		return 1;
+	}
+	if(!writeWavHeader(outFile, numOutputChannels, (int)sampleRate, 0))	// Sizes get filled in at the end
+	{
+		cerr << "Error: unable to write to '" << outputFilename << "'\n";
+		fclose(outFile);
+		return 1;
+	}
+
+	float *inBuffer = new float[bufferSize * (numInputChannels > 0 ? numInputChannels : 1)];
+	float *outBuffer = new float[bufferSize * numOutputChannels];
+
+	cout << "Rendering " << length << " seconds to '" << outputFilename << "'...\n";
+	gettimeofday(&startTime, NULL);
+
+	// This thread now owns the render list.  The cleanup thread would have to wait on it while holding the
+	// event mutex, which dispatching events needs, so its passes are run here instead.
+	if(midiController_ != NULL)
+		midiController_->pauseCleanupThread(true);
+	render_->beginOfflineRender();
+
+	while(framesRendered < totalFrames)
+	{
+		unsigned long frameCount = totalFrames - framesRendered;
+		PaTime blockTime = (PaTime)framesRendered / sampleRate;
+
+		if(frameCount > bufferSize)
+			frameCount = bufferSize;
+
+		// Advance the clock first so notes created by these events get the right start time
+		if(render_->eventLatency() >= 0.0)
+		{
+			PaTime blockEndTime = (PaTime)(framesRendered + frameCount) / sampleRate;
+			
+			while(nextEvent < events_.size() && events_[nextEvent].time < blockEndTime)
+			{
+				render_->setOfflineTime(events_[nextEvent].time);
+				dispatchEvent(events_[nextEvent++]);
+			}
+			render_->setOfflineTime(blockTime);
+		}
+		else
+		{
+			render_->setOfflineTime(blockTime);
+			while(nextEvent < events_.size() && events_[nextEvent].time <= blockTime)
+				dispatchEvent(events_[nextEvent++]);
+		}
+
+		if(numInputChannels > 0)
+			fillInput(inBuffer, frameCount);
+
+		timeInfo.inputBufferAdcTime = timeInfo.currentTime = timeInfo.outputBufferDacTime = blockTime;
+		render_->renderCallback(numInputChannels > 0 ? inBuffer : NULL, outBuffer, frameCount, &timeInfo, 0);
+		
+		// The cleanup thread runs on wall-clock time, which is far too slow to keep up with us
+		if(midiController_ != NULL)
+			midiController_->cleanupPass();
+
+		if(fwrite(outBuffer, sizeof(float), frameCount * numOutputChannels, outFile) != frameCount * numOutputChannels)
+		{
+			cerr << "Error: write to '" << outputFilename << "' failed\n";
+			break;
+		}
+		dataBytes += frameCount * numOutputChannels * sizeof(float);
+		framesRendered += frameCount;
+	}
+
+	gettimeofday(&endTime, NULL);
+
+	render_->endOfflineRender();
+	if(midiController_ != NULL)
+		midiController_->pauseCleanupThread(false);
+
+	// Go back and fill in the sizes now that we know them
+	fseek(outFile, 0, SEEK_SET);
+	if(!writeWavHeader(outFile, numOutputChannels, (int)sampleRate, dataBytes))
+	{
+		cerr << "Error: unable to update the header of '" << outputFilename << "'\n";
+		framesRendered = 0;
+	}
+	fclose(outFile);
+
+	delete[] inBuffer;
+	delete[] outBuffer;
+
+	double elapsed = (double)(endTime.tv_sec - startTime.tv_sec) + (double)(endTime.tv_usec - startTime.tv_usec) / 1000000.0;
+	cout << "Rendered " << (double)framesRendered / sampleRate << " seconds in " << elapsed << " seconds";
+	if(elapsed > 0)
+		cout << " (" << ((double)framesRendered / sampleRate) / elapsed << "x realtime)";
+	cout << endl;
+
+	return (framesRendered == totalFrames ? 0 : 1);
+}
+
+OfflineRender::~OfflineRender()
+{
+}
+
+#pragma mark Private Methods
+
+// Send one event to the controller that would have received it live
+
+void OfflineRender::dispatchEvent(offlineEvent& event)
+{
+	if(event.type == kEventMidi)
+	{
+		double deltaTime = 0.0;
+		
+		if(lastMidiTimes_.count(event.inputNumber) > 0)
+			deltaTime = event.time - lastMidiTimes_[event.inputNumber];
+		lastMidiTimes_[event.inputNumber] = event.time;
+		
+		if(midiController_ != NULL)
+			midiController_->rtMidiCallback(deltaTime, &event.midi, event.inputNumber);
+	}
+	else if(event.type == kEventOsc)
+	{
+		if(oscController_ == NULL)
+			return;
+
+		vector<lo_arg *> argv;
+		int stringIndex = 0;
+
+		for(int i = 0; i < event.values.size(); i++)
+		{
+			if(event.types[i] == 's')	// liblo passes strings in place of the argument
+				argv.push_back((lo_arg *)event.strings[stringIndex++].c_str());
+			else
+				argv.push_back(&event.values[i]);
+		}
+
+		oscController_->handler(event.path.c_str(), event.types.c_str(), argv.size() > 0 ? &argv[0] : NULL,
+								(int)argv.size(), NULL, NULL);
+	}
+}
+
+// Fill the interleaved input buffer for one block
+
+void OfflineRender::fillInput(float *buffer, unsigned long frameCount)
+{
+	int numInputChannels = render_->numInputChannels();
+	unsigned long n;
+	int ch;
+
+	switch(inputType_)
+	{
+		case kInputSine:
+		{
+			double phaseStep = 2.0 * M_PI * inputFrequency_ / render_->sampleRate();
+
+			for(n = 0; n < frameCount; n++)
+			{
+				float value = (float)(inputAmplitude_ * sin(inputPhase_));
+				for(ch = 0; ch < numInputChannels; ch++)
+					buffer[n*numInputChannels + ch] = value;
+				inputPhase_ = fmod(inputPhase_ + phaseStep, 2.0 * M_PI);
+			}
+			break;
+		}
+		case kInputNoise:
+			inputNoise_.uniform(buffer, frameCount*numInputChannels);
+			for(n = 0; n < frameCount*numInputChannels; n++)
+				buffer[n] *= (float)inputAmplitude_;
+			break;
+		case kInputWav:
+			for(n = 0; n < frameCount; n++, inputFilePosition_++)
+			{
+				for(ch = 0; ch < numInputChannels; ch++)
+				{
+					// Past the end of the file, or more stream channels than file channels: wrap the channels
+					// and pad with silence.
+					if(inputFilePosition_*inputFileChannels_ < inputSamples_.size())
+						buffer[n*numInputChannels + ch] = inputSamples_[inputFilePosition_*inputFileChannels_ + (ch % inputFileChannels_)];
+					else
+						buffer[n*numInputChannels + ch] = 0.0;
+				}
+			}
+			break;
+		case kInputSilence:
+		default:
+			memset(buffer, 0, frameCount*numInputChannels*sizeof(float));
+			break;
+	}
+}
+
+// Read a WAV file into memory as interleaved floats.  Handles 16-, 24- and 32-bit integer PCM and
+// 32-bit float, in either the plain or the WAVE_FORMAT_EXTENSIBLE header.  Assumes a little-endian host.
+// Returns 0 on success.
+
+int OfflineRender::readWavFile(const string& filename)
+{
+	FILE *inFile = fopen(filename.c_str(), "rb");
+	char chunkId[4];
+	uint32_t chunkSize, riffSize;
+	uint16_t format = 0, numChannels = 0, bitsPerSample = 0;
+	uint32_t fileSampleRate = 0;
+	bool foundFormat = false;
+
+	if(inFile == NULL)
+	{
+		cerr << "Error: unable to open input file '" << filename << "'\n";
+		return 1;
+	}
+
+	if(fread(chunkId, 1, 4, inFile) != 4 || memcmp(chunkId, "RIFF", 4) ||
+	   fread(&riffSize, 4, 1, inFile) != 1 ||
+	   fread(chunkId, 1, 4, inFile) != 4 || memcmp(chunkId, "WAVE", 4))
+	{
+		cerr << "Error: '" << filename << "' is not a WAV file\n";
+		fclose(inFile);
+		return 1;
+	}
+
+	inputSamples_.clear();
+
+	while(fread(chunkId, 1, 4, inFile) == 4 && fread(&chunkSize, 4, 1, inFile) == 1)
+	{
+		if(!memcmp(chunkId, "fmt ", 4))
+		{
+			unsigned char fmt[40];
+			uint32_t fmtBytes = (chunkSize < 40 ? chunkSize : 40);
+
+			if(chunkSize < 16 || fread(fmt, 1, fmtBytes, inFile) != fmtBytes)
+				break;
+			memcpy(&format, &fmt[0], 2);
+			memcpy(&numChannels, &fmt[2], 2);
+			memcpy(&fileSampleRate, &fmt[4], 4);
+			memcpy(&bitsPerSample, &fmt[14], 2);
+			if(format == 0xFFFE && fmtBytes >= 26)		// WAVE_FORMAT_EXTENSIBLE: the real format starts the subformat GUID
+				memcpy(&format, &fmt[24], 2);
+			fseek(inFile, chunkSize - fmtBytes + (chunkSize & 1), SEEK_CUR);
+			foundFormat = true;
+		}
+		else if(!memcmp(chunkId, "data", 4) && foundFormat)
+		{
+			int bytesPerSample = bitsPerSample / 8;
+			unsigned long numSamples;
+			vector<unsigned char> raw(chunkSize);
+
+			if(numChannels == 0 || bytesPerSample == 0 ||
+			   !((format == 1 && (bitsPerSample == 16 || bitsPerSample == 24 || bitsPerSample == 32)) ||
+				 (format == 3 && bitsPerSample == 32)))
+			{
+				cerr << "Error: unsupported WAV format in '" << filename << "'\n";
+				fclose(inFile);
+				return 1;
+			}
+
+			if(chunkSize == 0)
+				break;
+			chunkSize = fread(&raw[0], 1, chunkSize, inFile);	// Tolerate truncated files
+			numSamples = chunkSize / bytesPerSample / numChannels * numChannels;	// Whole frames only
+			inputSamples_.resize(numSamples);
+
+			for(unsigned long i = 0; i < numSamples; i++)
+			{
+				unsigned char *p = &raw[i * bytesPerSample];
+
+				if(format == 3)
+					memcpy(&inputSamples_[i], p, 4);
+				else if(bitsPerSample == 16)
+					inputSamples_[i] = (float)(int16_t)(p[0] | (p[1] << 8)) / 32768.0f;
+				else if(bitsPerSample == 24)
+					inputSamples_[i] = (float)((int32_t)((p[0] << 8) | (p[1] << 16) | (p[2] << 24)) >> 8) / 8388608.0f;
+				else
+					inputSamples_[i] = (float)((double)(int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) / 2147483648.0);
+			}
+			break;
+		}
+		else
+			fseek(inFile, chunkSize + (chunkSize & 1), SEEK_CUR);
+	}
+
+	fclose(inFile);
+
+	if(!foundFormat || numChannels == 0)
+	{
+		cerr << "Error: no audio data found in '" << filename << "'\n";
+		return 1;
+	}
+	if(fabs((double)fileSampleRate - render_->sampleRate()) > 0.5)
+		cerr << "Warning: '" << filename << "' has sample rate " << fileSampleRate << "; no conversion will be done\n";
+
+	inputFileChannels_ = numChannels;
+
+#ifdef DEBUG_MESSAGES
+	cout << "Input: " << inputSamples_.size() / numChannels << " frames, " << numChannels << " channels from '" << filename << "'\n";
+#endif
+
+	return 0;
+}
+
+// Write a 44-byte header for 32-bit float WAV output.  Returns true on success.
+
+bool OfflineRender::writeWavHeader(FILE *file, int numChannels, int sampleRate, unsigned int dataBytes)
+{
+	unsigned char header[44];
+	uint32_t u32;
+	uint16_t u16;
+
+	memcpy(&header[0], "RIFF", 4);
+	u32 = 36 + dataBytes;							memcpy(&header[4], &u32, 4);
+	memcpy(&header[8], "WAVEfmt ", 8);
+	u32 = 16;										memcpy(&header[16], &u32, 4);
+	u16 = 3;										memcpy(&header[20], &u16, 2);	// IEEE float
+	u16 = numChannels;								memcpy(&header[22], &u16, 2);
+	u32 = sampleRate;								memcpy(&header[24], &u32, 4);
+	u32 = sampleRate * numChannels * sizeof(float);	memcpy(&header[28], &u32, 4);
+	u16 = numChannels * sizeof(float);				memcpy(&header[32], &u16, 2);
+	u16 = 32;										memcpy(&header[34], &u16, 2);
+	memcpy(&header[36], "data", 4);
+	u32 = dataBytes;								memcpy(&header[40], &u32, 4);
+
+	return (fwrite(header, 1, 44, file) == 44);
+}
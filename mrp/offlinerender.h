@@ -0,0 +1,103 @@
+/*
+ *  offlinerender.h
+ *  mrp
+ *
+ */
+
+#ifndef OFFLINE_RENDER_H
+#define OFFLINE_RENDER_H
+
+#include <iostream>
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <string>
+#include "lo/lo.h"
+#include "audiorender.h"
+#include "noisegenerator.h"
+#include "midicontroller.h"
+#include "osccontroller.h"
+
+using namespace std;
+
+#define OFFLINE_DEFAULT_TAIL	2.0		// Seconds to keep rendering after the last event, if no length is given
+
+// OfflineRender drives an AudioRender object without PortAudio.  Timestamped MIDI and OSC events are read
+// from a text file and dispatched to the MIDI and OSC controllers at block boundaries, exactly as the live
+// threads would deliver them.  If AudioRender has an event latency, each event is instead dispatched with the
+// clock at its own time, so it takes effect at the same frame whatever the block size.  The input channels
+// are fed from a WAV file or a synthetic source, and the output is written to a 32-bit float WAV file.
+// Rendering runs as fast as the CPU allows.
+//
+// Event file format, one event per line (blank lines and lines starting with # are ignored):
+//
+//   <time>  midi  <input#>  <byte> [<byte> ...]		e.g.  0.5  midi 0 0x90 60 100
+//   <time>  osc   <path>  <types>  [<value> ...]		e.g.  1.0  osc /mrp/quality/intensity iif 0 60 0.8
+//
+// Times are in seconds from the start of the render.  Events need not be sorted.
+
+class OfflineRender
+{
+public:
+	OfflineRender(AudioRender *render, MidiController *midiController, OscController *oscController);
+
+	int loadEventFile(const string& filename);		// Returns 0 on success
+
+	// Input source is either a WAV file name, "sine:<freq>[:<amplitude>]", "noise[:<amplitude>]" or "silence".
+	// Returns 0 on success.
+	int setInput(const string& source);
+
+	// Render to the given file.  If length is negative, render until OFFLINE_DEFAULT_TAIL seconds past
+	// the last event.  Returns 0 on success.
+	int render(const string& outputFilename, double length, int bufferSize);
+
+	~OfflineRender();
+
+private:
+	enum {
+		kEventMidi = 0,
+		kEventOsc
+	};
+
+	enum {
+		kInputSilence = 0,
+		kInputWav,
+		kInputSine,
+		kInputNoise
+	};
+
+	typedef struct {
+		double time;
+		int type;
+		int inputNumber;				// MIDI events
+		vector<unsigned char> midi;
+		string path;					// OSC events
+		string types;
+		vector<lo_arg> values;
+		vector<string> strings;			// Storage for any string arguments, indexed in order of appearance
+	} offlineEvent;
+
+	static bool eventComesBefore(const offlineEvent& a, const offlineEvent& b) { return a.time < b.time; }
+
+	void dispatchEvent(offlineEvent& event);
+	void fillInput(float *buffer, unsigned long frameCount);
+
+	int readWavFile(const string& filename);
+	bool writeWavHeader(FILE *file, int numChannels, int sampleRate, unsigned int dataBytes);
+
+	AudioRender *render_;
+	MidiController *midiController_;
+	OscController *oscController_;
+
+	vector<offlineEvent> events_;
+	map<int, double> lastMidiTimes_;	// Time of the last event on each MIDI input, for RtMidi-style delta times
+
+	int inputType_;
+	double inputFrequency_, inputAmplitude_, inputPhase_;
+	NoiseGenerator inputNoise_;			// Own fixed seed, so it doesn't shift the synths' seeds
+	vector<float> inputSamples_;		// Interleaved WAV input
+	int inputFileChannels_;
+	unsigned long inputFilePosition_;	// In frames
+};
+
+#endif // OFFLINE_RENDER_H
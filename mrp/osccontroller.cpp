@@ -298,7 +298,7 @@ int OscController::handleMidi(unsigned char byte1, unsigned char byte2, unsigned
 	midiMsg.push_back(byte2);
 	midiMsg.push_back(byte3);
 
-	// FIXME: deltaTime
+	// OSC doesn't tell us the time between messages, so the controller times this one by its arrival
 	midiController_->rtMidiCallback(0.0, &midiMsg, OSC_MIDI_CONTROLLER_NUM);
 	
 	return 0;
@@ -0,0 +1,412 @@
+/*
+ *  oscillatorbank.cpp
+ *  mrp
+ *
+ */
+
+#include <cmath>
+#include "oscillatorbank.h"
+#include "benchmark.h"
+#include "kerneldispatch.h"
+#include "wavetables.h"
+#include "config.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OSCILLATOR_BANK_X86
+#if defined(__x86_64__) || defined(__SSE2__)
+#define OSCILLATOR_BANK_SSE2
+#endif
+#if defined(__GNUC__)						// Needs per-function target attributes (gcc or clang)
+#define OSCILLATOR_BANK_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define OSCILLATOR_BANK_NEON
+#endif
+
+using namespace std;
+
+// Each kernel adds, for each of frameCount samples, the sum of amplitudes[n]*sin(phase*multipliers[n] + phaseOffsets[n])
+// to output.  The arrays are padded with silent oscillators to a multiple of OSCILLATOR_BANK_LANES, so the SIMD
+// kernels may round size up to their own width.  Phases are 32-bit fixed point: the top bits (phase >> shift) index
+// the table and the low shift bits are the fractional part, scaled to [0, 1) by fractScale.  The table has a guard point.
+
+typedef void (*oscillatorKernel)(const float *table, int shift, float fractScale, float *output, const uint32_t *phase,
+								 unsigned long frameCount, const float *amplitudes, const uint32_t *multipliers,
+								 const uint32_t *phaseOffsets, int size);
+
+#pragma mark Kernels
+
+// Plain C++ version
+
+static void renderScalar(const float *table, int shift, float fractScale, float *output, const uint32_t *phase,
+						 unsigned long frameCount, const float *amplitudes, const uint32_t *multipliers,
+						 const uint32_t *phaseOffsets, int size)
+{
+	uint32_t fractMask = (1U << shift) - 1;
+	unsigned long i;
+	int n;
+
+	for(i = 0; i < frameCount; i++)
+	{
+		float sum = 0.0;
+
+		for(n = 0; n < size; n++)
+		{
+			uint32_t p = phase[i]*multipliers[n] + phaseOffsets[n];
+			uint32_t index = p >> shift;
+			float fract = (float)(int32_t)(p & fractMask) * fractScale;
+			float lo = table[index];
+
+			sum += amplitudes[n]*(lo + fract*(table[index + 1] - lo));
+		}
+
+		output[i] += sum;
+	}
+}
+
+#ifdef OSCILLATOR_BANK_SSE2
+
+// SSE2 has no 32-bit low multiply (that arrived in SSE4.1), so build one from two 32x32->64 multiplies
+
+static inline __m128i multiplyLow32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// SSE2 version, 4 oscillators at a time.  SSE2 has no gather, so the table values are loaded one lane at a time.
+
+static void renderSse2(const float *table, int shift, float fractScale, float *output, const uint32_t *phase,
+					   unsigned long frameCount, const float *amplitudes, const uint32_t *multipliers,
+					   const uint32_t *phaseOffsets, int size)
+{
+	__m128i shiftCount = _mm_cvtsi32_si128(shift);
+	__m128i fractMask = _mm_set1_epi32((1U << shift) - 1);
+	__m128 scale = _mm_set1_ps(fractScale);
+	int indices[4] __attribute__((aligned(16)));
+	unsigned long i;
+	int n;
+
+	for(i = 0; i < frameCount; i++)
+	{
+		__m128i basePhase = _mm_set1_epi32(phase[i]);
+		__m128 sum = _mm_setzero_ps();
+
+		for(n = 0; n < size; n += 4)
+		{
+			__m128i p = _mm_add_epi32(multiplyLow32(basePhase, _mm_loadu_si128((const __m128i *)&multipliers[n])),
+									  _mm_loadu_si128((const __m128i *)&phaseOffsets[n]));
+			__m128 fract = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(p, fractMask)), scale);
+
+			_mm_store_si128((__m128i *)indices, _mm_srl_epi32(p, shiftCount));
+
+			__m128 lo = _mm_set_ps(table[indices[3]], table[indices[2]], table[indices[1]], table[indices[0]]);
+			__m128 hi = _mm_set_ps(table[indices[3] + 1], table[indices[2] + 1], table[indices[1] + 1], table[indices[0] + 1]);
+			__m128 value = _mm_add_ps(lo, _mm_mul_ps(fract, _mm_sub_ps(hi, lo)));
+
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&amplitudes[n]), value));
+		}
+
+		// Horizontal sum of the 4 lanes
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		output[i] += _mm_cvtss_f32(sum);
+	}
+}
+
+#endif // OSCILLATOR_BANK_SSE2
+
+#ifdef OSCILLATOR_BANK_AVX2
+
+// AVX2 version, 8 oscillators at a time, using gather and fused multiply-add.  Only called when the CPU
+// reports AVX2 and FMA support.
+
+__attribute__((target("avx2,fma")))
+static void renderAvx2(const float *table, int shift, float fractScale, float *output, const uint32_t *phase,
+					   unsigned long frameCount, const float *amplitudes, const uint32_t *multipliers,
+					   const uint32_t *phaseOffsets, int size)
+{
+	__m128i shiftCount = _mm_cvtsi32_si128(shift);
+	__m256i fractMask = _mm256_set1_epi32((1U << shift) - 1);
+	__m256 scale = _mm256_set1_ps(fractScale);
+	unsigned long i;
+	int n;
+
+	for(i = 0; i < frameCount; i++)
+	{
+		__m256i basePhase = _mm256_set1_epi32(phase[i]);
+		__m256 sum = _mm256_setzero_ps();
+
+		for(n = 0; n < size; n += 8)
+		{
+			__m256i p = _mm256_add_epi32(_mm256_mullo_epi32(basePhase, _mm256_loadu_si256((const __m256i *)&multipliers[n])),
+										 _mm256_loadu_si256((const __m256i *)&phaseOffsets[n]));
+			__m256i index = _mm256_srl_epi32(p, shiftCount);
+			__m256 fract = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(p, fractMask)), scale);
+
+			__m256 lo = _mm256_i32gather_ps(table, index, 4);
+			__m256 hi = _mm256_i32gather_ps(table + 1, index, 4);
+			__m256 value = _mm256_fmadd_ps(fract, _mm256_sub_ps(hi, lo), lo);
+
+			sum = _mm256_fmadd_ps(_mm256_loadu_ps(&amplitudes[n]), value, sum);
+		}
+
+		// Horizontal sum of the 8 lanes
+		__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+		half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+		half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+		output[i] += _mm_cvtss_f32(half);
+	}
+}
+
+#endif // OSCILLATOR_BANK_AVX2
+
+#ifdef OSCILLATOR_BANK_NEON
+
+// NEON version, 4 oscillators at a time.  As with SSE2, the table is read one lane at a time.
+
+static void renderNeon(const float *table, int shift, float fractScale, float *output, const uint32_t *phase,
+					   unsigned long frameCount, const float *amplitudes, const uint32_t *multipliers,
+					   const uint32_t *phaseOffsets, int size)
+{
+	int32x4_t shiftRight = vdupq_n_s32(-shift);			// Negative left shift
+	uint32x4_t fractMask = vdupq_n_u32((1U << shift) - 1);
+	uint32_t indices[4];
+	float lo[4], hi[4];
+	unsigned long i;
+	int n, lane;
+
+	for(i = 0; i < frameCount; i++)
+	{
+		uint32x4_t basePhase = vdupq_n_u32(phase[i]);
+		float32x4_t sum = vdupq_n_f32(0.0f);
+
+		for(n = 0; n < size; n += 4)
+		{
+			uint32x4_t p = vmlaq_u32(vld1q_u32(&phaseOffsets[n]), basePhase, vld1q_u32(&multipliers[n]));
+			float32x4_t fract = vmulq_n_f32(vcvtq_f32_u32(vandq_u32(p, fractMask)), fractScale);
+
+			vst1q_u32(indices, vshlq_u32(p, shiftRight));
+			for(lane = 0; lane < 4; lane++)
+			{
+				lo[lane] = table[indices[lane]];
+				hi[lane] = table[indices[lane] + 1];
+			}
+
+			float32x4_t loValue = vld1q_f32(lo);
+			float32x4_t value = vmlaq_f32(loValue, fract, vsubq_f32(vld1q_f32(hi), loValue));
+
+			sum = vmlaq_f32(sum, vld1q_f32(&amplitudes[n]), value);
+		}
+
+		// Horizontal sum of the 4 lanes
+		float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+		output[i] += vget_lane_f32(vpadd_f32(half, half), 0);
+	}
+}
+
+#endif // OSCILLATOR_BANK_NEON
+
+#pragma mark Kernel Selection
+
+static const KernelDispatch<oscillatorKernel>::kernelInfo kKernels[OscillatorBank::kNumKernels] = {
+	{ "scalar", kInstructionsBase, renderScalar },
+#ifdef OSCILLATOR_BANK_SSE2
+	{ "SSE2", kInstructionsBase, renderSse2 },
+#else
+	{ "SSE2", kInstructionsBase, NULL },
+#endif
+#ifdef OSCILLATOR_BANK_AVX2
+	{ "AVX2", kInstructionsAvx2Fma, renderAvx2 },
+#else
+	{ "AVX2", kInstructionsAvx2Fma, NULL },
+#endif
+#ifdef OSCILLATOR_BANK_NEON
+	{ "NEON", kInstructionsBase, renderNeon },
+#else
+	{ "NEON", kInstructionsBase, NULL },
+#endif
+};
+
+static KernelDispatch<oscillatorKernel> gKernels("OscillatorBank", kKernels, OscillatorBank::kNumKernels);
+
+bool OscillatorBank::kernelIsAvailable(int kernel)
+{
+	return gKernels.isAvailable(kernel);
+}
+
+int OscillatorBank::currentKernel()
+{
+	return gKernels.current();
+}
+
+// Change the kernel used by every OscillatorBank.  This should not be called while audio is running.
+
+void OscillatorBank::setKernel(int kernel)
+{
+	gKernels.set(kernel);
+}
+
+const char *OscillatorBank::kernelName(int kernel)
+{
+	return gKernels.name(kernel);
+}
+
+#pragma mark OscillatorBank
+
+OscillatorBank::OscillatorBank()
+{
+	SineTable<WAVETABLE_SINE_BITS>::build();
+	size_ = 0;
+}
+
+OscillatorBank::OscillatorBank(const OscillatorBank& copy)
+{
+	amplitudes_ = copy.amplitudes_;
+	multipliers_ = copy.multipliers_;
+	phaseOffsets_ = copy.phaseOffsets_;
+	size_ = copy.size_;
+}
+
+void OscillatorBank::addOscillator(float amplitude, int multiplier, uint32_t phaseOffset)
+{
+	if(size_ >= amplitudes_.size())
+	{
+		// Grow by a whole number of lanes.  The new padding lanes get valid multipliers and offsets;
+		// their amplitudes are zeroed in render().
+
+		int newSize = amplitudes_.size() + OSCILLATOR_BANK_LANES;
+
+		amplitudes_.resize(newSize, 0.0);
+		multipliers_.resize(newSize, 0);
+		phaseOffsets_.resize(newSize, 0);
+	}
+
+	amplitudes_[size_] = amplitude;
+	multipliers_[size_] = (uint32_t)multiplier;		// Negative multipliers wrap correctly
+	phaseOffsets_[size_] = phaseOffset;
+	size_++;
+}
+
+void OscillatorBank::reserve(int size)
+{
+	int newSize = ((size + OSCILLATOR_BANK_LANES - 1) / OSCILLATOR_BANK_LANES) * OSCILLATOR_BANK_LANES;
+
+	if(newSize <= amplitudes_.size())
+		return;
+
+	amplitudes_.resize(newSize, 0.0);
+	multipliers_.resize(newSize, 0);
+	phaseOffsets_.resize(newSize, 0);
+}
+
+void OscillatorBank::render(float *output, const uint32_t *phase, unsigned long frameCount)
+{
+	int n, paddedSize;
+	int shift = SineTable<WAVETABLE_SINE_BITS>::kShift;
+
+	if(size_ == 0)
+		return;
+
+	// Silence any lanes left over past the last oscillator
+	paddedSize = ((size_ + OSCILLATOR_BANK_LANES - 1) / OSCILLATOR_BANK_LANES) * OSCILLATOR_BANK_LANES;
+	for(n = size_; n < paddedSize; n++)
+		amplitudes_[n] = 0.0;
+
+	(*gKernels.function())(SineTable<WAVETABLE_SINE_BITS>::table(), shift, 1.0f / (float)(1U << shift), output, phase, frameCount,
+						   &amplitudes_[0], &multipliers_[0], &phaseOffsets_[0], size_);
+}
+
+// With a common phase of 0 the multipliers drop out, so the phases array can stand in for them too
+
+void OscillatorBank::renderFixedPhases(float *output, const float *amplitudes, const uint32_t *phases, int size)
+{
+	static const uint32_t zeroPhase = 0;
+	int shift = SineTable<WAVETABLE_SINE_BITS>::kShift;
+
+	if(size == 0)
+		return;
+
+	(*gKernels.function())(SineTable<WAVETABLE_SINE_BITS>::table(), shift, 1.0f / (float)(1U << shift), output, &zeroPhase, 1,
+						   amplitudes, phases, phases, size);
+}
+
+#pragma mark Benchmark
+
+#define OSCILLATOR_BENCHMARK_FRAMES		4096
+#define OSCILLATOR_BENCHMARK_SAMPLES	2000000		// Total samples rendered for each measurement
+
+void OscillatorBank::benchmark(ostream& output)
+{
+	const int harmonicCounts[] = { 1, 4, 8, 16 };
+	vector<uint32_t> phase(OSCILLATOR_BENCHMARK_FRAMES);
+	vector<float> reference(OSCILLATOR_BENCHMARK_FRAMES), result(OSCILLATOR_BENCHMARK_FRAMES);
+	int savedKernel = gKernels.current();
+	int repetitions = OSCILLATOR_BENCHMARK_SAMPLES / OSCILLATOR_BENCHMARK_FRAMES;
+	double samples = (double)repetitions * OSCILLATOR_BENCHMARK_FRAMES;
+	BenchmarkTimer timer;
+	int h, j, kernel, r;
+	unsigned long i;
+
+	// A sawtooth phase at 261.6Hz, as the PLL would produce
+	for(i = 0; i < OSCILLATOR_BENCHMARK_FRAMES; i++)
+		phase[i] = PhaseAccumulator::fromCycles((double)i * 261.6 / 44100.0);
+
+	printBenchmarkHeading(output, "Oscillator bank", "sample", OSCILLATOR_BENCHMARK_SAMPLES);
+	output << "Default kernel: " << kernelName(gKernels.current()) << endl;
+
+	for(h = 0; h < sizeof(harmonicCounts) / sizeof(int); h++)
+	{
+		int numHarmonics = harmonicCounts[h];
+		OscillatorBank bank;
+
+		for(j = 0; j < numHarmonics; j++)
+			bank.addOscillator(1.0 / (float)(j+1), j+1, PhaseAccumulator::fromCycles(0.1*(float)j));
+
+		// Reference: one SineTable::lookupInterp() per harmonic per sample, as the synths did before
+		timer.start();
+		for(r = 0; r < repetitions; r++)
+		{
+			for(i = 0; i < OSCILLATOR_BENCHMARK_FRAMES; i++)
+			{
+				float outSample = 0.0;
+
+				for(j = 0; j < numHarmonics; j++)
+					outSample += (1.0 / (float)(j+1))*SineTable<WAVETABLE_SINE_BITS>::lookupInterp(PhaseAccumulator::toCycles(phase[i])*(float)(j+1) +
+																							  0.1*(float)j);
+				reference[i] = outSample;
+			}
+		}
+		output << "  " << numHarmonics << " harmonics: lookupInterp " << timer.nsPer(samples);
+
+		for(kernel = 0; kernel < kNumKernels; kernel++)
+		{
+			float maxError = 0.0;
+
+			if(!kernelIsAvailable(kernel))
+				continue;
+			setKernel(kernel);
+
+			timer.start();
+			for(r = 0; r < repetitions; r++)
+			{
+				for(i = 0; i < OSCILLATOR_BENCHMARK_FRAMES; i++)
+					result[i] = 0.0;
+				bank.render(&result[0], &phase[0], OSCILLATOR_BENCHMARK_FRAMES);
+			}
+			double nsPerSample = timer.nsPer(samples);
+
+			for(i = 0; i < OSCILLATOR_BENCHMARK_FRAMES; i++)
+				maxError = max(maxError, fabsf(result[i] - reference[i]));
+
+			output << ", " << kernelName(kernel) << " " << nsPerSample << " (max diff " << maxError << ")";
+		}
+		output << endl;
+	}
+
+	setKernel(savedKernel);
+}
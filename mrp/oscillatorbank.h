@@ -0,0 +1,83 @@
+/*
+ *  oscillatorbank.h
+ *  mrp
+ *
+ */
+
+#ifndef OSCILLATOR_BANK_H
+#define OSCILLATOR_BANK_H
+
+#include <iostream>
+#include <vector>
+#include "phaseaccumulator.h"
+using namespace std;
+
+#define OSCILLATOR_BANK_LANES	8		// Oscillator storage is padded to a multiple of this (the widest kernel)
+
+// OscillatorBank evaluates a set of sine oscillators that all derive their phase from one common
+// phase signal, as in a sum of harmonics.  For each sample, the output is
+//
+//   sum over n of amplitude[n] * sin(2*pi*(phase*multiplier[n] + phaseOffset[n]))
+//
+// using linear interpolation into the sine wavetable, as SineTable::lookupPhase() does.  Phases are
+// fixed-point (see PhaseAccumulator) and multipliers are integers, so each harmonic's phase wraps exactly.  The
+// oscillators are held in structure-of-arrays form so all of them can be computed at once with SIMD
+// instructions.  The kernel is chosen at startup according to what the CPU supports (AVX2, SSE2 or NEON,
+// with a plain C++ fallback).
+//
+// An oscillator with multiplier 0 sits at a fixed phase given by its phaseOffset, which lets synths whose
+// partials advance independently (e.g. ResonanceSynth) sum them with a single call.
+
+class OscillatorBank
+{
+public:
+	// Available kernels, in increasing order of preference
+	enum {
+		kKernelScalar = 0,
+		kKernelSse2,
+		kKernelAvx2,
+		kKernelNeon,
+		kNumKernels
+	};
+
+	OscillatorBank();
+	OscillatorBank(const OscillatorBank& copy);
+
+	// Build up the list of oscillators.  Neither allocates memory unless the bank grows beyond the
+	// largest size it has held before.
+	void clear() { size_ = 0; }
+	void addOscillator(float amplitude, int multiplier, uint32_t phaseOffset);
+	int size() { return size_; }
+	
+	// Allocate room for size oscillators now, so that adding up to that many later won't allocate
+	void reserve(int size);
+
+	// Add the sum of the oscillators to each sample of output.  phase holds the common phase for each of
+	// frameCount samples.
+	void render(float *output, const uint32_t *phase, unsigned long frameCount);
+
+	// Add to *output the sum of amplitudes[n]*sin(2*pi*phases[n]) over n < size, for oscillators whose phases
+	// are kept by the caller (e.g. ResonanceSynth).  Both arrays must be padded to a multiple of
+	// OSCILLATOR_BANK_LANES, with zero amplitudes past size.
+	static void renderFixedPhases(float *output, const float *amplitudes, const uint32_t *phases, int size);
+
+	// Kernel selection.  By default the best available kernel is used.
+	static bool kernelIsAvailable(int kernel);
+	static int currentKernel();
+	static void setKernel(int kernel);
+	static const char *kernelName(int kernel);
+
+	// Print the cost in ns/sample of each available kernel, versus calling SineTable::lookupInterp() once per
+	// harmonic, at several numbers of harmonics.
+	static void benchmark(ostream& output);
+
+	~OscillatorBank() {}
+
+private:
+	vector<float> amplitudes_;			// Padded to a multiple of OSCILLATOR_BANK_LANES; extra lanes
+	vector<uint32_t> multipliers_;		// are given zero amplitude at render time.
+	vector<uint32_t> phaseOffsets_;
+	int size_;
+};
+
+#endif // OSCILLATOR_BANK_H
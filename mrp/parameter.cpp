@@ -97,6 +97,14 @@ void Parameter::appendRampValues(timedParameter& rampValues)
 		startRamp();
 }
 
+void Parameter::applyCommand(int type, double value, timedParameter& rampValues)
+{
+	if(type == kParameterCommandAppend)
+		appendRampValues(rampValues);
+	else
+		setRampValues(value, rampValues);
+}
+
 bool Parameter::ramp(int numSamples)	// Returns true if the parameter has changed
 {
 	if(shape_ == shapeHold)		// Do nothing if we're holding the current value
@@ -202,4 +210,335 @@ void Parameter::startRamp()
 		cout << ", duration = " << duration << ", sampleRate = " << sampleRate_ << ", sampleMax_ = " << sampleMax_ << ", stepValue_ = " << stepValue_ << endl;
 #endif
 	}
-}
\ No newline at end of file
+}
+
+ParameterCommandQueue::ParameterCommandQueue()
+{
+	commands_ = NULL;
+	stagedPointer_ = writePointer_ = readPointer_ = 0;
+}
+
+// The commands belong to the synth that posted them, so a copy of the synth gets a queue of its own
+
+ParameterCommandQueue::ParameterCommandQueue(const ParameterCommandQueue&)
+{
+	commands_ = NULL;
+	stagedPointer_ = writePointer_ = readPointer_ = 0;
+}
+
+void ParameterCommandQueue::allocate()
+{
+	if(commands_ == NULL)
+	{
+		commands_ = new parameterCommand[PARAMETER_QUEUE_SIZE];
+		for(int i = 0; i < PARAMETER_QUEUE_SIZE; i++)
+			commands_[i].longRamp = NULL;
+	}
+}
+
+parameterCommand *ParameterCommandQueue::stage()
+{
+	parameterCommand *command;
+	
+	if(commands_ == NULL || space() <= 0)
+		return NULL;
+	command = &commands_[(stagedPointer_++) & (PARAMETER_QUEUE_SIZE - 1)];
+	
+	if(command->longRamp != NULL)	// Left over from the last time round; the consumer is done with it
+	{
+		delete command->longRamp;
+		command->longRamp = NULL;
+	}
+	return command;
+}
+
+void ParameterCommandQueue::commit()
+{
+	__sync_synchronize();			// Commands must be visible before the pointer moves
+	writePointer_ = stagedPointer_;
+}
+
+parameterCommand *ParameterCommandQueue::front()
+{
+	if(readPointer_ == writePointer_)
+		return NULL;
+	__sync_synchronize();			// Don't read the command ahead of the write pointer
+	return &commands_[readPointer_ & (PARAMETER_QUEUE_SIZE - 1)];
+}
+
+void ParameterCommandQueue::pop()
+{
+	__sync_synchronize();			// Finish with the command before giving up its slot
+	readPointer_ = readPointer_ + 1;
+}
+
+ParameterCommandQueue::~ParameterCommandQueue()
+{
+	if(commands_ != NULL)
+	{
+		for(int i = 0; i < PARAMETER_QUEUE_SIZE; i++)
+		{
+			if(commands_[i].longRamp != NULL)
+				delete commands_[i].longRamp;
+		}
+		delete[] commands_;
+	}
+}
+
+#pragma mark ParameterBank
+
+ParameterBank::ParameterBank(float sampleRate, int numGroups)
+{
+	updateRate_ = (double)sampleRate/(double)PARAMETER_UPDATE_INTERVAL;
+	groupStarts_.assign(numGroups, 0);
+	groupSizes_.assign(numGroups, 0);
+	numEntries_ = 0;
+}
+
+// The later groups move up or down to make room.  Growing into the spare entries only moves values and
+// swaps ramp storage, so the render thread can do it once the room has been reserved.
+
+void ParameterBank::resize(int group, int size, double initialValue)
+{
+	int end = groupStarts_[group] + groupSizes_[group];
+	int change = size - groupSizes_[group];
+	int n;
+	
+	if(change == 0)
+		return;
+	
+	if(change > 0)
+	{
+		if(numEntries_ + change > capacity())
+			reserve(numEntries_ + change);
+		
+		for(n = numEntries_ - 1; n >= end; n--)
+			moveEntry(n, n + change);
+		
+		for(n = end; n < end + change; n++)
+		{
+			values_[n] = previousValues_[n] = initialValue;
+			clearRamps(n);
+			startRamp(n);				// Hold the initial value
+		}
+	}
+	else
+	{
+		for(n = end; n < numEntries_; n++)
+			moveEntry(n, n + change);
+		for(n = numEntries_ + change; n < numEntries_; n++)
+			clearRamps(n);
+	}
+	
+	numEntries_ += change;
+	groupSizes_[group] = size;
+	for(n = group + 1; n < groupStarts_.size(); n++)
+		groupStarts_[n] += change;
+}
+
+void ParameterBank::reserve(int entries)
+{
+	int n, oldCapacity = capacity();
+	
+	if(entries <= oldCapacity)
+		return;
+	
+	values_.resize(entries, 0.0);
+	previousValues_.resize(entries, 0.0);
+	multipliers_.resize(entries, 1.0);
+	increments_.resize(entries, 0.0);
+	remaining_.resize(entries, 1);
+	decrements_.resize(entries, 0);
+	shapes_.resize(entries, (int)shapeHold);
+	rampHeads_.resize(entries, 0);
+	rampCounts_.resize(entries, 0);
+	rampStorage_.resize(entries*PARAMETER_RAMP_SIZE);
+	
+	// The existing entries hold a permutation of the old blocks, so the new blocks go to the new entries
+	rampSlots_.resize(entries);
+	for(n = oldCapacity; n < entries; n++)
+		rampSlots_[n] = n;
+}
+
+void ParameterBank::moveEntry(int from, int to)
+{
+	values_[to] = values_[from];
+	previousValues_[to] = previousValues_[from];
+	multipliers_[to] = multipliers_[from];
+	increments_[to] = increments_[from];
+	remaining_[to] = remaining_[from];
+	decrements_[to] = decrements_[from];
+	shapes_[to] = shapes_[from];
+	swap(rampSlots_[to], rampSlots_[from]);
+	swap(rampHeads_[to], rampHeads_[from]);
+	swap(rampCounts_[to], rampCounts_[from]);
+}
+
+// Add segments to the end of entry n's ramp list.  Any that don't fit are dropped, rather than allocating.
+
+void ParameterBank::pushRamps(int n, const timedParameter& rampValues)
+{
+	int i, size = min((int)rampValues.size(), PARAMETER_RAMP_SIZE - rampCounts_[n]);
+	parameterValue *block = &rampStorage_[rampSlots_[n]*PARAMETER_RAMP_SIZE];
+	
+	for(i = 0; i < size; i++)
+		block[(rampHeads_[n] + rampCounts_[n] + i) & (PARAMETER_RAMP_SIZE - 1)] = rampValues[i];
+	rampCounts_[n] += size;
+}
+
+void ParameterBank::setCurrentValue(int group, int index, double newValue)
+{
+	int n = groupStarts_[group] + index;
+	
+	values_[n] = newValue;
+	clearRamps(n);					// Clear any future ramps
+	
+	startRamp(n);					// This will hold the current value
+}
+
+void ParameterBank::setRampValues(int group, int index, double startValue, timedParameter& rampValues)
+{
+	int n = groupStarts_[group] + index;
+	
+	values_[n] = startValue;
+	clearRamps(n);
+	pushRamps(n, rampValues);
+	
+	startRamp(n);
+}
+
+void ParameterBank::appendRampValues(int group, int index, timedParameter& rampValues)
+{
+	int n = groupStarts_[group] + index;
+	
+	pushRamps(n, rampValues);
+	
+	if(shapes_[n] == shapeHold)		// If we're waiting, not in the middle of a current ramp, begin a new one
+		startRamp(n);
+}
+
+void ParameterBank::applyCommand(int group, int index, int type, double value, timedParameter& rampValues)
+{
+	if(type == kParameterCommandAppend)
+		appendRampValues(group, index, rampValues);
+	else
+		setRampValues(group, index, value, rampValues);
+}
+
+// The same arithmetic as Parameter::ramp(), so the values match it exactly.  Multiplying by 1 or adding 0
+// leaves a value unchanged, so holding entries can go through the same expression as ramping ones.
+
+void ParameterBank::ramp()
+{
+	int n, size = numEntries_;
+	int finished = 0;
+	
+	for(n = 0; n < size; n++)
+	{
+		previousValues_[n] = values_[n];
+		values_[n] = values_[n]*multipliers_[n] + increments_[n];
+		remaining_[n] -= decrements_[n];
+		finished |= (remaining_[n] <= 0);
+	}
+	
+	if(!finished)
+		return;
+	
+	for(n = 0; n < size; n++)
+	{
+		if(remaining_[n] <= 0)
+			finishSegment(n);
+	}
+}
+
+// Jump to the target, in case there was any drift, and set up the next segment
+
+void ParameterBank::finishSegment(int n)
+{
+	values_[n] = previousValues_[n];		// Undo this update's step
+	
+	if(rampCounts_[n] > 0)
+	{
+		values_[n] = frontRamp(n).nextValue;
+		popRamp(n);
+	}
+	
+	startRamp(n);
+}
+
+// Start a ramp to the next value given at the beginning of the ramp list.  See Parameter::startRamp().
+
+void ParameterBank::startRamp(int n)
+{
+	double oldValue = values_[n];
+	
+	multipliers_[n] = 1.0;
+	increments_[n] = 0.0;
+	
+	if(rampCounts_[n] == 0)		// Hold this value indefinitely
+	{
+		shapes_[n] = shapeHold;
+		remaining_[n] = 1;
+		decrements_[n] = 0;
+		return;
+	}
+	
+	double nextValue = frontRamp(n).nextValue;
+	double duration = frontRamp(n).duration;
+	
+	shapes_[n] = frontRamp(n).shape;
+	remaining_[n] = (int)(duration*updateRate_);
+	decrements_[n] = 1;
+	
+	// Calculate a step size based on the ramp shape
+	switch(shapes_[n])
+	{
+		case shapeLinear: // Linear (additive) steps
+			increments_[n] = (nextValue-oldValue)/(duration*updateRate_);
+			break;
+		case shapeLogarithmic: // Logarithmic (multiplicative) steps -- avoid dividing by 0!
+			if(oldValue == 0.0) // Can't divide by 0 or ramp from it, so start at -60dB
+				values_[n] = oldValue = 0.001;
+			if(nextValue == 0.0)
+				nextValue = 0.001;	// Similarly, ramp down to -60dB
+			multipliers_[n] = pow(nextValue/oldValue, 1.0/(duration*updateRate_));
+			if(multipliers_[n] == 1.0 && nextValue != oldValue)
+				cerr << "Warning: Logarithmic step = 1.0\n";
+			break;
+		case shapeStep: // No step at all until the next value
+		case shapeHold:
+		default:
+			break;
+	}
+}
+
+void ParameterBank::print(ostream& output, int group, int index) const
+{
+	int n = groupStarts_[group] + index;
+	
+	output << "val_ = " << values_[n] << ", multiplier = " << multipliers_[n] << ", increment = " << increments_[n]
+		   << ", remaining = " << remaining_[n] << ", shape = ";
+	switch(shapes_[n])
+	{
+		case shapeHold:
+			output << "hold\n";
+			break;
+		case shapeLinear:
+			output << "linear\n";
+			break;
+		case shapeLogarithmic:
+			output << "log\n";
+			break;
+		case shapeStep:
+			output << "step\n";
+			break;
+		default:
+			output << "unknown (" << shapes_[n] << ")\n";
+	}
+	output << "    rampList_: ";
+	if(rampCounts_[n] == 0)
+		output << "(empty)";
+	for(int i = 0; i < rampCounts_[n]; i++)
+		output << "[v " << rampAt(n, i).nextValue << ", d " << rampAt(n, i).duration << ", s " << rampAt(n, i).shape << "] ";
+	output << endl;
+}
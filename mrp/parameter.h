@@ -12,6 +12,7 @@
 
 #include <iostream>
 #include <deque>
+#include <vector>
 #include <cmath>
 using namespace std;
 
@@ -20,6 +21,11 @@ using namespace std;
 
 #define PARAMETER_UPDATE_INTERVAL	16
 
+#define PARAMETER_QUEUE_SIZE		128		// Commands held by each synth's parameter queue (must be a power of 2)
+#define PARAMETER_QUEUE_RAMP_SIZE	4		// Ramp segments carried in one command; longer ramps are attached
+#define PARAMETER_QUEUE_TIMEOUT		10		// Milliseconds to wait for space on a full parameter queue
+#define PARAMETER_RAMP_SIZE			32		// Ramp segments each ParameterBank entry can hold (must be a power of 2)
+
 enum
 {
 	shapeLinear = 0,
@@ -40,6 +46,14 @@ parameterValue;
 
 typedef deque<parameterValue> timedParameter;
 
+// Parameter changes arriving through a ParameterCommandQueue (below) either replace or extend the ramps
+
+enum
+{
+	kParameterCommandSet = 0,		// Replace the current value and ramps (Parameter::setRampValues())
+	kParameterCommandAppend			// Add ramps after the current ones (Parameter::appendRampValues())
+};
+
 class Parameter
 {
 	friend ostream& operator<<(ostream& output, const Parameter& p);
@@ -50,6 +64,8 @@ public:
 	void setRampValues(double startValue, timedParameter& rampValues);			
 																// Set a new value and future ramp values 
 	void appendRampValues(timedParameter& rampValues);			// Append ramp values to the current list
+	void applyCommand(int type, double value, timedParameter& rampValues);
+																// Set or append, from a parameterCommand
 	bool ramp(int numSamples);									// Update the value; return true if it changed
 	
 private:
@@ -66,4 +82,151 @@ private:
 	timedParameter rampList_;	// The list of ramp changes to make
 };
 
+// ParameterBank holds all of a synth's ramping parameters in structure-of-arrays form.  Each entry behaves
+// exactly like a Parameter ramped every PARAMETER_UPDATE_INTERVAL samples, but ramp() advances all of them
+// in one pass over contiguous arrays, which the compiler can vectorize: every entry steps as
+// value*multiplier + increment, with (1, step) for a linear ramp, (step, 0) for a logarithmic one and (1, 0)
+// otherwise.  The ramp lists are only consulted when an entry reaches the end of a segment.
+//
+// Each entry's ramp list is a ring of PARAMETER_RAMP_SIZE segments in storage that reserve() allocates, so
+// setting, appending and finishing ramps never touch the heap.  Segments beyond that are dropped, so the
+// synths refuse longer ramps when they are posted and patches warn about them when they are loaded.
+//
+// Entries are arranged in groups, one per named parameter of the synth.  A group holds a single value or a
+// vector of them (e.g. harmonic amplitudes), always contiguous, so values() returns the whole vector.
+
+class ParameterBank
+{
+public:
+	ParameterBank(float sampleRate, int numGroups);			// All groups start out empty
+	
+	// Change the size of a group, adding or removing entries at its end.  New entries hold initialValue.
+	// Only allocates memory if the bank grows beyond the room reserve() has made.
+	void resize(int group, int size, double initialValue);
+	int size(int group) const { return groupSizes_[group]; }
+	int size() const { return numEntries_; }				// All the groups together
+	
+	// Make room for a total of entries across all the groups
+	void reserve(int entries);
+	int capacity() const { return values_.size(); }
+	
+	double value(int group, int index = 0) { return values_[groupStarts_[group] + index]; }
+	const double *values(int group) { return &values_[groupStarts_[group]]; }
+	
+	// Whether the last ramp() changed an entry
+	bool changed(int group, int index = 0) {
+		int n = groupStarts_[group] + index;
+		return values_[n] != previousValues_[n];
+	}
+	
+	// Per-sample linear smoothing: the value position samples into the current update interval, moving in
+	// a straight line from the value before the last ramp() to the value after it rather than stepping.
+	double smoothedValue(int group, int index, int position) {
+		int n = groupStarts_[group] + index;
+		return previousValues_[n] + (values_[n] - previousValues_[n])*(double)(position + 1)*(1.0/PARAMETER_UPDATE_INTERVAL);
+	}
+	
+	// These match the Parameter methods of the same names
+	void setCurrentValue(int group, int index, double newValue);
+	void setRampValues(int group, int index, double startValue, timedParameter& rampValues);
+	void appendRampValues(int group, int index, timedParameter& rampValues);
+	void applyCommand(int group, int index, int type, double value, timedParameter& rampValues);
+	
+	// Advance every entry by PARAMETER_UPDATE_INTERVAL samples
+	void ramp();
+	
+	void print(ostream& output, int group, int index) const;	// Like Parameter's operator<<
+	
+private:
+	void startRamp(int n);				// Begin ramping entry n to the next value
+	void finishSegment(int n);			// Entry n has reached its target
+	void moveEntry(int from, int to);	// Swaps the ramp lists, so it doesn't allocate
+	
+	// Ramp list of entry n
+	void clearRamps(int n) { rampHeads_[n] = rampCounts_[n] = 0; }
+	void pushRamps(int n, const timedParameter& rampValues);
+	const parameterValue& frontRamp(int n) const { return rampAt(n, 0); }
+	void popRamp(int n) {
+		rampHeads_[n] = (rampHeads_[n] + 1) & (PARAMETER_RAMP_SIZE - 1);
+		rampCounts_[n]--;
+	}
+	const parameterValue& rampAt(int n, int i) const {
+		return rampStorage_[rampSlots_[n]*PARAMETER_RAMP_SIZE + ((rampHeads_[n] + i) & (PARAMETER_RAMP_SIZE - 1))];
+	}
+	
+	double updateRate_;					// Parameter updates per second (k-rate)
+	
+	vector<int> groupStarts_;			// First entry of each group
+	vector<int> groupSizes_;
+	int numEntries_;					// Entries in use, at the start of the vectors below; the rest are
+										// spare, each with an empty ramp list ready to be moved into place
+	
+	// Per-entry state used every ramp()
+	vector<double> values_;
+	vector<double> previousValues_;		// Values before the last ramp()
+	vector<double> multipliers_;
+	vector<double> increments_;
+	vector<int> remaining_;				// Updates left in the current segment
+	vector<int> decrements_;			// 1 while ramping, 0 while holding
+	
+	// Per-entry state used only at segment boundaries
+	vector<int> shapes_;
+	vector<int> rampSlots_;				// Which block of rampStorage_ holds the entry's ramp list
+	vector<int> rampHeads_;				// Position of the current segment within the block
+	vector<int> rampCounts_;			// Segments in the list
+	vector<parameterValue> rampStorage_;	// PARAMETER_RAMP_SIZE segments for each entry of the capacity
+};
+
+// Parameter changes travel from the control threads to the render thread as fixed-size commands, so
+// that the render thread never has to wait on a lock to pick them up.  The meaning of parameter and index
+// is up to the synth receiving the command.  A command with a time waits in the queue until the synth
+// renders that moment, holding up any commands behind it.
+
+typedef struct
+{
+	int parameter;				// Which parameter to change
+	int index;					// Element of a vector parameter, otherwise 0
+	int type;					// kParameterCommandSet or kParameterCommandAppend
+	double time;				// Stream time at which to apply the change, or 0 for the next update
+	double value;				// Starting value, for kParameterCommandSet
+	int numRampValues;
+	parameterValue rampValues[PARAMETER_QUEUE_RAMP_SIZE];
+	timedParameter *longRamp;	// Ramp too long for rampValues, or NULL.  Owned by the queue.
+}
+parameterCommand;
+
+// Single-producer, single-consumer ring of parameterCommands.  Commands are staged one at a time and
+// become visible to the consumer together when commit() is called, so a group of related changes is
+// always applied at once.  The counters are free-running and each is only written by one side.  Storage
+// is only allocated once allocate() is called, since most synths (prototypes held by the note factories)
+// never need a queue.  A command's long ramp is created by the producer, and only deleted by the producer
+// once the slot comes round again (or by the destructor), so the consumer never touches the heap.
+
+class ParameterCommandQueue
+{
+public:
+	ParameterCommandQueue();
+	ParameterCommandQueue(const ParameterCommandQueue&);	// Not copied: a copy starts out empty and unallocated
+	
+	void allocate();
+	bool isAllocated() { return commands_ != NULL; }
+	
+	// Producer side
+	int space() { return PARAMETER_QUEUE_SIZE - (int)(stagedPointer_ - readPointer_); }	// Including staged commands
+	parameterCommand *stage();				// Returns the next free slot, or NULL if full
+	void commit();							// Publish all the staged commands
+	
+	// Consumer side
+	parameterCommand *front();				// Returns the oldest command, or NULL if empty
+	void pop();
+	
+	~ParameterCommandQueue();
+	
+private:
+	parameterCommand *commands_;
+	unsigned int stagedPointer_;			// Written and read only by the producer
+	volatile unsigned int writePointer_;	// Written by the producer
+	volatile unsigned int readPointer_;		// Written by the consumer
+};
+
 #endif // PARAMETER_H
\ No newline at end of file
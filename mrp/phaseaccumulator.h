@@ -0,0 +1,49 @@
+/*
+ *  phaseaccumulator.h
+ *  mrp
+ *
+ */
+
+#ifndef PHASE_ACCUMULATOR_H
+#define PHASE_ACCUMULATOR_H
+
+#include <stdint.h>
+
+#define PHASE_ACCUMULATOR_CYCLE	4294967296.0	// 2^32: one full cycle in fixed-point phase units
+
+// Oscillator phase held as a 32-bit unsigned fraction of a cycle.  Wraparound is free (integer overflow
+// does it), the top bits index a power-of-two wavetable directly (see SineTable::lookupPhase()), and the
+// phase of harmonic n is exactly n times the fundamental phase, again with free wraparound.  This replaces
+// the fmod(phase + frequency*sampleLength, 1.0) that every oscillator used to perform each sample.
+
+class PhaseAccumulator
+{
+public:
+	PhaseAccumulator() : phase_(0), increment_(0) {}
+
+	// Convert a phase in cycles to fixed point, wrapping any real value (including negative ones) into
+	// [0, 1).  Valid for |cycles| < 2^31.
+	static uint32_t fromCycles(double cycles) { return (uint32_t)(int64_t)(cycles * PHASE_ACCUMULATOR_CYCLE); }
+
+	// Convert a fixed-point phase back to cycles, in the range [0, 1)
+	static float toCycles(uint32_t phase) { return (float)((double)phase * (1.0 / PHASE_ACCUMULATOR_CYCLE)); }
+
+	// Phase increment per sample for a given frequency.  Negative frequencies run the phase backwards.
+	static uint32_t incrementForFrequency(double frequency, double sampleLength) { return fromCycles(frequency * sampleLength); }
+
+	uint32_t phase() { return phase_; }
+	void setPhase(uint32_t phase) { phase_ = phase; }
+	void reset() { phase_ = 0; }
+
+	void setFrequency(double frequency, double sampleLength) { increment_ = incrementForFrequency(frequency, sampleLength); }
+
+	// Advance by one sample, at the frequency last set or at the one given.  Returns the new phase.
+	uint32_t advance() { return (phase_ += increment_); }
+	uint32_t advance(double frequency, double sampleLength) { return (phase_ += incrementForFrequency(frequency, sampleLength)); }
+
+private:
+	uint32_t phase_;
+	uint32_t increment_;
+};
+
+#endif // PHASE_ACCUMULATOR_H
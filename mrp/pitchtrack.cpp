@@ -15,8 +15,6 @@
 #define TWELVE_OVER_LN2	(17.312340490667561)	// 12/log(2)
 #define PTRK_PROGRAM_ID(prog, note) (unsigned int)((prog << 8) + note)
 
-extern WaveTable waveTable;
-
 #pragma mark PitchTrackController
 
 PitchTrackController::PitchTrackController(MidiController *midiController)
@@ -936,7 +934,8 @@ PitchTrackNote* PitchTrackNote::createNote(int audioChannel, int mrpChannel, int
 		else
 			cerr << "PTN createNote() warning: relativeOutputFrequencies_ too short\n";		
 		
-		newSynth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel);
+		newSynth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel,
+										render_->inputHistory());
 		out->synths_.push_back(newSynth);
 	}
 	
@@ -1048,45 +1047,34 @@ void PitchTrackNote::assignPitchTrackSynthParameters(PitchTrackSynth *synth,
 
 // Constructor
 
-PitchTrackSynth::PitchTrackSynth(float sampleRate) : SynthBase(sampleRate)
+PitchTrackSynth::PitchTrackSynth(float sampleRate) : SynthBase(sampleRate), parameters_(sampleRate, kNumParameterGroups)
 {
 	float defaultFreq = 440.0;
 	
-	// Initialize the mutex
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize parameterMutex in PitchTrackSynth\n";
-		// Throw exception?
-	}	
-	if(pthread_mutex_init(&freqAmpMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize freqAmpMutex in PitchTrackSynth\n";
-		// Throw exception?
-	}		
-	
-	// Set defaults for changeable parameters, so we don't have to worry about allocating Parameters later
+	// Set defaults for changeable parameters
 	maxDuration_ = -1.0;		// < 0 means ignore
 	shouldRelease_ = false;
 	decayTimeConstant_ = 0.0;
-	outputCenterFrequency_ = new Parameter(defaultFreq, sampleRate);
-	inputCenterFrequency_ = new Parameter(defaultFreq, sampleRate);
-	inputGain_ = new Parameter(-1.0, sampleRate);	// < 0 means don't follow amplitude
-	pitchFollowRange_ = new Parameter(0.0, sampleRate);
-	pitchFollowRatio_ = new Parameter(0.0, sampleRate);
-	harmonicCentroid_ = new Parameter(1.0, sampleRate);
+	parameters_.resize(kGroupOutputCenterFrequency, 1, defaultFreq);
+	parameters_.resize(kGroupInputCenterFrequency, 1, defaultFreq);
+	parameters_.resize(kGroupInputGain, 1, -1.0);	// < 0 means don't follow amplitude
+	parameters_.resize(kGroupPitchFollowRange, 1, 0.0);
+	parameters_.resize(kGroupPitchFollowRatio, 1, 0.0);
+	parameters_.resize(kGroupHarmonicCentroid, 1, 1.0);
 	harmonicCentroidMultiply_ = false;
+	reservedHarmonics_ = 0;
 	
 	// By default, amplitude 0.1 (-20dB) and no filters
-	maxGlobalAmplitude_ = new Parameter(0.1, sampleRate);
+	parameters_.resize(kGroupMaxGlobalAmplitude, 1, 0.1);
 	
-	harmonicAmplitudes_.push_back(new Parameter(1.0, sampleRate)); // By default, 1 sine wave
-	harmonicPhases_.push_back(new Parameter(0.0, sampleRate));
+	parameters_.resize(kGroupHarmonicAmplitudes, 1, 1.0);	// By default, 1 sine wave
+	parameters_.resize(kGroupHarmonicPhases, 1, 0.0);
 	
 	// Initialize the envelope follower
 	inputEnvelopeFollower_ = new EnvelopeFollower(0.0, sampleRate);	// Start with timeConstant = 0
 	
 	// State variables
-	phase_ = 0.0;
+	phase_.reset();
 	lastFrequency_ = defaultFreq;
 	lastAmplitude_ = 0.0;
 	minInputFrequency_ = maxInputFrequency_ = defaultFreq;
@@ -1098,10 +1086,8 @@ PitchTrackSynth::PitchTrackSynth(float sampleRate) : SynthBase(sampleRate)
 }
 
 // Copy constructor
-PitchTrackSynth::PitchTrackSynth(const PitchTrackSynth& copy) : SynthBase(copy)
+PitchTrackSynth::PitchTrackSynth(const PitchTrackSynth& copy) : SynthBase(copy), parameters_(copy.parameters_)
 {
-	int i;
-	
 #ifdef DEBUG_ALLOCATION
 	cout << "*** PitchTrackSynth (copy constructor)\n";
 #endif
@@ -1117,67 +1103,13 @@ PitchTrackSynth::PitchTrackSynth(const PitchTrackSynth& copy) : SynthBase(copy)
 	minInputFrequency_ = copy.minInputFrequency_;
 	maxInputFrequency_ = copy.maxInputFrequency_;
 	shouldRelease_ = copy.shouldRelease_;
+	reservedHarmonics_ = 0;		// Copies aren't rendering yet
 	
-	// Initialize a new mutex.  Just because the copy was locked doesn't mean this one should be.
-	
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize parameterMutex in PitchTrackSynth\n";
-		// Throw exception?
-	}	
-	if(pthread_mutex_init(&freqAmpMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize freqAmpMutex in PitchTrackSynth\n";
-		// Throw exception?
-	}		
-	
-	
-	// Copy all the pointer objects
-	if(copy.outputCenterFrequency_ != NULL)
-		outputCenterFrequency_ = new Parameter(*copy.outputCenterFrequency_);
-	else
-		outputCenterFrequency_ = NULL;
-	if(copy.inputCenterFrequency_ != NULL)
-		inputCenterFrequency_ = new Parameter(*copy.inputCenterFrequency_);
-	else
-		inputCenterFrequency_ = NULL;	
-	if(copy.maxGlobalAmplitude_ != NULL)
-		maxGlobalAmplitude_ = new Parameter(*copy.maxGlobalAmplitude_);
-	else
-		maxGlobalAmplitude_ = NULL;
-	if(copy.inputGain_ != NULL)
-		inputGain_ = new Parameter(*copy.inputGain_);
-	else
-		inputGain_ = NULL;
-	if(copy.inputGain_ != NULL)
-		inputGain_ = new Parameter(*copy.inputGain_);
-	else
-		inputGain_ = NULL;
-	if(copy.pitchFollowRange_ != NULL)
-		pitchFollowRange_ = new Parameter(*copy.pitchFollowRange_);
-	else
-		pitchFollowRange_ = NULL;	
-	if(copy.pitchFollowRatio_ != NULL)
-		pitchFollowRatio_ = new Parameter(*copy.pitchFollowRatio_);
-	else
-		pitchFollowRatio_ = NULL;	
-	if(copy.harmonicCentroid_ != NULL)
-		harmonicCentroid_ = new Parameter(*copy.harmonicCentroid_);
-	else
-		harmonicCentroid_ = NULL;
-	
+	// Copy the pointer objects
 	if(copy.inputEnvelopeFollower_ != NULL)
 		inputEnvelopeFollower_ = new EnvelopeFollower(*copy.inputEnvelopeFollower_);
 	else
 		inputEnvelopeFollower_ = NULL;
-
-	// Finally, copy over the vector parameters.  Fortunately, we shouldn't have NULL pointers in the
-	// vectors.
-	
-	for(i = 0; i < copy.harmonicAmplitudes_.size(); i++)
-		harmonicAmplitudes_.push_back(new Parameter(*copy.harmonicAmplitudes_[i]));
-	for(i = 0; i < copy.harmonicPhases_.size(); i++)
-		harmonicPhases_.push_back(new Parameter(*copy.harmonicPhases_[i]));
 }
 
 // begin() methods: we subclass these to handle maximum duration
@@ -1195,7 +1127,7 @@ void PitchTrackSynth::begin()
 
 void PitchTrackSynth::begin(PaTime when)
 {
-	SynthBase::begin();
+	SynthBase::begin(when);
 	
 	if(maxDuration_ >= 0.0)
 		shouldRelease_ = true;
@@ -1205,97 +1137,74 @@ void PitchTrackSynth::begin(PaTime when)
 
 void PitchTrackSynth::setMaxDuration(double maxDuration)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	maxDuration_ = maxDuration;
-	if(maxDuration_ >= 0.0)
-		shouldRelease_ = true;
-		
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterMaxDuration, 0, maxDuration);
+	endParameters();
 }
 
 void PitchTrackSynth::setDecayTimeConstant(double decayTimeConstant)
 {
-	pthread_mutex_lock(&parameterMutex_);	
-	
-	decayTimeConstant_ = decayTimeConstant;	// TODO: implement this
-	inputEnvelopeFollower_->updateTimeConstant(decayTimeConstant_);
-	
-	pthread_mutex_unlock(&parameterMutex_);			
+	beginParameters();
+	postParameter(kParameterDecayTimeConstant, 0, decayTimeConstant);
+	endParameters();
 }
 
 void PitchTrackSynth::setHarmonicCentroidMultiply(bool multiply)
 {
-	pthread_mutex_lock(&parameterMutex_);	
-	
-	harmonicCentroidMultiply_ = multiply;
-	
-	pthread_mutex_unlock(&parameterMutex_);			
+	beginParameters();
+	postParameter(kParameterHarmonicCentroidMultiply, 0, (multiply ? 1.0 : 0.0));
+	endParameters();
 }
 
 // These methods replace the current parameters with new ones, starting immediately
 
 void PitchTrackSynth::setInputCenterFrequency(double currentCenterFrequency, timedParameter& rampCenterFrequency)
 {
-	pthread_mutex_lock(&parameterMutex_);		// Acquire lock ensuring we're not actively rendering
-	
-	inputCenterFrequency_->setRampValues(currentCenterFrequency, rampCenterFrequency);	
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterInputCenterFrequency, 0, kParameterCommandSet, currentCenterFrequency, rampCenterFrequency);
+	endParameters();
 }
 
 void PitchTrackSynth::setOutputCenterFrequency(double currentCenterFrequency, timedParameter& rampCenterFrequency)
 {
-	pthread_mutex_lock(&parameterMutex_);		// Acquire lock ensuring we're not actively rendering
-	
-	outputCenterFrequency_->setRampValues(currentCenterFrequency, rampCenterFrequency);	
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterOutputCenterFrequency, 0, kParameterCommandSet, currentCenterFrequency, rampCenterFrequency);
+	endParameters();
 }
 
 void PitchTrackSynth::setMaxGlobalAmplitude(double currentAmplitude, timedParameter& rampAmplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	maxGlobalAmplitude_->setRampValues(currentAmplitude, rampAmplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterMaxGlobalAmplitude, 0, kParameterCommandSet, currentAmplitude, rampAmplitude);
+	endParameters();
 }
 
 void PitchTrackSynth::setInputGain(double currentGain, timedParameter& rampGain)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	inputGain_->setRampValues(currentGain, rampGain);
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterInputGain, 0, kParameterCommandSet, currentGain, rampGain);
+	endParameters();
 }
 
 void PitchTrackSynth::setPitchFollowRange(double currentRange, timedParameter& rampRange)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	pitchFollowRange_->setRampValues(currentRange, rampRange);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterPitchFollowRange, 0, kParameterCommandSet, currentRange, rampRange);
+	endParameters();
 }
 
 void PitchTrackSynth::setPitchFollowRatio(double currentRatio, timedParameter& rampRatio)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	pitchFollowRatio_->setRampValues(currentRatio, rampRatio);
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterPitchFollowRatio, 0, kParameterCommandSet, currentRatio, rampRatio);
+	endParameters();
 }
 
 void PitchTrackSynth::setHarmonicCentroid(double currentCentroid, timedParameter& rampCentroid)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	harmonicCentroid_->setRampValues(currentCentroid, rampCentroid);
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterHarmonicCentroid, 0, kParameterCommandSet, currentCentroid, rampCentroid);
+	endParameters();
 }
 
 
@@ -1305,126 +1214,82 @@ void PitchTrackSynth::setHarmonicAmplitudes(vector<double>& currentHarmonicAmpli
 	// Use the currentHarmonicAmplitudes size as our metric.  If rampHarmonicAmplitudes.size is greater,
 	// ignore the extra.  If it is smaller, don't ramp the last parameters.
 	int i, size = currentHarmonicAmplitudes.size();
+	timedParameter emptyRamp;
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicAmplitudes_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic amplitude, size was " << harmonicAmplitudes_.size() << endl;
-#endif
-		harmonicAmplitudes_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-	{
-		if(i < rampHarmonicAmplitudes.size())
-			harmonicAmplitudes_[i]->setRampValues(currentHarmonicAmplitudes[i], rampHarmonicAmplitudes[i]);
-		else
-			harmonicAmplitudes_[i]->setCurrentValue(currentHarmonicAmplitudes[i]);
-	}
+		postParameter(kParameterHarmonicAmplitude, i, kParameterCommandSet, currentHarmonicAmplitudes[i],
+					  (i < rampHarmonicAmplitudes.size() ? rampHarmonicAmplitudes[i] : emptyRamp));
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void PitchTrackSynth::setHarmonicPhases(vector<double>& currentHarmonicPhases,
 					   vector<timedParameter>& rampHarmonicPhases)
 {
-	// Use the currentHarmonicAmplitudes size as our metric.  If rampHarmonicAmplitudes.size is greater,
+	// Use the currentHarmonicPhases size as our metric.  If rampHarmonicPhases.size is greater,
 	// ignore the extra.  If it is smaller, don't ramp the last parameters.
 	int i, size = currentHarmonicPhases.size();
+	timedParameter emptyRamp;
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicPhases_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic phase, size was " << harmonicPhases_.size() << endl;
-#endif
-		harmonicPhases_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-	{
-		if(i < rampHarmonicPhases.size())
-			harmonicPhases_[i]->setRampValues(currentHarmonicPhases[i], rampHarmonicPhases[i]);
-		else
-			harmonicPhases_[i]->setCurrentValue(currentHarmonicPhases[i]);
-	}
+		postParameter(kParameterHarmonicPhase, i, kParameterCommandSet, currentHarmonicPhases[i],
+					  (i < rampHarmonicPhases.size() ? rampHarmonicPhases[i] : emptyRamp));
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 // These methods schedule new parameter additions at the end of the current ones
 void PitchTrackSynth::appendInputCenterFrequency(timedParameter& centerFrequency)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	inputCenterFrequency_->appendRampValues(centerFrequency); 
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterInputCenterFrequency, 0, kParameterCommandAppend, 0.0, centerFrequency);
+	endParameters();
 }
 
 void PitchTrackSynth::appendOuputCenterFrequency(timedParameter& centerFrequency)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	outputCenterFrequency_->appendRampValues(centerFrequency); 
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterOutputCenterFrequency, 0, kParameterCommandAppend, 0.0, centerFrequency);
+	endParameters();
 }
 
 void PitchTrackSynth::appendMaxGlobalAmplitude(timedParameter& amplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	maxGlobalAmplitude_->appendRampValues(amplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);		
+	beginParameters();
+	postParameter(kParameterMaxGlobalAmplitude, 0, kParameterCommandAppend, 0.0, amplitude);
+	endParameters();
 }
 
 void PitchTrackSynth::appendInputGain(timedParameter& inputGain)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	inputGain_->appendRampValues(inputGain);
-	
-	pthread_mutex_unlock(&parameterMutex_);			
+	beginParameters();
+	postParameter(kParameterInputGain, 0, kParameterCommandAppend, 0.0, inputGain);
+	endParameters();
 }
 
 void PitchTrackSynth::appendPitchFollowRange(timedParameter& range)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	pitchFollowRange_->appendRampValues(range);
-	
-	pthread_mutex_unlock(&parameterMutex_);			
+	beginParameters();
+	postParameter(kParameterPitchFollowRange, 0, kParameterCommandAppend, 0.0, range);
+	endParameters();
 }
 
 void PitchTrackSynth::appendPitchFollowRatio(timedParameter& ratio)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	pitchFollowRatio_->appendRampValues(ratio);
-	
-	pthread_mutex_unlock(&parameterMutex_);			
+	beginParameters();
+	postParameter(kParameterPitchFollowRatio, 0, kParameterCommandAppend, 0.0, ratio);
+	endParameters();
 }
 
 void PitchTrackSynth::appendHarmonicCentroid(timedParameter& inputCentroid)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	harmonicCentroid_->appendRampValues(inputCentroid);
-	
-	pthread_mutex_unlock(&parameterMutex_);			
+	beginParameters();
+	postParameter(kParameterHarmonicCentroid, 0, kParameterCommandAppend, 0.0, inputCentroid);
+	endParameters();
 }
 
 
@@ -1432,60 +1297,141 @@ void PitchTrackSynth::appendHarmonicAmplitudes(vector<timedParameter>& harmonicA
 {
 	int i, size = harmonicAmplitudes.size();
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicAmplitudes_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic amplitude, size was " << harmonicAmplitudes_.size() << endl;
-#endif
-		harmonicAmplitudes_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		harmonicAmplitudes_[i]->appendRampValues(harmonicAmplitudes[i]);
+		postParameter(kParameterHarmonicAmplitude, i, kParameterCommandAppend, 0.0, harmonicAmplitudes[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void PitchTrackSynth::appendHarmonicPhases(vector<timedParameter>& harmonicPhases)
 {
 	int i, size = harmonicPhases.size();
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicPhases_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic phase, size was " << harmonicPhases_.size() << endl;
-#endif
-		harmonicPhases_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		harmonicPhases_[i]->appendRampValues(harmonicPhases[i]);
+		postParameter(kParameterHarmonicPhase, i, kParameterCommandAppend, 0.0, harmonicPhases[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 // This function is called by the external process that provides pitch-tracking data
-// lastFrequency and lastAmplitude are used in the render loop.
+// lastFrequency and lastAmplitude are used in the render loop.  Both values travel through the parameter
+// queue together, so the render loop never sees a frequency paired with the wrong amplitude.
 
 void PitchTrackSynth::setFrequencyAmplitudeData(double freq, double amp)
 {
-	pthread_mutex_lock(&freqAmpMutex_);
-	lastFrequency_ = freq;
-	lastAmplitude_ = amp;
+	beginParameters();
+	postParameter(kParameterLastFrequency, 0, freq);
+	postParameter(kParameterLastAmplitude, 0, amp);
 	//cout << "freq = " << freq << " amp = " << amp << endl;
-	pthread_mutex_unlock(&freqAmpMutex_);
+	endParameters();
+}
+
+// Make room for PITCHTRACK_RESERVED_HARMONICS harmonics (or however many there already are) in the
+// parameters and the oscillator bank, so that harmonics added while rendering don't allocate.  A harmonic
+// shifted by a fractional centroid takes two oscillators.
+
+void PitchTrackSynth::reserveRenderStorage()
+{
+	int numHarmonics = max(PITCHTRACK_RESERVED_HARMONICS, max(parameters_.size(kGroupHarmonicAmplitudes),
+															  parameters_.size(kGroupHarmonicPhases)));
+	
+	parameters_.reserve(parameters_.size() + 2*numHarmonics
+						- parameters_.size(kGroupHarmonicAmplitudes) - parameters_.size(kGroupHarmonicPhases));
+	oscillators_.reserve(2*numHarmonics);
+	
+	reservedHarmonics_ = numHarmonics;
+}
+
+// Whether a change posted while rendering fits in the storage reserveRenderStorage() made
+
+bool PitchTrackSynth::parameterFits(int parameter, int index)
+{
+	switch(parameter)
+	{
+		case kParameterHarmonicAmplitude:
+		case kParameterHarmonicPhase:
+			return (index < reservedHarmonics_);
+		default:
+			return true;
+	}
+}
+
+// Apply one parameter change posted by the methods above.  Runs on the render thread once the synth
+// is being rendered, or directly on the calling thread before then.
+
+void PitchTrackSynth::applyParameter(int parameter, int index, int type, double value, timedParameter& ramp)
+{
+	switch(parameter)
+	{
+		case kParameterMaxDuration:
+			maxDuration_ = value;
+			if(maxDuration_ >= 0.0)
+				shouldRelease_ = true;
+			break;
+		case kParameterDecayTimeConstant:
+			decayTimeConstant_ = value;	// TODO: implement this
+			inputEnvelopeFollower_->updateTimeConstant(decayTimeConstant_);
+			break;
+		case kParameterHarmonicCentroidMultiply:
+			harmonicCentroidMultiply_ = (value != 0.0);
+			break;
+		case kParameterInputCenterFrequency:
+			parameters_.applyCommand(kGroupInputCenterFrequency, 0, type, value, ramp);
+			break;
+		case kParameterOutputCenterFrequency:
+			parameters_.applyCommand(kGroupOutputCenterFrequency, 0, type, value, ramp);
+			break;
+		case kParameterMaxGlobalAmplitude:
+			parameters_.applyCommand(kGroupMaxGlobalAmplitude, 0, type, value, ramp);
+			break;
+		case kParameterInputGain:
+			parameters_.applyCommand(kGroupInputGain, 0, type, value, ramp);
+			break;
+		case kParameterPitchFollowRange:
+			parameters_.applyCommand(kGroupPitchFollowRange, 0, type, value, ramp);
+			break;
+		case kParameterPitchFollowRatio:
+			parameters_.applyCommand(kGroupPitchFollowRatio, 0, type, value, ramp);
+			break;
+		case kParameterHarmonicCentroid:
+			parameters_.applyCommand(kGroupHarmonicCentroid, 0, type, value, ramp);
+			break;
+		case kParameterHarmonicAmplitude:
+			// Check if the change is beyond our internal storage, and if so, increase our storage
+			// accordingly.  Use 0 as the default starting amplitude
+			if(index >= parameters_.size(kGroupHarmonicAmplitudes))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding harmonic amplitude, size was " << parameters_.size(kGroupHarmonicAmplitudes) << endl;
+#endif
+				parameters_.resize(kGroupHarmonicAmplitudes, index + 1, 0.0);
+			}
+			parameters_.applyCommand(kGroupHarmonicAmplitudes, index, type, value, ramp);
+			break;
+		case kParameterHarmonicPhase:
+			// Use 0 as the default starting phase
+			if(index >= parameters_.size(kGroupHarmonicPhases))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding harmonic phase, size was " << parameters_.size(kGroupHarmonicPhases) << endl;
+#endif
+				parameters_.resize(kGroupHarmonicPhases, index + 1, 0.0);
+			}
+			parameters_.applyCommand(kGroupHarmonicPhases, index, type, value, ramp);
+			break;
+		case kParameterLastFrequency:
+			lastFrequency_ = value;
+			break;
+		case kParameterLastAmplitude:
+			lastAmplitude_ = value;
+			break;
+		default:
+			break;
+	}
 }
 
 // Render one buffer of output.  input holds the incoming audio data.  output may already contain
@@ -1496,25 +1442,30 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 {
 	float *outBuffer = (float *)output;		// and increment as frames are processed
 	float outSample;
+	uint32_t phase;
 	PaTime bufferStartTime, bufferEndTime;
-	unsigned long lastFrame = frameCount;
-	unsigned long i, j;
-	vector<Parameter *>::iterator it;
+	unsigned long firstFrame = 0, lastFrame = frameCount;
+	unsigned long i;
 	bool willFinishAtEnd = false;
 	
-	if(!isRunning_)			// Don't do anything if the note hasn't started
-		return paContinue;
-	
 	bufferStartTime = timeInfo->outputBufferDacTime;
 	bufferEndTime = bufferStartTime + (double)frameCount*sampleLength_;	// Time this buffer will end
 	
+	applyParameterCommands(bufferStartTime);	// Pick up parameter changes even if we're not running yet
+	
+	if(!isRunning_)			// Don't do anything if the note hasn't started
+		return paContinue;
+	
 	if(startTime_ >= bufferEndTime)
 		return paContinue;	// Note will begin, but not during this callback
 	
 	// If the note was set to begin "now", calibrate its start time to the beginning of this buffer
-	// We use the start time to calculate the offset from the beginning of the note.
+	// We use the start time to calculate the offset from the beginning of the note.  A note set to
+	// begin partway through this buffer starts at that frame.
 	if(startTime_ == 0)	
 		startTime_ = bufferStartTime;
+	else if(startTime_ > bufferStartTime)
+		firstFrame = frameAtTime(startTime_, bufferStartTime);
 	
 	if(shouldRelease_)
 	{
@@ -1537,7 +1488,7 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 		}
 		else if(releaseTime_ < bufferEndTime)		// Release mid-buffer
 		{
-			lastFrame = (unsigned long)((releaseTime_ - bufferStartTime)*sampleRate_);
+			lastFrame = frameAtTime(releaseTime_, bufferStartTime);
 #ifdef DEBUG_MESSAGES_EXTRA
 			cout << "Releasing at sample " << lastFrame << endl;
 #endif
@@ -1549,7 +1500,9 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 	
 	// Now calculate all the samples we need, either a full or partial frame.
 	
-	for(i = 0; i < lastFrame; i++)
+	outBuffer += firstFrame;
+	
+	for(i = firstFrame; i < lastFrame; i++)
 	{
 		float vcoFrequency;
 		float rawOutputAmplitude, filteredOutputAmplitude;
@@ -1559,59 +1512,50 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 		// A parameter needs ramping when there is at least one item in its timedParameter deque.
 		if(sampleNumber_ % PARAMETER_UPDATE_INTERVAL == 0)
 		{
-			pthread_mutex_lock(&parameterMutex_);	// Acquire lock so the parameters don't change
-			
-			maxGlobalAmplitude_->ramp(PARAMETER_UPDATE_INTERVAL);
-			inputCenterFrequency_->ramp(PARAMETER_UPDATE_INTERVAL);
-			outputCenterFrequency_->ramp(PARAMETER_UPDATE_INTERVAL);
-			inputGain_->ramp(PARAMETER_UPDATE_INTERVAL);
-			pitchFollowRange_->ramp(PARAMETER_UPDATE_INTERVAL);
-			pitchFollowRatio_->ramp(PARAMETER_UPDATE_INTERVAL);
-			harmonicCentroid_->ramp(PARAMETER_UPDATE_INTERVAL);
-
-			minInputFrequency_ = inputCenterFrequency_->currentValue()/pitchFollowRange_->currentValue();
-			maxInputFrequency_ = inputCenterFrequency_->currentValue()*pitchFollowRange_->currentValue();			
+			applyParameterCommands(bufferStartTime + (PaTime)i*sampleLength_);
 			
-			for(it = harmonicAmplitudes_.begin(); it != harmonicAmplitudes_.end(); it++)
-				(*it)->ramp(PARAMETER_UPDATE_INTERVAL);			
-			for(it = harmonicPhases_.begin(); it != harmonicPhases_.end(); it++)
-				(*it)->ramp(PARAMETER_UPDATE_INTERVAL);
+			parameters_.ramp();		// All of them in one pass
+
+			minInputFrequency_ = parameters_.value(kGroupInputCenterFrequency)/parameters_.value(kGroupPitchFollowRange);
+			maxInputFrequency_ = parameters_.value(kGroupInputCenterFrequency)*parameters_.value(kGroupPitchFollowRange);
 			
-			pthread_mutex_unlock(&parameterMutex_);
+			updateOscillators();
 		}	
+		else if(i == firstFrame)
+		{
+			// Pick up any changes made since the last callback
+			updateOscillators();
+		}
 		
-		// Lock this mutex during the calculations that use lastFrequency and lastAmplitude.  We expect that
-		// these values might change from one frame to the next, so we don't want to use the coarser-grained
-		// parameter mutex.
+		// lastFrequency_ and lastAmplitude_ arrive through the parameter queue along with everything else,
+		// so they stay consistent with each other between parameter updates.
 		
 		// FIXME: Render actually happens a good deal before the audio comes out, and the timing isn't specified.
 		// The interaction of threads here might produce somewhat strange results....
 		
-		pthread_mutex_lock(&freqAmpMutex_);		
-	
 		if(lastFrequency_ > minInputFrequency_ && lastFrequency_ < maxInputFrequency_)
 			frequencyInRange = true;
 		
 		// Calculate the output frequency, which follows the input unless the input is out of range (or
 		// unless we've disabled this feature
 		
-		if(pitchFollowRatio_->currentValue() != 0.0 && frequencyInRange)
+		if(parameters_.value(kGroupPitchFollowRatio) != 0.0 && frequencyInRange)
 		{
 			float outInRatio;
 			
 			// We want one semitone in to mean one semitone out in deviation, but that will require scaling
 			// for the respective registers of the tones
 			
-			if(inputCenterFrequency_->currentValue() != 0.0)		
-				outInRatio = outputCenterFrequency_->currentValue() / inputCenterFrequency_->currentValue();
+			if(parameters_.value(kGroupInputCenterFrequency) != 0.0)		
+				outInRatio = parameters_.value(kGroupOutputCenterFrequency) / parameters_.value(kGroupInputCenterFrequency);
 			else
 				outInRatio = 1.0;
 
-			vcoFrequency = outputCenterFrequency_->currentValue() + 
-								(lastFrequency_ - inputCenterFrequency_->currentValue())*pitchFollowRatio_->currentValue()*outInRatio;
+			vcoFrequency = parameters_.value(kGroupOutputCenterFrequency) + 
+								(lastFrequency_ - parameters_.value(kGroupInputCenterFrequency))*parameters_.value(kGroupPitchFollowRatio)*outInRatio;
 		}
 		else
-			vcoFrequency = outputCenterFrequency_->currentValue();	// Stay with center frequency
+			vcoFrequency = parameters_.value(kGroupOutputCenterFrequency);	// Stay with center frequency
 			   
 		// Calculate the output amplitude, which depends on these factors:
 		//   (1) The strength of the input signal, multiplied by the input gain
@@ -1620,18 +1564,18 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 		//       center frequency.  That's so we don't get weird clicks and pops as the input signal passes in
 		//       and out of range.
 		
-		if(inputGain_->currentValue() >= 0.0)
+		if(parameters_.value(kGroupInputGain) >= 0.0)
 		{
-			rawOutputAmplitude = lastAmplitude_*inputGain_->currentValue();
-			if(rawOutputAmplitude > maxGlobalAmplitude_->currentValue())
-				rawOutputAmplitude = maxGlobalAmplitude_->currentValue();
+			rawOutputAmplitude = lastAmplitude_*parameters_.value(kGroupInputGain);
+			if(rawOutputAmplitude > parameters_.value(kGroupMaxGlobalAmplitude))
+				rawOutputAmplitude = parameters_.value(kGroupMaxGlobalAmplitude);
 		}
 		else
-			rawOutputAmplitude = maxGlobalAmplitude_->currentValue();
+			rawOutputAmplitude = parameters_.value(kGroupMaxGlobalAmplitude);
 		
 		// TODO: averaging of input frequencies?
 		
-		if(minInputFrequency_ < maxInputFrequency_ && inputGain_->currentValue() >= 0.0)	// True if pitchFollowRange > 1.0
+		if(minInputFrequency_ < maxInputFrequency_ && parameters_.value(kGroupInputGain) >= 0.0)	// True if pitchFollowRange > 1.0
 		{
 			// Calculate the distance from centerFrequency to the current frequency, and do a linear rolloff in
 			// amplitude.  In perceptual (logarithmic) space, the rolloff will be the steepest toward the edges,
@@ -1643,82 +1587,35 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 				rawOutputAmplitude = 0.0;
 			else
 			{
-				if(lastFrequency_ <= inputCenterFrequency_->currentValue())
+				if(lastFrequency_ <= parameters_.value(kGroupInputCenterFrequency))
 				{
-					rawOutputAmplitude *= (lastFrequency_ - minInputFrequency_) / (inputCenterFrequency_->currentValue() - minInputFrequency_);
+					rawOutputAmplitude *= (lastFrequency_ - minInputFrequency_) / (parameters_.value(kGroupInputCenterFrequency) - minInputFrequency_);
 				}
 				else
 				{				
-					rawOutputAmplitude *= (maxInputFrequency_ - lastFrequency_) / (maxInputFrequency_ - inputCenterFrequency_->currentValue());
+					rawOutputAmplitude *= (maxInputFrequency_ - lastFrequency_) / (maxInputFrequency_ - parameters_.value(kGroupInputCenterFrequency));
 				}
 			}
 		}
-
-		// Unlock the frequency/amplitude mutex
-		pthread_mutex_unlock(&freqAmpMutex_);	
 		
-		if(inputGain_->currentValue() >= 0.0)
+		if(parameters_.value(kGroupInputGain) >= 0.0)
 		{
 			filteredOutputAmplitude = inputEnvelopeFollower_->filter(rawOutputAmplitude);
-			if(filteredOutputAmplitude > maxGlobalAmplitude_->currentValue())
-				filteredOutputAmplitude = maxGlobalAmplitude_->currentValue();
+			if(filteredOutputAmplitude > parameters_.value(kGroupMaxGlobalAmplitude))
+				filteredOutputAmplitude = parameters_.value(kGroupMaxGlobalAmplitude);
 		}
 		else
 			filteredOutputAmplitude = rawOutputAmplitude; // < 0 means bypass the filter process
 		
 		// Increment the phase according to the current frequency
-		phase_ = fmod(phase_ + vcoFrequency*sampleLength_, 1.0);
+		phase = phase_.advance(vcoFrequency, sampleLength_);
 
 		// Calculate the output as a sum of sine waves at each harmonic
 		outSample = 0.0;
-
-		// Harmonic amplitudes refer directly to the strength of each partial at the output
-		for(j = 0; j < harmonicAmplitudes_.size(); j++)
-		{
-			if(harmonicAmplitudes_[j]->currentValue() == 0.0)
-				continue;
-
-			float hPhase = (j < harmonicPhases_.size() ? harmonicPhases_[j]->currentValue() : 0.0);
-			
-			if(harmonicCentroid_->currentValue() == 1.0)
-			{
-				outSample += (float)(harmonicAmplitudes_[j]->currentValue())
-							* waveTable.lookupInterp(waveTableSine, phase_*(float)(j+1)+hPhase);
-			}
-			else 
-			{
-				// Calculate the actual contributions of this harmonic based on the centroid, which
-				// could shift or scale its frequency value.
-				
-				double num;
-				
-				if(harmonicCentroidMultiply_)
-					num = (j+1) * harmonicCentroid_->currentValue();
-				else
-					num = (j+1) + (harmonicCentroid_->currentValue() - 1.0);					
-
-				// val will most probably lie between two integers, in which case we assign each of its neighbors a weighted
-				// sum.  Keep some sort of limit on how many harmonics can be defined this way, so the system doesn't get
-				// too too slow.
-				
-				if(num == floor(num))	// num is a pure integer
-				{
-					outSample += (float)(harmonicAmplitudes_[j]->currentValue())
-								  * waveTable.lookupInterp(waveTableSine, phase_*num+hPhase);
-				}
-				else					// num has a fractional component
-				{
-					// harmonic below
-					outSample += (float)(harmonicAmplitudes_[j]->currentValue()) * (ceil(num) - num)
-									* waveTable.lookupInterp(waveTableSine, phase_*floor(num)+hPhase);
-					outSample += (float)(harmonicAmplitudes_[j]->currentValue()) * (num - floor(num))
-									* waveTable.lookupInterp(waveTableSine, phase_*ceil(num)+hPhase);					
-				}				
-			}
-		}
+		oscillators_.render(&outSample, &phase, 1);
 		
 		// Mix the output into the buffer, scaling by the global amplitude
-		outBuffer[outputChannel_] += outSample*filteredOutputAmplitude;
+		*outBuffer += outSample*filteredOutputAmplitude;
 		
 #ifdef DEBUG_MESSAGES_EXTRA
 		if(sampleNumber_ % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
@@ -1730,7 +1627,7 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 		
 		// Update counters for next cycle
 		sampleNumber_++;
-		outBuffer += numOutputChannels_;
+		outBuffer++;
 	}
 	
 	if(willFinishAtEnd)
@@ -1740,31 +1637,64 @@ int PitchTrackSynth::render(const void *input, void *output, unsigned long frame
 }
 
 
-PitchTrackSynth::~PitchTrackSynth()
+// Gather the harmonics into the oscillator bank.  Harmonic amplitudes refer directly to the strength of
+// each partial at the output.  Called from the render thread.
+
+void PitchTrackSynth::updateOscillators()
 {
-	int i;
+	int j;
 	
+	oscillators_.clear();
+	
+	for(j = 0; j < parameters_.size(kGroupHarmonicAmplitudes); j++)
+	{
+		float amplitude = parameters_.value(kGroupHarmonicAmplitudes, j);
+		
+		if(amplitude == 0.0)
+			continue;
+		
+		float hPhase = (j < parameters_.size(kGroupHarmonicPhases) ? parameters_.value(kGroupHarmonicPhases, j) : 0.0);
+		
+		if(parameters_.value(kGroupHarmonicCentroid) == 1.0)
+		{
+			oscillators_.addOscillator(amplitude, j+1, PhaseAccumulator::fromCycles(hPhase));
+		}
+		else 
+		{
+			// Calculate the actual contributions of this harmonic based on the centroid, which
+			// could shift or scale its frequency value.
+			
+			double num;
+			
+			if(harmonicCentroidMultiply_)
+				num = (j+1) * parameters_.value(kGroupHarmonicCentroid);
+			else
+				num = (j+1) + (parameters_.value(kGroupHarmonicCentroid) - 1.0);					
+			
+			// val will most probably lie between two integers, in which case we assign each of its neighbors a weighted
+			// sum.  Keep some sort of limit on how many harmonics can be defined this way, so the system doesn't get
+			// too too slow.
+			
+			if(num == floor(num))	// num is a pure integer
+			{
+				oscillators_.addOscillator(amplitude, (int)num, PhaseAccumulator::fromCycles(hPhase));
+			}
+			else					// num has a fractional component
+			{
+				uint32_t phaseOffset = PhaseAccumulator::fromCycles(hPhase);
+				
+				oscillators_.addOscillator(amplitude * (ceil(num) - num), (int)floor(num), phaseOffset);	// harmonic below
+				oscillators_.addOscillator(amplitude * (num - floor(num)), (int)ceil(num), phaseOffset);	// harmonic above
+			}				
+		}
+	}
+}
+
+PitchTrackSynth::~PitchTrackSynth()
+{
 #ifdef DEBUG_ALLOCATION
 	cout << "*** ~PitchTrackSynth\n";
 #endif
 	
-	// Parameters are dynamically-allocated and need to be deleted:
-	
-	delete inputCenterFrequency_;
-	delete outputCenterFrequency_;
-	delete inputGain_;
-	delete pitchFollowRange_;
-	delete pitchFollowRatio_;
-	delete harmonicCentroid_;
-	
-	for(i = 0; i < harmonicAmplitudes_.size(); i++)
-		delete harmonicAmplitudes_[i];
-	for(i = 0; i < harmonicPhases_.size(); i++)
-		delete harmonicPhases_[i];
-	
-	delete maxGlobalAmplitude_;
 	delete inputEnvelopeFollower_;
-
-	pthread_mutex_destroy(&parameterMutex_);	
-	pthread_mutex_destroy(&freqAmpMutex_);
 }
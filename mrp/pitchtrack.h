@@ -17,6 +17,8 @@
 #include "audiorender.h"
 #include "midicontroller.h"
 #include "note.h"
+#include "oscillatorbank.h"
+#include "phaseaccumulator.h"
 using namespace std;
 
 // This class handles all the central dispatching related to tracking an incoming pitch.  Note that
@@ -27,6 +29,7 @@ using namespace std;
 //   - Routing incoming pitch and amplitude messages to the appropriate notes
 
 #define PITCHTRACK_BUFFER_SIZE	128
+#define PITCHTRACK_RESERVED_HARMONICS	16	// Harmonics a rendering synth can grow to without allocating
 
 class PitchTrackNote;
 class PitchTrackSynth;
@@ -185,36 +188,66 @@ public:
 			   unsigned long frameCount,
 			   const PaStreamCallbackTimeInfo* timeInfo,
 			   PaStreamCallbackFlags statusFlags);	
+	int synthType() { return kSynthTypePitchTrack; }
 	
 	~PitchTrackSynth();
+protected:
+	void applyParameter(int parameter, int index, int type, double value, timedParameter& ramp);
+	void reserveRenderStorage();
+	bool parameterFits(int parameter, int index);
+	
 private:
+	// Parameters carried by the parameter queue
+	enum {
+		kParameterMaxDuration = 0,
+		kParameterDecayTimeConstant,
+		kParameterHarmonicCentroidMultiply,
+		kParameterInputCenterFrequency,
+		kParameterOutputCenterFrequency,
+		kParameterMaxGlobalAmplitude,
+		kParameterInputGain,
+		kParameterPitchFollowRange,
+		kParameterPitchFollowRatio,
+		kParameterHarmonicCentroid,
+		kParameterHarmonicAmplitude,
+		kParameterHarmonicPhase,
+		kParameterLastFrequency,		// From the pitch tracker
+		kParameterLastAmplitude
+	};
+	
+	// Groups within parameters_
+	enum {
+		kGroupInputCenterFrequency = 0,		// Center frequency of the input note to listen to
+		kGroupOutputCenterFrequency,		// Center frequency of the synthesized note
+		kGroupPitchFollowRange,				// How far (in frequency ratio) to deviate from supposed center pitch
+		kGroupPitchFollowRatio,				// How closely to track the incoming pitch
+		kGroupMaxGlobalAmplitude,			// Overall amplitude
+		kGroupInputGain,					// How much the input amplitude is scaled by (but never exceeding maxGlobalAmplitude)
+		kGroupHarmonicCentroid,				// Adjustment to previously set harmonics (add or multiply in frequency)
+		kGroupHarmonicAmplitudes,			// Amplitudes of output harmonics
+		kGroupHarmonicPhases,				// Phase offset of each harmonic
+		kNumParameterGroups
+	};
+	
+	void updateOscillators();				// Rebuild the oscillator bank from the harmonic parameters
+	
 	// Time-invariant parameters
 	double maxDuration_;
 	double decayTimeConstant_;
 	bool harmonicCentroidMultiply_;
 	
-	// Time-variant parameters
-	Parameter *inputCenterFrequency_;		// Center frequency of the input note to listen to
-	Parameter *outputCenterFrequency_;		// Center frequency of the synthesized note
-	Parameter *pitchFollowRange_;			// How far (in frequency ratio) to deviate from supposed center pitch
-	Parameter *pitchFollowRatio_;			// How closely to track the incoming pitch
-	Parameter *maxGlobalAmplitude_;			// Overall amplitude
-	Parameter *inputGain_;					// How much the input amplitude is scaled by (but never exceeding maxGlobalAmplitude)	
-	Parameter *harmonicCentroid_;			// Adjustment to previously set harmonics (add or multiply in frequency)
-	
-	vector<Parameter*> harmonicAmplitudes_;	// Amplitudes of output harmonics
-	vector<Parameter*> harmonicPhases_;		// Phase offset of each harmonic	
+	// Time-variant parameters, all ramped together
+	ParameterBank parameters_;
+	int reservedHarmonics_;					// Harmonics that reserveRenderStorage() has made room for
 	
 	// Other state
 	EnvelopeFollower *inputEnvelopeFollower_;	// Follows the (scaled) input amplitude
+	OscillatorBank oscillators_;				// Output harmonics, updated whenever parameters ramp
 	
-	double phase_;			// Current phase of the main oscillator, from which all others are derived
+	PhaseAccumulator phase_;	// Current phase of the main oscillator, from which all others are derived
 	double lastFrequency_, lastAmplitude_;		// Last input values from pitch tracker
 	double minInputFrequency_, maxInputFrequency_;	// The range of input frequencies that are "in range"
 	bool shouldRelease_;							// Works in conjunction with maxDuration_
-	
-	pthread_mutex_t parameterMutex_;	// Make sure parameters don't update during ramp	
-	pthread_mutex_t freqAmpMutex_;		// Mutex to handle more frequent frequency/amplitude updates
 };
 
 #endif // PITCHTRACK_H
\ No newline at end of file
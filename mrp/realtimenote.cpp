@@ -153,7 +153,7 @@ RealTimeMidiNote* RealTimeMidiNote::createNote(int audioChannel, int mrpChannel,
 											   float phaseOffset, float amplitudeOffset,
 											   double attack, double intensity, double brightness, double pitch)
 {
-	RealTimeMidiNote *out = new RealTimeMidiNote(controller_, render_);
+	RealTimeMidiNote *out = (RealTimeMidiNote *)allocateNote();	// newNote() makes the pool hold RealTimeMidiNotes
 	int i;
 	float baseFreq;
 	
@@ -171,20 +171,21 @@ RealTimeMidiNote* RealTimeMidiNote::createNote(int audioChannel, int mrpChannel,
 	for(i = 0; i < factories_.size(); i++)
 	{
 		SynthBase *synth = factories_[i]->createSynth(midiNote, velocity, velocityCurve_, amplitudeOffset);
-		timedParameter emptyParam;
 		
 		if(typeid(*synth) == typeid(PllSynth))
-			((PllSynth*)synth)->setPhaseOffset(phaseOffset, emptyParam);
-		synth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel);
+			((PllSynth*)synth)->setPhaseOffset(phaseOffset, emptyRamp_);
+		synth->setPerformanceParameters(render_->numInputChannels(), render_->numOutputChannels(), audioChannel,
+										render_->inputHistory());
 		out->synths_.push_back(synth);
+		out->voiceFactories_.push_back(factories_[i]);
 	}	
 	
 	// Copy the qualities from this object (which have been loaded by parseXml) to the newly created note.
 	
-	out->intensity_ = new PllSynthQuality(*intensity_);
-	out->brightness_ = new PllSynthQuality(*brightness_);
-	out->pitch_ = new PllSynthQuality(*pitch_);
-	out->harmonic_ = new PllSynthQuality(*harmonic_);
+	*out->intensity_ = *intensity_;
+	*out->brightness_ = *brightness_;
+	*out->pitch_ = *pitch_;
+	*out->harmonic_ = *harmonic_;
 	
 	out->keyDownHoldoffTime_ = keyDownHoldoffTime_;
 	out->keyDownHoldoffScaler_ = keyDownHoldoffScaler_;
@@ -192,6 +193,7 @@ RealTimeMidiNote* RealTimeMidiNote::createNote(int audioChannel, int mrpChannel,
 	out->harmonicSweepRange_ = harmonicSweepRange_;
 	out->harmonicSweepSpread_ = harmonicSweepSpread_;
 	out->usePitchBendWithHarmonics_ = usePitchBendWithHarmonics_;
+	out->usingRawHarmonics_ = false;
 	
 	// TODO: deal with attack
 	out->intensity_->setBaseValue(intensity);
@@ -314,6 +316,9 @@ void RealTimeMidiNote::updateSynthParameters()
 //		for(i = 0; i < harmonicAmplitudes.size(); i++)
 //			cout << "Setting harmonicAmplitudes[" << i <<"] to " << harmonicAmplitudes[i] << endl;
 		
+		// Changes made in response to a scheduled event take effect at its time
+		synths_[0]->setParameterTime(controller_->eventTime());
+		
 		if(amplitudeUpdated)
 			((PllSynth *)synths_[0])->setGlobalAmplitude(globalAmplitude, tp);
 		if(relativeFrequencyUpdated)
@@ -323,6 +328,8 @@ void RealTimeMidiNote::updateSynthParameters()
 		if(!usingRawHarmonics_ && harmonicAmplitudesUpdated)
 			((PllSynth *)synths_[0])->setHarmonicAmplitudes(harmonicAmplitudes, vtp);
 		//((PllSynth *)synths_[0])->setHarmonicPhases(harmonicPhases, vtp);
+		
+		synths_[0]->setParameterTime(0.0);
 	}
 }
 
@@ -177,6 +177,8 @@ public:
 
 	
 protected:
+	MidiNote* newNote() { return new RealTimeMidiNote(controller_, render_); }	// So our note pool holds these
+	
 	// ******* Mappings from quality to synth parameters *******
 	
 #pragma mark private class PllSynthQuality	
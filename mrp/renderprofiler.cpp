@@ -0,0 +1,179 @@
+/*
+ *  renderprofiler.cpp
+ *  mrp
+ *
+ */
+
+#include <cstring>
+#include "portaudio.h"
+#include "renderprofiler.h"
+
+RenderProfiler::RenderProfiler(int numThreads, int numTypes)
+{
+	numThreads_ = numThreads;
+	numTypes_ = numTypes;
+	numChannels_ = 0;
+	allocateCosts();
+	blockPeriod_ = 0.0;
+	resetRequested_ = false;
+	clear();
+}
+
+void RenderProfiler::setNumChannels(int numChannels)
+{
+	numChannels_ = numChannels;
+	allocateCosts();
+}
+
+// Give each thread its own block of counters, starting on a cache line and padded out to the next one
+
+void RenderProfiler::allocateCosts()
+{
+	const int spareCosts = PROFILER_LINE_SIZE / sizeof(cost) + 1;
+	cost zero = {0, 0, 0};
+	uintptr_t address;
+
+	threadStride_ = numTypes_ + numChannels_;
+	while((threadStride_ * sizeof(cost)) % PROFILER_LINE_SIZE != 0)
+		threadStride_++;
+
+	costStorage_.assign(numThreads_ * threadStride_ + spareCosts, zero);
+	address = (uintptr_t)&costStorage_[0];
+	costs_ = (cost *)((address + PROFILER_LINE_SIZE - 1) & ~(uintptr_t)(PROFILER_LINE_SIZE - 1));
+}
+
+// Called at the start of each callback.  Counts the stream status flags and works out how long the callback
+// has to render this block.
+
+uint64_t RenderProfiler::beginBlock(unsigned long frameCount, double sampleRate, unsigned long statusFlags)
+{
+	uint64_t startTime = now();
+
+	if(resetRequested_)
+	{
+		clear();
+		resetRequested_ = false;
+	}
+
+	if(statusFlags != 0)
+	{
+		if(statusFlags & paInputUnderflow)
+			statusFlagCounts_[kInputUnderflow]++;
+		if(statusFlags & paInputOverflow)
+			statusFlagCounts_[kInputOverflow]++;
+		if(statusFlags & paOutputUnderflow)
+			statusFlagCounts_[kOutputUnderflow]++;
+		if(statusFlags & paOutputOverflow)
+			statusFlagCounts_[kOutputOverflow]++;
+		if(statusFlags & paPrimingOutput)
+			statusFlagCounts_[kPrimingOutput]++;
+	}
+
+	blockPeriod_ = (sampleRate > 0.0 ? 1.0e9 * (double)frameCount / sampleRate : 0.0);
+	return startTime;
+}
+
+// Called at the end of each callback with the number of synths rendered
+
+void RenderProfiler::endBlock(uint64_t startTime, int voices)
+{
+	double load = (blockPeriod_ > 0.0 ? (double)(now() - startTime) / blockPeriod_ : 0.0);
+	int bin;
+
+	totalLoad_ += load;
+	if(load > maxLoad_)
+		maxLoad_ = load;
+	bin = (int)(load * 10.0);
+	if(bin >= PROFILER_LOAD_BINS)
+		bin = PROFILER_LOAD_BINS - 1;
+	loadHistogram_[bin]++;
+
+	totalVoices_ += voices;
+	if(voices > maxVoices_)
+		maxVoices_ = voices;
+	for(bin = 0; bin < PROFILER_VOICE_BINS - 1 && voices >= voiceBinLow(bin + 1); bin++)
+		;
+	voiceHistogram_[bin]++;
+
+	blocks_++;
+}
+
+void RenderProfiler::clear()
+{
+	cost zero = {0, 0, 0};
+
+	costStorage_.assign(costStorage_.size(), zero);
+	blocks_ = 0;
+	totalLoad_ = maxLoad_ = 0.0;
+	bzero(loadHistogram_, PROFILER_LOAD_BINS*sizeof(uint64_t));
+	bzero(statusFlagCounts_, kNumStatusFlags*sizeof(uint64_t));
+	totalVoices_ = 0;
+	maxVoices_ = 0;
+	bzero(voiceHistogram_, PROFILER_VOICE_BINS*sizeof(uint64_t));
+}
+
+uint64_t RenderProfiler::xruns()
+{
+	return statusFlagCounts_[kInputUnderflow] + statusFlagCounts_[kInputOverflow] +
+		   statusFlagCounts_[kOutputUnderflow] + statusFlagCounts_[kOutputOverflow];
+}
+
+RenderProfiler::cost RenderProfiler::sumCosts(int index)
+{
+	cost total = {0, 0, 0};
+
+	for(int i = 0; i < numThreads_; i++)
+		mergeCost(&total, &costs_[i*threadStride_ + index]);
+
+	return total;
+}
+
+RenderProfiler::cost RenderProfiler::voiceCost()
+{
+	cost total = {0, 0, 0};
+
+	for(int type = 0; type < numTypes_; type++)
+	{
+		cost c = sumCosts(type);
+		mergeCost(&total, &c);
+	}
+
+	return total;
+}
+
+RenderProfiler::cost RenderProfiler::typeCost(int type)
+{
+	cost zero = {0, 0, 0};
+
+	if(type < 0 || type >= numTypes_)
+		return zero;
+	return sumCosts(type);
+}
+
+RenderProfiler::cost RenderProfiler::channelCost(int channel)
+{
+	cost zero = {0, 0, 0};
+
+	if(channel < 0 || channel >= numChannels_)
+		return zero;
+	return sumCosts(numTypes_ + channel);
+}
+
+const char *RenderProfiler::statusFlagName(int flag)
+{
+	switch(flag)
+	{
+		case kInputUnderflow:
+			return "input underflow";
+		case kInputOverflow:
+			return "input overflow";
+		case kOutputUnderflow:
+			return "output underflow";
+		case kOutputOverflow:
+			return "output overflow";
+		case kPrimingOutput:
+			return "priming output";
+		default:
+			return "unknown";
+	}
+}
@@ -0,0 +1,143 @@
+/*
+ *  renderprofiler.h
+ *  mrp
+ *
+ */
+
+#ifndef RENDER_PROFILER_H
+#define RENDER_PROFILER_H
+
+#include <vector>
+#include <stdint.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+using namespace std;
+
+#define PROFILER_LOAD_BINS		12		// Callback duration histogram: 10% of the block period per bin, the last is >= 110%
+#define PROFILER_VOICE_BINS		10		// Voices per block histogram: 0, 1, 2-3, 4-7, ..., 256 and up
+#define PROFILER_LINE_SIZE		64		// Each render thread's counters start on their own cache line
+
+// RenderProfiler collects statistics from the render callback: how long each callback takes relative to the
+// block period, how many synths each block renders, what each type of synth and each output channel costs,
+// and how often PortAudio reports an underflow or overflow.  The render threads write the counters without
+// locking.  Each render thread has its own per-type and per-channel counters, padded out to whole cache
+// lines, so no two threads ever write the same counter or even the same line; they're only added up when
+// read.  Readers on other threads may see values a block out of date, which is fine for statistics.
+// reset() only raises a flag; the callback does the clearing at the start of its next block.
+//
+// The cost of a voice is the time one synth's render() takes for one block: voiceCost() over all of them,
+// and typeCost() for each type of synth.  Individual voices aren't tracked, since pooled synths are reused
+// from note to note and most last only a few seconds; the channel costs show where the busy ones are.
+
+class RenderProfiler
+{
+public:
+	// Stream conditions reported to the callback in statusFlags
+	enum {
+		kInputUnderflow = 0,
+		kInputOverflow,
+		kOutputUnderflow,
+		kOutputOverflow,
+		kPrimingOutput,
+		kNumStatusFlags
+	};
+
+	typedef struct {
+		uint64_t totalTime;				// Nanoseconds spent rendering
+		uint64_t maxTime;				// Longest single render() call
+		uint64_t renders;				// Number of render() calls
+	} cost;
+
+	RenderProfiler(int numThreads, int numTypes);
+
+	// Size the per-channel statistics.  Only call this while the stream is stopped.
+	void setNumChannels(int numChannels);
+
+	// Render thread methods.  beginBlock() returns the time to pass to endBlock().  addSynthTime() may be
+	// called by any render thread, with its own thread index.
+	uint64_t beginBlock(unsigned long frameCount, double sampleRate, unsigned long statusFlags);
+	void endBlock(uint64_t startTime, int voices);
+	void addSynthTime(int thread, int type, int channel, uint64_t time) {
+		cost *threadCosts = costs_ + thread*threadStride_;
+		
+		addCost(&threadCosts[type], time);
+		if(channel >= 0 && channel < numChannels_)
+			addCost(&threadCosts[numTypes_ + channel], time);
+	}
+
+	// Monotonic time in nanoseconds
+	static uint64_t now() {
+#ifdef __APPLE__
+		static mach_timebase_info_data_t timebase;
+		if(timebase.denom == 0)
+			mach_timebase_info(&timebase);
+		return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+	}
+
+	// Statistics, for any thread
+	void reset() { resetRequested_ = true; }
+	void clear();								// Reset immediately; only when the callback isn't running
+
+	uint64_t blocks() { return blocks_; }
+	double meanLoad() { return (blocks_ == 0 ? 0.0 : totalLoad_ / (double)blocks_); }
+	double maxLoad() { return maxLoad_; }
+	uint64_t loadHistogram(int bin) { return (bin >= 0 && bin < PROFILER_LOAD_BINS ? loadHistogram_[bin] : 0); }
+	uint64_t statusFlagCount(int flag) { return (flag >= 0 && flag < kNumStatusFlags ? statusFlagCounts_[flag] : 0); }
+	uint64_t xruns();							// Underflows and overflows of either kind
+	double meanVoices() { return (blocks_ == 0 ? 0.0 : (double)totalVoices_ / (double)blocks_); }
+	int maxVoices() { return maxVoices_; }
+	uint64_t voiceHistogram(int bin) { return (bin >= 0 && bin < PROFILER_VOICE_BINS ? voiceHistogram_[bin] : 0); }
+	int numTypes() { return numTypes_; }
+	cost voiceCost();							// Every render() call, whatever the type
+	cost typeCost(int type);					// Summed over all render threads
+	int numChannels() { return numChannels_; }
+	cost channelCost(int channel);
+
+	static const char *statusFlagName(int flag);
+	static int voiceBinLow(int bin) { return (bin == 0 ? 0 : 1 << (bin - 1)); }	// Smallest voice count in a bin
+
+private:
+	static void addCost(cost *c, uint64_t time) {
+		c->totalTime += time;
+		c->renders++;
+		if(time > c->maxTime)
+			c->maxTime = time;
+	}
+	static void mergeCost(cost *total, const cost *c) {
+		total->totalTime += c->totalTime;
+		total->renders += c->renders;
+		if(c->maxTime > total->maxTime)
+			total->maxTime = c->maxTime;
+	}
+	cost sumCosts(int index);					// One counter, summed over all render threads
+	void allocateCosts();
+
+	int numThreads_;
+	int numTypes_;
+	int numChannels_;
+	vector<cost> costStorage_;					// Holds costs_, with room to align it to a cache line
+	cost *costs_;								// For each thread, numTypes_ type costs then numChannels_ channel
+	int threadStride_;							// costs, padded to a whole number of cache lines
+
+	double blockPeriod_;						// Length of the current block, in nanoseconds
+	uint64_t blocks_;
+	double totalLoad_;							// Sum over blocks of callback time / block period
+	double maxLoad_;
+	uint64_t loadHistogram_[PROFILER_LOAD_BINS];
+	uint64_t statusFlagCounts_[kNumStatusFlags];
+	uint64_t totalVoices_;
+	int maxVoices_;
+	uint64_t voiceHistogram_[PROFILER_VOICE_BINS];
+
+	volatile bool resetRequested_;
+};
+
+#endif // RENDER_PROFILER_H
@@ -7,6 +7,7 @@
  *
  */
 
+#include <unistd.h>
 #include "synth.h"
 #include "wavetables.h"
 #include "config.h"
@@ -17,7 +18,36 @@
 
 #define MIDDLE_C 261.63	// Hz
 
-extern WaveTable waveTable;
+static timedParameter emptyRamp;	// Shared by the set methods for values with no ramp; never modified
+
+// Helpers for the assignment operators below: make dest a copy of src, reusing whatever objects dest already
+// holds.  Nothing is allocated or freed unless the two differ in structure.
+
+template<class T> static void assignObject(T*& dest, const T *src)
+{
+	if(src == NULL)
+	{
+		delete dest;
+		dest = NULL;
+	}
+	else if(dest == NULL)
+		dest = new T(*src);
+	else
+		*dest = *src;
+}
+
+template<class T> static void assignObjects(vector<T*>& dest, const vector<T*>& src)
+{
+	while(dest.size() > src.size())
+	{
+		delete dest.back();
+		dest.pop_back();
+	}
+	for(int i = 0; i < dest.size(); i++)
+		*dest[i] = *src[i];
+	while(dest.size() < src.size())
+		dest.push_back(new T(*src[dest.size()]));
+}
 
 #pragma mark SynthBase
 
@@ -36,6 +66,8 @@ ostream& operator<<(ostream& output, const SynthBase& s)
 	else
 		output << "Not Releasing | ";
 	output << "startTime = " << s.startTime_ << ", releaseTime_ = " << s.releaseTime_ << endl;
+	if(s.parameterOverflows_ > 0)
+		output << "  parameter overflows = " << s.parameterOverflows_ << endl;
 	return output;
 }
 
@@ -49,21 +81,91 @@ SynthBase::SynthBase(float sampleRate)
 	isRunning_ = isReleasing_ = isFinished_ = false;
 	startTime_ = releaseTime_ = (PaTime)0.0;
 	numInputChannels_ = numOutputChannels_ = outputChannel_ = 0;
+	inputHistory_ = NULL;
+	
+	isRendering_ = false;
+	parameterTime_ = 0.0;
+	parameterOverflows_ = 0;
+	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
+	{
+		cerr << "Warning: Failed to initialize parameter mutex in SynthBase\n";
+		// Throw exception?
+	}
+	
+	SynthSine::build();		// Make sure the sine is ready before any synth renders
 	
 #ifdef DEBUG_ALLOCATION
 	cout << "*** SynthBase\n";
 #endif
 }
 
+// Copy constructor: the copy gets its own (empty) parameter queue and mutex, and starts out
+// not being rendered.
+
+SynthBase::SynthBase(const SynthBase& copy)
+{
+	numInputChannels_ = copy.numInputChannels_;
+	numOutputChannels_ = copy.numOutputChannels_;
+	outputChannel_ = copy.outputChannel_;
+	inputHistory_ = copy.inputHistory_;
+	sampleRate_ = copy.sampleRate_;
+	sampleLength_ = copy.sampleLength_;
+	isRunning_ = copy.isRunning_;
+	isReleasing_ = copy.isReleasing_;
+	isFinished_ = copy.isFinished_;
+	sampleNumber_ = copy.sampleNumber_;
+	startTime_ = copy.startTime_;
+	releaseTime_ = copy.releaseTime_;
+	
+	isRendering_ = false;
+	parameterTime_ = 0.0;
+	parameterOverflows_ = 0;
+	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
+	{
+		cerr << "Warning: Failed to initialize parameter mutex in SynthBase\n";
+		// Throw exception?
+	}
+	
+#ifdef DEBUG_ALLOCATION
+	cout << "*** SynthBase (copy constructor)\n";
+#endif
+}
+
+// Assignment copies the same state as the copy constructor.  The parameter queue, mutex and overflow count
+// stay with the object, so this must only be used on a synth that isn't being rendered.
+
+SynthBase& SynthBase::operator=(const SynthBase& copy)
+{
+	if(this == &copy)
+		return *this;
+	
+	numInputChannels_ = copy.numInputChannels_;
+	numOutputChannels_ = copy.numOutputChannels_;
+	outputChannel_ = copy.outputChannel_;
+	inputHistory_ = copy.inputHistory_;
+	sampleRate_ = copy.sampleRate_;
+	sampleLength_ = copy.sampleLength_;
+	isRunning_ = copy.isRunning_;
+	isReleasing_ = copy.isReleasing_;
+	isFinished_ = copy.isFinished_;
+	sampleNumber_ = copy.sampleNumber_;
+	startTime_ = copy.startTime_;
+	releaseTime_ = copy.releaseTime_;
+	
+	return *this;
+}
+
 // This method is called by the controller right before a note is performed, to set the performance-specific
 // parameters.  Other parameters of the note might remain more-or-less the same from one MIDI note to the
 // next, but we probably won't know these until the last minute.
 
-void SynthBase::setPerformanceParameters(int numInputChannels, int numOutputChannels, int outputChannel)
+void SynthBase::setPerformanceParameters(int numInputChannels, int numOutputChannels, int outputChannel,
+										 InputHistory *inputHistory)
 {
 	numInputChannels_ = numInputChannels;
 	numOutputChannels_ = numOutputChannels;
 	outputChannel_ = outputChannel;
+	inputHistory_ = inputHistory;
 }
 
 // Thoughts: with this system, there is a granularity of attack time equal to the number of frames
@@ -71,6 +173,8 @@ void SynthBase::setPerformanceParameters(int numInputChannels, int numOutputChan
 // be calculating audio for some time in the future, so clearly the note should begin as soon as possible.
 // On the other hand, the amount of CPU time spent in the render is indeterminate (probably very small),
 // so the only predictable behavior is to wait until the beginning of the next render loop to start the note.
+// Notes given a time instead start at that frame of whichever buffer it falls in, so events scheduled
+// a fixed latency after they arrive keep their spacing whatever the buffer size.
 
 // Tell the note to begin playing now
 void SynthBase::begin()
@@ -106,9 +210,165 @@ void SynthBase::release(PaTime when)
 	releaseTime_ = when;
 }
 
+// Switch between applying parameter changes directly and queueing them for the render thread.  AudioRender
+// calls this with true before it posts the synth to the render list, and with false once the render thread
+// has let go of it, so exactly one thread applies changes at any time.  Anything left in the queue when
+// rendering stops is applied here.  Before rendering starts, the synth gets to allocate anything it will
+// need in the meantime.
+
+void SynthBase::setRendering(bool rendering)
+{
+	pthread_mutex_lock(&parameterMutex_);
+	
+	if(rendering)
+	{
+		parameterQueue_.allocate();	// First time only
+		if(!isRendering_)
+			reserveRenderStorage();
+	}
+	else if(isRendering_)
+		applyParameterCommands();
+	isRendering_ = rendering;
+	
+	pthread_mutex_unlock(&parameterMutex_);
+}
+
+// Parameter changes: a group of postParameter() calls between beginParameters() and endParameters()
+// will be applied by the render thread at the same point.  Only control threads call these.
+
+void SynthBase::beginParameters()
+{
+	pthread_mutex_lock(&parameterMutex_);
+}
+
+void SynthBase::postParameter(int parameter, int index, int type, double value, timedParameter& ramp)
+{
+	parameterCommand *command;
+	int i, tries = 0;
+	
+	if(!isRendering_)		// Nobody else is using the synth, so make the change now
+	{
+		applyParameter(parameter, index, type, value, ramp);
+		return;
+	}
+	
+	if(!parameterFits(parameter, index) || ramp.size() > PARAMETER_RAMP_SIZE)
+	{
+		cerr << "Warning: no room for parameter " << parameter << " index " << index << " while rendering\n";
+		parameterOverflows_++;
+		return;
+	}
+	
+	if(parameterQueue_.space() < 1)
+	{
+		// The render thread has fallen behind.  Publish what we have and give it a few blocks to catch up.
+		parameterOverflows_++;
+		parameterQueue_.commit();
+		
+		while(parameterQueue_.space() < 1 && tries++ < PARAMETER_QUEUE_TIMEOUT)
+			usleep(1000);
+		if(parameterQueue_.space() < 1)
+		{
+			cerr << "Warning: parameter queue full, dropping change to parameter " << parameter << endl;
+			return;
+		}
+	}
+	
+	command = parameterQueue_.stage();
+	
+	command->parameter = parameter;
+	command->index = index;
+	command->type = type;
+	command->time = parameterTime_;
+	command->value = value;
+	command->numRampValues = 0;
+	if(ramp.size() > PARAMETER_QUEUE_RAMP_SIZE)
+		command->longRamp = new timedParameter(ramp);
+	else
+	{
+		for(i = 0; i < ramp.size(); i++)
+			command->rampValues[command->numRampValues++] = ramp[i];
+	}
+}
+
+void SynthBase::postParameter(int parameter, int index, double value)
+{
+	postParameter(parameter, index, kParameterCommandSet, value, emptyRamp);
+}
+
+void SynthBase::endParameters()
+{
+	if(isRendering_)
+		parameterQueue_.commit();
+	pthread_mutex_unlock(&parameterMutex_);
+}
+
+// Apply any parameter changes waiting in the queue.  Called by the render thread; never blocks.
+
+void SynthBase::applyParameterCommands()
+{
+	applyParameterCommands(HUGE_VAL);
+}
+
+// Apply the changes due by the frame at time now.  Changes are applied in order, so one that isn't due
+// yet holds up the rest.
+
+void SynthBase::applyParameterCommands(PaTime now)
+{
+	parameterCommand *command;
+	
+	if(!parameterQueue_.isAllocated())
+		return;
+	
+	while((command = parameterQueue_.front()) != NULL)
+	{
+		if(command->time > now + 0.5*sampleLength_)
+			break;
+		
+		if(command->longRamp != NULL)
+			applyParameter(command->parameter, command->index, command->type, command->value, *command->longRamp);
+		else
+		{
+			// Short ramps fit in the node commandRamp_ keeps through clear(), so this doesn't allocate
+			commandRamp_.assign(command->rampValues, command->rampValues + command->numRampValues);
+			applyParameter(command->parameter, command->index, command->type, command->value, commandRamp_);
+			commandRamp_.clear();
+		}
+		
+		parameterQueue_.pop();
+	}
+}
+
+PaTime SynthBase::nextParameterTime()
+{
+	parameterCommand *command;
+	
+	if(!parameterQueue_.isAllocated() || (command = parameterQueue_.front()) == NULL)
+		return 0.0;
+	return command->time;
+}
+
+const char *SynthBase::synthTypeName(int type)
+{
+	switch(type)
+	{
+		case kSynthTypePll:
+			return "PllSynth";
+		case kSynthTypeNoise:
+			return "NoiseSynth";
+		case kSynthTypeResonance:
+			return "ResonanceSynth";
+		case kSynthTypePitchTrack:
+			return "PitchTrackSynth";
+		default:
+			return "other";
+	}
+}
+
 SynthBase::~SynthBase()
 {
 	// Nothing to do here, for now.  Possibly remove this synth from the render list.
+	pthread_mutex_destroy(&parameterMutex_);
 #ifdef DEBUG_ALLOCATION
 	cout << "*** ~SynthBase\n";
 #endif
@@ -122,18 +382,34 @@ ostream& operator<<(ostream& output, const PllSynth& s)
 	
 	output << (SynthBase&)s;
 	output << "PllSynth subclass:\n";
-	output << "  centerFrequency_: " << *(s.centerFrequency_);
-	output << "  globalAmplitude_: " << *(s.globalAmplitude_);
-	output << "  loopGain_: " << *(s.loopGain_);
-	output << "  phaseOffset_: " << *(s.phaseOffset_);
-	for(i = 0; i < s.inputGains_.size(); i++)
-		output << "  inputGains[" << i << "]: " << *(s.inputGains_[i]);
-	for(i = 0; i < s.inputDelays_.size(); i++)
-		output << "  inputDelays[" << i << "]: " << *(s.inputDelays_[i]);
-	for(i = 0; i < s.harmonicAmplitudes_.size(); i++)
-		output << "  harmonicAmplitudes[" << i << "]: " << *(s.harmonicAmplitudes_[i]);
-	for(i = 0; i < s.harmonicPhases_.size(); i++)
-		output << "  harmonicPhases[" << i << "]: " << *(s.harmonicPhases_[i]);
+	output << "  centerFrequency_: ";
+	s.parameters_.print(output, PllSynth::kGroupCenterFrequency, 0);
+	output << "  globalAmplitude_: ";
+	s.parameters_.print(output, PllSynth::kGroupGlobalAmplitude, 0);
+	output << "  loopGain_: ";
+	s.parameters_.print(output, PllSynth::kGroupLoopGain, 0);
+	output << "  phaseOffset_: ";
+	s.parameters_.print(output, PllSynth::kGroupPhaseOffset, 0);
+	for(i = 0; i < s.parameters_.size(PllSynth::kGroupInputGains); i++)
+	{
+		output << "  inputGains[" << i << "]: ";
+		s.parameters_.print(output, PllSynth::kGroupInputGains, i);
+	}
+	for(i = 0; i < s.parameters_.size(PllSynth::kGroupInputDelays); i++)
+	{
+		output << "  inputDelays[" << i << "]: ";
+		s.parameters_.print(output, PllSynth::kGroupInputDelays, i);
+	}
+	for(i = 0; i < s.parameters_.size(PllSynth::kGroupHarmonicAmplitudes); i++)
+	{
+		output << "  harmonicAmplitudes[" << i << "]: ";
+		s.parameters_.print(output, PllSynth::kGroupHarmonicAmplitudes, i);
+	}
+	for(i = 0; i < s.parameters_.size(PllSynth::kGroupHarmonicPhases); i++)
+	{
+		output << "  harmonicPhases[" << i << "]: ";
+		s.parameters_.print(output, PllSynth::kGroupHarmonicPhases, i);
+	}
 	output << "  filterQ = " << s.filterQ_ << " ";
 	output << "loopFilterPole = " << s.loopFilterPole_ << " ";
 	output << "loopFilterZero = " << s.loopFilterZero_;
@@ -152,7 +428,8 @@ ostream& operator<<(ostream& output, const PllSynth& s)
 		output << "No Delay-and-Sum\n";
 	if(s.useAmplitudeFeedback_)
 	{
-		output << "  amplitudeFeedbackScaler_: " << *(s.amplitudeFeedbackScaler_);
+		output << "  amplitudeFeedbackScaler_: ";
+		s.parameters_.print(output, PllSynth::kGroupFeedbackScaler, 0);
 	}
 	
 	return output;
@@ -160,46 +437,45 @@ ostream& operator<<(ostream& output, const PllSynth& s)
 
 // First constructor allows a generic loop filter specification
 
-PllSynth::PllSynth(float sampleRate) : SynthBase(sampleRate)
+PllSynth::PllSynth(float sampleRate) : SynthBase(sampleRate), parameters_(sampleRate, kNumParameterGroups),
+  inputFilters_(sampleRate), harmonicAnalyzer_(.05, sampleRate)
 {
 	float defaultFreq = 440.0;
 	
-	loopFilter_ = NULL;					// These objects are created later, if necessary
-	amplitudeFeedbackScaler_ = NULL;	// It's important they start as NULL so we know they haven't been
-	mainEnvelopeFollower_ = NULL;		// initialized yet.
+	loopFilter_ = NULL;					// These objects are created later, if necessary.  It's important
+	mainEnvelopeFollower_ = NULL;		// they start as NULL so we know they haven't been initialized yet.
 	lowEnvelopeFollower_ = highEnvelopeFollower_ = NULL;
-	lowInputFilter_ = highInputFilter_ = NULL;
 	useAmplitudeFeedback_ = useInterferenceRejection_ = false;
+	smoothGlobalAmplitude_ = false;
+	useHarmonicAnalyzer_ = false;
+	harmonicAnalyzer_.setFirstHarmonic(2);		// The fundamental uses the main filter and follower
+	reservedHarmonics_ = reservedInputs_ = 0;
 	
+	pllPhase_.reset();
 	pllLastOutput_ = 0.0;
 	
-	// Initialize the mutex
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize mutex in PllSynth\n";
-		// Throw exception?
-	}	
-	
-	// Set defaults for changeable parameters, so we don't have to worry about allocating Parameters later
+	// Set defaults for changeable parameters.  The amplitude feedback scaler is only added when it's used.
 	filterQ_ = 50.0;
 	filterQinverse_ = 1.0/filterQ_;
-	centerFrequency_ = new Parameter(defaultFreq, sampleRate);
-	loopGain_ = new Parameter(0.0, sampleRate);
+	parameters_.resize(kGroupCenterFrequency, 1, defaultFreq);
+	parameters_.resize(kGroupLoopGain, 1, 0.0);
 	loopGainWasZero_ = true;								
-	phaseOffset_ = new Parameter(0.0, sampleRate);
-	inputGains_.push_back(new Parameter(1.0, sampleRate));		// By default, 1 input with no delay
-	inputDelays_.push_back(new Parameter(0.0, sampleRate));
+	parameters_.resize(kGroupPhaseOffset, 1, 0.0);
+	parameters_.resize(kGroupInputGains, 1, 1.0);		// By default, 1 input with no delay
+	parameters_.resize(kGroupInputDelays, 1, 0.0);
 	
 	usingDelayAndSum_ = false;
-	harmonicAmplitudes_.push_back(new Parameter(1.0, sampleRate)); // By default, 1 sine wave
-	harmonicPhases_.push_back(new Parameter(0.0, sampleRate));
+	parameters_.resize(kGroupHarmonicAmplitudes, 1, 1.0);	// By default, 1 sine wave
+	parameters_.resize(kGroupHarmonicPhases, 1, 0.0);
 	
 	// By default, amplitude 0.1 (-20dB) and no filters
-	globalAmplitude_ = new Parameter(0.1, sampleRate);
+	parameters_.resize(kGroupGlobalAmplitude, 1, 0.1);
 	
-	// Initialize main input filter buffer (others are initialized if 
-	mainInputFilter_ = new ButterBandpassFilter(sampleRate);
-	mainInputFilter_->updateCoefficients(defaultFreq, defaultFreq*filterQinverse_);
+	// Initialize main input filter (the interference rejection filters are set up if they're used, and
+	// harmonic filters are added for amplitude feedback)
+	inputFilters_.resize(kInputFilterHarmonics);
+	inputFilters_.updateCoefficients(kInputFilterMain, defaultFreq, defaultFreq*filterQinverse_);
+	blockFiltered_.resize(PLL_BLOCK_SIZE*inputFilters_.stride());
 	
 	// Set the loop filter coefficients to default values
 	setLoopFilterPoleZero(1.0, 100.0);
@@ -209,7 +485,8 @@ PllSynth::PllSynth(float sampleRate) : SynthBase(sampleRate)
 #endif
 }
 
-PllSynth::PllSynth(const PllSynth& copy) : SynthBase(copy)
+PllSynth::PllSynth(const PllSynth& copy) : SynthBase(copy), parameters_(copy.parameters_),
+  inputFilters_(copy.inputFilters_), harmonicAnalyzer_(copy.harmonicAnalyzer_)
 {
 	int i;
 	
@@ -221,6 +498,9 @@ PllSynth::PllSynth(const PllSynth& copy) : SynthBase(copy)
 	
 	useAmplitudeFeedback_ = copy.useAmplitudeFeedback_;
 	useInterferenceRejection_ = copy.useInterferenceRejection_;
+	smoothGlobalAmplitude_ = copy.smoothGlobalAmplitude_;
+	useHarmonicAnalyzer_ = copy.useHarmonicAnalyzer_;
+	reservedHarmonics_ = reservedInputs_ = 0;	// Copies aren't rendering yet
 	filterQ_ = copy.filterQ_;
 	filterQinverse_ = copy.filterQinverse_;
 	loopFilterPole_ = copy.loopFilterPole_;
@@ -229,32 +509,10 @@ PllSynth::PllSynth(const PllSynth& copy) : SynthBase(copy)
 	usingDelayAndSum_ = copy.usingDelayAndSum_;
 	loopGainWasZero_ = copy.loopGainWasZero_;
 	pllLastOutput_ = copy.pllLastOutput_;
-	
-	// Initialize a new mutex.  Just because the copy was locked doesn't mean this one should be.
-
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize mutex in PllSynth\n";
-		// Throw exception?
-	}	
+	firstOrderLoopFilter_ = copy.firstOrderLoopFilter_;
+	blockFiltered_.resize(PLL_BLOCK_SIZE*inputFilters_.stride());
 	
 	// Copy all the pointer objects
-	if(copy.centerFrequency_ != NULL)
-		centerFrequency_ = new Parameter(*copy.centerFrequency_);
-	else
-		centerFrequency_ = NULL;
-	if(copy.mainInputFilter_ != NULL)
-		mainInputFilter_ = new ButterBandpassFilter(*copy.mainInputFilter_);
-	else
-		mainInputFilter_ = NULL;
-	if(copy.lowInputFilter_ != NULL)
-		lowInputFilter_ = new ButterBandpassFilter(*copy.lowInputFilter_);
-	else
-		lowInputFilter_ = NULL;
-	if(copy.highInputFilter_ != NULL)
-		highInputFilter_ = new ButterBandpassFilter(*copy.highInputFilter_);
-	else
-		highInputFilter_ = NULL;
 	if(copy.mainEnvelopeFollower_ != NULL)
 		mainEnvelopeFollower_ = new EnvelopeFollower(*copy.mainEnvelopeFollower_);
 	else
@@ -271,66 +529,57 @@ PllSynth::PllSynth(const PllSynth& copy) : SynthBase(copy)
 		loopFilter_ = new GenericFilter(*copy.loopFilter_);
 	else
 		loopFilter_ = NULL;
-	if(copy.amplitudeFeedbackScaler_ != NULL)
-		amplitudeFeedbackScaler_ = new Parameter(*copy.amplitudeFeedbackScaler_);
-	else
-		amplitudeFeedbackScaler_ = NULL;
-	if(copy.loopGain_ != NULL)
-		loopGain_ = new Parameter(*copy.loopGain_);
-	else
-		loopGain_ = NULL;
-	if(copy.phaseOffset_ != NULL)
-		phaseOffset_ = new Parameter(*copy.phaseOffset_);
-	else
-		phaseOffset_ = NULL;
-	if(copy.globalAmplitude_ != NULL)
-		globalAmplitude_ = new Parameter(*copy.globalAmplitude_);
-	else
-		globalAmplitude_ = NULL;
 	
-	// Finally, copy over the vector parameters.  Fortunately, we shouldn't have NULL pointers in the
-	// vectors.
+	// Finally, copy over the vector of followers.  Fortunately, we shouldn't have NULL pointers in it.
 	
-	for(i = 0; i < copy.inputGains_.size(); i++)
-		inputGains_.push_back(new Parameter(*copy.inputGains_[i]));
-	for(i = 0; i < copy.inputDelays_.size(); i++)
-		inputDelays_.push_back(new Parameter(*copy.inputDelays_[i]));
-	for(i = 0; i < copy.harmonicInputFilters_.size(); i++)
-		harmonicInputFilters_.push_back(new ButterBandpassFilter(*copy.harmonicInputFilters_[i]));
 	for(i = 0; i < copy.harmonicEnvelopeFollowers_.size(); i++)
 		harmonicEnvelopeFollowers_.push_back(new EnvelopeFollower(*copy.harmonicEnvelopeFollowers_[i]));
-	for(i = 0; i < copy.harmonicAmplitudes_.size(); i++)
-		harmonicAmplitudes_.push_back(new Parameter(*copy.harmonicAmplitudes_[i]));
-	for(i = 0; i < copy.harmonicPhases_.size(); i++)
-		harmonicPhases_.push_back(new Parameter(*copy.harmonicPhases_[i]));
 }
 
-// TODO: operator=
+// Assignment leaves this synth in the same state the copy constructor would.  Existing parameters, filters
+// and followers are overwritten in place, so when both synths have the same structure (e.g. two voices
+// from the same factory) nothing is allocated.
 
-void PllSynth::setFilterQ(double filterQ)
+PllSynth& PllSynth::operator=(const PllSynth& copy)
 {
-	pthread_mutex_lock(&parameterMutex_);	
+	if(this == &copy)
+		return *this;
 	
-	filterQ_ = filterQ;							// Save the new Q value
-	filterQinverse_ = 1.0/filterQ;				// Calculate Q inverse to save float divisions later
+	SynthBase::operator=(copy);
 	
-	float freq = centerFrequency_->currentValue();
-	float freqDivQ = freq*filterQinverse_;		// Save some multiplies...
+	useAmplitudeFeedback_ = copy.useAmplitudeFeedback_;
+	useInterferenceRejection_ = copy.useInterferenceRejection_;
+	smoothGlobalAmplitude_ = copy.smoothGlobalAmplitude_;
+	useHarmonicAnalyzer_ = copy.useHarmonicAnalyzer_;
+	reservedHarmonics_ = reservedInputs_ = 0;
+	filterQ_ = copy.filterQ_;
+	filterQinverse_ = copy.filterQinverse_;
+	loopFilterPole_ = copy.loopFilterPole_;
+	loopFilterZero_ = copy.loopFilterZero_;
+	pllPhase_ = copy.pllPhase_;
+	usingDelayAndSum_ = copy.usingDelayAndSum_;
+	loopGainWasZero_ = copy.loopGainWasZero_;
+	pllLastOutput_ = copy.pllLastOutput_;
+	firstOrderLoopFilter_ = copy.firstOrderLoopFilter_;
+	inputFilters_ = copy.inputFilters_;		// These reuse the existing storage if it's big enough
+	harmonicAnalyzer_ = copy.harmonicAnalyzer_;
+	parameters_ = copy.parameters_;
 	
-	if(mainInputFilter_ != NULL)				// Update all the bandpass filters
-		mainInputFilter_->updateCoefficients(freq, freqDivQ);
-	if(useInterferenceRejection_)
-	{
-		lowInputFilter_->updateCoefficients(freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
-		highInputFilter_->updateCoefficients(freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);	
-	}
-	if(useAmplitudeFeedback_)
-	{
-		for(int j = 0; j < harmonicInputFilters_.size(); j++)
-			harmonicInputFilters_[j]->updateCoefficients(freq*(float)(j+2), freqDivQ*(float)(j+2));
-	}	
+	assignObject(mainEnvelopeFollower_, copy.mainEnvelopeFollower_);
+	assignObject(lowEnvelopeFollower_, copy.lowEnvelopeFollower_);
+	assignObject(highEnvelopeFollower_, copy.highEnvelopeFollower_);
+	assignObject(loopFilter_, copy.loopFilter_);
+	
+	assignObjects(harmonicEnvelopeFollowers_, copy.harmonicEnvelopeFollowers_);
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	return *this;
+}
+
+void PllSynth::setFilterQ(double filterQ)
+{
+	beginParameters();
+	postParameter(kParameterFilterQ, 0, filterQ);
+	endParameters();
 }
 
 void PllSynth::setLoopFilterPole(float loopFilterPole)
@@ -349,7 +598,7 @@ void PllSynth::setLoopFilterZero(float loopFilterZero)
 
 void PllSynth::setLoopFilterPoleZero(float loopFilterPole, float loopFilterZero)
 {
-	vector<double> a, b;
+	double a[1], b[2];
 	
 	loopFilterPole_ = loopFilterPole;
 	loopFilterZero_ = loopFilterZero;
@@ -360,22 +609,41 @@ void PllSynth::setLoopFilterPoleZero(float loopFilterPole, float loopFilterZero)
 	double piDivSampleRate = M_PI/(double)sampleRate_;
 	
 	// Bilinear transform
-	b.push_back(poleZeroRatio); // b[0]
-	b.push_back(-poleZeroRatio*(1.0 - piDivSampleRate*loopFilterZero)/(1.0 + piDivSampleRate*loopFilterZero)); // b[1]
-	a.push_back(-(1.0 - piDivSampleRate*loopFilterPole)/(1.0 + piDivSampleRate*loopFilterPole)); // a[1] (a[0] = 1.0 always)
+	b[0] = poleZeroRatio;
+	b[1] = -poleZeroRatio*(1.0 - piDivSampleRate*loopFilterZero)/(1.0 + piDivSampleRate*loopFilterZero);
+	a[0] = -(1.0 - piDivSampleRate*loopFilterPole)/(1.0 + piDivSampleRate*loopFilterPole); // a1 (a0 = 1.0 always)
 	
-	// Initialize the loop filter
+	// Initialize the loop filter.  This is always first order, so it doesn't need the generic one.
+	firstOrderLoopFilter_.updateCoefficients(a, b);
 	if(loopFilter_ != NULL)
 		delete loopFilter_;
-	loopFilter_	= new GenericFilter(a, b);	
+	loopFilter_ = NULL;
 }
 
 void PllSynth::setLoopFilterAB(vector<double>& loopFilterA, vector<double>& loopFilterB)
 {
-	// Initialize the loop filter
+	// Initialize the loop filter.  Only use the generic filter if we need to: a first-order filter
+	// (or lower) is padded out with zeros, and no b coefficients means a passthrough, as in GenericFilter.
 	if(loopFilter_ != NULL)
 		delete loopFilter_;
-	loopFilter_	= new GenericFilter(loopFilterA, loopFilterB);	
+	loopFilter_ = NULL;
+	
+	if(loopFilterA.size() <= 1 && loopFilterB.size() <= 2)
+	{
+		double a[1] = { 0.0 }, b[2] = { 1.0, 0.0 };
+		
+		if(loopFilterA.size() > 0)
+			a[0] = loopFilterA[0];
+		if(loopFilterB.size() > 0)
+		{
+			b[0] = loopFilterB[0];
+			if(loopFilterB.size() > 1)
+				b[1] = loopFilterB[1];
+		}
+		firstOrderLoopFilter_.updateCoefficients(a, b);
+	}
+	else
+		loopFilter_	= new GenericFilter(loopFilterA, loopFilterB);	
 }
 
 void PllSynth::setUseAmplitudeFeedback(bool useAmplitudeFeedback)
@@ -384,37 +652,36 @@ void PllSynth::setUseAmplitudeFeedback(bool useAmplitudeFeedback)
 	
 	if(useAmplitudeFeedback_)
 	{
-		if(amplitudeFeedbackScaler_ == NULL)
-			amplitudeFeedbackScaler_ = new Parameter(4.0, sampleRate_); // Gain constant for amplitude feedback
+		if(parameters_.size(kGroupFeedbackScaler) == 0)
+			parameters_.resize(kGroupFeedbackScaler, 1, 4.0);	// Gain constant for amplitude feedback
 		
 		// For either amplitude feedback or interference rejection, we need this envelope follower.
 		// Once it's initialized, nothing further to do with it.
 		if(mainEnvelopeFollower_ == NULL)			
 			mainEnvelopeFollower_ = new EnvelopeFollower(.05, sampleRate_);
 
-		float freq = centerFrequency_->currentValue();
+		float freq = parameters_.value(kGroupCenterFrequency);
 		float freqDivQ = freq*filterQinverse_;		// Save some multiplies...
 		
 		// If we have multiple harmonics, we may need to create filters and followers from them too
-		while(harmonicAmplitudes_.size() > harmonicInputFilters_.size())
+		while(parameters_.size(kGroupHarmonicAmplitudes) > numHarmonicInputFilters())
 		{
 #ifdef DEBUG_MESSAGES_EXTRA
 			cout << "setUseAmplitudeFeedback(): adding harmonic input filter\n";
 #endif
-			ButterBandpassFilter *bp = new ButterBandpassFilter(sampleRate_);
-			harmonicInputFilters_.push_back(bp);
+			inputFilters_.resize(inputFilters_.size() + 1);
 
 #ifdef DEBUG_MESSAGES_EXTRA
-			cout << "filter has multiplier " << harmonicInputFilters_.size() << endl;
+			cout << "filter has multiplier " << numHarmonicInputFilters() << endl;
 #endif
 			// Use size as a proxy for which harmonic we just added.  Notice that this has to come
-			// AFTER the harmonicInputFilters_.push_back() call above, or the calcluation will change.
+			// AFTER the inputFilters_.resize() call above, or the calcluation will change.
 
-			bp->updateCoefficients(freq*(float)(harmonicInputFilters_.size()), 
-								   freqDivQ*(float)(harmonicInputFilters_.size()));
+			inputFilters_.updateCoefficients(inputFilters_.size() - 1, freq*(float)(numHarmonicInputFilters()), 
+											 freqDivQ*(float)(numHarmonicInputFilters()));
 		}
 	
-		while(harmonicAmplitudes_.size() > harmonicEnvelopeFollowers_.size())
+		while(parameters_.size(kGroupHarmonicAmplitudes) > harmonicEnvelopeFollowers_.size())
 		{
 #ifdef DEBUG_MESSAGES_EXTRA
 			cout << "setUseAmplitudeFeedback(): adding harmonic envelope follower\n";
@@ -422,6 +689,73 @@ void PllSynth::setUseAmplitudeFeedback(bool useAmplitudeFeedback)
 			EnvelopeFollower *ef = new EnvelopeFollower(.05, sampleRate_);
 			harmonicEnvelopeFollowers_.push_back(ef);	
 		}
+		
+		resizeHarmonicAnalyzer();
+	}
+}
+
+// Called before the synth is rendered.  Changes made while it's rendering can add harmonics up to
+// PLL_RESERVED_HARMONICS and inputs up to PLL_RESERVED_INPUTS (or more, if we already have them), so make
+// room for them all now: parameters, filters, followers and the block buffers.
+
+void PllSynth::reserveRenderStorage()
+{
+	int numHarmonics = max(PLL_RESERVED_HARMONICS, max(parameters_.size(kGroupHarmonicAmplitudes),
+													   parameters_.size(kGroupHarmonicPhases)));
+	int numInputs = max(max(PLL_RESERVED_INPUTS, numInputChannels_), max(parameters_.size(kGroupInputGains),
+																		parameters_.size(kGroupInputDelays)));
+	
+	parameters_.reserve(parameters_.size() + 2*numHarmonics + 2*numInputs
+						- parameters_.size(kGroupHarmonicAmplitudes) - parameters_.size(kGroupHarmonicPhases)
+						- parameters_.size(kGroupInputGains) - parameters_.size(kGroupInputDelays));
+	
+	inputFilters_.reserve(kInputFilterHarmonics + numHarmonics);
+	oscillators_.reserve(numHarmonics);
+	if(blockFiltered_.size() < PLL_BLOCK_SIZE*inputFilters_.capacity())
+		blockFiltered_.resize(PLL_BLOCK_SIZE*inputFilters_.capacity());
+	
+	if(useAmplitudeFeedback_)
+	{
+		harmonicEnvelopeFollowers_.reserve(numHarmonics);
+		while(harmonicEnvelopeFollowers_.size() < numHarmonics)
+			harmonicEnvelopeFollowers_.push_back(new EnvelopeFollower(.05, sampleRate_));
+	}
+	if(useHarmonicAnalyzer_)
+	{
+		harmonicAnalyzer_.reserve(numHarmonics);
+		if(blockHarmonicLevels_.size() < PLL_BLOCK_SIZE*numHarmonics)
+			blockHarmonicLevels_.resize(PLL_BLOCK_SIZE*numHarmonics);
+	}
+	
+	if(blockHarmonicAmplitudes_.size() < numHarmonics*PLL_BLOCK_SEGMENTS)
+	{
+		blockHarmonicAmplitudes_.resize(numHarmonics*PLL_BLOCK_SEGMENTS);
+		blockHarmonicPhases_.resize(numHarmonics*PLL_BLOCK_SEGMENTS);
+	}
+	if(blockInputGains_.size() < numInputs*PLL_BLOCK_SEGMENTS)
+	{
+		blockInputGains_.resize(numInputs*PLL_BLOCK_SEGMENTS);
+		blockInputDelays_.resize(numInputs*PLL_BLOCK_SEGMENTS);
+	}
+	
+	reservedHarmonics_ = numHarmonics;
+	reservedInputs_ = numInputs;
+}
+
+// Whether a change posted while rendering fits in the storage reserveRenderStorage() made
+
+bool PllSynth::parameterFits(int parameter, int index)
+{
+	switch(parameter)
+	{
+		case kParameterInputGain:
+		case kParameterInputDelay:
+			return (index < reservedInputs_);
+		case kParameterHarmonicAmplitude:
+		case kParameterHarmonicPhase:
+			return (index < reservedHarmonics_);
+		default:
+			return true;
 	}
 }
 
@@ -431,11 +765,6 @@ void PllSynth::setUseInterferenceRejection(bool useInterferenceRejection)
 	
 	if(useInterferenceRejection_)
 	{
-		if(lowInputFilter_ == NULL)
-			lowInputFilter_ = new ButterBandpassFilter(sampleRate_);
-		if(highInputFilter_ == NULL)
-			highInputFilter_ = new ButterBandpassFilter(sampleRate_);
-
 		if(lowEnvelopeFollower_ == NULL)
 			lowEnvelopeFollower_ = new EnvelopeFollower(.05, sampleRate_);
 		if(highEnvelopeFollower_ == NULL)
@@ -446,14 +775,51 @@ void PllSynth::setUseInterferenceRejection(bool useInterferenceRejection)
 		if(mainEnvelopeFollower_ == NULL)			
 			mainEnvelopeFollower_ = new EnvelopeFollower(.05, sampleRate_);		
 		
-		float freq = centerFrequency_->currentValue();	// Update the BPF coefficients
+		float freq = parameters_.value(kGroupCenterFrequency);	// Update the BPF coefficients
 		float freqDivQ = freq*filterQinverse_;		
 		
-		lowInputFilter_->updateCoefficients(freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
-		highInputFilter_->updateCoefficients(freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);			
+		inputFilters_.updateCoefficients(kInputFilterLow, freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
+		inputFilters_.updateCoefficients(kInputFilterHigh, freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);			
 	}		
 }
 
+// Without smoothing, the global amplitude steps every PARAMETER_UPDATE_INTERVAL samples.  With it, each
+// sample moves the amplitude a step closer to the value at the next update, which avoids zipper noise on
+// fast ramps at the cost of a little more work per sample.
+
+void PllSynth::setSmoothGlobalAmplitude(bool smoothGlobalAmplitude)
+{
+	smoothGlobalAmplitude_ = smoothGlobalAmplitude;
+}
+
+// Amplitude feedback normally measures each harmonic above the fundamental with its own bandpass filter
+// and envelope follower.  The harmonic analyzer measures them all at once, locked to the PLL phase, which
+// costs less with many harmonics and separates them better; see HarmonicAnalyzer.  The harmonic filters
+// are still kept up to date, but not run.
+
+void PllSynth::setUseHarmonicAnalyzer(bool useHarmonicAnalyzer)
+{
+	useHarmonicAnalyzer_ = useHarmonicAnalyzer;
+	resizeHarmonicAnalyzer();
+}
+
+// The analyzer measures every harmonic that has a filter, except the fundamental.  Called wherever
+// harmonics or filters are added, so that render() only has to read its results.  Once the synth is
+// rendering, reserveRenderStorage() has already made room for all of them.
+
+void PllSynth::resizeHarmonicAnalyzer()
+{
+	int size = max(0, min(numHarmonicInputFilters(), parameters_.size(kGroupHarmonicAmplitudes) - 1));
+	
+	if(!useHarmonicAnalyzer_)
+		return;
+	
+	if(harmonicAnalyzer_.size() != size)
+		harmonicAnalyzer_.resize(size);
+	if(blockHarmonicLevels_.size() < PLL_BLOCK_SIZE*size)
+		blockHarmonicLevels_.resize(PLL_BLOCK_SIZE*size);
+}
+
 // Time-variant parameters
 
 void PllSynth::setInputGains(vector<double>& currentInputGains,
@@ -463,41 +829,20 @@ void PllSynth::setInputGains(vector<double>& currentInputGains,
 	// ignore the extra.  If it is smaller, don't ramp the last parameters.
 	int i, size = currentInputGains.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > inputGains_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding input gain, size was " << inputGains_.size() << endl;
-#endif
-		inputGains_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-	{
-		if(i < rampInputGains.size())
-			inputGains_[i]->setRampValues(currentInputGains[i], rampInputGains[i]);
-		else
-			inputGains_[i]->setCurrentValue(currentInputGains[i]);
-	}
+		postParameter(kParameterInputGain, i, kParameterCommandSet, currentInputGains[i],
+					  (i < rampInputGains.size() ? rampInputGains[i] : emptyRamp));
 		
 	// Activate delay-and-sum code
 	if(currentInputGains.size() > 0)
 	{
 		if(rampInputGains.size() > 0 || currentInputGains.size() > 1 || currentInputGains[0] != 1.0)
-		{
-#ifdef DEBUG_MESSAGES
-			cout << "PllSynth::setInputGains(): using delay and sum\n";
-#endif
-			usingDelayAndSum_ = true;
-		}
+			postParameter(kParameterDelayAndSum, 0, 1.0);
 	}
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::setInputDelays(vector<double>& currentInputDelays,
@@ -507,102 +852,56 @@ void PllSynth::setInputDelays(vector<double>& currentInputDelays,
 	// ignore the extra.  If it is smaller, don't ramp the last parameters.
 	int i, size = currentInputDelays.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting delay
-	while(size > inputDelays_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding input delay, size was " << inputDelays_.size() << endl;
-#endif
-		inputDelays_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-	{
-		if(i < rampInputDelays.size())
-			inputDelays_[i]->setRampValues(currentInputDelays[i], rampInputDelays[i]);
-		else
-			inputDelays_[i]->setCurrentValue(currentInputDelays[i]);
-	}
+		postParameter(kParameterInputDelay, i, kParameterCommandSet, currentInputDelays[i],
+					  (i < rampInputDelays.size() ? rampInputDelays[i] : emptyRamp));
 
 	if(currentInputDelays.size() > 0)
 	{
 		if(rampInputDelays.size() > 0 || currentInputDelays.size() > 1 || currentInputDelays[0] != 0.0)
-		{
-#ifdef DEBUG_MESSAGES
-			cout << "PllSynth::setInputDelays(): using delay and sum\n";
-#endif
-			usingDelayAndSum_ = true;
-		}
+			postParameter(kParameterDelayAndSum, 0, 1.0);
 	}
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::setCenterFrequency(double currentCenterFrequency, timedParameter& rampCenterFrequency) 
-{ 
-	pthread_mutex_lock(&parameterMutex_);		// Acquire lock ensuring we're not actively rendering
-
-	float freq = currentCenterFrequency;
-	float freqDivQ = freq*filterQinverse_;	// Save some multiplies...
-
-	centerFrequency_->setRampValues(freq, rampCenterFrequency);	
-	
-	if(mainInputFilter_ != NULL)
-		mainInputFilter_->updateCoefficients(freq, freqDivQ);
-	if(useInterferenceRejection_)
-	{
-		lowInputFilter_->updateCoefficients(freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
-		highInputFilter_->updateCoefficients(freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);	
-	}
-	if(useAmplitudeFeedback_)
-	{
-		for(int j = 0; j < harmonicInputFilters_.size(); j++)
-			harmonicInputFilters_[j]->updateCoefficients(freq*(float)(j+2), freqDivQ*(float)(j+2));
-	}		
-	
-	pthread_mutex_unlock(&parameterMutex_);
+{
+	beginParameters();
+	postParameter(kParameterCenterFrequency, 0, kParameterCommandSet, currentCenterFrequency, rampCenterFrequency);
+	endParameters();
 }
 
 void PllSynth::setLoopGain(double currentLoopGain, timedParameter& rampLoopGain) 
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	loopGain_->setRampValues(currentLoopGain, rampLoopGain);
-
-	pthread_mutex_unlock(&parameterMutex_);
+	beginParameters();
+	postParameter(kParameterLoopGain, 0, kParameterCommandSet, currentLoopGain, rampLoopGain);
+	endParameters();
 }
 
 void PllSynth::setPhaseOffset(double currentPhaseOffset, timedParameter& rampPhaseOffset) 
 {
-	pthread_mutex_lock(&parameterMutex_);	
-	
-	phaseOffset_->setRampValues(currentPhaseOffset, rampPhaseOffset);
-	//cout << "synth: setPhaseOffset " << currentPhaseOffset << endl;
-	
-	pthread_mutex_unlock(&parameterMutex_);
+	beginParameters();
+	postParameter(kParameterPhaseOffset, 0, kParameterCommandSet, currentPhaseOffset, rampPhaseOffset);
+	endParameters();
 }
 
 void PllSynth::setGlobalAmplitude(double currentAmplitude, timedParameter& rampAmplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	globalAmplitude_->setRampValues(currentAmplitude, rampAmplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterGlobalAmplitude, 0, kParameterCommandSet, currentAmplitude, rampAmplitude);
+	endParameters();
 }
 
 vector<double> PllSynth::getCurrentHarmonicAmplitudes()
 {
     vector<double> returnAmplitudes;
     
-    for (int i = 0; i < harmonicAmplitudes_.size(); ++i)
+    for (int i = 0; i < parameters_.size(kGroupHarmonicAmplitudes); ++i)
     {
-        returnAmplitudes.push_back(harmonicAmplitudes_[i]->currentValue());
+        returnAmplitudes.push_back(parameters_.value(kGroupHarmonicAmplitudes, i));
     }
     
     return returnAmplitudes;
@@ -615,81 +914,29 @@ void PllSynth::setHarmonicAmplitudes(vector<double>& currentHarmonicAmplitudes,
 	// ignore the extra.  If it is smaller, don't ramp the last parameters.
 	int i, size = currentHarmonicAmplitudes.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
-
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicAmplitudes_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic amplitude, size was " << harmonicAmplitudes_.size() << endl;
-#endif
-		harmonicAmplitudes_.push_back(newParam);
-		
-		if(useAmplitudeFeedback_)
-		{
-			// There will always be one fewer filterBuffers than harmonics, since the main buffer is separate	
-			
-			ButterBandpassFilter *bp = new ButterBandpassFilter(sampleRate_);
-			
-			EnvelopeFollower *ef = new EnvelopeFollower(.05, sampleRate_);
-			harmonicEnvelopeFollowers_.push_back(ef);
-
-			// Use size as a proxy for which harmonic we just added.  Notice that this has to come
-			// AFTER the harmonicAmplitudes_.push_back() call above, or the calcluation will change.
-			
-#ifdef DEBUG_MESSAGES_EXTRA
-			cout << "filter has multiplier " << harmonicAmplitudes_.size() << endl;
-#endif
-			float freq = centerFrequency_->currentValue()*(float)(harmonicAmplitudes_.size());
-			bp->updateCoefficients(freq, freq*filterQinverse_);
-			harmonicInputFilters_.push_back(bp);
-		}
-	}
-	// Append the new values to each timedParameter in our internal vector
-	for(i = 0; i < size; i++)
-	{
-		if(i < rampHarmonicAmplitudes.size())
-			harmonicAmplitudes_[i]->setRampValues(currentHarmonicAmplitudes[i], rampHarmonicAmplitudes[i]);
-		else
-			harmonicAmplitudes_[i]->setCurrentValue(currentHarmonicAmplitudes[i]);
-	}
-	
-	pthread_mutex_unlock(&parameterMutex_);
-}
+	beginParameters();
+	
+	for(i = 0; i < size; i++)
+		postParameter(kParameterHarmonicAmplitude, i, kParameterCommandSet, currentHarmonicAmplitudes[i],
+					  (i < rampHarmonicAmplitudes.size() ? rampHarmonicAmplitudes[i] : emptyRamp));
+	
+	endParameters();
+}
 
 void PllSynth::setHarmonicPhases(vector<double>& currentHarmonicPhases,
 									 vector<timedParameter>& rampHarmonicPhases)
 {
-	// Use the currentHarmonicAmplitudes size as our metric.  If rampHarmonicAmplitudes.size is greater,
+	// Use the currentHarmonicPhases size as our metric.  If rampHarmonicPhases.size is greater,
 	// ignore the extra.  If it is smaller, don't ramp the last parameters.
 	int i, size = currentHarmonicPhases.size();
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicPhases_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic phase, size was " << harmonicPhases_.size() << endl;
-#endif
-		harmonicPhases_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-	{
-		if(i < rampHarmonicPhases.size())
-			harmonicPhases_[i]->setRampValues(currentHarmonicPhases[i], rampHarmonicPhases[i]);
-		else
-			harmonicPhases_[i]->setCurrentValue(currentHarmonicPhases[i]);
-	}
+		postParameter(kParameterHarmonicPhase, i, kParameterCommandSet, currentHarmonicPhases[i],
+					  (i < rampHarmonicPhases.size() ? rampHarmonicPhases[i] : emptyRamp));
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::setAmplitudeFeedbackScaler(double currentScaler, timedParameter& rampScaler) 
@@ -697,11 +944,9 @@ void PllSynth::setAmplitudeFeedbackScaler(double currentScaler, timedParameter&
 	if(!useAmplitudeFeedback_)	// This parameter doesn't mean anything without amplitude feedback
 		return;
 	
-	pthread_mutex_lock(&parameterMutex_);
-	
-	amplitudeFeedbackScaler_->setRampValues(currentScaler, rampScaler);
-	
-	pthread_mutex_unlock(&parameterMutex_);
+	beginParameters();
+	postParameter(kParameterFeedbackScaler, 0, kParameterCommandSet, currentScaler, rampScaler);
+	endParameters();
 }
 
 // FIXME: Should append methods actually increase size??
@@ -712,152 +957,82 @@ void PllSynth::appendInputGains(vector<timedParameter>& inputGains)
 {
 	int i, size = inputGains.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > inputGains_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding input gain, size was " << inputGains_.size() << endl;
-#endif
-		inputGains_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		inputGains_[i]->appendRampValues(inputGains[i]);
+		postParameter(kParameterInputGain, i, kParameterCommandAppend, 0.0, inputGains[i]);
 
 	// Activate delay-and-sum code
-	usingDelayAndSum_ = true;
+	postParameter(kParameterDelayAndSum, 0, 1.0);
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::appendInputDelays(vector<timedParameter>& inputDelays)
 {
 	int i, size = inputDelays.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting delay
-	while(size > inputDelays_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding input delay, size was " << inputDelays_.size() << endl;
-#endif
-		inputDelays_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		inputDelays_[i]->appendRampValues(inputDelays[i]);
-	
+		postParameter(kParameterInputDelay, i, kParameterCommandAppend, 0.0, inputDelays[i]);
+
 	// Activate delay-and-sum code
-	usingDelayAndSum_ = true;
+	postParameter(kParameterDelayAndSum, 0, 1.0);
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::appendCenterFrequency(timedParameter& centerFrequency) 
-{ 
-	pthread_mutex_lock(&parameterMutex_);
-	
-	centerFrequency_->appendRampValues(centerFrequency); 
-
-	pthread_mutex_unlock(&parameterMutex_);
+{
+	beginParameters();
+	postParameter(kParameterCenterFrequency, 0, kParameterCommandAppend, 0.0, centerFrequency);
+	endParameters();
 }
 
 void PllSynth::appendLoopGain(timedParameter& loopGain) 
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	loopGain_->appendRampValues(loopGain);
-
-	pthread_mutex_unlock(&parameterMutex_);
+	beginParameters();
+	postParameter(kParameterLoopGain, 0, kParameterCommandAppend, 0.0, loopGain);
+	endParameters();
 }
 
 void PllSynth::appendPhaseOffset(timedParameter& phaseOffset) 
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	phaseOffset_->appendRampValues(phaseOffset);
-	
-	pthread_mutex_unlock(&parameterMutex_);
+	beginParameters();
+	postParameter(kParameterPhaseOffset, 0, kParameterCommandAppend, 0.0, phaseOffset);
+	endParameters();
 }
 
 void PllSynth::appendGlobalAmplitude(timedParameter& amplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	globalAmplitude_->appendRampValues(amplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterGlobalAmplitude, 0, kParameterCommandAppend, 0.0, amplitude);
+	endParameters();
 }
 
 void PllSynth::appendHarmonicAmplitudes(vector<timedParameter>& harmonicAmplitudes) 
 {
 	int i, size = harmonicAmplitudes.size();
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicAmplitudes_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic amplitude, size was " << harmonicAmplitudes_.size() << endl;
-#endif
-		harmonicAmplitudes_.push_back(newParam);
-		
-		if(useAmplitudeFeedback_)
-		{
-			// There will always be one fewer filterBuffers than harmonics, since the main buffer is separate	
-			
-			ButterBandpassFilter *bp = new ButterBandpassFilter(sampleRate_);
-			
-			// Use size as a proxy for which harmonic we just added.  Notice that this has to come
-			// AFTER the push_back() call above, or the calcluation will change.
-			
-			float freq = centerFrequency_->currentValue()*(float)(harmonicAmplitudes_.size());
-			bp->updateCoefficients(freq, freq*filterQinverse_);
-			harmonicInputFilters_.push_back(bp);
-		}		
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		harmonicAmplitudes_[i]->appendRampValues(harmonicAmplitudes[i]);
+		postParameter(kParameterHarmonicAmplitude, i, kParameterCommandAppend, 0.0, harmonicAmplitudes[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::appendHarmonicPhases(vector<timedParameter>& harmonicPhases) 
 {
 	int i, size = harmonicPhases.size();
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0 as the default starting amplitude
-	while(size > harmonicPhases_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding harmonic phase, size was " << harmonicPhases_.size() << endl;
-#endif
-		harmonicPhases_.push_back(newParam);
-	}
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		harmonicPhases_[i]->appendRampValues(harmonicPhases[i]);
+		postParameter(kParameterHarmonicPhase, i, kParameterCommandAppend, 0.0, harmonicPhases[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	endParameters();
 }
 
 void PllSynth::appendAmplitudeFeedbackScaler(timedParameter& scaler) 
@@ -865,41 +1040,176 @@ void PllSynth::appendAmplitudeFeedbackScaler(timedParameter& scaler)
 	if(!useAmplitudeFeedback_)	// This parameter doesn't mean anything without amplitude feedback
 		return;
 	
-	pthread_mutex_lock(&parameterMutex_);
+	beginParameters();
+	postParameter(kParameterFeedbackScaler, 0, kParameterCommandAppend, 0.0, scaler);
+	endParameters();
+}
+
+// Apply one parameter change posted by the methods above.  Runs on the render thread at the start of a
+// block once the synth is being rendered, or directly on the calling thread before then.
+
+void PllSynth::applyParameter(int parameter, int index, int type, double value, timedParameter& ramp)
+{
+	float freq;
 	
-	amplitudeFeedbackScaler_->appendRampValues(scaler);
+	switch(parameter)
+	{
+		case kParameterFilterQ:
+			filterQ_ = value;							// Save the new Q value
+			filterQinverse_ = 1.0/value;				// Calculate Q inverse to save float divisions later
+			updateFilterCoefficients(parameters_.value(kGroupCenterFrequency));
+			break;
+		case kParameterInputGain:
+			// Check if the change is beyond our internal storage, and if so, increase our storage
+			// accordingly.  Use 0 as the default starting amplitude
+			if(index >= parameters_.size(kGroupInputGains))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding input gains, size was " << parameters_.size(kGroupInputGains) << endl;
+#endif
+				parameters_.resize(kGroupInputGains, index + 1, 0.0);
+			}
+			parameters_.applyCommand(kGroupInputGains, index, type, value, ramp);
+			break;
+		case kParameterInputDelay:
+			// Likewise, use 0 as the default starting delay
+			if(index >= parameters_.size(kGroupInputDelays))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding input delays, size was " << parameters_.size(kGroupInputDelays) << endl;
+#endif
+				parameters_.resize(kGroupInputDelays, index + 1, 0.0);
+			}
+			parameters_.applyCommand(kGroupInputDelays, index, type, value, ramp);
+			break;
+		case kParameterDelayAndSum:
+#ifdef DEBUG_MESSAGES
+			if(!usingDelayAndSum_)
+				cout << "PllSynth: using delay and sum\n";
+#endif
+			usingDelayAndSum_ = true;
+			break;
+		case kParameterCenterFrequency:
+			parameters_.applyCommand(kGroupCenterFrequency, 0, type, value, ramp);
+			if(type == kParameterCommandSet)
+				updateFilterCoefficients(value);
+			break;
+		case kParameterLoopGain:
+			parameters_.applyCommand(kGroupLoopGain, 0, type, value, ramp);
+			break;
+		case kParameterPhaseOffset:
+			parameters_.applyCommand(kGroupPhaseOffset, 0, type, value, ramp);
+			break;
+		case kParameterGlobalAmplitude:
+			parameters_.applyCommand(kGroupGlobalAmplitude, 0, type, value, ramp);
+			break;
+		case kParameterHarmonicAmplitude:
+			// Use 0 as the default starting amplitude
+			while(index >= parameters_.size(kGroupHarmonicAmplitudes))
+			{
+				int numHarmonics = parameters_.size(kGroupHarmonicAmplitudes) + 1;
+				
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding harmonic amplitude, size was " << numHarmonics - 1 << endl;
+#endif
+				parameters_.resize(kGroupHarmonicAmplitudes, numHarmonics, 0.0);
+				
+				if(useAmplitudeFeedback_)
+				{
+					// There will always be one fewer harmonic filters than harmonics, since the main filter is separate.
+					// The filter's envelope follower is created along with the others, by reserveRenderStorage().
+					
+					inputFilters_.resize(inputFilters_.size() + 1);
+					
+					// The new harmonic's number is the new size of the group
+					
+#ifdef DEBUG_MESSAGES_EXTRA
+					cout << "filter has multiplier " << numHarmonics << endl;
+#endif
+					freq = parameters_.value(kGroupCenterFrequency)*(float)numHarmonics;
+					inputFilters_.updateCoefficients(inputFilters_.size() - 1, freq, freq*filterQinverse_);
+					resizeHarmonicAnalyzer();
+				}
+			}
+			parameters_.applyCommand(kGroupHarmonicAmplitudes, index, type, value, ramp);
+			break;
+		case kParameterHarmonicPhase:
+			// Use 0 as the default starting phase
+			if(index >= parameters_.size(kGroupHarmonicPhases))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding harmonic phases, size was " << parameters_.size(kGroupHarmonicPhases) << endl;
+#endif
+				parameters_.resize(kGroupHarmonicPhases, index + 1, 0.0);
+			}
+			parameters_.applyCommand(kGroupHarmonicPhases, index, type, value, ramp);
+			break;
+		case kParameterFeedbackScaler:
+			if(parameters_.size(kGroupFeedbackScaler) > 0)
+				parameters_.applyCommand(kGroupFeedbackScaler, 0, type, value, ramp);
+			break;
+		default:
+			break;
+	}
+}
+
+// Recalculate the coefficients of all the bandpass filters around a new center frequency
+
+void PllSynth::updateFilterCoefficients(float freq)
+{
+	float freqDivQ = freq*filterQinverse_;		// Save some multiplies...
 	
-	pthread_mutex_unlock(&parameterMutex_);
+	inputFilters_.updateCoefficients(kInputFilterMain, freq, freqDivQ);
+	if(useInterferenceRejection_)
+	{
+		inputFilters_.updateCoefficients(kInputFilterLow, freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
+		inputFilters_.updateCoefficients(kInputFilterHigh, freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);	
+	}
+	if(useAmplitudeFeedback_)
+	{
+		for(int j = 0; j < numHarmonicInputFilters(); j++)
+			inputFilters_.updateCoefficients(kInputFilterHarmonics + j, freq*(float)(j+2), freqDivQ*(float)(j+2));
+	}
 }
 
 // Render one buffer of output.  input holds the incoming audio data.  output may already contain
 // audio, so we add our result to it rather than replacing.
+//
+// The buffer is processed in blocks of at most PLL_BLOCK_SIZE samples, each of which runs through
+// the four stages below.  The filters and the PLL perform the same arithmetic in the same order as the
+// original sample-by-sample loop did.  The oscillators work in single precision (see OscillatorBank) and
+// the PLL phase is a 32-bit fixed-point accumulator rather than a double, whose truncated increment shifts
+// the frequency by at most 1e-5Hz.  Together these keep the output within 1e-4 of full scale of the
+// original double-precision loop over a few seconds.
 
 int PllSynth::render(const void *input, void *output, unsigned long frameCount,
 					 const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags)
 {
 	float *inBuffer = (float *)input;		// These start by pointing at the beginning of the buffer
-	float *outBuffer = (float *)output;		// and increment as frames are processed
-	float outSample;
-	PaTime bufferStartTime, bufferEndTime;
-	unsigned long lastFrame = frameCount;
-	unsigned long i, j;
-	vector<Parameter *>::iterator it;
+	float *outBuffer = (float *)output;		// and increment as blocks are processed
+	PaTime bufferStartTime, bufferEndTime, parameterTime;
+	unsigned long firstFrame = 0, lastFrame = frameCount;
+	unsigned long framesRendered, blockFrames, parameterFrame;
 	bool willFinishAtEnd = false;
 	
-	if(!isRunning_)			// Don't do anything if the note hasn't started
-		return paContinue;
-
 	bufferStartTime = timeInfo->outputBufferDacTime;
 	bufferEndTime = bufferStartTime + (double)frameCount*sampleLength_;	// Time this buffer will end
 	
+	applyParameterCommands(bufferStartTime);	// Pick up parameter changes even if we're not running yet
+	
+	if(!isRunning_)			// Don't do anything if the note hasn't started
+		return paContinue;
+	
 	if(startTime_ >= bufferEndTime)
 		return paContinue;	// Note will begin, but not during this callback
 	
 	// If the note was set to begin "now", calibrate its start time to the beginning of this buffer
-	// We use the start time to calculate the offset from the beginning of the note.
+	// We use the start time to calculate the offset from the beginning of the note.  A note set to
+	// begin partway through this buffer starts at that frame.
 	if(startTime_ == 0)	
 		startTime_ = bufferStartTime;
+	else if(startTime_ > bufferStartTime)
+		firstFrame = frameAtTime(startTime_, bufferStartTime);
 	
 	// If the note has been set to release, check whether that should happen immediately, within this
 	// buffer, or later.  If later, then go about our business like normal.
@@ -916,7 +1226,7 @@ int PllSynth::render(const void *input, void *output, unsigned long frameCount,
 		}
 		else if(releaseTime_ < bufferEndTime)		// Release mid-buffer
 		{
-			lastFrame = (unsigned long)((releaseTime_ - bufferStartTime)*sampleRate_);
+			lastFrame = frameAtTime(releaseTime_, bufferStartTime);
 #ifdef DEBUG_MESSAGES
 			cout << "Releasing at sample " << lastFrame << endl;
 #endif
@@ -926,121 +1236,312 @@ int PllSynth::render(const void *input, void *output, unsigned long frameCount,
 		// else do nothing
 	}
 	
-	// Now calculate all the samples we need, either a full or partial frame.
+	// Now calculate all the samples we need, either a full or partial frame.  Queued parameter changes
+	// are only applied between blocks: besides ramping, the later stages walk the harmonic and filter
+	// vectors, which the changes may resize.  So a block ends early where a timed change falls.
 	
-	for(i = 0; i < lastFrame; i++)
+	framesRendered = firstFrame;
+	if(inBuffer != NULL)
+		inBuffer += firstFrame*numInputChannels_;
+	outBuffer += firstFrame;
+	
+	while(framesRendered < lastFrame)
 	{
-		float inputSample;		// Delay-and-sum on multiple inputs (partially implemented right now)
-		float vcoFrequency;
-		float followerMain;
+		blockFrames = min(lastFrame - framesRendered, (unsigned long)PLL_BLOCK_SIZE);
+		
+		if(framesRendered > 0)
+			applyParameterCommands(bufferStartTime + (PaTime)framesRendered*sampleLength_);
+		
+		parameterTime = nextParameterTime();
+		if(parameterTime > bufferStartTime)
+		{
+			parameterFrame = frameAtTime(parameterTime, bufferStartTime);
+			if(parameterFrame > framesRendered && parameterFrame < framesRendered + blockFrames)
+				blockFrames = parameterFrame - framesRendered;
+		}
+		
+		rampBlockParameters(blockFrames);
+		filterBlockInput(inBuffer, framesRendered, blockFrames);
+		runBlockPll(blockFrames);
+		renderBlockOscillators(outBuffer, blockFrames);
+		
+		// Update counters for next block
+		sampleNumber_ += blockFrames;
+		framesRendered += blockFrames;
+		if(inBuffer != NULL)
+			inBuffer += blockFrames*numInputChannels_;
+		outBuffer += blockFrames;
+	}
+	
+	if(willFinishAtEnd)
+		isFinished_ = true;
+	
+	return paContinue;
+}
+
+// Stage 1: ramp the parameters and record their values for each segment of the block.  A new segment
+// begins wherever the parameters are ramped, which happens every PARAMETER_UPDATE_INTERVAL samples.  This
+// is also where we work out when the bandpass filters need new coefficients or a fresh start, so the later
+// stages can apply those changes at the right sample.
+
+void PllSynth::rampBlockParameters(unsigned long frameCount)
+{
+	unsigned long i, j;
+	int segment = 0;
+	int numInputs = usingDelayAndSum_ ? min(parameters_.size(kGroupInputGains), numInputChannels_) : 0;
+	int numHarmonics = parameters_.size(kGroupHarmonicAmplitudes);
+	int numHarmonicPhases = parameters_.size(kGroupHarmonicPhases);
+	int numInputDelays = min(parameters_.size(kGroupInputDelays), numInputs);
+	float maxDelay = (inputHistory_ != NULL ? inputHistory_->maxDelay() : 0.0);
+	
+	for(i = 0; i < frameCount; i++)
+	{
+		bool rampNow = ((sampleNumber_ + i) % PARAMETER_UPDATE_INTERVAL == 0);
+		bool centerFrequencyChanged = false;
+		const double *inputGains, *inputDelays, *harmonicAmplitudes, *harmonicPhases;
+		
+		if(i != 0 && !rampNow)
+			continue;
 		
 		// Handle ramped parameter updates, but not every sample to save CPU time.
 		// A parameter needs ramping when there is at least one item in its timedParameter deque.
-		if(sampleNumber_ % PARAMETER_UPDATE_INTERVAL == 0)
+		if(rampNow)
+		{
+			parameters_.ramp();		// All of them in one pass
+			centerFrequencyChanged = parameters_.changed(kGroupCenterFrequency);
+		}
+		
+		// The groups don't move while we're ramping, so these can be read straight from the bank
+		inputGains = parameters_.values(kGroupInputGains);
+		inputDelays = parameters_.values(kGroupInputDelays);
+		harmonicAmplitudes = parameters_.values(kGroupHarmonicAmplitudes);
+		harmonicPhases = parameters_.values(kGroupHarmonicPhases);
+		
+		blockSegmentStart_[segment] = i;
+		blockCenterFrequency_[segment] = parameters_.value(kGroupCenterFrequency);
+		blockLoopGain_[segment] = parameters_.value(kGroupLoopGain);
+		blockPhaseOffset_[segment] = parameters_.value(kGroupPhaseOffset);
+		blockGlobalAmplitude_[segment] = parameters_.value(kGroupGlobalAmplitude);
+		blockFeedbackScaler_[segment] = (useAmplitudeFeedback_ ? parameters_.value(kGroupFeedbackScaler) : 0.0);
+		
+		for(j = 0; j < numInputs; j++)
+			blockInputGains_[j*PLL_BLOCK_SEGMENTS + segment] = inputGains[j];
+		for(j = 0; j < numInputs; j++)
+		{
+			// Delays are in seconds; inputs without one, or with nowhere to read it from, have none
+			float delay = (j < numInputDelays ? (float)inputDelays[j]*sampleRate_ : 0.0);
+			
+			blockInputDelays_[j*PLL_BLOCK_SEGMENTS + segment] = max(0.0f, min(delay, maxDelay));
+		}
+		for(j = 0; j < numHarmonics; j++)
+			blockHarmonicAmplitudes_[j*PLL_BLOCK_SEGMENTS + segment] = harmonicAmplitudes[j];
+		for(j = 0; j < numHarmonicPhases; j++)
+			blockHarmonicPhases_[j*PLL_BLOCK_SEGMENTS + segment] = harmonicPhases[j];
+		
+		// With smoothing, the global amplitude moves in a straight line across each update interval
+		if(smoothGlobalAmplitude_)
+		{
+			unsigned long k, segmentEnd = min(frameCount, i + PARAMETER_UPDATE_INTERVAL - (sampleNumber_ + i) % PARAMETER_UPDATE_INTERVAL);
+			
+			for(k = i; k < segmentEnd; k++)
+				blockSmoothedAmplitude_[k] = parameters_.smoothedValue(kGroupGlobalAmplitude, 0, (sampleNumber_ + k) % PARAMETER_UPDATE_INTERVAL);
+		}
+		
+		// If centerFrequency_ changes, need to update the filter coefficients.  When the loop gain
+		// goes from zero to nonzero, we have to go back and update the stuff we skipped over before.
+		
+		blockUpdateFilters_[segment] = (centerFrequencyChanged && blockLoopGain_[segment] != 0.0);
+		blockRestartFilters_[segment] = false;
+		
+		if(blockLoopGain_[segment] != 0.0)
 		{
-			pthread_mutex_lock(&parameterMutex_);	// Acquire lock so the parameters don't change
+			if(loopGainWasZero_)
+			{
+				blockRestartFilters_[segment] = true;
+				loopGainWasZero_ = false;
+			}
+		}
+		else
+			loopGainWasZero_ = true;
+		
+		segment++;
+	}
+	
+	blockSegments_ = segment;
+	blockSegmentStart_[segment] = frameCount;
+}
+
+// Stage 2: delay-and-sum on the inputs, then the main bandpass filter and (if enabled) the
+// interference rejection filters, which together give us the input to the PLL and the effective
+// loop gain at each sample.  The harmonic filters for amplitude feedback run here too, as part of
+// the same filter bank, and their outputs are left in blockFiltered_ for stage 4.
 
-			globalAmplitude_->ramp(PARAMETER_UPDATE_INTERVAL);
-			loopGain_->ramp(PARAMETER_UPDATE_INTERVAL);
-			phaseOffset_->ramp(PARAMETER_UPDATE_INTERVAL);
+void PllSynth::filterBlockInput(float *inBuffer, unsigned long blockOffset, unsigned long frameCount)
+{
+	unsigned long i, j;
+	int segment;
+	bool haveInput = (numInputChannels_ > 0 && inBuffer != NULL);
+	bool havePlanarInput = (inputHistory_ != NULL && inputHistory_->numChannels() >= numInputChannels_);
+	int numInputs = usingDelayAndSum_ ? min(parameters_.size(kGroupInputGains), numInputChannels_) : 0;
+	int numHarmonicFilters = numHarmonicInputFilters();
+	int numFeedbackHarmonics = min(numHarmonicFilters, (int)parameters_.size(kGroupHarmonicAmplitudes)-1); // sanity check
+	int stride = inputFilters_.stride();
+	
+	for(segment = 0; segment < blockSegments_; segment++)
+	{
+		unsigned long segmentStart = blockSegmentStart_[segment], segmentEnd = blockSegmentStart_[segment + 1];
+		bool loopIsActive = (blockLoopGain_[segment] != 0.0);
+		float *filtered = &blockFiltered_[segmentStart*stride];
+		
+		// The input is needed by the PLL whenever the loop is running, and by the harmonic
+		// filters of amplitude feedback whether or not it is.
+		
+		if(!loopIsActive && !useAmplitudeFeedback_)
+			continue;
+		
+		if(!haveInput)
+		{
+			for(i = segmentStart; i < segmentEnd; i++)
+				blockInput_[i] = 0.0;
+		}
+		else if(!usingDelayAndSum_)	// Bypass the delay and sum code if we don't need it.
+		{
+			// Channel 1, gain 1.0
+			if(havePlanarInput)
+			{
+				const float *in = inputHistory_->channel(0) + blockOffset;
+				
+				for(i = segmentStart; i < segmentEnd; i++)
+					blockInput_[i] = in[i];
+			}
+			else
+			{
+				for(i = segmentStart; i < segmentEnd; i++)
+					blockInput_[i] = inBuffer[i*numInputChannels_];
+			}
+		}
+		else
+		{
+			for(i = segmentStart; i < segmentEnd; i++)
+				blockInput_[i] = 0.0;
 			
-			if(centerFrequency_->ramp(PARAMETER_UPDATE_INTERVAL) && loopGain_->currentValue() != 0.0)
+			// Sum the inputs one at a time, each with its own gain and delay for the segment.  Undelayed
+			// inputs come straight from the planar input, delayed ones from the history AudioRender keeps.
+			// Both are indexed from the start of the whole buffer, of which this block is a part.
+			for(j = 0; j < numInputs; j++)
 			{
-				// If centerFrequency_ changes, need to update the filter buffer coefficients
-				float freq = centerFrequency_->currentValue();
-				float freqDivQ = freq*filterQinverse_;	// Save some multiplies...
+				double gain = blockInputGains_[j*PLL_BLOCK_SEGMENTS + segment];
+				float delay = blockInputDelays_[j*PLL_BLOCK_SEGMENTS + segment];
+				int wholeDelay = (int)delay;
 				
-				mainInputFilter_->updateCoefficients(freq, freqDivQ);
-				if(useInterferenceRejection_)
+				if(!havePlanarInput)
 				{
-					lowInputFilter_->updateCoefficients(freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
-					highInputFilter_->updateCoefficients(freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);	
+					for(i = segmentStart; i < segmentEnd; i++)
+						blockInput_[i] += inBuffer[i*numInputChannels_ + j]*gain;
 				}
-				if(useAmplitudeFeedback_)
+				else if(delay == 0.0)
 				{
-					for(j = 0; j < harmonicInputFilters_.size(); j++)
-						harmonicInputFilters_[j]->updateCoefficients(freq*(float)(j+2), freqDivQ*(float)(j+2));
-				}				
+					const float *in = inputHistory_->channel(j) + blockOffset;
+					
+					for(i = segmentStart; i < segmentEnd; i++)
+						blockInput_[i] += in[i]*gain;
+				}
+				else if(delay == (float)wholeDelay)
+				{
+					for(i = segmentStart; i < segmentEnd; i++)
+						blockInput_[i] += inputHistory_->readWhole(j, blockOffset + i, wholeDelay)*gain;
+				}
+				else
+				{
+					for(i = segmentStart; i < segmentEnd; i++)
+						blockInput_[i] += inputHistory_->read(j, blockOffset + i, delay)*gain;
+				}
 			}
-
-			// Should we somehow condense these so we don't have to call so many ramp functions?
-			for(it = inputGains_.begin(); it != inputGains_.end(); it++)
-				(*it)->ramp(PARAMETER_UPDATE_INTERVAL);
-			for(it = inputDelays_.begin(); it != inputDelays_.end(); it++)
-				(*it)->ramp(PARAMETER_UPDATE_INTERVAL);
-			for(it = harmonicAmplitudes_.begin(); it != harmonicAmplitudes_.end(); it++)
-				(*it)->ramp(PARAMETER_UPDATE_INTERVAL);			
-			for(it = harmonicPhases_.begin(); it != harmonicPhases_.end(); it++)
-				(*it)->ramp(PARAMETER_UPDATE_INTERVAL);
-			
-			if(useAmplitudeFeedback_)
-				amplitudeFeedbackScaler_->ramp(PARAMETER_UPDATE_INTERVAL);
-			
-			pthread_mutex_unlock(&parameterMutex_);
-		}	
+		}
 		
-		if(loopGain_->currentValue() != 0.0)
+		// When the center frequency changes or the loop restarts, update the filters.  These flags are
+		// only ever set while the loop is active.  The harmonic filters track the center frequency even
+		// when their harmonic is silent.
+		
+		if(blockUpdateFilters_[segment] || blockRestartFilters_[segment])
 		{
-			if(loopGainWasZero_)	// Have to go back and update the stuff we skipped over before
+			float freq = blockCenterFrequency_[segment];
+			float freqDivQ = freq*filterQinverse_;	// Save some multiplies...
+			
+			if(blockRestartFilters_[segment])
+				inputFilters_.clearBuffer(kInputFilterMain);
+			inputFilters_.updateCoefficients(kInputFilterMain, freq, freqDivQ);
+			if(useInterferenceRejection_)
 			{
-				float freq = centerFrequency_->currentValue();
-				float freqDivQ = freq*filterQinverse_;	// Save some multiplies...
-				
-				mainInputFilter_->clearBuffer();
-				mainInputFilter_->updateCoefficients(freq, freqDivQ);
-
-				if(useInterferenceRejection_)
-				{
-					lowInputFilter_->clearBuffer();
-					highInputFilter_->clearBuffer();
-					lowInputFilter_->updateCoefficients(freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
-					highInputFilter_->updateCoefficients(freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);	
-				}				
-				if(useAmplitudeFeedback_)
+				if(blockRestartFilters_[segment])
 				{
-					for(j = 0; j < harmonicInputFilters_.size(); j++)
-					{
-						harmonicInputFilters_[j]->clearBuffer();
-						harmonicInputFilters_[j]->updateCoefficients(freq*(float)(j+2), freqDivQ*(float)(j+2));
-					}
+					inputFilters_.clearBuffer(kInputFilterLow);
+					inputFilters_.clearBuffer(kInputFilterHigh);
 				}
-				
-				loopGainWasZero_ = false;
-				pllLastOutput_ = 0.0;
+				inputFilters_.updateCoefficients(kInputFilterLow, freq*SEMITONE_DOWN, freqDivQ*SEMITONE_DOWN);
+				inputFilters_.updateCoefficients(kInputFilterHigh, freq*SEMITONE_UP, freqDivQ*SEMITONE_UP);	
 			}
-			
-			if(numInputChannels_ > 0 && inBuffer != NULL)
+			if(useAmplitudeFeedback_)
 			{
-				if(!usingDelayAndSum_)	// Bypass the delay and sum code if we don't need it.
-					inputSample = *inBuffer;	// Channel 1, gain 1.0
-				else
+				for(j = 0; j < numHarmonicFilters; j++)
 				{
-					inputSample = 0.0;
-					
-					for(j = 0; j < min(inputGains_.size(), numInputChannels_); j++)
-					{
-						// FIXME: inputDelays not yet implemented.  Need to keep long storage buffers
-						// for any channels that are delayed.
-						
-						inputSample += inBuffer[j]*inputGains_[j]->currentValue();
-					}
+					if(blockRestartFilters_[segment])
+						inputFilters_.clearBuffer(kInputFilterHarmonics + j);
+					inputFilters_.updateCoefficients(kInputFilterHarmonics + j, freq*(float)(j+2), freqDivQ*(float)(j+2));
 				}
 			}
+		}
+		
+		// Run the filters whose outputs are used in this segment: the main and interference rejection
+		// filters when the loop is running, and the harmonic filters of any audible harmonics.  The rest
+		// keep their state for later.
+		
+		inputFilters_.setActive(kInputFilterMain, loopIsActive);
+		inputFilters_.setActive(kInputFilterLow, loopIsActive && useInterferenceRejection_);
+		inputFilters_.setActive(kInputFilterHigh, loopIsActive && useInterferenceRejection_);
+		for(j = 0; j < numHarmonicFilters; j++)
+		{
+			float target = blockGlobalAmplitude_[segment]*blockHarmonicAmplitudes_[(j+1)*PLL_BLOCK_SEGMENTS + segment];
+			
+			inputFilters_.setActive(kInputFilterHarmonics + j, useAmplitudeFeedback_ && !useHarmonicAnalyzer_ &&
+									j < numFeedbackHarmonics && target != 0.0);
+		}
+		
+		inputFilters_.filter(&blockInput_[segmentStart], filtered, segmentEnd - segmentStart);
+		
+		if(!loopIsActive)
+		{
+			// If the loop gain is zero, don't need any of the fancy BPF, PLL processing, since the
+			// output will remain at centerFrequency no matter what.  Amplitude feedback still compares
+			// against the last level of the main follower.
 			
-			float currentLoopGain = loopGain_->currentValue();
+			for(i = segmentStart; i < segmentEnd; i++)
+				blockFollowerMain_[i] = mainEnvelopeFollower_->currentValue();
+			continue;
+		}
+		
+		// 2nd order bandpass filter on input, based at centerFrequency_
+		for(i = segmentStart; i < segmentEnd; i++)
+			blockFilteredCenter_[i] = filtered[(i - segmentStart)*stride + kInputFilterMain];
+		if(useInterferenceRejection_ || useAmplitudeFeedback_)
+		{
+			for(i = segmentStart; i < segmentEnd; i++)
+				blockFollowerMain_[i] = mainEnvelopeFollower_->filter(blockFilteredCenter_[i]);
+		}
+		
+		for(i = segmentStart; i < segmentEnd; i++)
+			blockScaledLoopGain_[i] = blockLoopGain_[segment];
+		
+		if(useInterferenceRejection_)
+		{
+			// Interference rejection scales the loop gain down when there's more energy at adjacent
+			// semitones than at the desired frequency.  This avoids the problem of PLL locking to the
+			// wrong frequency, which results in a note that doesn't play properly.
 			
-			// 2nd order bandpass filter on input, based at centerFrequency_
-			float inputFilteredCenter = mainInputFilter_->filter(inputSample);
-			if(useInterferenceRejection_ || useAmplitudeFeedback_)
-				followerMain = mainEnvelopeFollower_->filter(inputFilteredCenter);			
-			if(useInterferenceRejection_)
+			for(i = segmentStart; i < segmentEnd; i++)
 			{
-				// Interference rejection scales the loop gain down when there's more energy at adjacent
-				// semitones than at the desired frequency.  This avoids the problem of PLL locking to the
-				// wrong frequency, which results in a note that doesn't play properly.
-				
-				float inputFilteredLow = lowInputFilter_->filter(inputSample);
-				float inputFilteredHigh = highInputFilter_->filter(inputSample);
+				float inputFilteredLow = filtered[(i - segmentStart)*stride + kInputFilterLow];
+				float inputFilteredHigh = filtered[(i - segmentStart)*stride + kInputFilterHigh];
 				
 				float followerLow = lowEnvelopeFollower_->filter(inputFilteredLow);
 				float followerHigh = highEnvelopeFollower_->filter(inputFilteredHigh);
@@ -1050,170 +1551,236 @@ int PllSynth::render(const void *input, void *output, unsigned long frameCount,
 				
 				if(followerNeighborMax > 0.0)
 				{
-					float ratio = followerMain / followerNeighborMax;
+					float ratio = blockFollowerMain_[i] / followerNeighborMax;
 					if(ratio <= 1.0)	// Reduce by ratio^4 (steep fall-off for large interference)
 					{
 						float ratioSquared = ratio*ratio;
-						currentLoopGain *= ratioSquared*ratioSquared;
+						blockScaledLoopGain_[i] *= ratioSquared*ratioSquared;
 					}
 				}
 #ifdef DEBUG_MESSAGES_EXTRA
-				if(sampleNumber_ % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
+				if((sampleNumber_ + i) % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
 				{
-					cout << "filters: main = " << inputFilteredCenter << "low = " << inputFilteredLow << "high = " << inputFilteredHigh << endl;
-					cout << "followers: main = " << followerMain << " low = " << followerLow << " high = " << followerHigh << endl;
+					cout << "filters: main = " << blockFilteredCenter_[i] << "low = " << inputFilteredLow << "high = " << inputFilteredHigh << endl;
+					cout << "followers: main = " << blockFollowerMain_[i] << " low = " << followerLow << " high = " << followerHigh << endl;
 				}				
-				
 #endif
 			}
-			
-			// PLL loop filter: the input to the PLL is a multiplier block of its last output sample
-			// and the current input (which comes from the main bandpass filter), which then goes
-			// through the loop filter
-			
-			float loopFilterOutput = (float)loopFilter_->filter((double)(pllLastOutput_*inputFilteredCenter));
+		}
+	}
+}
 
-			// Should loopGain be scaled according to centerFrequency?  Currently the relative frequency
-			// displacement is smaller at higher frequencies, but maybe we only care about absolute displacement.
-			
-			vcoFrequency = centerFrequency_->currentValue() + currentLoopGain*loopFilterOutput;
+// Stage 3: the phase-locked loop.  This is the one stage that has to run sample by sample, since each
+// output of the VCO feeds back into the next input.  It produces the PLL phase for every sample of the block.
 
-			// Update the phase information
-			pllPhase_ = fmod(pllPhase_ + vcoFrequency*sampleLength_, 1.0);		
-			
-			// Calculate the PLL VCO output (a single sine wave without any of the harmonic or phase
-			// offset information that we ultimately send to the DAC).
-			pllLastOutput_ = waveTable.lookupInterp(waveTableSine, pllPhase_);	
-		}
-		else
+void PllSynth::runBlockPll(unsigned long frameCount)
+{
+	unsigned long i;
+	int segment;
+	
+	for(segment = 0; segment < blockSegments_; segment++)
+	{
+		unsigned long segmentStart = blockSegmentStart_[segment], segmentEnd = blockSegmentStart_[segment + 1];
+		double centerFrequency = blockCenterFrequency_[segment];
+		float vcoFrequency;
+		
+		if(blockLoopGain_[segment] != 0.0)
 		{
-			// If the loop gain is zero, don't need any of the fancy BPF, PLL processing, since the
-			// output will remain at centerFrequency no matter what.  However, we should remember to
-			// still pass some data through the filter buffers so we're not left with artifacts later.
-			
-			loopGainWasZero_ = true;
+			if(blockRestartFilters_[segment])
+				pllLastOutput_ = 0.0;
 			
-			if(useAmplitudeFeedback_)
+			for(i = segmentStart; i < segmentEnd; i++)
 			{
-				if(!usingDelayAndSum_)	// Bypass the delay and sum code if we don't need it.
-					inputSample = *inBuffer;	// Channel 1, gain 1.0
+				// PLL loop filter: the input to the PLL is a multiplier block of its last output sample
+				// and the current input (which comes from the main bandpass filter), which then goes
+				// through the loop filter
+				
+				float loopFilterOutput;
+				
+				if(loopFilter_ == NULL)
+					loopFilterOutput = (float)firstOrderLoopFilter_.filter((double)(pllLastOutput_*blockFilteredCenter_[i]));
 				else
+					loopFilterOutput = (float)loopFilter_->filter((double)(pllLastOutput_*blockFilteredCenter_[i]));
+				
+				// Should loopGain be scaled according to centerFrequency?  Currently the relative frequency
+				// displacement is smaller at higher frequencies, but maybe we only care about absolute displacement.
+				
+				vcoFrequency = centerFrequency + blockScaledLoopGain_[i]*loopFilterOutput;
+				
+				// Update the phase information
+				blockPhase_[i] = pllPhase_.advance(vcoFrequency, sampleLength_);
+				
+				// Calculate the PLL VCO output (a single sine wave without any of the harmonic or phase
+				// offset information that we ultimately send to the DAC).
+				pllLastOutput_ = SynthSine::lookupPhase(blockPhase_[i]);
+				
+#ifdef DEBUG_MESSAGES_EXTRA
+				if((sampleNumber_ + i) % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
 				{
-					inputSample = 0.0;
-					
-					for(j = 0; j < min(inputGains_.size(), numInputChannels_); j++)
-					{
-						// FIXME: inputDelays not yet implemented.  Need to keep long storage buffers
-						// for any channels that are delayed.
-						
-						inputSample += inBuffer[j]*inputGains_[j]->currentValue();
-					}
-				}	
+					cout << "freq = " << vcoFrequency << ", inputLevel = " << blockFollowerMain_[i] << endl;
+				}
+#endif
 			}
+		}
+		else
+		{
+			// With zero loop gain the output stays at centerFrequency no matter what.
+			
+			vcoFrequency = centerFrequency;
+			pllPhase_.setFrequency(vcoFrequency, sampleLength_);
 			
-			vcoFrequency = centerFrequency_->currentValue();
-			pllPhase_ = fmod(pllPhase_ + vcoFrequency*sampleLength_, 1.0);
+			for(i = segmentStart; i < segmentEnd; i++)
+				blockPhase_[i] = pllPhase_.advance();
 		}
+	}
+}
+
+// Stage 4: the oscillator bank.  The harmonics are accumulated into blockOutput_, which is then scaled
+// by the global amplitude and mixed into the output buffer.
+
+void PllSynth::renderBlockOscillators(float *outBuffer, unsigned long frameCount)
+{
+	unsigned long i, j;
+	int segment;
+	
+	for(i = 0; i < frameCount; i++)
+		blockOutput_[i] = 0.0;
+	
+	if(useAmplitudeFeedback_)
+	{
+		// Amplitude feedback records the intensity of each harmonic by filtering the input
+		// signal.  harmonicAmplitudes holds the target values, and the outputs are adjusted
+		// to match this.  Note that we can only make the output amplitudes larger; if they're
+		// already too large, just turn off that particular harmonic and wait for it to come down.
+		// Not a perfect feedback strategy by any means, but it produces musical results.
 		
-		// Calculate the output as a sum of sine waves at each harmonic
-		outSample = 0.0;
-		float phaseShift = phaseOffset_->currentValue();
+		int size = min(numHarmonicInputFilters(), (int)parameters_.size(kGroupHarmonicAmplitudes)-1); // sanity check
+		int stride = inputFilters_.stride();
+		
+		// If there are N harmonics (i.e. N amplitudes), there will be N-1 harmonic input filters.
+		// This is because the fundamental frequency has an amplitude, but its input filter is already
+		// handled in inputFilteredCenter followerMain.
+		
+		// step 1: compare followerMain to harmonicAmplitudes[0]
+		// step 2: compare followerHarmonic[n] to harmonicAmplitudes[n+1]
+		// procedure: take max(harmonicAmplitude - followerAmplitude, 0)
+		//            filter this through a first-order lowpass, to pull out any weird peaks from follower
+		//            (is the above necessary?)
+		//            scale by some constant-- overall we need to figure out the proper dynamics of this loop
 		
-		if(useAmplitudeFeedback_)
+		for(segment = 0; segment < blockSegments_; segment++)
 		{
-			// Amplitude feedback records the intensity of each harmonic by filtering the input
-			// signal.  harmonicAmplitudes holds the target values, and the outputs are adjusted
-			// to match this.  Note that we can only make the output amplitudes larger; if they're
-			// already too large, just turn off that particular harmonic and wait for it to come down.
-			// Not a perfect feedback strategy by any means, but it produces musical results.
+			float target = blockGlobalAmplitude_[segment]*blockHarmonicAmplitudes_[segment];
+			float phaseShift = blockPhaseOffset_[segment];
+			float hPhase = (parameters_.size(kGroupHarmonicPhases) > 0 ? blockHarmonicPhases_[segment] : 0.0);
+			uint32_t phaseOffset = PhaseAccumulator::fromCycles(hPhase + phaseShift);
 			
-			int size = min(harmonicInputFilters_.size(), harmonicAmplitudes_.size()-1); // sanity check
+			if(target == 0.0)
+				continue;
 			
-			// If there are N harmonics (i.e. N amplitudes), there will be N-1 elements in harmonicInputFilters.
-			// This is because the fundamental frequency has an amplitude, but its input filter is already
-			// handled in inputFilteredCenter followerMain.
-			
-			// step 1: compare followerMain to harmonicAmplitudes[0]
-			// step 2: compare followerHarmonic[n] to harmonicAmplitudes[n+1]
-			// procedure: take max(harmonicAmplitude - followerAmplitude, 0)
-			//            filter this through a first-order lowpass, to pull out any weird peaks from follower
-			//            (is the above necessary?)
-			//            scale by some constant-- overall we need to figure out the proper dynamics of this loop
-			
-			float target = globalAmplitude_->currentValue()*harmonicAmplitudes_[0]->currentValue();
-			float outputLevel, hPhase;
-			if(target != 0.0)
+			for(i = blockSegmentStart_[segment]; i < blockSegmentStart_[segment + 1]; i++)
 			{
-				outputLevel = amplitudeFeedbackScaler_->currentValue()*max(target - followerMain, (float)0.0);
-				hPhase = (harmonicPhases_.size() > 0 ? harmonicPhases_[0]->currentValue() : 0.0);
-				outSample += outputLevel*waveTable.lookupInterp(waveTableSine, pllPhase_+hPhase+phaseShift);
-				
-				if(sampleNumber_ % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
-				{
-					//cout << "Fundamental: target = " << target << " follower = " << followerMain << " output = " << outputLevel << endl;
-				}
+				float outputLevel = blockFeedbackScaler_[segment]*max(target - blockFollowerMain_[i], (float)0.0);
+				blockOutput_[i] += outputLevel*SynthSine::lookupPhase(blockPhase_[i] + phaseOffset);
 			}
+		}
+		
+		// The harmonic filters were run in stage 2, for just those segments where the target is nonzero.
+		// The analyzer instead runs over every sample here, since it needs the PLL phase.
+		
+		if(useHarmonicAnalyzer_)
+		{
+			// Sized to match by resizeHarmonicAnalyzer()
+			harmonicAnalyzer_.analyze(blockInput_, blockPhase_, frameCount, size > 0 ? &blockHarmonicLevels_[0] : NULL);
+		}
+		
+		for(j = 0; j < size; j++)
+		{
+			float *filtered = &blockFiltered_[kInputFilterHarmonics + j];
+			EnvelopeFollower *follower = harmonicEnvelopeFollowers_[j];
 			
-			for(j = 0; j < size; j++)
+			for(segment = 0; segment < blockSegments_; segment++)
 			{
-				target = globalAmplitude_->currentValue()*harmonicAmplitudes_[j+1]->currentValue();
-				if(target == 0.0)
-					continue;
+				float target = blockGlobalAmplitude_[segment]*blockHarmonicAmplitudes_[(j+1)*PLL_BLOCK_SEGMENTS + segment];
+				float phaseShift = blockPhaseOffset_[segment];
 				
-				float filteredHarmonic = harmonicInputFilters_[j]->filter(inputSample);
-				float followerHarmonic = harmonicEnvelopeFollowers_[j]->filter(filteredHarmonic);
+				// FIXME: this takes the phase of harmonic j+1 from harmonicPhases_[j] and its frequency
+				// from multiplier j+1, both one less than the amplitude index.  Kept as-is for now so
+				// existing patches sound the same.
+				float hPhase = (j < parameters_.size(kGroupHarmonicPhases) ? blockHarmonicPhases_[j*PLL_BLOCK_SEGMENTS + segment] : 0.0);
+				uint32_t phaseOffset = PhaseAccumulator::fromCycles(hPhase + phaseShift);
 				
-				outputLevel = amplitudeFeedbackScaler_->currentValue()*max(target - followerHarmonic, (float)0.0);
-				// TODO: filter this level?
+				if(target == 0.0)
+					continue;
 				
-				if(sampleNumber_ % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
+				for(i = blockSegmentStart_[segment]; i < blockSegmentStart_[segment + 1]; i++)
 				{
-					cout << "Harmonic " << j+1 << ": target = " << target << " follower = " << followerHarmonic << " output = " << outputLevel << endl;
+					float followerHarmonic;
+					
+					if(useHarmonicAnalyzer_)
+						followerHarmonic = blockHarmonicLevels_[i*size + j];
+					else
+						followerHarmonic = follower->filter(filtered[i*stride]);
+					
+					float outputLevel = blockFeedbackScaler_[segment]*max(target - followerHarmonic, (float)0.0);
+					// TODO: filter this level?
+					
+#ifdef DEBUG_MESSAGES_EXTRA
+					if((sampleNumber_ + i) % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
+					{
+						cout << "Harmonic " << j+1 << ": target = " << target << " follower = " << followerHarmonic << " output = " << outputLevel << endl;
+					}
+#endif
+					
+					blockOutput_[i] += outputLevel*SynthSine::lookupPhase(blockPhase_[i]*(uint32_t)(j+1) + phaseOffset);
 				}
-				
-				hPhase = (j < harmonicPhases_.size() ? harmonicPhases_[j]->currentValue() : 0.0);				
-				outSample += outputLevel*waveTable.lookupInterp(waveTableSine, pllPhase_*(float)(j+1)+hPhase+phaseShift);				
-			}			
+			}
 		}
-		else
+	}
+	else
+	{
+		// With no amplitude feedback, harmonic amplitudes refer directly to the strength of each
+		// partial at the output.  Gather the audible harmonics for each segment into the oscillator
+		// bank, which renders them all at once.
+		
+		for(segment = 0; segment < blockSegments_; segment++)
 		{
-			// With no amplitude feedback, harmonic amplitudes refer directly to the strength of each
-			// partial at the output
+			float phaseShift = blockPhaseOffset_[segment];
 			
-			for(j = 0; j < harmonicAmplitudes_.size(); j++)
+			oscillators_.clear();
+			
+			for(j = 0; j < parameters_.size(kGroupHarmonicAmplitudes); j++)
 			{
-				if(harmonicAmplitudes_[j]->currentValue() == 0.0)
+				double amplitude = blockHarmonicAmplitudes_[j*PLL_BLOCK_SEGMENTS + segment];
+				
+				if(amplitude == 0.0)
 					continue;
-			
-				float hPhase = (j < harmonicPhases_.size() ? harmonicPhases_[j]->currentValue() : 0.0);
-			
-				outSample += (float)(harmonicAmplitudes_[j]->currentValue())
-							* waveTable.lookupInterp(waveTableSine, pllPhase_*(float)(j+1)+hPhase+phaseShift);
-				//outSample += (float)(harmonicAmplitudes_[j]->currentValue())
-				//				* waveTable.lookup(waveTableSine, pllPhase_*(float)(j+1)+hPhase);
+				
+				float hPhase = (j < parameters_.size(kGroupHarmonicPhases) ? blockHarmonicPhases_[j*PLL_BLOCK_SEGMENTS + segment] : 0.0);
+				
+				oscillators_.addOscillator((float)amplitude, j+1, PhaseAccumulator::fromCycles(hPhase + phaseShift));
 			}
+			
+			oscillators_.render(&blockOutput_[blockSegmentStart_[segment]], &blockPhase_[blockSegmentStart_[segment]],
+								blockSegmentStart_[segment + 1] - blockSegmentStart_[segment]);
 		}
-		
-		// Mix the output into the buffer, scaling by the global amplitude
-		outBuffer[outputChannel_] += outSample*globalAmplitude_->currentValue();
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		if(sampleNumber_ % DEBUG_MESSAGE_SAMPLE_INTERVAL == 0)
-		{
-			cout << "freq = " << vcoFrequency << ", inputLevel = " << followerMain << endl;
-		}
-#endif
-		
-		// Update counters for next cycle
-		sampleNumber_++;
-		inBuffer += numInputChannels_;
-		outBuffer += numOutputChannels_;
 	}
 	
-	if(willFinishAtEnd)
-		isFinished_ = true;
-	
-	return paContinue;
+	// Mix the output into the buffer, scaling by the global amplitude
+	if(smoothGlobalAmplitude_)
+	{
+		for(i = 0; i < frameCount; i++)
+			outBuffer[i] += blockOutput_[i]*blockSmoothedAmplitude_[i];
+		return;
+	}
+	
+	for(segment = 0; segment < blockSegments_; segment++)
+	{
+		double globalAmplitude = blockGlobalAmplitude_[segment];
+		
+		for(i = blockSegmentStart_[segment]; i < blockSegmentStart_[segment + 1]; i++)
+			outBuffer[i] += blockOutput_[i]*globalAmplitude;
+	}
 }
 
 PllSynth::~PllSynth()
@@ -1224,43 +1791,20 @@ PllSynth::~PllSynth()
 	cout << "*** ~PllSynth\n";
 #endif
 	
-	// Parameters are dynamically-allocated and need to be deleted:
-	
-	delete centerFrequency_;
-	delete loopGain_;
-	delete phaseOffset_;
+	// Filters and followers are dynamically-allocated and need to be deleted:
 	
-	for(i = 0; i < harmonicAmplitudes_.size(); i++)
-		delete harmonicAmplitudes_[i];
-	for(i = 0; i < harmonicPhases_.size(); i++)
-		delete harmonicPhases_[i];
-	for(i = 0; i < inputGains_.size(); i++)
-		delete inputGains_[i];
-	for(i = 0; i < inputDelays_.size(); i++)
-		delete inputDelays_[i];
-	
-	delete globalAmplitude_;
 	delete loopFilter_;
-	delete mainInputFilter_;
 	
 	if(useInterferenceRejection_ || useAmplitudeFeedback_)
 		delete mainEnvelopeFollower_;
 	if(useInterferenceRejection_)
 	{
-		delete lowInputFilter_;
-		delete highInputFilter_;
 		delete lowEnvelopeFollower_;
 		delete highEnvelopeFollower_;
 	}
 
-	for(i = 0; i < harmonicInputFilters_.size(); i++)
-		delete harmonicInputFilters_[i];
 	for(i = 0; i < harmonicEnvelopeFollowers_.size(); i++)
 		delete harmonicEnvelopeFollowers_[i];
-	if(useAmplitudeFeedback_)
-		delete amplitudeFeedbackScaler_;
-	
-	pthread_mutex_destroy(&parameterMutex_);
 }
 
 #pragma mark NoiseSynth
@@ -1271,82 +1815,75 @@ ostream& operator<<(ostream& output, const NoiseSynth& s)
 	
 	output << (SynthBase&)s;
 	output << "NoiseSynth subclass:\n";
-	output << "  globalAmplitude_: " << *(s.globalAmplitude_);
-	for(i = 0; i < s.filterFrequencies_.size(); i++)
-		output << "  filterFrequencies[" << i << "]: " << *(s.filterFrequencies_[i]);
-	for(i = 0; i < s.filterAmplitudes_.size(); i++)
-		output << "  filterAmplitudes[" << i << "]: " << *(s.filterAmplitudes_[i]);
-	for(i = 0; i < s.filterQs_.size(); i++)
-		output << "  filterQs[" << i << "]: " << *(s.filterQs_[i]);	
+	output << "  globalAmplitude_: ";
+	s.parameters_.print(output, NoiseSynth::kGroupGlobalAmplitude, 0);
+	for(i = 0; i < s.parameters_.size(NoiseSynth::kGroupFilterFrequencies); i++)
+	{
+		output << "  filterFrequencies[" << i << "]: ";
+		s.parameters_.print(output, NoiseSynth::kGroupFilterFrequencies, i);
+	}
+	for(i = 0; i < s.parameters_.size(NoiseSynth::kGroupFilterAmplitudes); i++)
+	{
+		output << "  filterAmplitudes[" << i << "]: ";
+		s.parameters_.print(output, NoiseSynth::kGroupFilterAmplitudes, i);
+	}
+	for(i = 0; i < s.parameters_.size(NoiseSynth::kGroupFilterQs); i++)
+	{
+		output << "  filterQs[" << i << "]: ";
+		s.parameters_.print(output, NoiseSynth::kGroupFilterQs, i);
+	}
 	return output;	
 }
 
-NoiseSynth::NoiseSynth(float sampleRate) : SynthBase(sampleRate)
+NoiseSynth::NoiseSynth(float sampleRate) : SynthBase(sampleRate), parameters_(sampleRate, kNumParameterGroups),
+  filters_(sampleRate)
 {
 #ifdef DEBUG_ALLOCATION
 	cout << "*** NoiseSynth\n";
 #endif
 	
-	// Initialize the mutex
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize mutex in NoiseSynth\n";
-		// Throw exception?
-	}
-	
-	// Seed the random number generator
-	sranddev();
-	
-	// By default, amplitude 0.1 (-20dB) and no filters
-	globalAmplitude_ = new Parameter(0.1, sampleRate);
+	// The noise generator seeds itself.  By default, uniform noise, amplitude 0.1 (-20dB) and no filters
+	useGaussianNoise_ = false;
+	parameters_.resize(kGroupGlobalAmplitude, 1, 0.1);
+	reservedFilters_ = 0;
 }
 
-NoiseSynth::NoiseSynth(const NoiseSynth& copy) : SynthBase(copy)
+NoiseSynth::NoiseSynth(const NoiseSynth& copy) : SynthBase(copy), parameters_(copy.parameters_), filters_(copy.filters_)
 {
-	int i;
-	
 #ifdef DEBUG_ALLOCATION
 	cout << "*** NoiseSynth (copy constructor)\n";
 #endif
 	
-	// Make copies of the relevant parameters
-	
-	if(copy.globalAmplitude_ != NULL)
-		globalAmplitude_ = new Parameter(*copy.globalAmplitude_);
-	else
-		globalAmplitude_ = NULL;
+	// The noise generator takes a new seed rather than copying, or both synths would produce the same noise.
 	
-	// Copy over the vector parameters.  Fortunately, we shouldn't have NULL pointers in the vectors.
+	useGaussianNoise_ = copy.useGaussianNoise_;
+	reservedFilters_ = 0;			// Copies aren't rendering yet
+	filteredNoise_.resize(PARAMETER_UPDATE_INTERVAL*filters_.stride());
+}
+
+NoiseSynth& NoiseSynth::operator=(const NoiseSynth& copy)
+{
+	if(this == &copy)
+		return *this;
 	
-	for(i = 0; i < copy.filterFrequencies_.size(); i++)
-		filterFrequencies_.push_back(new Parameter(*copy.filterFrequencies_[i]));
-	for(i = 0; i < copy.filterQs_.size(); i++)
-		filterQs_.push_back(new Parameter(*copy.filterQs_[i]));
-	for(i = 0; i < copy.filterAmplitudes_.size(); i++)
-		filterAmplitudes_.push_back(new Parameter(*copy.filterAmplitudes_[i]));	
-	for(i = 0; i < copy.filters_.size(); i++)
-		filters_.push_back(new ButterBandpassFilter(*copy.filters_[i]));
+	SynthBase::operator=(copy);
 	
-	// Initialize (don't copy) the mutex
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize mutex in NoiseSynth\n";
-		// Throw exception?
-	}
+	useGaussianNoise_ = copy.useGaussianNoise_;
+	noise_.reseed();				// As in the copy constructor, new noise for the new note
+	reservedFilters_ = 0;
+	parameters_ = copy.parameters_;	// These reuse the existing storage if it's big enough
+	filters_ = copy.filters_;
+	if(filteredNoise_.size() < PARAMETER_UPDATE_INTERVAL*filters_.stride())
+		filteredNoise_.resize(PARAMETER_UPDATE_INTERVAL*filters_.stride());
 	
-	// Seed the random number generator
-	sranddev();	
+	return *this;
 }
 
-// TODO: operator=
-
 void NoiseSynth::setGlobalAmplitude(double currentAmplitude, timedParameter& rampAmplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	globalAmplitude_->setRampValues(currentAmplitude, rampAmplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterGlobalAmplitude, 0, kParameterCommandSet, currentAmplitude, rampAmplitude);
+	endParameters();
 }
 
 void NoiseSynth::setFilterFrequencies(vector<double>& currentFrequencies, 
@@ -1355,27 +1892,12 @@ void NoiseSynth::setFilterFrequencies(vector<double>& currentFrequencies,
 	// If the argument sizes don't match, use the smaller one.  (They should always match)
 	int i, size = min(currentFrequencies.size(), rampFrequencies.size());
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 1kHz as the default starting frequency
-	while(size > filterFrequencies_.size())
-	{
-		Parameter *newParam = new Parameter(1000.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding filter frequency, size was " << filterFrequencies_.size() << endl;
-#endif
-		filterFrequencies_.push_back(newParam);
-	}
-	
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		filterFrequencies_[i]->setRampValues(currentFrequencies[i], rampFrequencies[i]);
+		postParameter(kParameterFilterFrequency, i, kParameterCommandSet, currentFrequencies[i], rampFrequencies[i]);
 	
-	updateFilters(); // Make new ButterBandpassFilters, if necessary
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void NoiseSynth::setFilterQs(vector<double>& currentQs, 
@@ -1384,27 +1906,12 @@ void NoiseSynth::setFilterQs(vector<double>& currentQs,
 	// If the argument sizes don't match, use the smaller one.  (They should always match)
 	int i, size = min(currentQs.size(), rampQs.size());
 	
-	pthread_mutex_lock(&parameterMutex_);		
-	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 10 as the default starting Q
-	while(size > filterQs_.size())
-	{
-		Parameter *newParam = new Parameter(10.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding filter Q, size was " << filterQs_.size() << endl;
-#endif
-		filterQs_.push_back(newParam);
-	}
+	beginParameters();
 	
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		filterQs_[i]->setRampValues(currentQs[i], rampQs[i]);
-	
-	updateFilters(); // Make new ButterBandpassFilters, if necessary
+		postParameter(kParameterFilterQ, i, kParameterCommandSet, currentQs[i], rampQs[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void NoiseSynth::setFilterAmplitudes(vector<double>& currentAmplitudes, 
@@ -1413,130 +1920,153 @@ void NoiseSynth::setFilterAmplitudes(vector<double>& currentAmplitudes,
 	// If the argument sizes don't match, use the smaller one.  (They should always match)
 	int i, size = min(currentAmplitudes.size(), rampAmplitudes.size());
 	
-	pthread_mutex_lock(&parameterMutex_);		
-	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0.0 as the default starting amplitude
-	while(size > filterAmplitudes_.size())
-	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding filter amplitude, size was " << filterAmplitudes_.size() << endl;
-#endif
-		filterAmplitudes_.push_back(newParam);
-	}
+	beginParameters();
 	
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		filterAmplitudes_[i]->setRampValues(currentAmplitudes[i], rampAmplitudes[i]);
+		postParameter(kParameterFilterAmplitude, i, kParameterCommandSet, currentAmplitudes[i], rampAmplitudes[i]);
 	
-	updateFilters(); // Make new ButterBandpassFilters, if necessary
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void NoiseSynth::appendGlobalAmplitude(timedParameter& amplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	globalAmplitude_->appendRampValues(amplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterGlobalAmplitude, 0, kParameterCommandAppend, 0.0, amplitude);
+	endParameters();
 }
 
 void NoiseSynth::appendFilterFrequencies(vector<timedParameter>& frequencies)
 {
-	// If the argument sizes don't match, use the smaller one.  (They should always match)
 	int i, size = frequencies.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
-	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 1kHz as the default starting frequency
-	while(size > filterFrequencies_.size())
-	{
-		Parameter *newParam = new Parameter(1000.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding filter frequency, size was " << filterFrequencies_.size() << endl;
-#endif
-		filterFrequencies_.push_back(newParam);
-	}
+	beginParameters();
 	
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		filterFrequencies_[i]->appendRampValues(frequencies[i]);
-	
-	updateFilters(); // Make new ButterBandpassFilters, if necessary
+		postParameter(kParameterFilterFrequency, i, kParameterCommandAppend, 0.0, frequencies[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void NoiseSynth::appendFilterQs(vector<timedParameter>& qs)
 {
-	// If the argument sizes don't match, use the smaller one.  (They should always match)
 	int i, size = qs.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
-	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 10 as the default starting Q
-	while(size > filterQs_.size())
-	{
-		Parameter *newParam = new Parameter(10.0, sampleRate_);
-		
-#ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding filter Q, size was " << filterQs_.size() << endl;
-#endif
-		filterQs_.push_back(newParam);
-	}
+	beginParameters();
 	
-	// Append the new values to each timedParameter in our internal vector
 	for(i = 0; i < size; i++)
-		filterQs_[i]->appendRampValues(qs[i]);
-	
-	updateFilters(); // Make new ButterBandpassFilters, if necessary
+		postParameter(kParameterFilterQ, i, kParameterCommandAppend, 0.0, qs[i]);
 	
-	pthread_mutex_unlock(&parameterMutex_);	
+	endParameters();
 }
 
 void NoiseSynth::appendFilterAmplitudes(vector<timedParameter>& amplitudes)
 {
-	// If the argument sizes don't match, use the smaller one.  (They should always match)
 	int i, size = amplitudes.size();
 	
-	pthread_mutex_lock(&parameterMutex_);		
+	beginParameters();
+	
+	for(i = 0; i < size; i++)
+		postParameter(kParameterFilterAmplitude, i, kParameterCommandAppend, 0.0, amplitudes[i]);
+	
+	endParameters();
+}
+
+// Make room for NOISE_RESERVED_FILTERS filters (or however many there already are) in the parameters, the
+// filter bank and the filter output, so that filters added while rendering don't allocate.
+
+void NoiseSynth::reserveRenderStorage()
+{
+	int numFilters = max(NOISE_RESERVED_FILTERS, max(max(parameters_.size(kGroupFilterFrequencies),
+															 parameters_.size(kGroupFilterQs)),
+														 parameters_.size(kGroupFilterAmplitudes)));
+	
+	parameters_.reserve(parameters_.size(kGroupGlobalAmplitude) + 3*numFilters);
+	filters_.reserve(numFilters);
+	if(filteredNoise_.size() < PARAMETER_UPDATE_INTERVAL*filters_.capacity())
+		filteredNoise_.resize(PARAMETER_UPDATE_INTERVAL*filters_.capacity());
 	
-	// Check if the vector we're appending has more elements than our internal storage, and
-	// if so, increase our storage accordingly.  Use 0.0 as the default starting amplitude
-	while(size > filterAmplitudes_.size())
+	reservedFilters_ = numFilters;
+}
+
+// Whether a change posted while rendering fits in the storage reserveRenderStorage() made
+
+bool NoiseSynth::parameterFits(int parameter, int index)
+{
+	switch(parameter)
 	{
-		Parameter *newParam = new Parameter(0.0, sampleRate_);
-		
+		case kParameterFilterFrequency:
+		case kParameterFilterQ:
+		case kParameterFilterAmplitude:
+			return (index < reservedFilters_);
+		default:
+			return true;
+	}
+}
+
+// Apply one parameter change posted by the methods above.  Runs on the render thread once the synth
+// is being rendered, or directly on the calling thread before then.
+
+void NoiseSynth::applyParameter(int parameter, int index, int type, double value, timedParameter& ramp)
+{
+	switch(parameter)
+	{
+		case kParameterGlobalAmplitude:
+			parameters_.applyCommand(kGroupGlobalAmplitude, 0, type, value, ramp);
+			break;
+		case kParameterFilterFrequency:
+			// Check if the change is beyond our internal storage, and if so, increase our storage
+			// accordingly.  Use 1kHz as the default starting frequency
+			if(index >= parameters_.size(kGroupFilterFrequencies))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding filter frequency, size was " << parameters_.size(kGroupFilterFrequencies) << endl;
+#endif
+				parameters_.resize(kGroupFilterFrequencies, index + 1, 1000.0);
+			}
+			parameters_.applyCommand(kGroupFilterFrequencies, index, type, value, ramp);
+			updateFilters(); // Add new filters, if necessary
+			break;
+		case kParameterFilterQ:
+			// Use 10 as the default starting Q
+			if(index >= parameters_.size(kGroupFilterQs))
+			{
+#ifdef DEBUG_MESSAGES_EXTRA
+				cout << "Adding filter Q, size was " << parameters_.size(kGroupFilterQs) << endl;
+#endif
+				parameters_.resize(kGroupFilterQs, index + 1, 10.0);
+			}
+			parameters_.applyCommand(kGroupFilterQs, index, type, value, ramp);
+			updateFilters();
+			break;
+		case kParameterFilterAmplitude:
+			// Use 0.0 as the default starting amplitude
+			if(index >= parameters_.size(kGroupFilterAmplitudes))
+			{
 #ifdef DEBUG_MESSAGES_EXTRA
-		cout << "Adding filter amplitude, size was " << filterAmplitudes_.size() << endl;
+				cout << "Adding filter amplitude, size was " << parameters_.size(kGroupFilterAmplitudes) << endl;
 #endif
-		filterAmplitudes_.push_back(newParam);
+				parameters_.resize(kGroupFilterAmplitudes, index + 1, 0.0);
+			}
+			parameters_.applyCommand(kGroupFilterAmplitudes, index, type, value, ramp);
+			updateFilters();
+			break;
+		default:
+			break;
 	}
-	
-	// Append the new values to each timedParameter in our internal vector
-	for(i = 0; i < size; i++)
-		filterAmplitudes_[i]->appendRampValues(amplitudes[i]);
-	
-	updateFilters(); // Make new ButterBandpassFilters, if necessary
-	
-	pthread_mutex_unlock(&parameterMutex_);	
 }
 
-// Private method called by the set and append methods.  This ensures there
-// are enough bandpass filter objects, and updates their values.  The number of
-// filters is equal to min(size(freqs), size(qs), size(amplitudes))
+// Private method called by applyParameter().  This ensures there
+// are enough bandpass filters in the bank, and updates their values.  The number of
+// filters is equal to min(size(freqs), size(qs), size(amplitudes)).  Once the synth is rendering,
+// reserveRenderStorage() has already made room for all of them.
 
 void NoiseSynth::updateFilters()
 {
 	int i;
-	int minSize = min(min(filterFrequencies_.size(), filterQs_.size()), filterAmplitudes_.size());
+	int minSize = min(min(parameters_.size(kGroupFilterFrequencies), parameters_.size(kGroupFilterQs)),
+					  parameters_.size(kGroupFilterAmplitudes));
+	const double *frequencies = parameters_.values(kGroupFilterFrequencies);
+	const double *qs = parameters_.values(kGroupFilterQs);
 	
 	if(minSize == filters_.size())	// Nothing to do here, filters has correct size
 		return;
@@ -1545,25 +2075,29 @@ void NoiseSynth::updateFilters()
 		while((i = filters_.size()) < minSize)
 		{
 #ifdef DEBUG_MESSAGES
-			cout << "NoiseSynth: adding ButterBandpassFilter, size was " << i << endl;
+			cout << "NoiseSynth: adding bandpass filter, size was " << i << endl;
 #endif
-			ButterBandpassFilter *bp = new ButterBandpassFilter(sampleRate_);
-			bp->updateCoefficients(filterFrequencies_[i]->currentValue(),
-								   (filterFrequencies_[i]->currentValue())/(filterQs_[i]->currentValue()));
-			filters_.push_back(bp);			
+			filters_.resize(i + 1);
+			filters_.updateCoefficients(i, frequencies[i], frequencies[i]/qs[i]);
 		}
 	}
 	else	// Uh-oh, filters has too many elements.  This will cause trouble in render() so fix ASAP!
 	{
 		cerr << "Warning: NoiseSynth had " << filters_.size() << " filters and " << minSize << " parameters.\n";
 		
-		while(filters_.size() > minSize)
-			filters_.pop_back();
+		filters_.resize(minSize);
 	}
+	
+	if(filteredNoise_.size() < PARAMETER_UPDATE_INTERVAL*filters_.stride())
+		filteredNoise_.resize(PARAMETER_UPDATE_INTERVAL*filters_.stride());
 }
 
 // Render one buffer of output.  input holds the incoming audio data.  output may already contain
 // audio, so we add our result to it rather than replacing.
+//
+// Parameters are constant between updates, so the noise is generated and filtered a stretch at a
+// time, up to the next update.  The filters and the sum over them perform the same arithmetic in the
+// same order as filtering each sample separately.
 
 int NoiseSynth::render(const void *input, void *output, unsigned long frameCount,
 					 const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags)
@@ -1571,23 +2105,30 @@ int NoiseSynth::render(const void *input, void *output, unsigned long frameCount
 	float *outBuffer = (float *)output;
 	float outSample;
 	PaTime bufferStartTime, bufferEndTime;
-	unsigned long lastFrame = frameCount;
-	unsigned long i, j;
+	unsigned long firstFrame = 0, lastFrame = frameCount;
+	unsigned long i, j, k, chunkFrames;
+	const double *frequencies, *qs, *amplitudes;
+	double globalAmplitude;
 	bool willFinishAtEnd = false;
 	
-	if(!isRunning_)			// Don't do anything if the note hasn't started
-		return paContinue;
-	
 	bufferStartTime = timeInfo->outputBufferDacTime;
 	bufferEndTime = bufferStartTime + (double)frameCount*sampleLength_;	// Time this buffer will end
 	
+	applyParameterCommands(bufferStartTime);	// Pick up parameter changes even if we're not running yet
+	
+	if(!isRunning_)			// Don't do anything if the note hasn't started
+		return paContinue;
+	
 	if(startTime_ >= bufferEndTime)
 		return paContinue;	// Note will begin, but not during this callback
 	
 	// If the note was set to begin "now", calibrate its start time to the beginning of this buffer
-	// We use the start time to calculate the offset from the beginning of the note.
+	// We use the start time to calculate the offset from the beginning of the note.  A note set to
+	// begin partway through this buffer starts at that frame.
 	if(startTime_ == 0)	
 		startTime_ = bufferStartTime;
+	else if(startTime_ > bufferStartTime)
+		firstFrame = frameAtTime(startTime_, bufferStartTime);
 	
 	// If the note has been set to release, check whether that should happen immediately, within this
 	// buffer, or later.  If later, then go about our business like normal.
@@ -1604,7 +2145,7 @@ int NoiseSynth::render(const void *input, void *output, unsigned long frameCount
 		}
 		else if(releaseTime_ < bufferEndTime)		// Release mid-buffer
 		{
-			lastFrame = (unsigned long)((releaseTime_ - bufferStartTime)*sampleRate_);
+			lastFrame = frameAtTime(releaseTime_, bufferStartTime);
 #ifdef DEBUG_MESSAGES
 			cout << "NoiseSynth releasing at sample " << lastFrame << endl;
 #endif
@@ -1614,55 +2155,72 @@ int NoiseSynth::render(const void *input, void *output, unsigned long frameCount
 		// else do nothing
 	}
 	
-	for(i = 0; i < lastFrame; i++)
+	outBuffer += firstFrame;
+	
+	// Groups move within the bank as others grow, so these are fetched again after each parameter update
+	frequencies = parameters_.values(kGroupFilterFrequencies);
+	qs = parameters_.values(kGroupFilterQs);
+	amplitudes = parameters_.values(kGroupFilterAmplitudes);
+	globalAmplitude = parameters_.value(kGroupGlobalAmplitude);
+	
+	for(i = firstFrame; i < lastFrame; i += chunkFrames)
 	{
 		// Handle ramped parameter updates, but not every sample to save CPU time.
 		// A parameter needs ramping when there is at least one item in its timedParameter deque.
 		if(sampleNumber_ % PARAMETER_UPDATE_INTERVAL == 0)
 		{
-			pthread_mutex_lock(&parameterMutex_);	// Acquire lock so the parameters don't change
+			applyParameterCommands(bufferStartTime + (PaTime)i*sampleLength_);
+			
+			parameters_.ramp();		// All of them in one pass
 			
-			globalAmplitude_->ramp(PARAMETER_UPDATE_INTERVAL);
+			frequencies = parameters_.values(kGroupFilterFrequencies);
+			qs = parameters_.values(kGroupFilterQs);
+			amplitudes = parameters_.values(kGroupFilterAmplitudes);
+			globalAmplitude = parameters_.value(kGroupGlobalAmplitude);
 
 			// Note: there must never be more filters than collections of (freq, Q, amplitude)
-			// The set and append methods are responsible for enforcing this
+			// applyParameter() is responsible for enforcing this
 			for(j = 0; j < filters_.size(); j++)
 			{
-				bool changed;
-				
-				filterAmplitudes_[j]->ramp(PARAMETER_UPDATE_INTERVAL);
-				changed = filterFrequencies_[j]->ramp(PARAMETER_UPDATE_INTERVAL) || filterQs_[j]->ramp(PARAMETER_UPDATE_INTERVAL);
-
-				if(changed)
-				{
-					filters_[j]->updateCoefficients(filterFrequencies_[j]->currentValue(), 
-													(filterFrequencies_[j]->currentValue())/(filterQs_[j]->currentValue()));
-				}
+				if(parameters_.changed(kGroupFilterFrequencies, j) || parameters_.changed(kGroupFilterQs, j))
+					filters_.updateCoefficients(j, frequencies[j], frequencies[j]/qs[j]);
 			}
-			
-			pthread_mutex_unlock(&parameterMutex_);
 		}	
+		
+		// Render up to the next parameter update or the end of the note
+		chunkFrames = min(PARAMETER_UPDATE_INTERVAL - sampleNumber_ % PARAMETER_UPDATE_INTERVAL, lastFrame - i);
 
 		// Start with a noise source between -1 and 1
-		float noise = (float)rand()/(float)(RAND_MAX>>1) - 1.0;
+		if(useGaussianNoise_)
+			noise_.gaussian(noiseBuffer_, chunkFrames);
+		else
+			noise_.uniform(noiseBuffer_, chunkFrames);
+		
+		if(filters_.size() > 0)
+			filters_.filter(noiseBuffer_, &filteredNoise_[0], chunkFrames);
 		
-		if(filters_.size() == 0)	// With no filters, pass the noise through
-			outSample = noise;
-		else						// Output sample is a sum of all filter outputs
+		for(k = 0; k < chunkFrames; k++)
 		{
-			outSample = 0.0;
+			if(filters_.size() == 0)	// With no filters, pass the noise through
+				outSample = noiseBuffer_[k];
+			else						// Output sample is a sum of all filter outputs
+			{
+				float *filtered = &filteredNoise_[k*filters_.stride()];
+				
+				outSample = 0.0;
+				
+				for(j = 0; j < filters_.size(); j++)	// Multiply the output by the Q to keep total energy the same
+					outSample += filtered[j]*amplitudes[j]*qs[j];
+			}
+			outSample *= globalAmplitude;	// Scale by overall output level
 			
-			for(j = 0; j < filters_.size(); j++)	// Multiply the output by the Q to keep total energy the same
-				outSample += filters_[j]->filter(noise)*filterAmplitudes_[j]->currentValue()*filterQs_[j]->currentValue();
+			// Mix the output into the buffer
+			*outBuffer += outSample;
+			
+			// Update counters for next cycle
+			outBuffer++;
+			sampleNumber_++;
 		}
-		outSample *= globalAmplitude_->currentValue();	// Scale by overall output level
-		
-		// Mix the output into the buffer
-		outBuffer[outputChannel_] += outSample;
-		
-		// Update counters for next cycle
-		outBuffer += numOutputChannels_;
-		sampleNumber_++;
 	}
 	
 	if(willFinishAtEnd)
@@ -1674,147 +2232,122 @@ int NoiseSynth::render(const void *input, void *output, unsigned long frameCount
 
 NoiseSynth::~NoiseSynth()
 {
-	int i;
-	
 #ifdef DEBUG_ALLOCATION
 	cout << "*** ~NoiseSynth\n";
 #endif
-	for(i = 0; i < filterAmplitudes_.size(); i++)
-		delete filterAmplitudes_[i];
-	for(i = 0; i < filterQs_.size(); i++)
-		delete filterQs_[i];
-	for(i = 0; i < filterFrequencies_.size(); i++)
-		delete filterFrequencies_[i];
-	for(i = 0; i < filters_.size(); i++)
-		delete filters_[i];
-	delete globalAmplitude_;
-	
-	pthread_mutex_destroy(&parameterMutex_);	
 }
 
 #pragma mark ResonanceSynth
 
-ResonanceSynth::ResonanceSynth(float sampleRate) : SynthBase(sampleRate)
+ResonanceSynth::ResonanceSynth(float sampleRate) : SynthBase(sampleRate), parameters_(sampleRate, kNumParameterGroups)
 {
 #ifdef DEBUG_ALLOCATION
 	cout << "*** ResonanceSynth\n";
 #endif
 	
-	// Initialize the mutexes
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize parameter mutex in ResonanceSynth\n";
-		// Throw exception?
-	}
-	if(pthread_mutex_init(&noteMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize note mutex in ResonanceSynth\n";
-		// Throw exception?
-	}	
-	
 	// By default, amplitude 0.1 (-20dB) and 6dB / octave harmonic rolloff, .5 sec decay at middle C
-	globalAmplitude_ = new Parameter(0.1, sampleRate);
-	harmonicRolloff_ = new Parameter(0.5, sampleRate);
-	decayRate_ = new Parameter(0.5, sampleRate);
+	parameters_.resize(kGroupGlobalAmplitude, 1, 0.1);
+	parameters_.resize(kGroupHarmonicRolloff, 1, 0.5);
+	parameters_.resize(kGroupDecayRate, 1, 0.5);
 	mono_ = false;
+	
+	numHarmonics_ = 0;
+	pendingHarmonicFrequency_ = 0.0;
+	bzero(harmonicAmplitudes_, RESONANCE_MAX_HARMONICS*sizeof(float));
 }
 
-ResonanceSynth::ResonanceSynth(const ResonanceSynth& copy) : SynthBase(copy)
+ResonanceSynth::ResonanceSynth(const ResonanceSynth& copy) : SynthBase(copy), parameters_(copy.parameters_)
 {
 #ifdef DEBUG_ALLOCATION
 	cout << "*** ResonanceSynth (copy constructor)\n";
 #endif
 	
-	// Make copies of the relevant parameters
-	
-	if(copy.globalAmplitude_ != NULL)
-		globalAmplitude_ = new Parameter(*copy.globalAmplitude_);
-	else
-		globalAmplitude_ = NULL;
-	if(copy.harmonicRolloff_ != NULL)
-		harmonicRolloff_ = new Parameter(*copy.harmonicRolloff_);
-	else
-		harmonicRolloff_ = NULL;	
-	if(copy.decayRate_ != NULL)
-		decayRate_ = new Parameter(*copy.decayRate_);
-	else
-		decayRate_ = NULL;		
+	mono_ = copy.mono_;
 	
-	// Initialize (don't copy) the mutexes
-	if(pthread_mutex_init(&parameterMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize parameter mutex in ResonanceSynth\n";
-		// Throw exception?
-	}
-	if(pthread_mutex_init(&noteMutex_, NULL) != 0)
-	{
-		cerr << "Warning: Failed to initialize note mutex in ResonanceSynth\n";
-		// Throw exception?
-	}	
+	// Start with no harmonics sounding
+	numHarmonics_ = 0;
+	pendingHarmonicFrequency_ = 0.0;
+	bzero(harmonicAmplitudes_, RESONANCE_MAX_HARMONICS*sizeof(float));
 }
 
 void ResonanceSynth::setGlobalAmplitude(double currentAmplitude, timedParameter& rampAmplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	globalAmplitude_->setRampValues(currentAmplitude, rampAmplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterGlobalAmplitude, 0, kParameterCommandSet, currentAmplitude, rampAmplitude);
+	endParameters();
 }
 
 void ResonanceSynth::setHarmonicRolloff(double currentRolloff, timedParameter& rampRolloff)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	harmonicRolloff_->setRampValues(currentRolloff, rampRolloff);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterHarmonicRolloff, 0, kParameterCommandSet, currentRolloff, rampRolloff);
+	endParameters();
 }
 
 void ResonanceSynth::setDecayRate(double currentRate, timedParameter& rampRate)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	decayRate_->setRampValues(currentRate, rampRate);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterDecayRate, 0, kParameterCommandSet, currentRate, rampRate);
+	endParameters();
 }
 
 void ResonanceSynth::setMono(bool mono)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	mono_ = mono;
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterMono, 0, (mono ? 1.0 : 0.0));
+	endParameters();
 }
 
 
 void ResonanceSynth::appendGlobalAmplitude(timedParameter& amplitude)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	globalAmplitude_->appendRampValues(amplitude);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterGlobalAmplitude, 0, kParameterCommandAppend, 0.0, amplitude);
+	endParameters();
 }
 
 void ResonanceSynth::appendHarmonicRolloff(timedParameter& rolloff)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	harmonicRolloff_->appendRampValues(rolloff);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterHarmonicRolloff, 0, kParameterCommandAppend, 0.0, rolloff);
+	endParameters();
 }
 
 void ResonanceSynth::appendDecayRate(timedParameter& rate)
 {
-	pthread_mutex_lock(&parameterMutex_);
-	
-	decayRate_->appendRampValues(rate);
-	
-	pthread_mutex_unlock(&parameterMutex_);	
+	beginParameters();
+	postParameter(kParameterDecayRate, 0, kParameterCommandAppend, 0.0, rate);
+	endParameters();
+}
+
+// Apply one parameter change posted by the methods above.  Runs on the render thread once the synth
+// is being rendered, or directly on the calling thread before then.
+
+void ResonanceSynth::applyParameter(int parameter, int index, int type, double value, timedParameter& ramp)
+{
+	switch(parameter)
+	{
+		case kParameterGlobalAmplitude:
+			parameters_.applyCommand(kGroupGlobalAmplitude, 0, type, value, ramp);
+			break;
+		case kParameterHarmonicRolloff:
+			parameters_.applyCommand(kGroupHarmonicRolloff, 0, type, value, ramp);
+			break;
+		case kParameterDecayRate:
+			parameters_.applyCommand(kGroupDecayRate, 0, type, value, ramp);
+			break;
+		case kParameterMono:
+			mono_ = (value != 0.0);
+			break;
+		case kParameterHarmonicFrequency:
+			pendingHarmonicFrequency_ = value;
+			break;
+		case kParameterHarmonicAmplitude:
+			insertHarmonic(index, pendingHarmonicFrequency_, value);
+			break;
+		default:
+			break;
+	}
 }
 
 // Add a new harmonic to the list to render.  midiNoteKey is usually the midi ID of the
@@ -1823,50 +2356,126 @@ void ResonanceSynth::appendDecayRate(timedParameter& rate)
 
 void ResonanceSynth::addHarmonic(int midiNoteKey, float frequency, float amplitude)
 {
-	harmonicInfo newHarmonic;
-	
 	if(amplitude == 0.0)		// Note off messages might generate a new harmonic otherwise
 		return;
 	
-	newHarmonic.frequency = frequency;
-	newHarmonic.phase = 0.0;
-	
-	pthread_mutex_lock(&parameterMutex_);
-	
+	beginParameters();
+	postParameter(kParameterHarmonicFrequency, midiNoteKey, frequency);
+	postParameter(kParameterHarmonicAmplitude, midiNoteKey, amplitude);
+	endParameters();
+}
+
+// Per-sample multiplier for a first-order decay with the given time constant, as in EnvelopeFollower
+
+static float decayScalerForTimeConstant(float timeConstant, float sampleRate)
+{
+	if(timeConstant == 0.0)
+		return 0.0;
+	return exp(-1.0/(fabsf(timeConstant)*sampleRate));
+}
+
+// Place a harmonic in the arrays, keeping them sorted by key.  Runs on whichever thread applies the
+// parameter commands, so it uses the current parameter values.
+
+void ResonanceSynth::insertHarmonic(int key, float frequency, float amplitude)
+{
 	float freqRatio = MIDDLE_C/frequency;
-	newHarmonic.amplitude = new EnvelopeFollower(decayRate_->currentValue()*freqRatio, sampleRate_);
+	float startAmplitude = fabsf(amplitude*powf(parameters_.value(kGroupHarmonicRolloff), log2f(freqRatio)));
+	int position, n;
 	
-	// Start the first sample from which the amplitude will decay
-	float test = newHarmonic.amplitude->filter(amplitude*powf(harmonicRolloff_->currentValue(), log2f(freqRatio)));
 #ifdef DEBUG_MESSAGES
-	cout << "starting amplitude " << test << endl;
+	cout << "starting amplitude " << startAmplitude << endl;
 #endif
-
-	pthread_mutex_unlock(&parameterMutex_);										
-												 
-	pthread_mutex_lock(&noteMutex_);
 	
 	if(mono_)								// Allow only one note at a time
 	{
-		map<unsigned int, harmonicInfo>::iterator it = harmonics_.begin();
+		float fastDecay = decayScalerForTimeConstant(.01, sampleRate_);	// This will trail the note off rapidly without a click
 		
-		while(it != harmonics_.end())
-			(*it++).second.amplitude->updateTimeConstant(.01);	// This will trail the note off rapidly without a click
+		for(n = 0; n < numHarmonics_; n++)
+			harmonicDecayScalers_[n] = fastDecay;
 	}
 	
-	if(harmonics_.count(midiNoteKey) > 0)	// Erase any duplicate harmonics
+	for(position = 0; position < numHarmonics_ && harmonicKeys_[position] < key; position++)
+		;
+	
+	if(position < numHarmonics_ && harmonicKeys_[position] == key)	// Replace any duplicate harmonic...
+	{
+		if(amplitude <= harmonicAmplitudes_[position])		// ...but only if the new amplitude is higher
+			return;
+	}
+	else
 	{
-		if(amplitude > harmonics_[midiNoteKey].amplitude->currentValue())	// Only erase if the new amplitude is higher
+		if(numHarmonics_ == RESONANCE_MAX_HARMONICS)
+		{
+			// Full: make room by dropping the quietest harmonic, if it's quieter than the new one
+			int quietest = 0;
+			
+			for(n = 1; n < numHarmonics_; n++)
+			{
+				if(harmonicAmplitudes_[n] < harmonicAmplitudes_[quietest])
+					quietest = n;
+			}
+			if(harmonicAmplitudes_[quietest] >= startAmplitude)
+				return;
+			removeHarmonic(quietest);
+			if(quietest < position)
+				position--;
+		}
+		
+		for(n = numHarmonics_; n > position; n--)
 		{
-			delete harmonics_[midiNoteKey].amplitude;
-			harmonics_.erase(midiNoteKey);
-			harmonics_[midiNoteKey] = newHarmonic;	// Add the new harmonic
+			harmonicKeys_[n] = harmonicKeys_[n - 1];
+			harmonicAmplitudes_[n] = harmonicAmplitudes_[n - 1];
+			harmonicDecayScalers_[n] = harmonicDecayScalers_[n - 1];
+			harmonicPhases_[n] = harmonicPhases_[n - 1];
+			harmonicIncrements_[n] = harmonicIncrements_[n - 1];
 		}
+		numHarmonics_++;
 	}
-	else
-		harmonics_[midiNoteKey] = newHarmonic;	// Add the new harmonic
 	
-	pthread_mutex_unlock(&noteMutex_);
+	harmonicKeys_[position] = key;
+	harmonicAmplitudes_[position] = startAmplitude;
+	harmonicDecayScalers_[position] = decayScalerForTimeConstant(parameters_.value(kGroupDecayRate)*freqRatio, sampleRate_);
+	harmonicPhases_[position] = 0;
+	harmonicIncrements_[position] = PhaseAccumulator::incrementForFrequency(frequency, sampleLength_);
+}
+
+void ResonanceSynth::removeHarmonic(int position)
+{
+	int n;
+	
+	numHarmonics_--;
+	for(n = position; n < numHarmonics_; n++)
+	{
+		harmonicKeys_[n] = harmonicKeys_[n + 1];
+		harmonicAmplitudes_[n] = harmonicAmplitudes_[n + 1];
+		harmonicDecayScalers_[n] = harmonicDecayScalers_[n + 1];
+		harmonicPhases_[n] = harmonicPhases_[n + 1];
+		harmonicIncrements_[n] = harmonicIncrements_[n + 1];
+	}
+	harmonicAmplitudes_[numHarmonics_] = 0.0;
+}
+
+// Drop every harmonic which has decayed below -60dB, keeping the rest in order
+
+void ResonanceSynth::removeDecayedHarmonics()
+{
+	int n, kept = 0;
+	
+	for(n = 0; n < numHarmonics_; n++)
+	{
+		if(harmonicAmplitudes_[n] < 0.001)
+			continue;
+		harmonicKeys_[kept] = harmonicKeys_[n];
+		harmonicAmplitudes_[kept] = harmonicAmplitudes_[n];
+		harmonicDecayScalers_[kept] = harmonicDecayScalers_[n];
+		harmonicPhases_[kept] = harmonicPhases_[n];
+		harmonicIncrements_[kept] = harmonicIncrements_[n];
+		kept++;
+	}
+	for(n = kept; n < numHarmonics_; n++)
+		harmonicAmplitudes_[n] = 0.0;
+	numHarmonics_ = kept;
 }
 
 
@@ -1879,24 +2488,29 @@ int ResonanceSynth::render(const void *input, void *output, unsigned long frameC
 	float *outBuffer = (float *)output;
 	float outSample;
 	PaTime bufferStartTime, bufferEndTime;
-	map<unsigned int, harmonicInfo>::iterator it;
-	unsigned long lastFrame = frameCount;
+	unsigned long firstFrame = 0, lastFrame = frameCount;
 	unsigned long i;
+	int n, decayed;
 	bool willFinishAtEnd = false;
 	
-	if(!isRunning_)			// Don't do anything if the note hasn't started
-		return paContinue;
-	
 	bufferStartTime = timeInfo->outputBufferDacTime;
 	bufferEndTime = bufferStartTime + (double)frameCount*sampleLength_;	// Time this buffer will end
 	
+	applyParameterCommands(bufferStartTime);	// Pick up parameter changes even if we're not running yet
+	
+	if(!isRunning_)			// Don't do anything if the note hasn't started
+		return paContinue;
+	
 	if(startTime_ >= bufferEndTime)
 		return paContinue;	// Note will begin, but not during this callback
 	
 	// If the note was set to begin "now", calibrate its start time to the beginning of this buffer
-	// We use the start time to calculate the offset from the beginning of the note.
+	// We use the start time to calculate the offset from the beginning of the note.  A note set to
+	// begin partway through this buffer starts at that frame.
 	if(startTime_ == 0)	
 		startTime_ = bufferStartTime;
+	else if(startTime_ > bufferStartTime)
+		firstFrame = frameAtTime(startTime_, bufferStartTime);
 	
 	// If the note has been set to release, check whether that should happen immediately, within this
 	// buffer, or later.  If later, then go about our business like normal.
@@ -1913,7 +2527,7 @@ int ResonanceSynth::render(const void *input, void *output, unsigned long frameC
 		}
 		else if(releaseTime_ < bufferEndTime)		// Release mid-buffer
 		{
-			lastFrame = (unsigned long)((releaseTime_ - bufferStartTime)*sampleRate_);
+			lastFrame = frameAtTime(releaseTime_, bufferStartTime);
 #ifdef DEBUG_MESSAGES
 			cout << "ResonanceSynth releasing at sample " << lastFrame << endl;
 #endif
@@ -1923,60 +2537,41 @@ int ResonanceSynth::render(const void *input, void *output, unsigned long frameC
 		// else do nothing
 	}
 	
-	for(i = 0; i < lastFrame; i++)
+	outBuffer += firstFrame;
+	
+	for(i = firstFrame; i < lastFrame; i++)
 	{
 		// Handle ramped parameter updates, but not every sample to save CPU time.
 		// A parameter needs ramping when there is at least one item in its timedParameter deque.
 		if(sampleNumber_ % PARAMETER_UPDATE_INTERVAL == 0)
 		{
-			pthread_mutex_lock(&parameterMutex_);	// Acquire lock so the parameters don't change
-			
-			globalAmplitude_->ramp(PARAMETER_UPDATE_INTERVAL);
-			harmonicRolloff_->ramp(PARAMETER_UPDATE_INTERVAL);
-			decayRate_->ramp(PARAMETER_UPDATE_INTERVAL);
+			applyParameterCommands(bufferStartTime + (PaTime)i*sampleLength_);
 			
-			pthread_mutex_unlock(&parameterMutex_);
+			parameters_.ramp();
 		}	
 		
-		outSample = 0.0;
-		
-		pthread_mutex_lock(&noteMutex_);
-		
-		// Go through the map of current harmonics and add the contribution from each to the output
-		it = harmonics_.begin();
-		
-		while(it != harmonics_.end())
+		// Decay and advance every harmonic at once.  These loops have no dependencies between
+		// harmonics, so the compiler can vectorize them.
+		decayed = 0;
+		for(n = 0; n < numHarmonics_; n++)
 		{
-			float frequency = (*it).second.frequency;
-			EnvelopeFollower *amp = (*it).second.amplitude;
-			float phase = (*it).second.phase;
-			
-			float newAmp = amp->filter(0.0);		// Do a rolloff on this amplitude
-			phase = fmod(phase + frequency*sampleLength_, 1.0);			
-			(*it).second.phase = phase;			// Increment the phase
-			
-			if(newAmp < 0.001) // -60dB as cutoff
-			{
-				delete amp;
-				harmonics_.erase((*it++).first);
-			}
-			else
-			{
-				outSample += newAmp * waveTable.lookup(waveTableSine, phase);
-				
-				it++;
-			}
+			harmonicAmplitudes_[n] *= harmonicDecayScalers_[n];
+			harmonicPhases_[n] += harmonicIncrements_[n];
+			decayed |= (harmonicAmplitudes_[n] < 0.001);	// -60dB as cutoff
 		}
+		if(decayed)
+			removeDecayedHarmonics();
 		
-		pthread_mutex_unlock(&noteMutex_);
+		outSample = 0.0;
+		OscillatorBank::renderFixedPhases(&outSample, harmonicAmplitudes_, harmonicPhases_, numHarmonics_);
 		
-		outSample *= globalAmplitude_->currentValue();	// Scale by overall output level
+		outSample *= parameters_.value(kGroupGlobalAmplitude);	// Scale by overall output level
 		
 		// Mix the output into the buffer
-		outBuffer[outputChannel_] += outSample;
+		*outBuffer += outSample;
 		
 		// Update counters for next cycle
-		outBuffer += numOutputChannels_;
+		outBuffer++;
 		sampleNumber_++;
 	}
 	
@@ -1993,18 +2588,4 @@ ResonanceSynth::~ResonanceSynth()
 #ifdef DEBUG_ALLOCATION
 	cout << "*** ~ResonanceSynth\n";
 #endif
-	map<unsigned int, harmonicInfo>::iterator it = harmonics_.begin();
-	
-	while(it != harmonics_.end())
-	{
-		delete (*it).second.amplitude;
-		harmonics_.erase((*it++).first);
-	}
-	
-	delete globalAmplitude_;
-	delete harmonicRolloff_;
-	delete decayRate_;
-	
-	pthread_mutex_destroy(&parameterMutex_);	
-	pthread_mutex_destroy(&noteMutex_);
 }
@@ -21,6 +21,12 @@
 #include "portaudio.h"
 #include "parameter.h"
 #include "filter.h"
+#include "biquadbank.h"
+#include "harmonicanalyzer.h"
+#include "noisegenerator.h"
+#include "oscillatorbank.h"
+#include "phaseaccumulator.h"
+#include "inputhistory.h"
 using namespace std;
 
 
@@ -28,19 +34,38 @@ class SynthBase
 {
 	friend ostream& operator<<(ostream& output, const SynthBase& s);
 public:
+	// Kinds of synth, so render statistics can be broken down by type
+	enum {
+		kSynthTypeOther = 0,
+		kSynthTypePll,
+		kSynthTypeNoise,
+		kSynthTypeResonance,
+		kSynthTypePitchTrack,
+		kNumSynthTypes
+	};
+	
 	// constructor holds channel info
 	SynthBase(float sampleRate);
+	SynthBase(const SynthBase& copy);
+	SynthBase& operator=(const SynthBase& copy);	// Neither copies the parameter queue; see below
 	
-	// render() is called by the PortAudio callback to render an output buffer
+	// render() is called by the PortAudio callback to render an output buffer.  output is this synth's
+	// output channel alone: frameCount contiguous samples, which the synth adds its output to.
 	virtual int render(const void *input, void *output,
 					   unsigned long frameCount,
 					   const PaStreamCallbackTimeInfo* timeInfo,
 					   PaStreamCallbackFlags statusFlags) { return 0; }
 	
-	// These settings are initialized right as the Synth is about to be performed
-	void setPerformanceParameters(int numInputChannels, int numOutputChannels, int outputChannel);
+	virtual int synthType() { return kSynthTypeOther; }
+	static const char *synthTypeName(int type);
+	
+	// These settings are initialized right as the Synth is about to be performed.  inputHistory, if given,
+	// holds the recent input shared by all synths, for reading inputs with a delay.
+	void setPerformanceParameters(int numInputChannels, int numOutputChannels, int outputChannel,
+								  InputHistory *inputHistory = NULL);
 	
-	// Tell the note to begin
+	// Tell the note to begin.  A note given a time (in stream time, as in PaStreamCallbackTimeInfo)
+	// starts at that exact frame, even partway through a buffer.
 	void begin();
 	void begin(PaTime when);
 	
@@ -52,6 +77,21 @@ public:
 	bool isRunning() { return isRunning_; }
 	bool isFinished() { return isFinished_; }
 	
+	// Which output channel this synth writes to
+	int outputChannel() { return outputChannel_; }
+	
+	// Called by AudioRender when the synth joins or leaves the render list.  While the synth is being
+	// rendered, parameter changes are queued for render() to pick up at its next parameter update; the
+	// rest of the time they take effect immediately.
+	void setRendering(bool rendering);
+	
+	// Parameter changes made after this take effect at the given stream time, rather than at the next
+	// parameter update (when = 0, the default).  Control threads only.
+	void setParameterTime(PaTime when) { parameterTime_ = when; }
+	
+	// Number of times a parameter change found the queue full
+	unsigned int parameterOverflows() { return parameterOverflows_; }
+	
 	// Destructor immediately terminates the note.  The note should always be removed from the render
 	// list before its destructor is called, or the program is likely to crash.
 	
@@ -62,6 +102,7 @@ protected:
 	int numInputChannels_;
 	int numOutputChannels_;
 	int outputChannel_;
+	InputHistory *inputHistory_;	// Owned by AudioRender; may be NULL
 	float sampleRate_;
 	PaTime sampleLength_;	// Time of one sample, inverse of sampleRate
 	
@@ -72,6 +113,41 @@ protected:
 	
 	PaTime startTime_;		// When this note began
 	PaTime releaseTime_;	// When this note should end
+	
+	// Frame of a buffer starting at bufferStartTime nearest to the given (later) time
+	unsigned long frameAtTime(PaTime time, PaTime bufferStartTime) {
+		return (unsigned long)((time - bufferStartTime)*sampleRate_ + 0.5);
+	}
+	
+	// Parameter changes.  The set and append methods of each subclass wrap their changes in
+	// beginParameters() and endParameters(), which makes them take effect together.  applyParameter() does
+	// the actual work, on whichever thread owns the synth at the time.  Subclasses call
+	// applyParameterCommands() from render() wherever they ramp their parameters, with the time of the frame
+	// being rendered; changes timed later than that stay queued.  nextParameterTime() is the time of the
+	// oldest change still queued, or 0 if there is none (or it has no time), for synths that want to split
+	// their rendering where it falls.
+	void beginParameters();
+	void postParameter(int parameter, int index, int type, double value, timedParameter& ramp);
+	void postParameter(int parameter, int index, double value);		// Set with no ramp
+	void endParameters();
+	void applyParameterCommands();						// All of them, whatever their time
+	void applyParameterCommands(PaTime now);
+	PaTime nextParameterTime();
+	virtual void applyParameter(int parameter, int index, int type, double value, timedParameter& ramp) {}
+	
+	// The render thread never allocates memory, so whatever applyParameter() might need while the synth is
+	// rendering is allocated beforehand by reserveRenderStorage(), which setRendering() calls on the control
+	// thread.  A queued change that parameterFits() says won't fit in that storage is dropped.
+	virtual void reserveRenderStorage() {}
+	virtual bool parameterFits(int parameter, int index) { return true; }
+	
+private:
+	ParameterCommandQueue parameterQueue_;	// Changes waiting for the render thread
+	timedParameter commandRamp_;			// Ramp of the command being applied (render thread)
+	bool isRendering_;						// Whether changes must go through the queue
+	PaTime parameterTime_;					// Time stamped on changes posted now (control threads)
+	unsigned int parameterOverflows_;		// Changes delayed or dropped for lack of room
+	pthread_mutex_t parameterMutex_;		// Serializes the control threads; never taken by the render thread
 };
 
 /*****************
@@ -83,20 +159,33 @@ protected:
  * filter to isolate the desired frequency, and a phase-locked loop to synthesize
  * a clean output signal.  The output waveform is continuously variable as a sum of
  * harmonics.
+ *
+ * Rendering is done in blocks of up to PLL_BLOCK_SIZE samples, each of which passes
+ * through four stages in turn: ramping the parameters into per-segment (k-rate) arrays,
+ * bandpass and interference filtering of the input, the PLL recursion itself, and
+ * finally the oscillator bank.  Only the PLL recursion has a true sample-to-sample
+ * dependency; the other stages each make one tight pass over the block.
  *****************/
 
+#define PLL_BLOCK_SIZE		256		// Maximum number of samples processed by one pass through the stages
+#define PLL_BLOCK_SEGMENTS	(PLL_BLOCK_SIZE/PARAMETER_UPDATE_INTERVAL + 1)	// Max parameter segments per block
+#define PLL_RESERVED_HARMONICS	16	// Harmonics a rendering synth can grow to without allocating
+#define PLL_RESERVED_INPUTS		8	// Likewise for input gains and delays, unless there are more input channels
+
 class PllSynth : public SynthBase
 {
 	friend ostream& operator<<(ostream& output, const PllSynth& s);
 public:
 	PllSynth(float sampleRate);
 	PllSynth(const PllSynth& copy);		// Copy constructor
+	PllSynth& operator=(const PllSynth& copy);	// Reuses existing objects where the structure matches
 	
 	// Inherited methods from SynthBase
 	int render(const void *input, void *output,
 					   unsigned long frameCount,
 					   const PaStreamCallbackTimeInfo* timeInfo,
 						PaStreamCallbackFlags statusFlags);
+	int synthType() { return kSynthTypePll; }
 	
 	// These parameters are time-invariant, so we don't use the Parameter structure for them
 	void setFilterQ(double filterQ);
@@ -106,11 +195,13 @@ public:
 	void setLoopFilterAB(vector<double>& loopFilterA, vector<double>& loopFilterB); // methods...
 	void setUseAmplitudeFeedback(bool useAmplitudeFeedback);
 	void setUseInterferenceRejection(bool useInterferenceRejection);
+	void setSmoothGlobalAmplitude(bool smoothGlobalAmplitude);
+	void setUseHarmonicAnalyzer(bool useHarmonicAnalyzer);
 	
 	// These methods replace the current parameters with new ones, starting immediately
 	void setInputGains(vector<double>& currentInputGains,
 					   vector<timedParameter>& rampInputGains);
-	void setInputDelays(vector<double>& currentInputDelays,
+	void setInputDelays(vector<double>& currentInputDelays,			// In seconds, up to INPUT_HISTORY_MAX_DELAY
 					    vector<timedParameter>& rampInputDelays);	
 	void setCenterFrequency(double currentCenterFrequency, timedParameter& rampCenterFrequency);
 	void setLoopGain(double currentLoopGain, timedParameter& rampLoopGain);
@@ -135,55 +226,131 @@ public:
 	void appendAmplitudeFeedbackScaler(timedParameter& scaler);
 	
 	~PllSynth();
+protected:
+	void applyParameter(int parameter, int index, int type, double value, timedParameter& ramp);
+	void reserveRenderStorage();
+	bool parameterFits(int parameter, int index);
+	
 private:
-	/* Common Parameters to BPF and PLL */
-	Parameter *centerFrequency_;				// Center frequency of the PLL and BPF
+	// Parameters carried by the parameter queue
+	enum {
+		kParameterFilterQ = 0,
+		kParameterInputGain,
+		kParameterInputDelay,
+		kParameterDelayAndSum,
+		kParameterCenterFrequency,
+		kParameterLoopGain,
+		kParameterPhaseOffset,
+		kParameterGlobalAmplitude,
+		kParameterHarmonicAmplitude,
+		kParameterHarmonicPhase,
+		kParameterFeedbackScaler
+	};
+	
+	// Groups within parameters_
+	enum {
+		kGroupCenterFrequency = 0,
+		kGroupInputGains,
+		kGroupInputDelays,
+		kGroupLoopGain,
+		kGroupPhaseOffset,
+		kGroupGlobalAmplitude,
+		kGroupHarmonicAmplitudes,
+		kGroupHarmonicPhases,
+		kGroupFeedbackScaler,		// Empty until amplitude feedback is turned on
+		kNumParameterGroups
+	};
+	
+	// Filters within inputFilters_
+	enum {
+		kInputFilterMain = 0,
+		kInputFilterLow,
+		kInputFilterHigh,
+		kInputFilterHarmonics		// First of the harmonic filters, which follow in order
+	};
+	
+	int numHarmonicInputFilters() { return inputFilters_.size() - kInputFilterHarmonics; }
+	void updateFilterCoefficients(float freq);		// New center frequency or Q for the bandpass filters
+	void resizeHarmonicAnalyzer();					// Match the analyzer to the harmonic filters
+	
+	// Stages of the block render pipeline, called in this order by render()
+	void rampBlockParameters(unsigned long frameCount);
+	void filterBlockInput(float *inBuffer, unsigned long blockOffset, unsigned long frameCount);
+	void runBlockPll(unsigned long frameCount);
+	void renderBlockOscillators(float *outBuffer, unsigned long frameCount);
+	
+	/* Time-varying parameters */
+	ParameterBank parameters_;				// Center frequency of the PLL and BPF; input gains and delays (for one
+											// input, these reduce to 1 and 0); loop gain (when 0, output = center
+											// frequency) and output phase offset of the PLL; overall amplitude,
+											// amplitude and phase offset of each output harmonic; and the
+											// amplitude feedback scaler.  All of them ramp together.
+	int reservedHarmonics_;					// Harmonics and inputs that reserveRenderStorage() has made room for
+	int reservedInputs_;
 	
 	bool useAmplitudeFeedback_;				// If true, use feedback on output levels to enforce the desired amplitude
 	bool useInterferenceRejection_;			// If true, scales down the loop gain in the presence of interfering
 											// signals a semitone above or below
-	
-	/* Pre-filter input processing */
-	vector<Parameter*> inputGains_;			// Gains and delays of several inputs.  For one	
-	vector<Parameter*> inputDelays_;		// input, these reduce to 1 and 0, respectively.
+	bool smoothGlobalAmplitude_;			// If true, interpolate the overall amplitude between parameter updates
 	
 	/* Bandpass filter */
 	float filterQ_;						// Q of the bandpass filter (doesn't change over time)
 	float filterQinverse_;				// Inverse of Q, for calculating bandwidth
 	
-	ButterBandpassFilter *mainInputFilter_;		// Amplitude feedback requires BPFs and envelope followers
-	ButterBandpassFilter *lowInputFilter_;		// at any harmonics we want to use.  Interference rejection
-	ButterBandpassFilter *highInputFilter_;		// requires BPFs and followers at neighboring frequencies.
-	vector<ButterBandpassFilter*> harmonicInputFilters_;	
+	BiquadBank inputFilters_;				// Main BPF, then the ones amplitude feedback and interference rejection
+											// need: BPFs and envelope followers at any harmonics we want to use, and
+											// at neighboring frequencies.  All of them run over the input together.
 	
 	EnvelopeFollower *mainEnvelopeFollower_;
 	EnvelopeFollower *lowEnvelopeFollower_;
 	EnvelopeFollower *highEnvelopeFollower_;
 	vector<EnvelopeFollower*> harmonicEnvelopeFollowers_;
 	
-	Parameter *amplitudeFeedbackScaler_;
+	bool useHarmonicAnalyzer_;				// If true, amplitude feedback measures the harmonics with harmonicAnalyzer_
+	HarmonicAnalyzer harmonicAnalyzer_;		// instead of the harmonic filters and followers
 	
 	/* Phase-locked loop */
-	GenericFilter *loopFilter_;		
+	FixedOrderFilter<1> firstOrderLoopFilter_;	// Loop filter from setLoopFilterPoleZero(), or any first-order one
+	GenericFilter *loopFilter_;					// Higher-order loop filter from setLoopFilterAB(), or NULL
 	double loopFilterPole_, loopFilterZero_;
 	
-	Parameter *loopGain_;					// Overall loop gain (when 0, output = centerFrequency_)	
-	Parameter *phaseOffset_;					// Phase offset of output waveform versus internal PLL
-	
-	/* Output parameters */
-	Parameter *globalAmplitude_;			// Overall amplitude
-	vector<Parameter*> harmonicAmplitudes_;	// Amplitudes of output harmonics
-	vector<Parameter*> harmonicPhases_;		// Phase offset of each harmonic
-	
 	/* Internal variables */	
-	double pllPhase_;			// Current phase of the main PLL, from which all others are derived
+	PhaseAccumulator pllPhase_;	// Current phase of the main PLL, from which all others are derived
 		
 	bool usingDelayAndSum_;		// Whether we're using multiple inputs, or false for one input with gain 1.0
 	bool loopGainWasZero_;		// State information on whether loop gain was zero the last time around
 	
 	float pllLastOutput_;			// One sample of memory for the PLL loop
 	
-	pthread_mutex_t parameterMutex_;	// Make sure parameters don't update during ramp
+	/* Block render state */
+	// A block is divided into segments, each starting where the parameters were ramped (every
+	// PARAMETER_UPDATE_INTERVAL samples).  Parameter values are constant within a segment.
+	int blockSegments_;
+	unsigned long blockSegmentStart_[PLL_BLOCK_SEGMENTS + 1];	// Last entry holds the block length
+	double blockCenterFrequency_[PLL_BLOCK_SEGMENTS];
+	double blockLoopGain_[PLL_BLOCK_SEGMENTS];
+	double blockGlobalAmplitude_[PLL_BLOCK_SEGMENTS];
+	double blockFeedbackScaler_[PLL_BLOCK_SEGMENTS];
+	float blockPhaseOffset_[PLL_BLOCK_SEGMENTS];
+	bool blockUpdateFilters_[PLL_BLOCK_SEGMENTS];		// Center frequency changed: new BPF coefficients
+	bool blockRestartFilters_[PLL_BLOCK_SEGMENTS];		// Loop gain became nonzero: clear the BPFs
+	vector<double> blockInputGains_;			// Per-channel segment values, indexed
+	vector<double> blockHarmonicAmplitudes_;	// [n*PLL_BLOCK_SEGMENTS + segment]
+	vector<double> blockHarmonicPhases_;
+	vector<float> blockInputDelays_;			// Likewise, in samples
+	
+	// Per-sample buffers passed from one stage to the next
+	float blockInput_[PLL_BLOCK_SIZE];				// Input after delay-and-sum
+	vector<float> blockFiltered_;					// Output of inputFilters_, [i*inputFilters_.stride() + filter]
+	float blockFilteredCenter_[PLL_BLOCK_SIZE];		// Output of the main bandpass filter
+	float blockFollowerMain_[PLL_BLOCK_SIZE];		// Envelope of the main bandpass filter
+	float blockScaledLoopGain_[PLL_BLOCK_SIZE];		// Loop gain after interference rejection
+	uint32_t blockPhase_[PLL_BLOCK_SIZE];			// PLL phase at each sample
+	vector<float> blockHarmonicLevels_;				// Output of harmonicAnalyzer_, [i*harmonics + harmonic]
+	float blockOutput_[PLL_BLOCK_SIZE];				// Sum of the harmonics, before global amplitude
+	float blockSmoothedAmplitude_[PLL_BLOCK_SIZE];	// Global amplitude at each sample, if smoothing it
+	
+	OscillatorBank oscillators_;		// Harmonics for the current segment, when not using amplitude feedback
 };
 
 /*****************
@@ -192,19 +359,27 @@ private:
  * Send filtered noise to the output, using any number of bandpass filters of adjustable
  * Q, center frequency, and amplitude.  This class does not make use of an audio input.
  *****************/
+
+#define NOISE_RESERVED_FILTERS	8		// Filters a rendering synth can grow to without allocating
+
 class NoiseSynth : public SynthBase
 {
 	friend ostream& operator<<(ostream& output, const NoiseSynth& s);
 public:
 	NoiseSynth(float sampleRate);
 	NoiseSynth(const NoiseSynth& copy);
+	NoiseSynth& operator=(const NoiseSynth& copy);
 
 	// Inherited methods from SynthBase
 	int render(const void *input, void *output,
 			   unsigned long frameCount,
 			   const PaStreamCallbackTimeInfo* timeInfo,
 			   PaStreamCallbackFlags statusFlags);
+	int synthType() { return kSynthTypeNoise; }
 
+	// This parameter is time-invariant.  Gaussian noise has the same power as the default uniform noise.
+	void setUseGaussianNoise(bool useGaussianNoise) { useGaussianNoise_ = useGaussianNoise; }
+	
 	// These methods replace the current parameters with new ones, starting immediately
 	void setGlobalAmplitude(double currentAmplitude, timedParameter& rampAmplitude);
 	void setFilterFrequencies(vector<double>& currentFrequencies, vector<timedParameter>& rampFrequencies);
@@ -218,17 +393,44 @@ public:
 	void appendFilterAmplitudes(vector<timedParameter>& amplitudes);
 	
 	~NoiseSynth();
-private:
-	void updateFilters();				   // Update ButterBandpassFilter objects after set/append
-	
-	Parameter *globalAmplitude_;		   // Overall amplitude
-	vector<Parameter*> filterFrequencies_; // Frequency, Q, and level for an arbitrary number of BPFs
-	vector<Parameter*> filterQs_;		   // If no filters are defined, output is white noise with
-	vector<Parameter*> filterAmplitudes_;  // amplitude globalAmplitude
-	
-	vector<ButterBandpassFilter*> filters_;	// This holds the actual filter objects
+protected:
+	void applyParameter(int parameter, int index, int type, double value, timedParameter& ramp);
+	void reserveRenderStorage();
+	bool parameterFits(int parameter, int index);
 	
-	pthread_mutex_t parameterMutex_;	// Make sure parameters don't update during ramp	
+private:
+	// Parameters carried by the parameter queue
+	enum {
+		kParameterGlobalAmplitude = 0,
+		kParameterFilterFrequency,
+		kParameterFilterQ,
+		kParameterFilterAmplitude
+	};
+	
+	// Groups within parameters_
+	enum {
+		kGroupGlobalAmplitude = 0,
+		kGroupFilterFrequencies,
+		kGroupFilterQs,
+		kGroupFilterAmplitudes,
+		kNumParameterGroups
+	};
+	
+	void updateFilters();				   // Update the filter bank after set/append
+	
+	ParameterBank parameters_;				// Overall amplitude, then frequency, Q, and level for an arbitrary
+											// number of BPFs.  If no filters are defined, output is white noise
+											// with amplitude globalAmplitude.
+	int reservedFilters_;					// Filters that reserveRenderStorage() has made room for
+	
+	BiquadBank filters_;					// This holds the actual filters
+	
+	NoiseGenerator noise_;					// Each synth has its own generator, never copied from another
+	bool useGaussianNoise_;					// Gaussian rather than uniform noise source
+	
+	// Noise and filter outputs for the samples between two parameter updates
+	float noiseBuffer_[PARAMETER_UPDATE_INTERVAL];
+	vector<float> filteredNoise_;			// [i*filters_.stride() + filter]
 };
 
 /*****************
@@ -257,7 +459,13 @@ private:
  * class ResonanceSynth
  *
  * Reinforces the natural overtones of a given string, depending on input from other MIDI notes.
+ * Sounding harmonics are held in fixed-size arrays, one per property, so the render thread
+ * decays and sums all of them in one pass each sample and never allocates or takes a lock.
+ * New harmonics arrive through the parameter queue.
  *****************/
+
+#define RESONANCE_MAX_HARMONICS		32		// Harmonics that can sound at once (a multiple of OSCILLATOR_BANK_LANES)
+
 class ResonanceSynth : public SynthBase
 {
 public:
@@ -269,6 +477,7 @@ public:
 			   unsigned long frameCount,
 			   const PaStreamCallbackTimeInfo* timeInfo,
 			   PaStreamCallbackFlags statusFlags);
+	int synthType() { return kSynthTypeResonance; }
 	
 	// These methods replace the current parameters with new ones, starting immediately
 	void setGlobalAmplitude(double currentAmplitude, timedParameter& rampAmplitude);
@@ -285,24 +494,46 @@ public:
 	void addHarmonic(int midiNoteKey, float frequency, float amplitude);
 	
 	~ResonanceSynth();
+protected:
+	void applyParameter(int parameter, int index, int type, double value, timedParameter& ramp);
+	
 private:
-	// Parameters
-	Parameter *globalAmplitude_;			// Total strength of synthesized notes
-	Parameter *harmonicRolloff_;			// How much to de-emphasize higher partials
-	Parameter *decayRate_;					// How quickly the harmonics decay (normalized to middle C)
+	// Parameters carried by the parameter queue.  A new harmonic is posted as its frequency followed by
+	// its amplitude, with the MIDI note key as the index of both.
+	enum {
+		kParameterGlobalAmplitude = 0,
+		kParameterHarmonicRolloff,
+		kParameterDecayRate,
+		kParameterMono,
+		kParameterHarmonicFrequency,
+		kParameterHarmonicAmplitude
+	};
+	
+	// Groups within parameters_, each a single value
+	enum {
+		kGroupGlobalAmplitude = 0,			// Total strength of synthesized notes
+		kGroupHarmonicRolloff,				// How much to de-emphasize higher partials
+		kGroupDecayRate,					// How quickly the harmonics decay (normalized to middle C)
+		kNumParameterGroups
+	};
+	
+	void insertHarmonic(int key, float frequency, float amplitude);
+	void removeHarmonic(int position);
+	void removeDecayedHarmonics();
+	
+	// Parameters.  The groups never grow, so the bank needs no more room once constructed.
+	ParameterBank parameters_;
 	bool mono_;								// If true, use only one harmonic at a time
 	
-	// State variables
-	typedef struct {
-		float frequency;					// Hold information on currently sounding harmonics					
-		float phase;
-		EnvelopeFollower *amplitude;
-	} harmonicInfo;
-	
-	map<unsigned int, harmonicInfo> harmonics_;	// Which harmonics are currently sounding
-	
-	pthread_mutex_t parameterMutex_;	// Make sure parameters don't update during ramp		
-	pthread_mutex_t noteMutex_;
+	// State variables: the currently sounding harmonics, sorted by key.  Entries past numHarmonics_
+	// have zero amplitude, as OscillatorBank::renderFixedPhases() requires.
+	int harmonicKeys_[RESONANCE_MAX_HARMONICS];			// MIDI note which triggered each harmonic
+	float harmonicAmplitudes_[RESONANCE_MAX_HARMONICS];
+	float harmonicDecayScalers_[RESONANCE_MAX_HARMONICS];	// Amplitude multiplier per sample
+	uint32_t harmonicPhases_[RESONANCE_MAX_HARMONICS];
+	uint32_t harmonicIncrements_[RESONANCE_MAX_HARMONICS];
+	int numHarmonics_;
+	float pendingHarmonicFrequency_;					// Frequency for the next harmonic amplitude command
 };
 
 #endif // SYNTH_H
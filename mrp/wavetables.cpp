@@ -9,101 +9,169 @@
 
 #include <cmath>
 #include "wavetables.h"
+#include "benchmark.h"
 #include "config.h"
 using namespace std;
 
-// Initialize all the tables we use
-// Keep this in sync with the enum in the header file
+#pragma mark Benchmark
 
-WaveTable::WaveTable()
-{
-	float *table;
-	int i, length;
-	
-	// Table 0: sine, size 4096
-	
-	length = 4096;
-	table = new float[length + 1];	// +1 for guard point and interpolation
-	
-    for(i = 0; i < length; i++ )
-    {
-        table[i] = (float)sin(((double)i/(double)length) * M_PI * 2.);
-    }
-    table[length] = table[0]; /* set guard point */	
-	
-	tables_.push_back(table);
-	lengths_.push_back(length);
-	
-	// Table 1 (TEST): linear, size 16
-	
-	length = 16;
-	table = new float[length + 1];
-	
-	for(i = 0; i < length; i++ )
-	{
-		table[i] = (float)i / 16.;
-	}
-	table[length] = table[0];
-	
-	tables_.push_back(table);
-	lengths_.push_back(length);	
-}
+#define WAVETABLE_BENCHMARK_LOOKUPS		4096		// Phases in each pattern
+#define WAVETABLE_BENCHMARK_TOTAL		8000000		// Total lookups timed for each measurement
+
+// The lookups WaveTable used to do, with % and a sign test, kept as a reference.  (They're static members
+// rather than static functions because template arguments need external linkage.)
 
-// Return the table value that corresponds to index, which takes a range of 0-1.
-// No interpolation, faster performance; allow wraparounds
+class ModuloLookup
+{
+public:
+	static float lookup(float phase);
+	static float lookupInterp(float phase);
+};
 
-float WaveTable::lookup(int table, float phase)
+float ModuloLookup::lookup(float phase)
 {
-	int length = lengths_[table];
-	float* buf = tables_[table];
+	const float *buf = SineTable<WAVETABLE_SINE_BITS>::table();
+	int length = SineTable<WAVETABLE_SINE_BITS>::kLength;
 	int index;
-	
+
 	if(phase >= 0)
 		index = (int)((float)length * phase) % length;
 	else
 		index = (int)((float)length * phase) % length + length;
-	
+
 	return buf[index];
 }
 
-// Return the table value that corresponds to index, which takes a range of 0-1.
-// With interpolation and wraparounds
-
-float WaveTable::lookupInterp(int table, float phase)
+float ModuloLookup::lookupInterp(float phase)
 {
-	int length = lengths_[table];
-	float* buf = tables_[table];
-	float lo, hi, val;
-	
-	// First, calculate the fractional part, before applying wraparound
-    float fIndex = phase * (float)length;
-    int   index = (int)fIndex;
-    float fract = fIndex - index;
-	
-	// Now handle the wraparound
-	
-	if(index >= 0)				// phase >= 0, 0 <= fract < 1
+	const float *buf = SineTable<WAVETABLE_SINE_BITS>::table();
+	int length = SineTable<WAVETABLE_SINE_BITS>::kLength;
+	float fIndex = phase * (float)length;
+	int index = (int)fIndex;
+	float fract = fIndex - index;
+
+	if(index >= 0)
 	{
 		index = index % length;
-		lo = buf[index];
-		hi = buf[index + 1];
-		val = lo + fract*(hi-lo);
+		return buf[index] + fract*(buf[index + 1] - buf[index]);
+	}
+
+	index = index % length + length;
+	return buf[index] - fract*(buf[index - 1] - buf[index]);
+}
+
+// Time one kind of lookup over a set of phases and print ns/lookup and the largest error against sin().  The
+// lookup is a template argument so that it's inlined into the timing loop, as it would be in a synth.
+
+template<float (*Lookup)(uint32_t)>
+static void benchmarkPhaseLookup(ostream& output, const char *name, const uint32_t *phases, float *sink)
+{
+	int repetitions = WAVETABLE_BENCHMARK_TOTAL / WAVETABLE_BENCHMARK_LOOKUPS;
+	BenchmarkTimer timer;
+	double nsPerLookup, maxError = 0.0;
+	float sum = 0.0;
+	int i, r;
+
+	timer.start();
+	for(r = 0; r < repetitions; r++)
+	{
+		for(i = 0; i < WAVETABLE_BENCHMARK_LOOKUPS; i++)
+			sum += Lookup(phases[i]);
 	}
-	else						// phase < 0, -1 < fract <= 0
+	nsPerLookup = timer.nsPer((double)repetitions * WAVETABLE_BENCHMARK_LOOKUPS);
+	*sink += sum;
+
+	for(i = 0; i < WAVETABLE_BENCHMARK_LOOKUPS; i++)
 	{
-		index = index % length + length;
-		lo = buf[index];
-		hi = buf[index - 1];
-		val = lo - fract*(hi-lo);
+		double error = fabs((double)Lookup(phases[i]) - sin(2.0 * M_PI * (double)phases[i] / PHASE_ACCUMULATOR_CYCLE));
+
+		if(error > maxError)
+			maxError = error;
 	}
-	
-    return val;
+
+	output << "    " << name << ": " << nsPerLookup << " ns, max error " << maxError << endl;
 }
 
-WaveTable::~WaveTable()
+// The same for lookups which take a phase in cycles
+
+template<float (*Lookup)(float)>
+static void benchmarkCycleLookup(ostream& output, const char *name, const float *phases, float *sink)
 {
-	// Free the allocated wavetables
-	
-	for(int i = 0; i < tables_.size(); i++)
-		delete tables_[i];
-}
\ No newline at end of file
+	int repetitions = WAVETABLE_BENCHMARK_TOTAL / WAVETABLE_BENCHMARK_LOOKUPS;
+	BenchmarkTimer timer;
+	double nsPerLookup, maxError = 0.0;
+	float sum = 0.0;
+	int i, r;
+
+	timer.start();
+	for(r = 0; r < repetitions; r++)
+	{
+		for(i = 0; i < WAVETABLE_BENCHMARK_LOOKUPS; i++)
+			sum += Lookup(phases[i]);
+	}
+	nsPerLookup = timer.nsPer((double)repetitions * WAVETABLE_BENCHMARK_LOOKUPS);
+	*sink += sum;
+
+	for(i = 0; i < WAVETABLE_BENCHMARK_LOOKUPS; i++)
+	{
+		double error = fabs((double)Lookup(phases[i]) - sin(2.0 * M_PI * (double)phases[i]));
+
+		if(error > maxError)
+			maxError = error;
+	}
+
+	output << "    " << name << ": " << nsPerLookup << " ns, max error " << maxError << endl;
+}
+
+void benchmarkWaveTables(ostream& output)
+{
+	vector<uint32_t> phases(WAVETABLE_BENCHMARK_LOOKUPS);
+	vector<float> cycles(WAVETABLE_BENCHMARK_LOOKUPS);
+	uint32_t random = 0x12345678;
+	float sink = 0.0;
+	int pattern, i;
+
+	SineTable<8>::build();
+	SineTable<WAVETABLE_SINE_BITS>::build();
+	SineTable<16>::build();
+
+	printBenchmarkHeading(output, "Wavetable", "lookup", WAVETABLE_BENCHMARK_TOTAL);
+
+	for(pattern = 0; pattern < 2; pattern++)
+	{
+		// Sequential phases are a 261.6Hz oscillator, as a synth's fundamental would be.  Scattered phases
+		// jump around the whole table, as when many unrelated partials share it.
+		for(i = 0; i < WAVETABLE_BENCHMARK_LOOKUPS; i++)
+		{
+			if(pattern == 0)
+				phases[i] = PhaseAccumulator::fromCycles((double)i * 261.6 / 44100.0);
+			else
+			{
+				random ^= random << 13;
+				random ^= random >> 17;
+				random ^= random << 5;
+				phases[i] = random;
+			}
+
+			// Signed phases in cycles, so the modulo lookups take both branches
+			cycles[i] = (float)(int32_t)phases[i] * (float)(1.0 / PHASE_ACCUMULATOR_CYCLE);
+		}
+
+		output << (pattern == 0 ? "  Sequential phases:\n" : "  Scattered phases:\n");
+
+		benchmarkCycleLookup<ModuloLookup::lookup>(output, "modulo lookup, 4096 points", &cycles[0], &sink);
+		benchmarkCycleLookup<ModuloLookup::lookupInterp>(output, "modulo lookupInterp, 4096 points", &cycles[0], &sink);
+		benchmarkCycleLookup<SineTable<WAVETABLE_SINE_BITS>::lookup>(output, "masked lookup, 4096 points", &cycles[0], &sink);
+		benchmarkCycleLookup<SineTable<WAVETABLE_SINE_BITS>::lookupInterp>(output, "masked lookupInterp, 4096 points", &cycles[0], &sink);
+		benchmarkPhaseLookup<SineTable<8>::lookupPhaseNoInterp>(output, "lookupPhaseNoInterp, 256 points", &phases[0], &sink);
+		benchmarkPhaseLookup<SineTable<8>::lookupPhase>(output, "lookupPhase, 256 points", &phases[0], &sink);
+		benchmarkPhaseLookup<SineTable<WAVETABLE_SINE_BITS>::lookupPhaseNoInterp>(output, "lookupPhaseNoInterp, 4096 points", &phases[0], &sink);
+		benchmarkPhaseLookup<SineTable<WAVETABLE_SINE_BITS>::lookupPhase>(output, "lookupPhase, 4096 points", &phases[0], &sink);
+		benchmarkPhaseLookup<SineTable<16>::lookupPhaseNoInterp>(output, "lookupPhaseNoInterp, 65536 points", &phases[0], &sink);
+		benchmarkPhaseLookup<SineTable<16>::lookupPhase>(output, "lookupPhase, 65536 points", &phases[0], &sink);
+		benchmarkPhaseLookup<PolynomialSine::lookupPhase>(output, "polynomial", &phases[0], &sink);
+	}
+
+	if(sink == 12345.0)		// Keeps the compiler from discarding the lookups
+		output << endl;
+}
@@ -11,29 +11,110 @@
 #define WAVETABLES_H
 
 #include <iostream>
-#include <vector>
+#include <cmath>
+#include "phaseaccumulator.h"
 using namespace std;
 
-// List of presently defined tables; make sure the WaveTable constructor stays in sync with this
-enum
+#define WAVETABLE_SINE_BITS		12		// log2 of the length of the sine table the synths use
+
+// SineTable holds one cycle of a sine wave in 2^Bits points, plus a guard point equal to the first for
+// interpolation.  Since the length is a compile-time power of two, a fixed-point phase (see PhaseAccumulator)
+// becomes a table index with a constant shift, and phases in cycles wrap with a mask instead of % and a sign
+// test.  All the lookups are inline.
+//
+// The table is filled the first time build() or table() is called.  The lookups don't check, so anything that
+// uses them calls build() first; SynthBase and OscillatorBank do this in their constructors.
+
+template<int Bits>
+class SineTable
 {
-	waveTableSine = 0
+public:
+	enum {
+		kLength = 1 << Bits,
+		kShift = 32 - Bits				// Phase bits below the table index
+	};
+
+	static void build();
+	static const float *table() { build(); return table_; }
+
+	// Return a non-interpolated or an interpolated value, given a fixed-point phase.  The top Bits bits of
+	// the phase are the table index and the rest are the fractional part.
+	static float lookupPhaseNoInterp(uint32_t phase) { return table_[phase >> kShift]; }
+	static float lookupPhase(uint32_t phase) {
+		uint32_t index = phase >> kShift;
+		float fract = PhaseAccumulator::toCycles(phase << Bits);
+		float lo = table_[index];
+
+		return lo + fract*(table_[index + 1] - lo);
+	}
+
+	// The same, given a phase in cycles, which may be any value with |phase| < 2^31
+	static float lookup(float phase) { return lookupPhaseNoInterp(PhaseAccumulator::fromCycles(phase)); }
+	static float lookupInterp(float phase) { return lookupPhase(PhaseAccumulator::fromCycles(phase)); }
+
+private:
+	static float table_[kLength + 1];
+	static volatile bool isBuilt_;
 };
 
-// Lookup tables for various waveforms
-class WaveTable
+template<int Bits> float SineTable<Bits>::table_[SineTable<Bits>::kLength + 1];
+template<int Bits> volatile bool SineTable<Bits>::isBuilt_ = false;
+
+// Filling the table twice at once does no harm, since both threads write the same values
+
+template<int Bits>
+void SineTable<Bits>::build()
+{
+	if(isBuilt_)
+		return;
+
+	for(int i = 0; i < kLength; i++)
+		table_[i] = (float)sin(((double)i/(double)kLength) * M_PI * 2.);
+	table_[kLength] = table_[0];		// Guard point
+
+	__sync_synchronize();
+	isBuilt_ = true;
+}
+
+// PolynomialSine computes sin(2*pi*phase) from a fixed-point phase with an odd 7th-order minimax polynomial
+// and no table, so it never misses the cache.  The error is below 1e-6, comparable to interpolating the
+// 4096-point table.  It has the same interface as SineTable so the two can be swapped.
+
+class PolynomialSine
 {
 public:
-	WaveTable();
-	// Return a non-interpolated value from a table
-	float lookup(int table, float phase);
-	// Return an interpolated value from a table
-	float lookupInterp(int table, float phase);
-	~WaveTable();
-	
-private:
-	vector<float*> tables_;
-	vector<int>	lengths_;
+	static void build() {}
+
+	static float lookupPhase(uint32_t phase) {
+		// Phase in quarter cycles, [-2, 2), folded into [-1, 1] where sin(2*pi*phase) = sin(pi/2 * x)
+		float x = (float)(int32_t)phase * (1.0f / 1073741824.0f);
+		float x2;
+
+		if(x > 1.0f)
+			x = 2.0f - x;
+		else if(x < -1.0f)
+			x = -2.0f - x;
+		x2 = x*x;
+
+		return x*(1.570791011f + x2*(-0.6458928496f + x2*(0.07943434462f + x2*(-0.004333095295f))));
+	}
+	static float lookupInterp(float phase) { return lookupPhase(PhaseAccumulator::fromCycles(phase)); }
 };
 
-#endif // WAVETABLES_H
\ No newline at end of file
+// The sine the synths use in their sample loops.  Define WAVETABLE_POLYNOMIAL_SINE in the build settings to
+// compute it by polynomial instead, where table lookups are missing the cache.  OscillatorBank always uses
+// the table.
+
+#ifdef WAVETABLE_POLYNOMIAL_SINE
+typedef PolynomialSine SynthSine;
+#else
+typedef SineTable<WAVETABLE_SINE_BITS> SynthSine;
+#endif
+
+// Print the cost in ns/lookup and the largest error of each way of getting a sine value: the old modulo
+// lookups, the masked lookups at several table sizes, and the polynomial, for both sequential and
+// scattered phases.
+
+void benchmarkWaveTables(ostream& output);
+
+#endif // WAVETABLES_H